@@ -193,6 +193,22 @@ struct rl_msg_layout rl_ker_numtables[] = {
         {
             .copylen = sizeof(struct rl_kmsg_ipcp_sched_pfifo),
         },
+    [RLITE_KER_FLOW_STATS_DUMP] =
+        {
+            .copylen = sizeof(struct rl_kmsg_flow_stats_dump),
+        },
+    [RLITE_KER_FLOW_STATS_DUMP_RESP] =
+        {
+            .copylen = sizeof(struct rl_kmsg_flow_stats_dump_resp) -
+                       1 * sizeof(struct rl_msg_array_field),
+            .arrays = 1,
+        },
+    [RLITE_KER_IPCP_PDUFT_BATCH] =
+        {
+            .copylen = sizeof(struct rl_kmsg_ipcp_pduft_batch) -
+                       1 * sizeof(struct rl_msg_array_field),
+            .arrays = 1,
+        },
     [RLITE_KER_MSG_MAX] =
         {
             .copylen = 0,
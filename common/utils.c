@@ -270,6 +270,7 @@ rl_msg_serlen(struct rl_msg_layout *numtables, size_t num_entries,
     struct rina_name *name;
     string_t *str;
     const struct rl_msg_buf_field *bf;
+    const struct rl_msg_array_field *af;
     int i;
 
     if (msg->hdr.msg_type >= num_entries) {
@@ -295,6 +296,11 @@ rl_msg_serlen(struct rl_msg_layout *numtables, size_t num_entries,
         ret += sizeof(bf->len) + bf->len;
     }
 
+    af = (const struct rl_msg_array_field *)bf;
+    for (i = 0; i < numtables[msg->hdr.msg_type].arrays; i++, af++) {
+        ret += 2 * sizeof(uint32_t) + af->elem_size * af->num_elements;
+    }
+
     return ret;
 }
 COMMON_EXPORT(rl_msg_serlen);
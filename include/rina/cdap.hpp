@@ -26,6 +26,10 @@
 
 #include <string>
 #include <unordered_set>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <memory>
 #include <ctime>
 #include <chrono>
 
@@ -46,39 +50,27 @@ struct CDAPAuthValue {
 #define CDAP_DISCARD_SECS_DFLT 15
 
 class InvokeIdMgr {
-    struct Id {
-        int iid;
-        std::chrono::system_clock::time_point created;
-
-        Id(int i, std::chrono::system_clock::time_point t) : iid(i), created(t)
-        {
-        }
-        Id(int i) : iid(i), created(std::chrono::system_clock::time_point()) {}
-        Id(const Id &o) : iid(o.iid), created(o.created) {}
-        bool operator==(const Id &o) const { return iid == o.iid; }
-        bool operator!=(const Id &o) const { return iid != o.iid; }
-        bool operator<(const Id &o) const { return iid < o.iid; }
-        bool operator>(const Id &o) const { return iid > o.iid; }
+    using Clock = std::chrono::steady_clock;
+
+    /* A set of pending ids, together with a FIFO queue of ids ordered by
+     * creation time. As all the ids are discarded after the same time,
+     * the expired ones are found at the front of the queue, so that they
+     * can be discarded without scanning the whole set. The queue may also
+     * contain ids that are no longer pending (or that have been reused),
+     * which are skipped by comparing the creation time. */
+    struct PendingIds {
+        std::unordered_map<int, Clock::time_point> ids;
+        std::deque<std::pair<Clock::time_point, int>> expiry;
     };
 
-    /* Hasher class to allow for struct Id to be used as key type for
-     * unordered maps and unordered sets. */
-    struct IdHasher {
-        std::size_t operator()(const Id &i) const
-        {
-            return std::hash<int>()(i.iid);
-        }
-    };
-
-    std::unordered_set<Id, IdHasher> pending_invoke_ids;
+    PendingIds pending_invoke_ids;
     int invoke_id_next;
     std::chrono::seconds discard_time;
-    std::unordered_set<Id, IdHasher> pending_invoke_ids_remote;
+    PendingIds pending_invoke_ids_remote;
 
-    int __put_invoke_id(std::unordered_set<Id, IdHasher> &pending,
-                        int invoke_id);
-    void __discard(std::unordered_set<Id, IdHasher> &pending);
-    void discard();
+    int __put_invoke_id(PendingIds &pending, int invoke_id);
+    void __insert(PendingIds &pending, int invoke_id);
+    void __discard(PendingIds &pending);
 
 public:
     InvokeIdMgr(std::chrono::seconds discard_time =
@@ -89,7 +81,8 @@ public:
     int put_invoke_id_remote(int invoke_id);
     unsigned size() const
     {
-        return pending_invoke_ids.size() + pending_invoke_ids_remote.size();
+        return pending_invoke_ids.ids.size() +
+               pending_invoke_ids_remote.ids.size();
     }
 };
 
@@ -113,6 +106,23 @@ class CDAPConn {
 
     CDAPConn(const CDAPConn &o);
 
+    int msg_ser_prepare(CDAPMessage *m, int invoke_id);
+
+    bool framed = false;
+
+#ifndef SWIG
+    /* Reused by msg_send() to serialize messages. */
+    std::vector<char> sndbuf;
+
+    /* Reused by msg_recv(). With framing, it may contain many messages
+     * (or part of one) between rcv_head and rcv_tail. */
+    std::vector<char> rcvbuf;
+    size_t rcv_head = 0;
+    size_t rcv_tail = 0;
+#endif /* SWIG */
+
+    size_t frame_len() const;
+
 public:
     CDAPConn(int fd, long version = 1,
              std::chrono::seconds discard_time =
@@ -125,6 +135,32 @@ public:
 
     std::unique_ptr<CDAPMessage> msg_recv();
     std::unique_ptr<CDAPMessage> msg_deser(const char *serbuf, size_t serlen);
+#ifndef SWIG
+    /* Receive the next message without deserializing it, e.g. to look at
+     * it before running msg_deser(). On success, the length of the
+     * message is returned and *buf points to it, until the next call.
+     * If 'wait' is false, the file descriptor must be readable, and
+     * read() is called at most once. With framing, -1 is then returned
+     * with errno set to EAGAIN if the message is still incomplete. */
+    ssize_t msg_recv_raw(const char **buf, bool wait = true);
+#endif /* SWIG */
+
+    /* With framing, each message is preceded by its length (32 bits, in
+     * network order), so that messages of any size can be exchanged over
+     * flows that do not preserve message boundaries (e.g. stream
+     * sockets). Both ends must use the same setting. */
+    void set_framed(bool f) { framed = f; }
+    bool is_framed() const { return framed; }
+
+    /* True if msg_recv() can return the next message without reading
+     * from the file descriptor, because a previous read returned more
+     * than one message. */
+    bool msg_buffered() const;
+
+    /* Length of the frame header, and maximum length of the messages
+     * accepted with framing. */
+    static constexpr size_t kFrameHdrLen = 4;
+    static constexpr size_t kFrameMaxLen = 64 << 20;
 
     void reset();
     bool connected() const { return state == ConnState::CONNECTED; }
@@ -147,10 +183,18 @@ public:
     long version;
 };
 
+/* If 'borrow' is true, the object value of the returned message points
+ * into 'serbuf', which must then outlive the message. */
 std::unique_ptr<CDAPMessage> msg_deser_stateless(const char *serbuf,
-                                                 size_t serlen);
+                                                 size_t serlen,
+                                                 bool borrow = false);
 
 int msg_ser_stateless(CDAPMessage *m, char **buf, size_t *len);
+#ifndef SWIG
+/* Serialize into a buffer owned by the caller, which is resized to the
+ * length of the message and can be reused for the next ones. */
+int msg_ser_stateless(const CDAPMessage *m, std::vector<char> *buf);
+#endif /* SWIG */
 
 /* Internal representation of a CDAP message. */
 struct CDAPMessage {
@@ -185,6 +229,15 @@ struct CDAPMessage {
     CDAPMessage(const gpb::CDAPMessage &gm);
     operator gpb::CDAPMessage() const;
 
+    /* Encoding to and decoding from the CDAP wire format (the protobuf
+     * encoding of gpb::CDAPMessage), without going through a
+     * gpb::CDAPMessage. The buffer passed to wire_encode() must be at
+     * least wire_size() bytes long. With 'borrow', the object value
+     * points into 'buf' rather than into a copy. */
+    size_t wire_size() const { return wire_write(nullptr); }
+    size_t wire_encode(char *buf) const { return wire_write(buf); }
+    int wire_decode(const char *buf, size_t len, bool borrow = false);
+
     bool valid(bool check_invoke_id) const;
 
     void get_obj_value(int32_t &v) const;
@@ -288,6 +341,10 @@ private:
     void copy(const CDAPMessage &o);
     void destroy();
 
+    /* Only computes the length if 'buf' is nullptr. */
+    size_t wire_write(char *buf) const;
+    size_t obj_value_write(char *buf) const;
+
 #ifndef SWIG
     enum class ObjValType {
         NONE,
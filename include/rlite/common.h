@@ -170,6 +170,56 @@ struct rl_ioctl_info {
 #define RLITE_IOCTL_FLOW_BIND _IOW(0xAF, 0x00, struct rl_ioctl_info)
 #define RLITE_IOCTL_CHFLAGS _IOW(0xAF, 0x01, uint64_t)
 #define RLITE_IOCTL_MSS_GET _IOW(0xAF, 0x02, uint32_t *)
+#define RLITE_IOCTL_CTRL_RING _IOW(0xAF, 0x03, uint32_t)
+#define RLITE_IOCTL_CTRL_STATS _IOR(0xAF, 0x04, struct rl_ctrl_stats)
+#define RLITE_IOCTL_CTRL_RING_CONSUMED _IO(0xAF, 0x05)
+
+/* Event counters of a control device. */
+struct rl_ctrl_stats {
+    uint64_t queued;     /* messages queued for userspace */
+    uint64_t dropped;    /* messages dropped because of overrun */
+    uint64_t peak_depth; /* maximum queue occupancy, in bytes */
+};
+
+/*
+ * Shared-memory ring used by a control device to deliver messages to
+ * userspace, as an alternative to read(). The ring is created with an
+ * ioctl(fd, RLITE_IOCTL_CTRL_RING, size), where size is the size of the
+ * data area (a power of two), and then mapped with mmap() at offset 0,
+ * for RL_CTRL_RING_DATA_OFS + size bytes. The kernel starts using the
+ * ring (instead of the queue drained by read()) when it is mapped.
+ * The kernel serializes each message into a record made of a
+ * struct rl_ctrl_ring_rec followed by the serialized message, padded to
+ * RL_CTRL_RING_ALIGN bytes. Records never wrap: when a record does not
+ * fit before the end of the data area, the kernel writes a record with
+ * len == RL_CTRL_RING_WRAP and restarts from offset 0.
+ * Indices are free running and are masked with (size - 1) to get
+ * offsets. The kernel only writes tail, userspace only writes head.
+ * When the kernel is waiting for free space, it sets notify: userspace
+ * must then call ioctl(fd, RLITE_IOCTL_CTRL_RING_CONSUMED) after
+ * updating head.
+ */
+struct rl_ctrl_ring_hdr {
+    uint32_t size;
+    uint32_t pad1;
+    struct rl_ctrl_stats stats; /* snapshot, updated by the kernel */
+    uint8_t pad2[64 - 8 - sizeof(struct rl_ctrl_stats)];
+    uint32_t tail; /* producer index */
+    uint8_t pad3[64 - sizeof(uint32_t)];
+    uint32_t head;   /* consumer index */
+    uint32_t notify; /* set by the kernel, see above */
+};
+
+struct rl_ctrl_ring_rec {
+    uint32_t len; /* length of the serialized message */
+    uint32_t pad1;
+};
+
+#define RL_CTRL_RING_DATA_OFS 4096
+#define RL_CTRL_RING_ALIGN 8
+#define RL_CTRL_RING_WRAP 0xffffffffU
+#define RL_CTRL_RING_SIZE_MIN (1 << 14)
+#define RL_CTRL_RING_SIZE_MAX (1 << 24)
 
 #define RLITE_MGMT_HDR_T_OUT_LOCAL_PORT 1
 #define RLITE_MGMT_HDR_T_OUT_DST_ADDR 2
@@ -272,6 +322,13 @@ rina_flow_spec_best_effort(struct rina_flow_spec *spec)
            !spec->max_jitter && !spec->in_order_delivery;
 }
 
+/* Number of buckets of the flow latency histograms. Bucket 0 counts
+ * samples below 1 us, bucket i (0 < i < RL_FLOW_LAT_BUCKETS - 1) counts
+ * samples in the range [2^(i-1), 2^i) us, and the last bucket counts all
+ * the samples above. */
+#define RL_FLOW_LAT_BUCKETS 16
+
+/* Flow statistics. All counters must be 64 bits wide. */
 struct rl_flow_stats {
     /* Statistics for an rl_io device. */
     uint64_t tx_pkt;
@@ -280,6 +337,18 @@ struct rl_flow_stats {
     uint64_t rx_byte;
     uint64_t rx_overrun_pkt;
     uint64_t rx_overrun_byte;
+
+    /* Failed writes, and drops on the receive side, by reason. */
+    uint64_t tx_err;
+    uint64_t rx_dup_drop;
+    uint64_t rx_seqq_drop;
+    uint64_t rx_gap_drop;
+
+    /* Time spent by received SDUs in the userspace queue before being
+     * read, and time spent by writers for an SDU to be accepted by the
+     * IPCP (including flow control waits). */
+    uint64_t rx_lat[RL_FLOW_LAT_BUCKETS];
+    uint64_t tx_lat[RL_FLOW_LAT_BUCKETS];
 };
 
 /* RMT statistics. All counters must be 64 bits wide. */
@@ -44,6 +44,14 @@ struct rl_flow_info {
     struct list_head node;
 };
 
+struct rl_flow_stats_info {
+    rl_ipcp_id_t ipcp_id;
+    rl_port_t local_port;
+    struct rl_flow_stats stats;
+
+    struct list_head node;
+};
+
 struct rl_reg_info {
     rl_ipcp_id_t ipcp_id;
     int pending;
@@ -83,6 +91,13 @@ int rl_conf_flow_get_stats(rl_port_t port_id, struct rl_flow_stats *stats);
 
 int rl_conf_ipcp_get_stats(rl_ipcp_id_t ipcp_id, struct rl_ipcp_stats *stats);
 
+/* Fetch the statistics of all the flows in the system (or supported by a
+ * given IPCP) with a single request. The list is sorted by IPCP id first
+ * and then by local port id. */
+int rl_conf_flows_stats_fetch(struct list_head *stats, rl_ipcp_id_t ipcp_id);
+
+void rl_conf_flows_stats_purge(struct list_head *stats);
+
 #ifdef RL_MEMTRACK
 int rl_conf_memtrack_dump(void);
 #endif
@@ -39,6 +39,31 @@ int rl_write_msg(int rfd, const struct rl_msg_base *msg, int quiet);
 
 struct rl_msg_base *rl_read_next_msg(int rfd, int quiet);
 
+/* Userspace view of the shared-memory ring of a control device. */
+struct rl_ctrl_ring {
+    int fd;
+    struct rl_ctrl_ring_hdr *hdr;
+    uint8_t *data;
+    uint32_t size;
+    size_t maplen;
+};
+
+/* Switch the control device rfd to a shared-memory ring of the given
+ * size, and map it. Must be called before any message is queued. On
+ * failure the control device keeps working with read(). */
+int rl_ctrl_ring_open(int rfd, uint32_t size, struct rl_ctrl_ring *ring);
+
+void rl_ctrl_ring_close(struct rl_ctrl_ring *ring);
+
+/* Pop up to max messages from the ring, releasing their space with a
+ * single update of the consumer index (and notifying the kernel if it
+ * is waiting for space). Returns the number of messages stored in msgs,
+ * or -1 on error. */
+int rl_ctrl_ring_read_batch(struct rl_ctrl_ring *ring,
+                            struct rl_msg_base **msgs, unsigned int max);
+
+int rl_ctrl_stats_get(int rfd, struct rl_ctrl_stats *stats);
+
 int rl_fa_req_fill(struct rl_kmsg_fa_req *req, uint32_t event_id,
                    const char *dif_name, const char *local_appl,
                    const char *remote_appl,
@@ -67,6 +67,9 @@ enum {
     RLITE_KER_IPCP_CONFIG_GET_RESP,  /* 35 */
     RLITE_KER_IPCP_SCHED_WRR,        /* 36 */
     RLITE_KER_IPCP_SCHED_PFIFO,      /* 37 */
+    RLITE_KER_FLOW_STATS_DUMP,       /* 38 */
+    RLITE_KER_FLOW_STATS_DUMP_RESP,  /* 39 */
+    RLITE_KER_IPCP_PDUFT_BATCH,      /* 40 */
 
     RLITE_KER_MSG_MAX,
 };
@@ -317,6 +320,50 @@ struct rl_kmsg_ipcp_pduft_mod {
     struct rl_pci_match match;
 };
 
+/* A single modification carried by a batched PDUFT update.
+ * RL_PDUFT_OP_ADD adds a lower flow to the entry set by the previous
+ * operation, which must be a RL_PDUFT_OP_SET or RL_PDUFT_OP_ADD for the
+ * same destination. The traffic matching an entry with more than one
+ * lower flow is spread over the group by hashing the PCI fields that
+ * identify an N-flow, so that the PDUs of an N-flow are not reordered.
+ * RL_PDUFT_OP_BACKUP sets the backup lower flow of the same entry, and
+ * must follow its RL_PDUFT_OP_SET and RL_PDUFT_OP_ADD operations. The
+ * backup flow is used in place of a lower flow of the group that is down
+ * (fast reroute), until the entry is updated. */
+#define RL_PDUFT_OP_SET 1
+#define RL_PDUFT_OP_DEL 2
+#define RL_PDUFT_OP_ADD 3
+#define RL_PDUFT_OP_BACKUP 4
+
+/* Maximum number of lower flows in a PDUFT entry. */
+#define RL_PDUFT_ECMP_MAX 8
+
+struct rl_pduft_op {
+    uint8_t op; /* RL_PDUFT_OP_* */
+    uint8_t pad1;
+    /* The local port where matching packets must be forwarded
+     * (ignored by RL_PDUFT_OP_DEL). */
+    rl_port_t local_port;
+    uint32_t pad2;
+    struct rl_pci_match match;
+};
+
+/* Maximum number of operations in a batched PDUFT update. */
+#define RL_PDUFT_BATCH_MAX 16384
+
+/* application --> kernel to apply a list of PDUFT modifications
+ * atomically, so that the datapath never sees an intermediate state of
+ * the table. Either all the operations are applied or none is. */
+struct rl_kmsg_ipcp_pduft_batch {
+    struct rl_msg_hdr hdr;
+
+    /* The IPCP whose PDUFT is to be modified. */
+    rl_ipcp_id_t ipcp_id;
+    uint16_t pad1[3];
+    /* Array of struct rl_pduft_op. */
+    struct rl_msg_array_field ops;
+};
+
 /* application --> kernel message to flush the PDUFT of an IPC Process. */
 #define rl_kmsg_ipcp_pduft_flush rl_kmsg_ipcp_create_resp
 
@@ -419,6 +466,35 @@ struct rl_kmsg_flow_stats_resp {
     struct rl_flow_dtp dtp;
 };
 
+/* application --> kernel message to ask for the statistics of all
+ * the flows, optionally filtered by IPCP (if ipcp_id != ~0). */
+#define rl_kmsg_flow_stats_dump rl_kmsg_flow_fetch
+
+/* An element of a flow statistics dump. */
+struct rl_flow_stats_entry {
+    rl_ipcp_id_t ipcp_id;
+    rl_port_t port_id;
+    uint32_t pad1;
+    struct rl_flow_stats stats;
+};
+
+/* Maximum number of entries carried by a single dump response, chosen
+ * so that a response fits into a 4 KiB read buffer. */
+#define RL_FLOW_STATS_DUMP_BATCH                                               \
+    ((4096 - 64) / sizeof(struct rl_flow_stats_entry))
+
+/* application <-- kernel message carrying a batch of flow statistics.
+ * A single dump request produces a sequence of responses, the last one
+ * having the 'end' field set. */
+struct rl_kmsg_flow_stats_dump_resp {
+    struct rl_msg_hdr hdr;
+
+    uint8_t end;
+    uint8_t pad1[7];
+    /* Array of struct rl_flow_stats_entry. */
+    struct rl_msg_array_field entries;
+};
+
 /* application --> kernel message to ask an IPCP if a given
  * QoS can be supported. */
 struct rl_kmsg_ipcp_qos_supported {
@@ -28,10 +28,13 @@
 #include <string>
 #include <list>
 #include <map>
+#include <set>
+#include <vector>
 #include <fstream>
 #include <iostream>
 #include <memory>
 #include <chrono>
+#include <sys/uio.h>
 
 namespace raft {
 
@@ -39,6 +42,11 @@ using Term      = uint32_t;
 using LogIndex  = uint32_t;
 using ReplicaId = std::string;
 
+/* The serialized command of a log entry, whose size is not fixed. It is
+ * shared between the log cache and the messages that carry the entry, so
+ * that replicating an entry to many followers does not copy it. */
+using LogCommand = std::shared_ptr<const std::string>;
+
 /* Base class for all the Raft messages. */
 struct RaftMessage {
     Term term;
@@ -83,7 +91,11 @@ struct RaftAppendEntries : public RaftMessage {
 
     /* Log entries to store (empty for heartbeat). There may be
      * more than one for efficiency. */
-    std::list<std::pair<Term, std::unique_ptr<char[]>>> entries;
+    std::list<std::pair<Term, LogCommand>> entries;
+
+    /* Round of leadership confirmation for linearizable reads, or 0. If
+     * not 0 the follower responds even to a heartbeat, echoing it. */
+    uint64_t read_seq = 0;
 };
 
 struct RaftAppendEntriesResp : public RaftMessage {
@@ -93,7 +105,8 @@ struct RaftAppendEntriesResp : public RaftMessage {
     /* Id of the responding follower. */
     ReplicaId follower_id;
 
-    /* On success, the new last log index of the follower.
+    /* On success, the index of the last entry carried by the
+     * corresponding AppendEntries request.
      * On failure, it matches the prev_log_index field of
      * the corresponding AppendEntries request.
      * In both cases this field is used by the leader to
@@ -104,6 +117,71 @@ struct RaftAppendEntriesResp : public RaftMessage {
      * and prev_log_term as specified in the request. If false
      * the leader should retry with an older log entry. */
     bool success;
+
+    /* On failure, hints that allow the leader to skip a whole term of
+     * entries at once: the term of the follower's entry at prev_log_index
+     * and the index of the first follower's entry with that term. If the
+     * follower's log does not reach prev_log_index, conflict_term is 0
+     * and conflict_index is the follower's last log index + 1. */
+    Term conflict_term      = 0;
+    LogIndex conflict_index = 0;
+
+    /* The read_seq of the corresponding AppendEntries request. */
+    uint64_t read_seq = 0;
+};
+
+/* Sent by a follower to the leader to serve a linearizable read. The
+ * leader responds once it has confirmed that it is still the leader. */
+struct RaftReadIndex : public RaftMessage {
+    /* RaftMessage::term is the current term as known by the follower. */
+
+    /* Id of the follower that serves the read. */
+    ReplicaId follower_id;
+
+    /* Identifier of the read, chosen by the follower. */
+    uint64_t read_id;
+};
+
+struct RaftReadIndexResp : public RaftMessage {
+    /* RaftMessage::term is the current term as known by the leader. */
+
+    /* Identifier of the read, as in the request. */
+    uint64_t read_id;
+
+    /* The follower can serve the read once it has applied all the entries
+     * up to this index. */
+    LogIndex read_index;
+
+    /* False if the replica is not the leader anymore. */
+    bool success;
+};
+
+/* Sent by the leader to a follower that needs log entries which have
+ * already been compacted into a snapshot. The snapshot may be split into
+ * many messages, which are sent in order. The follower acknowledges the
+ * last chunk with a RaftAppendEntriesResp, whose log_index is the last
+ * entry covered by the snapshot. */
+struct RaftInstallSnapshot : public RaftMessage {
+    /* RaftMessage::term is the current term as known by the leader. */
+
+    /* Id of the leader, so that followers can redirect clients. */
+    ReplicaId leader_id;
+
+    /* The snapshot replaces all the entries up through and including
+     * this index. */
+    LogIndex last_included_index;
+
+    /* Term of last_included_index. */
+    Term last_included_term;
+
+    /* Byte offset where this chunk is positioned in the snapshot. */
+    uint32_t offset;
+
+    /* Raw bytes of the snapshot chunk. */
+    std::string data;
+
+    /* True if this is the last chunk. */
+    bool done;
 };
 
 enum class RaftTimerType {
@@ -148,6 +226,13 @@ struct RaftSMOutput {
     std::list<std::pair<ReplicaId, std::unique_ptr<RaftMessage>>>
         output_messages;
     std::list<RaftTimerCmd> timer_commands;
+
+    /* Identifiers of the reads submitted with RaftSM::read_request() that
+     * can be served now, because the local replica of the state machine
+     * is up to date, and of the ones that cannot be served here (e.g.
+     * because the leader changed), which should be retried. */
+    std::list<uint64_t> reads_ready;
+    std::list<uint64_t> reads_failed;
 };
 
 enum class RaftState {
@@ -174,7 +259,10 @@ class RaftSM {
 
     /* Log entries (only on disc). Each entry contains a command for the
      * replicated state machine and the term when entry was received by the
-     * leader. The first index in the log is 1 (and not 0). */
+     * leader. The first index in the log is 1 (and not 0). The entries up
+     * to log_base are not in the log anymore, as they are covered by the
+     * snapshot of the replicated state machine. Each entry is stored as a
+     * LogRecordHeader followed by the command. */
 
     /* =================================================================
      * Volatile state for leaders.
@@ -205,10 +293,25 @@ class RaftSM {
          * monotonically. */
         LogIndex match_index;
 
-        /* We record the last time we sent a RaftAppendEntries message with
-         * one or more entries. This is used to avoid useless retransmissions
-         * that closely follow a submit(). */
-        std::chrono::system_clock::time_point last_ae_time;
+        /* We record the last time the replication towards this replica
+         * made progress, i.e. when entries were sent with none in flight,
+         * or when some entries in flight were acked. The entries in
+         * flight are retransmitted when this is older than RtxTimeout. */
+        std::chrono::steady_clock::time_point last_ae_time;
+
+        /* Last time we received a response from this replica. */
+        std::chrono::steady_clock::time_point last_ack_time;
+
+        /* Number of rejected requests that caused a backtrack, and of
+         * retransmissions on timeout. */
+        unsigned int rejections      = 0;
+        unsigned int retransmissions = 0;
+
+        /* Last round of leadership confirmation acked by this replica. */
+        uint64_t read_seq_acked = 0;
+
+        /* The commit index carried by the last request sent. */
+        LogIndex commit_sent = 0;
     };
 
     std::map<ReplicaId, Server> servers;
@@ -243,29 +346,122 @@ class RaftSM {
     /* Term of the last log entry. */
     Term last_log_term = 0;
 
+    /* Index and term of the last entry covered by the snapshot, which is
+     * also the entry that precedes the first entry of the log file (0 if
+     * there is no snapshot). */
+    LogIndex log_base  = 0;
+    Term log_base_term = 0;
+
+    /* Take a snapshot when the log has this many entries that are already
+     * applied (0 to disable automatic snapshots). */
+    LogIndex snapshot_threshold = 0;
+
+    /* Chunks of a snapshot that is being received from the leader. */
+    std::string snapshot_chunks;
+    LogIndex snapshot_chunks_index = 0;
+    Term snapshot_chunks_term      = 0;
+
     /* How many votes we collected as a candidate. */
     unsigned int votes_collected = 0;
 
+    /* =================================================================
+     * Linearizable reads.
+     */
+
+    /* A read on the leader, waiting for the confirmation of the leadership
+     * (round 'seq'). The origin is the follower that forwarded it, or
+     * empty for local reads. */
+    struct PendingRead {
+        uint64_t id;
+        ReplicaId origin;
+        uint64_t seq;
+    };
+    std::list<PendingRead> leader_reads;
+
+    /* On the leader, the last round of leadership confirmation started,
+     * the last one confirmed by a majority and the time when the rounds
+     * still to be confirmed were started. A round is started when the
+     * leader sends the next batch of RaftAppendEntries, if there are
+     * reads waiting or if leases are enabled. */
+    uint64_t read_seq           = 0;
+    uint64_t read_seq_confirmed = 0;
+    std::list<std::pair<uint64_t, std::chrono::steady_clock::time_point>>
+        read_rounds;
+
+    /* On the leader, reads can be served without confirming the leadership
+     * until this time (see set_read_lease()). */
+    std::chrono::steady_clock::time_point lease_expiry;
+
+    /* On followers, the reads forwarded to the leader, and the ones waiting
+     * for the local replica of the state machine to apply their read
+     * index. */
+    std::set<uint64_t> forwarded_reads;
+    std::multimap<LogIndex, uint64_t> waiting_reads;
+
+    /* Last time we heard from the leader of the current term. */
+    std::chrono::steady_clock::time_point last_leader_contact;
+
     /* Name of the log file. */
     const std::string logfilename;
 
-    /* File descriptor for the log file. */
-    std::fstream logfile;
-
-    /* Size of a log entry (with and without term info). */
-    const size_t log_entry_size   = sizeof(Term);
-    const size_t log_command_size = 0;
+    /* Name of the snapshot file. */
+    const std::string snapfilename;
+
+    /* File descriptor for the log file, kept open until the SM is
+     * destroyed. */
+    int logfd = -1;
+
+    /* Size of the commands in the logs written by the previous versions,
+     * where each entry was a term followed by a command of fixed size.
+     * Used to convert those logs, 0 if there are none. */
+    const size_t legacy_command_size = 0;
+
+    /* Position in the log file of each entry after log_base, followed by
+     * the end of the log. This allows to access any entry in O(1). */
+    std::vector<uint64_t> log_offsets;
+
+    /* The header of a log entry. The checksum covers the header (with the
+     * checksums set to 0) and the command, so that a partially written
+     * entry at the end of the log can be detected and discarded. The
+     * header checksum covers the fields before it, so that a corrupted
+     * length is not mistaken for a partially written entry. */
+    struct LogRecordHeader {
+        uint32_t length; /* of the command */
+        Term term;
+        uint32_t checksum;
+        uint32_t hdr_checksum;
+    };
 
     /* For logging of Raft internal operations. */
     std::ostream &ios_err;
     std::ostream &ios_inf;
 
-    static constexpr uint32_t kLogMagicNumber         = 0x89ae01caU;
+    static constexpr uint32_t kLogMagicNumber         = 0x89ae02caU;
+    static constexpr uint32_t kLogMagicNumberFixed    = 0x89ae01caU;
     static constexpr unsigned long kLogMagicOfs       = 0;
     static constexpr unsigned long kLogCurrentTermOfs = 4;
     static constexpr unsigned long kLogVotedForOfs    = 8;
+    static constexpr unsigned long kLogBaseIndexOfs   = 120;
+    static constexpr unsigned long kLogBaseTermOfs    = 124;
     static constexpr unsigned long kLogEntriesOfs     = 128;
-    static constexpr size_t kLogVotedForSize = kLogEntriesOfs - kLogVotedForOfs;
+    static constexpr size_t kLogVotedForSize =
+        kLogBaseIndexOfs - kLogVotedForOfs;
+
+    /* Bytes read at once when scanning or converting the log. */
+    static constexpr size_t kLogScanChunkBytes = 1 << 20;
+
+    static constexpr uint32_t kSnapshotMagicNumber = 0x89ae01cbU;
+
+    /* Cache of the most recent log entries, so that the replication to
+     * the followers and the application of the committed entries do not
+     * need to read them back from the log file. Entry 'i' is stored in
+     * slot i % log_cache.size(). */
+    struct LogCacheSlot {
+        LogIndex index = 0; /* 0 if the slot is empty */
+        Term term      = 0;
+        LogCommand command;
+    };
+    std::vector<LogCacheSlot> log_cache;
 
     /* Argument for RaftSM::prepare_append_entries() that specifies
      * its behaviour (send all the unacked log entries or only the
@@ -282,8 +478,23 @@ class RaftSM {
     int log_buf_read(unsigned long pos, char *buf, size_t len);
     int magic_check();
     int log_open(bool first_boot);
+    int log_writev(int fd, unsigned long pos, struct iovec *iov, int iovcnt);
+    static uint32_t log_record_checksum(const LogRecordHeader &hdr,
+                                        const char *command);
+    static uint32_t log_header_checksum(const LogRecordHeader &hdr);
+    int log_valid_record_after(uint64_t pos, uint64_t size);
+    int log_scan();
+    int log_convert();
+    int file_sync(int fd);
+    int file_replace(const std::string &tmpname, const std::string &name);
     int log_disk_flush();
     int log_truncate(LogIndex index);
+    int log_compact(LogIndex index, Term term);
+    unsigned long log_entry_pos(LogIndex index) const;
+    int snapshot_write(LogIndex index, Term term, const std::string &data);
+    int snapshot_read(LogIndex *index, Term *term, std::string *data);
+    int snapshot_load();
+    int install_snapshot(LogIndex index, Term term, const std::string &data);
 
     /* Logging helpers. */
     std::string curtime_string(void)
@@ -318,10 +529,30 @@ class RaftSM {
     unsigned int quorum() const;
     int prepare_append_entries(LogReplicateStrategy strategy,
                                RaftSMOutput *out);
+    int replicate_to(const ReplicaId &id, Server &follower, bool heartbeat,
+                     RaftSMOutput *out);
+    int log_term_search(Term term, LogIndex hi, LogIndex *index);
+    int prepare_install_snapshot(const ReplicaId &follower, RaftSMOutput *out);
+    const LogCacheSlot *log_cache_lookup(LogIndex index);
+    void log_cache_insert(LogIndex index, Term term, LogCommand command);
+    void log_cache_truncate(LogIndex index);
     int log_entry_get_term(LogIndex index, Term *term);
-    int log_entry_get_command(LogIndex index, char *const serbuf);
-    int append_log_entry(const Term term, const char *serbuf);
+    int log_entry_get(LogIndex index, Term *term, LogCommand *command);
+    int append_log_entries(
+        const std::vector<std::pair<Term, LogCommand>> &entries);
     int apply_committed_entries();
+    bool committed_in_term();
+    bool read_rounds_wanted() const
+    {
+        return ReadLease.count() > 0 || !leader_reads.empty();
+    }
+    bool lease_holding() const;
+    int leader_read_register(uint64_t id, const ReplicaId &origin,
+                             RaftSMOutput *out);
+    int leader_reads_serve(RaftSMOutput *out);
+    void read_rounds_update();
+    void waiting_reads_release(RaftSMOutput *out);
+    void reads_fail(RaftSMOutput *out);
 
     std::chrono::milliseconds ElectionTimeoutMin =
         std::chrono::milliseconds(int(kElectionTimeoutMinMsecs));
@@ -332,30 +563,68 @@ class RaftSM {
     std::chrono::milliseconds RtxTimeout =
         std::chrono::milliseconds(int(kRtxTimeoutMsecs));
 
+    /* Duration of the read lease, 0 if leases are disabled. */
+    std::chrono::milliseconds ReadLease = std::chrono::milliseconds(0);
+
+    /* Maximum number of entries in flight towards each follower, i.e.
+     * sent but not acked yet. */
+    LogIndex replication_window = kReplicationWindowEntries;
+
     unsigned int verbosity = kVerboseVery;
 
     /* Statistics. */
     struct Stats {
         /* Number of discarded log entries, due to partial replication. */
         unsigned int discarded = 0;
+
+        /* Number of log entries written, and number of flushes of the log
+         * to stable storage (which include the updates of the term and of
+         * the vote). */
+        unsigned int log_entries_written = 0;
+        unsigned int log_flushes         = 0;
+
+        /* Bytes of log entries written (headers included). */
+        uint64_t log_bytes_written = 0;
+
+        /* Lookups of log entries served by the log cache, and the ones
+         * that needed to read the log file. */
+        unsigned int log_cache_hits   = 0;
+        unsigned int log_cache_misses = 0;
+
+        /* Snapshots taken locally, and received from the leader. */
+        unsigned int snapshots_taken     = 0;
+        unsigned int snapshots_installed = 0;
+
+        /* Reads served by the leader under the lease or after confirming
+         * its leadership, reads forwarded to the leader, and reads that
+         * failed. */
+        unsigned int reads_lease     = 0;
+        unsigned int reads_confirmed = 0;
+        unsigned int reads_forwarded = 0;
+        unsigned int reads_failed    = 0;
     } stats;
 
 public:
+    /* If the log file was written by a previous version with fixed size
+     * commands, init() converts it, using 'legacy_cmd_size' as the size
+     * of those commands. */
     RaftSM(const std::string &smname, const ReplicaId &myname,
-           std::string logname, size_t cmd_size, std::ostream &ioe,
+           std::string logname, size_t legacy_cmd_size, std::ostream &ioe,
            std::ostream &ioi)
         : name(smname),
           local_id(myname),
           logfilename(logname),
-          log_entry_size(sizeof(Term) + cmd_size),
-          log_command_size(cmd_size),
+          snapfilename(logname + ".snap"),
+          legacy_command_size(legacy_cmd_size),
           ios_err(ioe),
-          ios_inf(ioi)
+          ios_inf(ioi),
+          log_cache(kLogCacheEntries)
     {
     }
     int init(const std::list<ReplicaId> peers, RaftSMOutput *out);
 
-    /* The user doesn't need this Raft SM anymore. Delete the log on disk. */
+    /* The user doesn't need this Raft SM anymore. Delete the log and the
+     * snapshot on disk. */
     void shutdown();
 
     /* Called by the user when the corresponding message is
@@ -366,6 +635,11 @@ public:
     int append_entries_input(const RaftAppendEntries &msg, RaftSMOutput *out);
     int append_entries_resp_input(const RaftAppendEntriesResp &msg,
                                   RaftSMOutput *out);
+    int install_snapshot_input(const RaftInstallSnapshot &msg,
+                               RaftSMOutput *out);
+    int read_index_input(const RaftReadIndex &msg, RaftSMOutput *out);
+    int read_index_resp_input(const RaftReadIndexResp &msg,
+                              RaftSMOutput *out);
 
     /* Called by the user when a timer requested by Raft expired. */
     int timer_expired(RaftTimerType, RaftSMOutput *out);
@@ -374,14 +648,75 @@ public:
      * the replicated state machine. If 'log_index_p' is not nullptr,
      * it is filled with the index of the log entry allocated for
      * this request. */
-    int submit(const char *const serbuf, LogIndex *log_index_p,
+    int submit(const std::string &command, LogIndex *log_index_p,
                RaftSMOutput *out);
 
+    /* Same as submit(), for a batch of new log entries that are written
+     * to the local log with a single flush to stable storage. If
+     * 'log_index_p' is not nullptr, it is filled with the index of the
+     * first entry of the batch, the others follow in order. */
+    int submit_batch(const std::vector<std::string> &commands,
+                     LogIndex *log_index_p, RaftSMOutput *out);
+
+    /* Many commands can be packed in a single log entry, to amortize the
+     * cost of replicating and storing each entry. The replicated state
+     * machine unpacks them in apply(). Commands starting with
+     * kPackedCommandsMarker are reserved for this purpose. */
+    static constexpr uint8_t kPackedCommandsMarker = 0xff;
+    static std::string commands_pack(const std::vector<std::string> &commands);
+    static int commands_unpack(const std::string &entry,
+                               std::vector<std::string> *commands);
+    static bool commands_packed(const std::string &entry)
+    {
+        return !entry.empty() &&
+               static_cast<uint8_t>(entry[0]) == kPackedCommandsMarker;
+    }
+
+    /* Called by the user when it wants to serve a linearizable read from
+     * the local replica of the state machine, without writing to the log.
+     * The read, identified by 'id', is reported in out->reads_ready when
+     * the local replica reflects all the entries committed before this
+     * call, or in out->reads_failed if it cannot be served here. This may
+     * happen in this call or in a later one. A leader serves the read once
+     * a majority confirmed that it is still the leader (or right away
+     * under a lease), a follower asks the leader for the commit index to
+     * wait for. */
+    int read_request(uint64_t id, RaftSMOutput *out);
+
     /* Called by the Raft state machine when a log entry needs to
-     * be applied to the replicated state machine. */
-    virtual int apply(LogIndex index, Term term, const char *const serbuf) = 0;
+     * be applied to the replicated state machine. Empty commands are
+     * appended by the leader for its own purposes, and are not applied. */
+    virtual int apply(LogIndex index, Term term,
+                      const std::string &command) = 0;
     virtual ~RaftSM();
 
+    /* Called by the Raft state machine to serialize the current state of
+     * the replicated state machine into 'state', or to replace it with
+     * a serialized state (received from the leader or loaded from disk).
+     * Replicated state machines that do not override these methods do not
+     * support snapshots. */
+    virtual int snapshot_serialize(std::string &state) { return -1; }
+    virtual int snapshot_restore(const std::string &state) { return -1; }
+
+    /* Called by the Raft state machine to read the current time, which
+     * drives the leases and the retransmissions. The tests override it to
+     * emulate the passing of time. */
+    virtual std::chrono::steady_clock::time_point clock_now() const
+    {
+        return std::chrono::steady_clock::now();
+    }
+
+    /* Take a snapshot of the replicated state machine, which covers all
+     * the entries applied so far, and drop those entries from the log. */
+    int take_snapshot();
+
+    /* Take a snapshot automatically each time the log contains this many
+     * entries that are already applied (0 to disable). */
+    void set_snapshot_threshold(LogIndex entries)
+    {
+        snapshot_threshold = entries;
+    }
+
     /* True if this Raft SM is the current leader. */
     bool leader() const { return state == RaftState::Leader; }
 
@@ -395,10 +730,12 @@ public:
 
     Term curr_term() const { return current_term; }
 
+    LogIndex last_index() const { return last_log_index; }
+
     int set_election_timeout(std::chrono::milliseconds tmin,
                              std::chrono::milliseconds tmax)
     {
-        if (tmin > tmax) {
+        if (tmin > tmax || tmin <= ReadLease) {
             return -1;
         }
 
@@ -425,6 +762,17 @@ public:
 
     Stats get_stats() { return stats; };
 
+    /* Change the number of entries of the log cache, dropping its current
+     * content. Zero disables the cache. */
+    void set_log_cache_size(size_t entries)
+    {
+        log_cache.clear();
+        log_cache.resize(entries);
+    }
+
+    /* Default number of entries of the log cache. */
+    static constexpr size_t kLogCacheEntries = 1024;
+
     static constexpr unsigned int kVerboseQuiet = 0;
     static constexpr unsigned int kVerboseInfo  = 6;
     static constexpr unsigned int kVerboseVery  = 10;
@@ -438,14 +786,63 @@ public:
      * message. */
     static constexpr size_t kMaxLogChunkBytes = 1000;
 
+    /* At most 2048 bytes of snapshot per each RaftInstallSnapshot
+     * message. */
+    static constexpr size_t kMaxSnapshotChunkBytes = 2048;
+
     void set_retransmission_timeout(std::chrono::milliseconds t)
     {
         RtxTimeout = t;
     }
 
+    /* Enable leader leases: once a majority confirmed its leadership, the
+     * leader serves reads locally for 't', as the other replicas refuse to
+     * vote while they hear from it. This relies on bounded clock drift, so
+     * 't' must be shorter than the minimum election timeout. Zero
+     * disables leases. */
+    int set_read_lease(std::chrono::milliseconds t)
+    {
+        if (t >= ElectionTimeoutMin) {
+            return -1;
+        }
+        ReadLease = t;
+        return 0;
+    }
+
+    /* Default number of entries in flight towards each follower. */
+    static constexpr LogIndex kReplicationWindowEntries = 512;
+
+    int set_replication_window(LogIndex entries)
+    {
+        if (entries == 0) {
+            return -1;
+        }
+        replication_window = entries;
+        return 0;
+    }
+
+    /* The state of the replication towards a follower, as seen by the
+     * leader. */
+    struct FollowerInfo {
+        ReplicaId id;
+        LogIndex match_index;
+        LogIndex lag;      /* entries not known to be replicated */
+        LogIndex inflight; /* entries sent but not acked */
+        unsigned int rejections;
+        unsigned int retransmissions;
+        std::chrono::milliseconds since_ack;
+    };
+
+    /* Only meaningful on the leader. */
+    std::vector<FollowerInfo> followers_info() const;
+
     static constexpr int kElectionTimeoutMinMsecs = 200;
     static constexpr int kHeartBeatTimeoutMsecs   = 100;
     static constexpr int kRtxTimeoutMsecs         = 2000;
+
+    /* Maximum number of rounds of leadership confirmation in flight that
+     * are remembered, to extend the lease when they are confirmed. */
+    static constexpr size_t kReadRoundsMax = 64;
 };
 
 } /* namespace raft */
@@ -40,6 +40,8 @@
 #include <linux/spinlock.h>
 #include <linux/nsproxy.h>
 #include <linux/compat.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include <net/net_namespace.h>
 
 int verbosity = RL_VERB_DBG;
@@ -69,8 +71,24 @@ struct rl_ctrl {
     spinlock_t upqueue_lock;
     wait_queue_head_t upqueue_wqh;
 
+    /* Optional shared-memory ring that replaces the upqueue list,
+     * protected by upqueue_lock. The ring is allocated by ioctl() in
+     * ring_mem, and only used (ring != NULL) once userspace maps it. */
+    struct rl_ctrl_ring_hdr *ring;
+    struct rl_ctrl_ring_hdr *ring_mem;
+    uint32_t ring_size;
+    uint32_t ring_tail;
+
+    /* Upqueue counters, protected by upqueue_lock. */
+    struct rl_ctrl_stats stats;
+
     struct list_head flows_fetch_q;
     struct list_head regs_fetch_q;
+
+    /* Pending responses of a flow statistics dump. */
+    struct list_head flow_stats_dump_q;
+    spinlock_t flow_stats_dump_lock;
+
     struct list_head node;
 
     unsigned flags;
@@ -296,6 +314,108 @@ upqentry_size(struct upqueue_entry *entry)
     return entry->serlen + sizeof(*entry);
 }
 
+/* Bytes currently used in the shared ring. To be called under upqueue_lock.
+ * The head index is written by userspace, so it cannot be trusted. */
+static int
+ctrl_ring_used(struct rl_ctrl *rc, uint32_t *used)
+{
+    uint32_t head = smp_load_acquire(&rc->ring->head);
+
+    *used = rc->ring_tail - head;
+    if (unlikely(*used > rc->ring_size ||
+                 (head & (RL_CTRL_RING_ALIGN - 1)))) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Serialize a message straight into the shared ring. To be called under
+ * upqueue_lock. Returns -ENOSPC if there is not enough room. */
+static int
+ctrl_ring_push(struct rl_ctrl *rc, const struct rl_msg_base *rmsg,
+               unsigned int serlen)
+{
+    uint8_t *data   = ((uint8_t *)rc->ring) + RL_CTRL_RING_DATA_OFS;
+    uint32_t reclen = ALIGN(sizeof(struct rl_ctrl_ring_rec) + serlen,
+                            RL_CTRL_RING_ALIGN);
+    uint32_t tail   = rc->ring_tail;
+    uint32_t ofs    = tail & (rc->ring_size - 1);
+    uint32_t contig = rc->ring_size - ofs;
+    uint32_t needed = reclen;
+    struct rl_ctrl_ring_rec *rec;
+    uint32_t used;
+    int ret;
+
+    ret = ctrl_ring_used(rc, &used);
+    if (ret) {
+        RPD(1, "ctrl ring corrupted by userspace\n");
+        return ret;
+    }
+
+    if (reclen > rc->ring_size / 2) {
+        return -EMSGSIZE;
+    }
+
+    if (contig < reclen) {
+        /* Skip the end of the data area. */
+        needed += contig;
+    }
+
+    if (rc->ring_size - used < needed) {
+        /* Ask userspace to tell us when it frees some space. */
+        WRITE_ONCE(rc->ring->notify, 1);
+        return -ENOSPC;
+    }
+
+    if (contig < reclen) {
+        rec      = (struct rl_ctrl_ring_rec *)(data + ofs);
+        rec->len = RL_CTRL_RING_WRAP;
+        tail += contig;
+        ofs = 0;
+    }
+
+    rec       = (struct rl_ctrl_ring_rec *)(data + ofs);
+    rec->len  = serlen;
+    rec->pad1 = 0;
+    serialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX, rec + 1, rmsg);
+    tail += reclen;
+
+    rc->ring_tail = tail;
+    smp_store_release(&rc->ring->tail, tail);
+
+    return 0;
+}
+
+/* Update the upqueue counters. To be called under upqueue_lock. */
+static void
+ctrl_stats_update(struct rl_ctrl *rc, bool queued)
+{
+    uint64_t depth = rc->upqueue_size;
+
+    if (queued) {
+        rc->stats.queued++;
+    } else {
+        rc->stats.dropped++;
+    }
+
+    if (rc->ring) {
+        uint32_t used;
+
+        if (ctrl_ring_used(rc, &used) == 0) {
+            depth = used;
+        }
+    }
+
+    if (depth > rc->stats.peak_depth) {
+        rc->stats.peak_depth = depth;
+    }
+
+    if (rc->ring) {
+        rc->ring->stats = rc->stats;
+    }
+}
+
 int
 rl_upqueue_append(struct rl_ctrl *rc, const struct rl_msg_base *rmsg,
                   bool maysleep)
@@ -303,35 +423,40 @@ rl_upqueue_append(struct rl_ctrl *rc, const struct rl_msg_base *rmsg,
     gfp_t gfp        = maysleep ? GFP_KERNEL : GFP_ATOMIC;
     unsigned long to = msecs_to_jiffies(5);
     DECLARE_WAITQUEUE(wait, current);
-    struct upqueue_entry *entry;
+    struct upqueue_entry *entry = NULL;
     unsigned long exp;
     unsigned int serlen;
-    void *serbuf;
-    int ret = 0;
+    void *serbuf = NULL;
+    int ret      = 0;
 
     if (rc == NULL) {
         return 0; /* Nothing to do. */
     }
 
-    entry = rl_alloc(sizeof(*entry), gfp | __GFP_ZERO, RL_MT_UPQ);
-    if (!entry) {
-        RPV(1, "Out of memory\n");
-        return -ENOMEM;
-    }
-
-    /* Serialize the response into serbuf and then put it into the upqueue. */
     serlen = rl_msg_serlen(rl_ker_numtables, RLITE_KER_MSG_MAX, rmsg);
-    serbuf = rl_alloc(serlen, gfp | __GFP_ZERO, RL_MT_UPQ);
-    if (!serbuf) {
-        rl_free(entry, RL_MT_UPQ);
-        RPV(1, "Out of memory\n");
-        return -ENOMEM;
-    }
-    serlen =
-        serialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX, serbuf, rmsg);
 
-    entry->sermsg = serbuf;
-    entry->serlen = serlen;
+    if (!READ_ONCE(rc->ring)) {
+        /* No shared ring: serialize the response into serbuf and then put
+         * it into the upqueue. A ring is only created while the upqueue
+         * is empty, and never destroyed before release(). */
+        entry = rl_alloc(sizeof(*entry), gfp | __GFP_ZERO, RL_MT_UPQ);
+        if (!entry) {
+            RPV(1, "Out of memory\n");
+            return -ENOMEM;
+        }
+
+        serbuf = rl_alloc(serlen, gfp | __GFP_ZERO, RL_MT_UPQ);
+        if (!serbuf) {
+            rl_free(entry, RL_MT_UPQ);
+            RPV(1, "Out of memory\n");
+            return -ENOMEM;
+        }
+        serlen = serialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX,
+                                     serbuf, rmsg);
+
+        entry->sermsg = serbuf;
+        entry->serlen = serlen;
+    }
 
     if (maysleep) {
         add_wait_queue(&rc->upqueue_wqh, &wait);
@@ -341,27 +466,43 @@ rl_upqueue_append(struct rl_ctrl *rc, const struct rl_msg_base *rmsg,
 
     for (;;) {
         spin_lock(&rc->upqueue_lock);
-        if (rc->upqueue_size + upqentry_size(entry) > RL_UPQUEUE_SIZE_MAX) {
-            /* No free space in the queue. */
-            spin_unlock(&rc->upqueue_lock);
-            if (!maysleep || !time_before(jiffies, exp)) {
-                RPD(1, "upqueue overrun, dropping [cansleep=%d]\n", maysleep);
-                rl_free(serbuf, RL_MT_UPQ);
-                rl_free(entry, RL_MT_UPQ);
-                ret = -ENOSPC;
-                break;
-            }
+        if (rc->ring) {
+            /* Serialize straight into the shared ring, with no memory
+             * allocations. The ring may also have been created after
+             * the entry was prepared. */
+            ret = ctrl_ring_push(rc, rmsg, serlen);
+        } else if (rc->upqueue_size + upqentry_size(entry) >
+                   RL_UPQUEUE_SIZE_MAX) {
+            ret = -ENOSPC;
+        } else {
+            list_add_tail(&entry->node, &rc->upqueue);
+            rc->upqueue_size += upqentry_size(entry);
+            entry = NULL; /* now owned by the upqueue */
+            ret   = 0;
+        }
 
-            /* Wait for more space, but not more than 2 seconds. */
+        if (ret == -ENOSPC && maysleep && time_before(jiffies, exp)) {
+            /* No free space in the queue. Wait for more space, but not
+             * more than 5 milliseconds. */
+            spin_unlock(&rc->upqueue_lock);
             schedule_timeout(to);
             continue;
         }
-        list_add_tail(&entry->node, &rc->upqueue);
-        rc->upqueue_size += upqentry_size(entry);
+
+        ctrl_stats_update(rc, ret == 0);
         spin_unlock(&rc->upqueue_lock);
+        if (ret) {
+            RPD(1, "upqueue overrun, dropping [cansleep=%d,err=%d]\n",
+                maysleep, ret);
+        }
         break;
     }
 
+    if (entry) {
+        rl_free(serbuf, RL_MT_UPQ);
+        rl_free(entry, RL_MT_UPQ);
+    }
+
     if (maysleep) {
         remove_wait_queue(&rc->upqueue_wqh, &wait);
     }
@@ -1277,6 +1418,7 @@ flow_del(struct flow_entry *entry)
     rl_iodevs_probe_flow_references(entry);
 
     PD("flow entry %u removed\n", entry->local_port);
+    free_percpu(entry->stats);
     rl_free(entry, RL_MT_FLOW);
 
     if (!ipcp->ops.flow_deallocated) {
@@ -1359,6 +1501,14 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
         return -ENOMEM;
     }
 
+    /* Per-CPU statistics, zeroed by the allocator. */
+    entry->stats = alloc_percpu_gfp(struct rl_flow_stats, gfp);
+    if (!entry->stats) {
+        rl_free(entry, RL_MT_FLOW);
+        *pentry = NULL;
+        return -ENOMEM;
+    }
+
     FLOCK(dm);
 
     /* Try to alloc a port id and a cep id from the bitmaps, cep
@@ -1429,6 +1579,7 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
     } else {
         FUNLOCK(dm);
 
+        free_percpu(entry->stats);
         rl_free(entry, RL_MT_FLOW);
         *pentry = NULL;
         ret     = -ENOSPC;
@@ -2259,6 +2410,69 @@ rl_ipcp_pduft_mod(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     return ret;
 }
 
+static int
+rl_ipcp_pduft_batch(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_pduft_batch *req =
+        (struct rl_kmsg_ipcp_pduft_batch *)bmsg;
+    const struct rl_pduft_op *ops = req->ops.slots.raw;
+    unsigned int n                = req->ops.num_elements;
+    struct flow_entry **flows     = NULL;
+    struct ipcp_entry *ipcp;
+    int ret = -EINVAL; /* Report failure by default. */
+    unsigned int i;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    if (req->ops.elem_size != sizeof(*ops) || n > RL_PDUFT_BATCH_MAX) {
+        return -EINVAL;
+    }
+
+    ipcp = ipcp_get(rc->dm, req->ipcp_id);
+    if (!ipcp || !ipcp->ops.pduft_batch || (ipcp->flags & RL_K_IPCP_ZOMBIE)) {
+        goto out;
+    }
+
+    flows = rl_alloc(sizeof(*flows) * n, GFP_KERNEL | __GFP_ZERO, RL_MT_MISC);
+    if (!flows) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* Resolve all the flows before touching the PDUFT. As for
+     * rl_ipcp_pduft_mod(), the requesting IPCP must be the user of each
+     * flow. */
+    for (i = 0; i < n; i++) {
+        if (ops[i].op == RL_PDUFT_OP_DEL) {
+            continue;
+        }
+        flows[i] = flow_get(rc->dm, ops[i].local_port);
+        if (!flows[i] || flows[i]->upper.ipcp != ipcp) {
+            goto out;
+        }
+    }
+
+    mutex_lock(&ipcp->lock);
+    ret = ipcp->ops.pduft_batch(ipcp, ops, flows, n);
+    mutex_unlock(&ipcp->lock);
+
+    if (ret == 0) {
+        PV("Applied %u PDUFT updates to IPC process %s\n", n, ipcp->name);
+    }
+out:
+    if (flows) {
+        for (i = 0; i < n; i++) {
+            flow_put(flows[i]);
+        }
+        rl_free(flows, RL_MT_MISC);
+    }
+    ipcp_put(ipcp);
+
+    return ret;
+}
+
 static int
 rl_ipcp_pduft_flush(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
 {
@@ -2503,6 +2717,27 @@ rl_flow_dealloc(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     return ret;
 }
 
+/* Collect the statistics of a flow from all the CPUs. */
+static void
+rl_flow_stats_get(struct flow_entry *flow, struct rl_flow_stats *stats)
+{
+    int cpu;
+
+    memset(stats, 0, sizeof(*stats));
+    for_each_possible_cpu(cpu)
+    {
+        struct rl_flow_stats *cpustats = per_cpu_ptr(flow->stats, cpu);
+        unsigned num   = sizeof(*stats) / sizeof(stats->tx_pkt);
+        uint64_t *ssrc = (uint64_t *)cpustats;
+        uint64_t *sdst = (uint64_t *)stats;
+        unsigned i;
+
+        for (i = 0; i < num; i++, sdst++, ssrc++) {
+            *sdst += *ssrc;
+        }
+    }
+}
+
 static int
 rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
 {
@@ -2526,7 +2761,7 @@ rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     spin_lock_bh(&dtp->lock);
 
     /* Copy in rl_io device stats. */
-    memcpy(&resp.stats, &flow->stats, sizeof(resp.stats));
+    rl_flow_stats_get(flow, &resp.stats);
 
     /* Copy in DTP state. */
     resp.dtp.snd_lwe                = dtp->snd_lwe;
@@ -2561,6 +2796,174 @@ rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     return ret;
 }
 
+struct flow_stats_dump_q_entry {
+    struct rl_kmsg_flow_stats_dump_resp resp;
+    struct list_head node;
+};
+
+/* Move pending flow statistics dump responses into the upqueue, as long as
+ * the upqueue is not too full. This is called when the dump is requested
+ * and every time userspace reads a message from the upqueue, so that a
+ * single request can stream an arbitrary number of responses without
+ * overrunning the upqueue. */
+static void
+flow_stats_dump_push(struct rl_ctrl *rc)
+{
+    struct flow_stats_dump_q_entry *dqe;
+
+    spin_lock_bh(&rc->flow_stats_dump_lock);
+    while (!list_empty(&rc->flow_stats_dump_q)) {
+        bool room;
+
+        spin_lock(&rc->upqueue_lock);
+        if (rc->ring) {
+            uint32_t used;
+
+            room = ctrl_ring_used(rc, &used) == 0 &&
+                   used <= rc->ring_size / 2;
+            if (!room) {
+                /* Ask userspace to tell us when it frees some space,
+                 * and check again in case it just did. */
+                WRITE_ONCE(rc->ring->notify, 1);
+                smp_mb();
+                room = ctrl_ring_used(rc, &used) == 0 &&
+                       used <= rc->ring_size / 2;
+            }
+        } else {
+            room = rc->upqueue_size <= RL_UPQUEUE_SIZE_MAX / 2;
+        }
+        spin_unlock(&rc->upqueue_lock);
+        if (!room) {
+            break;
+        }
+
+        dqe = list_first_entry(&rc->flow_stats_dump_q,
+                               struct flow_stats_dump_q_entry, node);
+        list_del_init(&dqe->node);
+        rl_upqueue_append(rc, RLITE_MB(&dqe->resp), false);
+        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&dqe->resp));
+        rl_free(dqe, RL_MT_FFETCH);
+    }
+    spin_unlock_bh(&rc->flow_stats_dump_lock);
+}
+
+static struct flow_stats_dump_q_entry *
+flow_stats_dump_q_entry_alloc(uint32_t event_id)
+{
+    struct flow_stats_dump_q_entry *dqe;
+
+    dqe = rl_alloc(sizeof(*dqe), GFP_ATOMIC | __GFP_ZERO, RL_MT_FFETCH);
+    if (!dqe) {
+        return NULL;
+    }
+
+    dqe->resp.hdr.msg_type        = RLITE_KER_FLOW_STATS_DUMP_RESP;
+    dqe->resp.hdr.event_id        = event_id;
+    dqe->resp.entries.elem_size   = sizeof(struct rl_flow_stats_entry);
+    dqe->resp.entries.slots.raw   = rl_alloc(
+        RL_FLOW_STATS_DUMP_BATCH * sizeof(struct rl_flow_stats_entry),
+        GFP_ATOMIC, RL_MT_UTILS);
+    if (!dqe->resp.entries.slots.raw) {
+        rl_free(dqe, RL_MT_FFETCH);
+        return NULL;
+    }
+
+    return dqe;
+}
+
+static int
+rl_flow_stats_dump(struct rl_ctrl *rc, struct rl_msg_base *b_req)
+{
+    struct rl_kmsg_flow_stats_dump *req = (struct rl_kmsg_flow_stats_dump *)b_req;
+    struct flow_stats_dump_q_entry *dqe = NULL;
+    struct flow_stats_dump_q_entry *tmp;
+    struct flow_entry *entry;
+    struct list_head q;
+    int bucket;
+    int ret = 0;
+
+    if (req->ipcp_id != 0xffff) {
+        /* Validate req->ipcp_id. */
+        struct ipcp_entry *ipcp = ipcp_get(rc->dm, req->ipcp_id);
+
+        if (!ipcp) {
+            return -EINVAL;
+        }
+        ipcp_put(ipcp);
+    }
+
+    spin_lock_bh(&rc->flow_stats_dump_lock);
+    ret = list_empty(&rc->flow_stats_dump_q) ? 0 : -EBUSY;
+    spin_unlock_bh(&rc->flow_stats_dump_lock);
+    if (ret) {
+        return ret; /* A dump is still in progress. */
+    }
+
+    /* Snapshot the statistics of all the (matching) flows into a list of
+     * batched responses, the last one marked with the 'end' flag. */
+    INIT_LIST_HEAD(&q);
+
+    FRLOCK(rc->dm);
+    hash_for_each(rc->dm->flow_table, bucket, entry, node)
+    {
+        struct rl_flow_stats_entry *se;
+
+        if (req->ipcp_id != 0xffff && entry->txrx.ipcp->id != req->ipcp_id) {
+            continue;
+        }
+
+        if (!dqe ||
+            dqe->resp.entries.num_elements >= RL_FLOW_STATS_DUMP_BATCH) {
+            dqe = flow_stats_dump_q_entry_alloc(req->hdr.event_id);
+            if (!dqe) {
+                ret = -ENOMEM;
+                break;
+            }
+            list_add_tail(&dqe->node, &q);
+        }
+
+        se = ((struct rl_flow_stats_entry *)dqe->resp.entries.slots.raw) +
+             dqe->resp.entries.num_elements++;
+        memset(se, 0, sizeof(*se));
+        se->ipcp_id = entry->txrx.ipcp->id;
+        se->port_id = entry->local_port;
+        rl_flow_stats_get(entry, &se->stats);
+    }
+    FRUNLOCK(rc->dm);
+
+    if (!ret && (!dqe || dqe->resp.entries.num_elements ==
+                             RL_FLOW_STATS_DUMP_BATCH)) {
+        /* We need an additional (possibly empty) response to carry
+         * the 'end' flag. */
+        dqe = flow_stats_dump_q_entry_alloc(req->hdr.event_id);
+        if (!dqe) {
+            ret = -ENOMEM;
+        } else {
+            list_add_tail(&dqe->node, &q);
+        }
+    }
+
+    if (ret) {
+        list_for_each_entry_safe (dqe, tmp, &q, node) {
+            list_del_init(&dqe->node);
+            rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX,
+                        RLITE_MB(&dqe->resp));
+            rl_free(dqe, RL_MT_FFETCH);
+        }
+        RPV(1, "Out of memory\n");
+        return ret;
+    }
+    dqe->resp.end = 1;
+
+    spin_lock_bh(&rc->flow_stats_dump_lock);
+    list_splice_tail(&q, &rc->flow_stats_dump_q);
+    spin_unlock_bh(&rc->flow_stats_dump_lock);
+
+    flow_stats_dump_push(rc);
+
+    return 0;
+}
+
 static int
 rl_flow_cfg_update(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
 {
@@ -3163,6 +3566,7 @@ static rl_msg_handler_t rl_ctrl_handlers[] = {
     [RLITE_KER_IPCP_PDUFT_SET]        = rl_ipcp_pduft_mod,
     [RLITE_KER_IPCP_PDUFT_DEL]        = rl_ipcp_pduft_mod,
     [RLITE_KER_IPCP_PDUFT_FLUSH]      = rl_ipcp_pduft_flush,
+    [RLITE_KER_IPCP_PDUFT_BATCH]      = rl_ipcp_pduft_batch,
     [RLITE_KER_APPL_REGISTER]         = rl_appl_register,
     [RLITE_KER_APPL_REGISTER_RESP]    = rl_appl_register_resp,
     [RLITE_KER_FA_REQ]                = rl_fa_req,
@@ -3181,6 +3585,7 @@ static rl_msg_handler_t rl_ctrl_handlers[] = {
     [RLITE_KER_IPCP_CONFIG_GET_REQ]   = rl_ipcp_config_get,
     [RLITE_KER_IPCP_SCHED_WRR]        = rl_ipcp_sched_config,
     [RLITE_KER_IPCP_SCHED_PFIFO]      = rl_ipcp_sched_config,
+    [RLITE_KER_FLOW_STATS_DUMP]       = rl_flow_stats_dump,
 #ifdef RL_MEMTRACK
     [RLITE_KER_MEMTRACK_DUMP] = rl_memtrack_dump,
 #endif /* RL_MEMTRACK */
@@ -3235,6 +3640,7 @@ rl_ctrl_write(struct file *f, const char __user *ubuf, size_t len, loff_t *ppos)
     case RLITE_KER_IPCP_CONFIG:
     case RLITE_KER_IPCP_PDUFT_SET:
     case RLITE_KER_IPCP_PDUFT_FLUSH:
+    case RLITE_KER_IPCP_PDUFT_BATCH:
     case RLITE_KER_APPL_REGISTER_RESP:
     case RLITE_KER_IPCP_UIPCP_SET:
     case RLITE_KER_UIPCP_FA_REQ_ARRIVED:
@@ -3264,6 +3670,19 @@ rl_ctrl_write(struct file *f, const char __user *ubuf, size_t len, loff_t *ppos)
     return len;
 }
 
+/* Called when userspace consumed some messages, with read() or from the
+ * shared ring. */
+static void
+rl_ctrl_consumed(struct rl_ctrl *rc)
+{
+    /* Some space was freed up in the upqueue: wake up processes
+     * blocked on rl_upqueue_append(). */
+    wake_up_interruptible_poll(&rc->upqueue_wqh,
+                               POLLOUT | POLLWRNORM | POLLWRBAND);
+    /* Continue a flow statistics dump, if any. */
+    flow_stats_dump_push(rc);
+}
+
 static ssize_t
 rl_ctrl_read(struct file *f, char __user *buf, size_t len, loff_t *ppos)
 {
@@ -3325,10 +3744,7 @@ rl_ctrl_read(struct file *f, char __user *buf, size_t len, loff_t *ppos)
     }
 
     if (ret > 0) {
-        /* Some space was freed up in the upqueue: wake up processes
-         * blocked on rl_upqueue_append(). */
-        wake_up_interruptible_poll(&rc->upqueue_wqh,
-                                   POLLOUT | POLLWRNORM | POLLWRBAND);
+        rl_ctrl_consumed(rc);
     }
 
     return ret;
@@ -3343,7 +3759,8 @@ rl_ctrl_poll(struct file *f, poll_table *wait)
     poll_wait(f, &rc->upqueue_wqh, wait);
 
     spin_lock(&rc->upqueue_lock);
-    if (!list_empty(&rc->upqueue)) {
+    if (!list_empty(&rc->upqueue) ||
+        (rc->ring && READ_ONCE(rc->ring->head) != rc->ring_tail)) {
         mask |= POLLIN | POLLRDNORM;
     }
     spin_unlock(&rc->upqueue_lock);
@@ -3407,6 +3824,8 @@ rl_ctrl_open(struct inode *inode, struct file *f)
 
     INIT_LIST_HEAD(&rc->flows_fetch_q);
     INIT_LIST_HEAD(&rc->regs_fetch_q);
+    INIT_LIST_HEAD(&rc->flow_stats_dump_q);
+    spin_lock_init(&rc->flow_stats_dump_lock);
 
     rc->handlers = rl_ctrl_handlers;
 
@@ -3467,6 +3886,24 @@ rl_ctrl_release(struct inode *inode, struct file *f)
         }
     }
 
+    /* Drain flow-stats-dump queue. */
+    {
+        struct flow_stats_dump_q_entry *dqe, *dqet;
+
+        list_for_each_entry_safe (dqe, dqet, &rc->flow_stats_dump_q, node) {
+            list_del_init(&dqe->node);
+            rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX,
+                        RLITE_MB(&dqe->resp));
+            rl_free(dqe, RL_MT_FFETCH);
+        }
+    }
+
+    /* The ring cannot be mapped anymore, as each mapping holds a
+     * reference to the file. */
+    if (rc->ring_mem) {
+        vfree(rc->ring_mem);
+    }
+
     rl_free(rc, RL_MT_CTLDEV);
     f->private_data = NULL;
 
@@ -3475,17 +3912,11 @@ rl_ctrl_release(struct inode *inode, struct file *f)
     return 0;
 }
 
-static long
-rl_ctrl_ioctl(struct file *f, unsigned int cmd, unsigned long flags)
+static int
+rl_ctrl_chflags(struct rl_ctrl *rc, unsigned long flags)
 {
-    struct rl_ctrl *rc   = (struct rl_ctrl *)f->private_data;
     unsigned int changed = flags ^ rc->flags;
 
-    /* We have only one command, to change the flags. */
-    if (cmd != RLITE_IOCTL_CHFLAGS) {
-        return -EINVAL;
-    }
-
     if (flags & ~RL_F_ALL) {
         return -EINVAL;
     }
@@ -3500,6 +3931,124 @@ rl_ctrl_ioctl(struct file *f, unsigned int cmd, unsigned long flags)
     return 0;
 }
 
+/* Allocate the shared-memory ring of the control device. The ring is
+ * used once userspace maps it (see rl_ctrl_mmap()), so that no message
+ * is lost if the mapping fails. */
+static int
+rl_ctrl_ring_create(struct rl_ctrl *rc, unsigned long size)
+{
+    struct rl_ctrl_ring_hdr *ring;
+    int ret = 0;
+
+    if (size < RL_CTRL_RING_SIZE_MIN || size > RL_CTRL_RING_SIZE_MAX ||
+        !is_power_of_2(size)) {
+        return -EINVAL;
+    }
+
+    ring = vmalloc_user(RL_CTRL_RING_DATA_OFS + size);
+    if (!ring) {
+        return -ENOMEM;
+    }
+    ring->size = size;
+
+    spin_lock(&rc->upqueue_lock);
+    if (rc->ring_mem) {
+        ret = -EBUSY;
+    } else {
+        rc->ring_mem  = ring;
+        rc->ring_size = size;
+    }
+    spin_unlock(&rc->upqueue_lock);
+
+    if (ret) {
+        vfree(ring);
+    }
+
+    return ret;
+}
+
+static long
+rl_ctrl_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+    struct rl_ctrl *rc = (struct rl_ctrl *)f->private_data;
+
+    switch (cmd) {
+    case RLITE_IOCTL_CHFLAGS:
+        return rl_ctrl_chflags(rc, arg);
+
+    case RLITE_IOCTL_CTRL_RING:
+        return rl_ctrl_ring_create(rc, arg);
+
+    case RLITE_IOCTL_CTRL_RING_CONSUMED:
+        if (!READ_ONCE(rc->ring)) {
+            return -ENXIO;
+        }
+        WRITE_ONCE(rc->ring->notify, 0);
+        rl_ctrl_consumed(rc);
+        return 0;
+
+    case RLITE_IOCTL_CTRL_STATS: {
+        struct rl_ctrl_stats stats;
+
+        spin_lock(&rc->upqueue_lock);
+        stats = rc->stats;
+        spin_unlock(&rc->upqueue_lock);
+
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats))) {
+            return -EFAULT;
+        }
+        return 0;
+    }
+    }
+
+    return -EINVAL;
+}
+
+static int
+rl_ctrl_mmap(struct file *f, struct vm_area_struct *vma)
+{
+    struct rl_ctrl *rc = (struct rl_ctrl *)f->private_data;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    struct rl_ctrl_ring_hdr *ring;
+    uint32_t size;
+    int ret;
+
+    spin_lock(&rc->upqueue_lock);
+    ring = rc->ring_mem;
+    size = rc->ring_size;
+    spin_unlock(&rc->upqueue_lock);
+
+    if (!ring) {
+        return -ENXIO;
+    }
+
+    if (vma->vm_pgoff != 0 || len > RL_CTRL_RING_DATA_OFS + size) {
+        return -EINVAL;
+    }
+
+    ret = remap_vmalloc_range(vma, ring, 0);
+    if (ret) {
+        return ret;
+    }
+
+    /* Switch the control device to the ring. This is only possible while
+     * there are no pending messages in the upqueue list. On failure the
+     * mapping is undone by the caller. */
+    spin_lock(&rc->upqueue_lock);
+    if (!rc->ring) {
+        if (!list_empty(&rc->upqueue)) {
+            ret = -EBUSY;
+        } else {
+            ring->stats   = rc->stats;
+            rc->ring_tail = 0;
+            WRITE_ONCE(rc->ring, ring);
+        }
+    }
+    spin_unlock(&rc->upqueue_lock);
+
+    return ret;
+}
+
 #ifdef CONFIG_COMPAT
 static long
 rl_ctrl_compat_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
@@ -3515,6 +4064,7 @@ static const struct file_operations rl_ctrl_fops = {
     .write          = rl_ctrl_write,
     .read           = rl_ctrl_read,
     .poll           = rl_ctrl_poll,
+    .mmap           = rl_ctrl_mmap,
     .unlocked_ioctl = rl_ctrl_ioctl,
 #ifdef CONFIG_COMPAT
     .compat_ioctl = rl_ctrl_compat_ioctl,
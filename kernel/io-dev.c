@@ -38,6 +38,7 @@
 #include <linux/spinlock.h>
 #include <linux/uio.h>
 #include <linux/compat.h>
+#include <asm/ioctls.h>
 
 static LIST_HEAD(rl_iodevs);
 static DEFINE_MUTEX(rl_iodevs_lock);
@@ -70,6 +71,7 @@ rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
                struct rl_buf *rb, bool qlimit)
 {
     struct ipcp_entry *upper_ipcp = flow->upper.ipcp;
+    struct rl_flow_stats *stats;
     struct txrx *txrx;
 
     if (upper_ipcp) {
@@ -89,20 +91,22 @@ rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
     }
 
     spin_lock_bh(&txrx->rx_lock);
+    stats = this_cpu_ptr(flow->stats);
     if (unlikely(qlimit && txrx->rx_qsize > RL_RXQ_SIZE_MAX)) {
         /* This is useful when flow control is not used on a flow. */
         RPD(1,
             "dropping PDU [length %lu] to avoid userspace rx queue "
             "overrun\n",
             (long unsigned)rb->len);
-        flow->stats.rx_overrun_pkt++;
-        flow->stats.rx_overrun_byte += rb->len;
+        stats->rx_overrun_pkt++;
+        stats->rx_overrun_byte += rb->len;
         rl_buf_free(rb);
     } else {
+        RL_BUF_RX(rb).tstamp = ktime_get();
         rb_list_enq(rb, &txrx->rx_q);
         txrx->rx_qsize += rl_buf_truesize(rb);
-        flow->stats.rx_pkt++;
-        flow->stats.rx_byte += rb->len;
+        stats->rx_pkt++;
+        stats->rx_byte += rb->len;
     }
     spin_unlock_bh(&txrx->rx_lock);
     wake_up_interruptible_poll(&txrx->rx_wqh, POLLIN | POLLRDNORM | POLLRDBAND);
@@ -221,6 +225,7 @@ rl_io_write_iter(struct kiocb *iocb,
     bool something_sent = false;
     DECLARE_WAITQUEUE(wait, current);
     ssize_t ret = 0;
+    ktime_t t0;
 
     if (unlikely(!rio->txrx)) {
         PE("Error: Not bound to a flow nor IPCP\n");
@@ -316,6 +321,7 @@ rl_io_write_iter(struct kiocb *iocb,
             add_wait_queue(flow->txrx.tx_wqh, &wait);
         }
 
+        t0 = ktime_get();
         for (;;) {
             set_current_state(TASK_INTERRUPTIBLE);
 
@@ -352,14 +358,19 @@ rl_io_write_iter(struct kiocb *iocb,
         }
 
         if (unlikely(ret < 0)) {
+            if (ret != -EAGAIN) {
+                this_cpu_inc(flow->stats->tx_err);
+            }
             break;
         }
 
         something_sent = true;
         left -= copylen;
         tot += copylen;
-        flow->stats.tx_pkt++;
-        flow->stats.tx_byte += copylen;
+        this_cpu_inc(flow->stats->tx_pkt);
+        this_cpu_add(flow->stats->tx_byte, copylen);
+        this_cpu_inc(flow->stats->tx_lat[rl_flow_lat_bucket(
+            ktime_to_ns(ktime_sub(ktime_get(), t0)))]);
     }
 
     return something_sent ? tot : ret;
@@ -442,6 +453,11 @@ rl_io_read_iter(struct kiocb *iocb,
             spin_unlock_bh(&txrx->rx_lock);
 
             ret = rl_buf_copy_to_user(rb, to, rb->len);
+            if (flow) {
+                this_cpu_inc(flow->stats->rx_lat[rl_flow_lat_bucket(
+                    ktime_to_ns(ktime_sub(ktime_get(),
+                                          RL_BUF_RX(rb).tstamp)))]);
+            }
             if (flow && flow->sdu_rx_consumed && ret >= 0) {
                 flow->sdu_rx_consumed(flow, RL_BUF_RX(rb).cons_seqnum,
                                       blocking);
@@ -706,6 +722,29 @@ rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
         break;
     }
 
+    case FIONREAD: {
+        int __user *avail = (int __user *)argp;
+        struct txrx *txrx = rio->txrx;
+        int len           = 0;
+
+        if (unlikely(!txrx)) {
+            return -ENXIO;
+        }
+
+        /* As for datagram sockets, report the length of the next SDU
+         * (including the management header, if any), so that the reader
+         * can make room for all of it. */
+        spin_lock_bh(&txrx->rx_lock);
+        if (!rb_list_empty(&txrx->rx_q)) {
+            len = rb_list_front(&txrx->rx_q)->len;
+        }
+        spin_unlock_bh(&txrx->rx_lock);
+        if (put_user(len, avail)) {
+            return -EFAULT;
+        }
+        break;
+    }
+
     default:
         ret = -EINVAL;
         break;
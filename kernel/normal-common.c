@@ -25,6 +25,7 @@
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/timer.h>
+#include <linux/jhash.h>
 #include "rlite/utils.h"
 #include "rlite-kernel.h"
 
@@ -168,6 +169,35 @@ pduft_lookup_internal(struct rl_normal *priv, const struct rl_pci_match *pci)
     return NULL;
 }
 
+/* Select one of the lower flows of an entry, hashing the PCI fields that
+ * identify the N-flow, so that all its PDUs take the same lower flow. If
+ * the selected flow is down, switch to the backup flow (if any), without
+ * waiting for the routing to converge. */
+static inline struct flow_entry *
+pduft_entry_flow(const struct pduft_entry *entry,
+                 const struct rl_pci_match *pci)
+{
+    struct flow_entry *flow;
+    u32 hash;
+
+    if (likely(entry->num_flows == 1)) {
+        flow = entry->flows[0];
+    } else {
+        hash = jhash_3words((u32)(pci->src_addr ^ (pci->src_addr >> 32)),
+                            (u32)(pci->dst_addr ^ (pci->dst_addr >> 32)),
+                            (pci->src_cepid << 16) ^ pci->dst_cepid,
+                            pci->qos_id);
+        flow = entry->flows[((u64)hash * entry->num_flows) >> 32];
+    }
+
+    if (unlikely(READ_ONCE(flow->down)) && entry->backup &&
+        !READ_ONCE(entry->backup->down)) {
+        return entry->backup;
+    }
+
+    return flow;
+}
+
 struct flow_entry *
 rl_pduft_lookup(struct rl_normal *priv, const struct rl_pci_match *pci)
 {
@@ -176,7 +206,7 @@ rl_pduft_lookup(struct rl_normal *priv, const struct rl_pci_match *pci)
 
     read_lock_bh(&priv->pduft_lock);
     entry = pduft_lookup_internal(priv, pci);
-    flow  = entry ? entry->flow : priv->pduft_dflt;
+    flow  = entry ? pduft_entry_flow(entry, pci) : priv->pduft_dflt;
     read_unlock_bh(&priv->pduft_lock);
 
     return flow;
@@ -197,6 +227,21 @@ rl_pduft_match_is_perflow(const struct rl_pci_match *match)
            match->dst_cepid != 0 && match->src_cepid != 0;
 }
 
+static void
+pduft_entry_flows_put(struct pduft_entry *entry)
+{
+    unsigned int i;
+
+    for (i = 0; i < entry->num_flows; i++) {
+        flow_put(entry->flows[i]);
+    }
+    entry->num_flows = 0;
+    if (entry->backup) {
+        flow_put(entry->backup);
+        entry->backup = NULL;
+    }
+}
+
 int
 rl_pduft_set(struct ipcp_entry *ipcp, const struct rl_pci_match *match,
              struct flow_entry *flow)
@@ -233,12 +278,14 @@ rl_pduft_set(struct ipcp_entry *ipcp, const struct rl_pci_match *match,
                          PDUFT_PERFLOW_KEY(match->dst_addr, match->dst_cepid));
                 priv->perflow_present = true;
             }
+            entry->backup = NULL;
         } else {
-            flow_put(entry->flow);
+            pduft_entry_flows_put(entry);
         }
 
-        entry->flow  = flow;
-        entry->match = *match;
+        entry->flows[0]  = flow;
+        entry->num_flows = 1;
+        entry->match     = *match;
     }
     write_unlock_bh(&priv->pduft_lock);
 
@@ -255,8 +302,195 @@ pduft_entry_unlink(struct rl_normal *priv, struct pduft_entry *entry)
     if (hash_empty(priv->pdu_ft_perflow)) {
         priv->perflow_present = false;
     }
-    flow_put(entry->flow);
+    pduft_entry_flows_put(entry);
+}
+
+/* Remove 'flow' from the group of an entry (or from its backup),
+ * preserving the order of the other lower flows. Returns the number of
+ * lower flows left in the group. */
+static unsigned int
+pduft_entry_flow_remove(struct pduft_entry *entry,
+                        const struct flow_entry *flow)
+{
+    unsigned int i, j;
+
+    if (entry->backup == flow) {
+        flow_put(entry->backup);
+        entry->backup = NULL;
+    }
+
+    for (i = 0, j = 0; i < entry->num_flows; i++) {
+        if (entry->flows[i] == flow) {
+            flow_put(entry->flows[i]);
+        } else {
+            entry->flows[j++] = entry->flows[i];
+        }
+    }
+    entry->num_flows = j;
+
+    return j;
+}
+
+/* Apply a list of PDUFT modifications under a single acquisition of the
+ * PDUFT lock, so that the datapath never sees a partially updated table.
+ * The caller provides a referenced flow for each RL_PDUFT_OP_SET,
+ * RL_PDUFT_OP_ADD and RL_PDUFT_OP_BACKUP operation. All the memory is
+ * allocated before taking the lock, and removed entries are freed after
+ * releasing it. */
+int
+rl_pduft_batch(struct ipcp_entry *ipcp, const struct rl_pduft_op *ops,
+               struct flow_entry **flows, unsigned int n)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct pduft_entry *group = NULL;
+    unsigned int group_size   = 0;
+    struct pduft_entry **spare;
+    struct pduft_entry *entry;
+    struct hlist_node *tmp;
+    unsigned int nspare = 0;
+    HLIST_HEAD(gc);
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 0; i < n; i++) {
+        if (!rl_pduft_match_is_dstonly(&ops[i].match) &&
+            !rl_pduft_match_is_perflow(&ops[i].match)) {
+            PE("Invalid route: neither dst-only nor per-flow\n");
+            return -EINVAL;
+        }
+        switch (ops[i].op) {
+        case RL_PDUFT_OP_SET:
+            nspare++;
+            group_size = 1;
+            break;
+        case RL_PDUFT_OP_ADD:
+            /* The default entry cannot have a group of lower flows. */
+            if (group_size == 0 || ++group_size > RL_PDUFT_ECMP_MAX ||
+                ops[i].match.dst_addr == RL_ADDR_NULL ||
+                memcmp(&ops[i].match, &ops[i - 1].match,
+                       sizeof(ops[i].match))) {
+                PE("Invalid PDUFT group operation\n");
+                return -EINVAL;
+            }
+            break;
+        case RL_PDUFT_OP_BACKUP:
+            /* At most one backup flow, after the group. */
+            if (group_size == 0 || ops[i].match.dst_addr == RL_ADDR_NULL ||
+                memcmp(&ops[i].match, &ops[i - 1].match,
+                       sizeof(ops[i].match))) {
+                PE("Invalid PDUFT backup operation\n");
+                return -EINVAL;
+            }
+            group_size = 0;
+            break;
+        case RL_PDUFT_OP_DEL:
+            group_size = 0;
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+
+    /* Preallocate one entry for each insertion, as an upper bound. */
+    spare = rl_alloc(sizeof(*spare) * (nspare + 1), GFP_KERNEL | __GFP_ZERO,
+                     RL_MT_PDUFT);
+    if (!spare) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < nspare; i++) {
+        spare[i] = rl_alloc(sizeof(*entry), GFP_KERNEL, RL_MT_PDUFT);
+        if (!spare[i]) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (ops[i].op != RL_PDUFT_OP_DEL) {
+            flow_get_ref(flows[i]);
+        }
+    }
+
+    write_lock_bh(&priv->pduft_lock);
+
+    for (i = 0; i < n; i++) {
+        const struct rl_pci_match *match = &ops[i].match;
+
+        if (ops[i].op == RL_PDUFT_OP_DEL) {
+            if (match->dst_addr == RL_ADDR_NULL) {
+                if (priv->pduft_dflt) {
+                    flow_put(priv->pduft_dflt);
+                    priv->pduft_dflt = NULL;
+                }
+            } else {
+                entry = pduft_lookup_internal(priv, match);
+                if (entry) {
+                    pduft_entry_unlink(priv, entry);
+                    hlist_add_head(&entry->node, &gc);
+                }
+            }
+            continue;
+        }
+
+        if (ops[i].op == RL_PDUFT_OP_ADD) {
+            /* Extend the group of the entry set just before. */
+            group->flows[group->num_flows++] = flows[i];
+            continue;
+        }
+
+        if (ops[i].op == RL_PDUFT_OP_BACKUP) {
+            group->backup = flows[i];
+            continue;
+        }
+
+        if (match->dst_addr == RL_ADDR_NULL) {
+            /* Default entry. */
+            if (priv->pduft_dflt) {
+                flow_put(priv->pduft_dflt);
+            }
+            priv->pduft_dflt = flows[i];
+            continue;
+        }
+
+        entry = pduft_lookup_internal(priv, match);
+        if (!entry) {
+            entry = spare[--nspare];
+            if (rl_pduft_match_is_dstonly(match)) {
+                hash_add(priv->pdu_ft, &entry->node, match->dst_addr);
+            } else {
+                hash_add(priv->pdu_ft_perflow, &entry->node,
+                         PDUFT_PERFLOW_KEY(match->dst_addr, match->dst_cepid));
+                priv->perflow_present = true;
+            }
+            entry->backup = NULL;
+        } else {
+            pduft_entry_flows_put(entry);
+        }
+
+        entry->flows[0]  = flows[i];
+        entry->num_flows = 1;
+        entry->match     = *match;
+        group            = entry;
+    }
+
+    write_unlock_bh(&priv->pduft_lock);
+
+    hlist_for_each_entry_safe(entry, tmp, &gc, node)
+    {
+        hlist_del(&entry->node);
+        rl_free(entry, RL_MT_PDUFT);
+    }
+
+out:
+    /* Release the preallocated entries that were not used. */
+    for (i = 0; i < nspare && spare[i]; i++) {
+        rl_free(spare[i], RL_MT_PDUFT);
+    }
+    rl_free(spare, RL_MT_PDUFT);
+
+    return ret;
 }
+EXPORT_SYMBOL(rl_pduft_batch);
 
 int
 rl_pduft_flush(struct ipcp_entry *ipcp)
@@ -299,9 +533,10 @@ rl_pduft_flush_by_flow(struct ipcp_entry *ipcp, const struct flow_entry *flow)
 
     write_lock_bh(&priv->pduft_lock);
 
+    /* Entries whose group still has other lower flows are kept. */
     hash_for_each_safe(priv->pdu_ft, bucket, tmp, entry, node)
     {
-        if (entry->flow == flow) {
+        if (pduft_entry_flow_remove(entry, flow) == 0) {
             pduft_entry_unlink(priv, entry);
             rl_free(entry, RL_MT_PDUFT);
         }
@@ -309,7 +544,7 @@ rl_pduft_flush_by_flow(struct ipcp_entry *ipcp, const struct flow_entry *flow)
 
     hash_for_each_safe(priv->pdu_ft_perflow, bucket, tmp, entry, node)
     {
-        if (entry->flow == flow) {
+        if (pduft_entry_flow_remove(entry, flow) == 0) {
             pduft_entry_unlink(priv, entry);
             rl_free(entry, RL_MT_PDUFT);
         }
@@ -138,6 +138,9 @@ struct rl_sched_pfifo {
     rl_qosid_t num_queues;
 };
 
+#define CREATE_TRACE_POINTS
+#include "rlite-trace.h"
+
 static int
 sched_pfifo_do_config(struct rl_sched *sched, unsigned int max_queue_size,
                       rl_qosid_t num_queues)
@@ -701,6 +704,8 @@ rtx_tmr_cb(
                 rb_list_enq(crb, &rrbq);
                 stats->rtx_pkt++;
                 stats->rtx_byte += rb->len;
+                trace_rlite_rtx_fire(flow, RL_BUF_PCI(rb)->seqnum, rb->len,
+                                     dtp->rtxq_len);
             }
         }
         if (!next_exp_set ||
@@ -1026,8 +1031,13 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
                 struct rl_buf *drb = sched->ops.deq(sched);
 
                 BUG_ON(!drb);
+                sched->qlen--;
+                trace_rlite_rmt_deq(ipcp, RL_BUF_RMT(drb).lower_flow,
+                                    RL_BUF_PCI(drb), sched->qlen);
                 rb_list_enq(drb, &drbs);
             }
+            sched->qlen++;
+            trace_rlite_rmt_enq(ipcp, lower_flow, pci, sched->qlen);
             stats->rmt.queued_pkt++;
             spin_unlock_bh(&sched->qlock);
             rb = NULL;
@@ -1048,6 +1058,10 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
                 set_current_state(TASK_INTERRUPTIBLE);
                 spin_lock_bh(&sched->qlock);
                 err = sched->ops.enq(sched, rb);
+                if (err == 0) {
+                    sched->qlen++;
+                    trace_rlite_rmt_enq(ipcp, lower_flow, pci, sched->qlen);
+                }
                 spin_unlock_bh(&sched->qlock);
                 if (err == 0) {
                     /* PDU enqueued to the scheduler. */
@@ -1100,6 +1114,9 @@ sched_deq_worker(struct work_struct *w)
             if (!rb) {
                 break;
             }
+            sched->qlen--;
+            trace_rlite_rmt_deq(priv->ipcp, RL_BUF_RMT(rb).lower_flow,
+                                RL_BUF_PCI(rb), sched->qlen);
             rb_list_enq(rb, &ready);
         }
         spin_unlock_bh(&sched->qlock);
@@ -1295,6 +1312,11 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
          * started again when we will be invoked again. */
         del_timer(&dtp->snd_inact_tmr);
 
+        if (!(dtp->flags & DTP_F_TX_BLOCKED)) {
+            dtp->flags |= DTP_F_TX_BLOCKED;
+            trace_rlite_fc_block(flow, dtp);
+        }
+
         spin_unlock_bh(&dtp->lock);
 
         /* Backpressure. Don't drop the PDU, we will be
@@ -1323,6 +1345,7 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     pci->pdu_ttl       = priv->ttl;
     pci->pdu_csum      = 0;
     pci->seqnum        = dtp->next_seq_num_to_use++;
+    trace_rlite_sdu_write(flow, pci->seqnum, len, dtp->cwq_len);
 
     if (unlikely(dtp->flags & DTP_F_DRF_SET)) {
         dtp->flags &= ~DTP_F_DRF_SET;
@@ -1700,6 +1723,7 @@ seqq_push(struct flow_entry *flow, struct rl_buf *rb)
     if (unlikely(dtp->seqq_len >= SEQQ_MAX_LEN)) {
         RPD(1, "seqq overrun: dropping PDU [%lu]\n", (long unsigned)seqnum);
         stats->rx_err++;
+        this_cpu_inc(flow->stats->rx_seqq_drop);
         rl_buf_free(rb);
         return;
     }
@@ -1714,6 +1738,7 @@ seqq_push(struct flow_entry *flow, struct rl_buf *rb)
             /* This is a duplicate amongst the gaps, we can
              * drop it. */
             stats->rx_err++;
+            this_cpu_inc(flow->stats->rx_dup_drop);
             rl_buf_free(rb);
             RPD(1, "Duplicate amongst the gaps [%lu] dropped\n",
                 (long unsigned)seqnum);
@@ -1725,6 +1750,7 @@ seqq_push(struct flow_entry *flow, struct rl_buf *rb)
     /* Insert the rb right before 'pos'. */
     rb_list_enq(rb, pos);
     dtp->seqq_len++;
+    trace_rlite_seqq_push(flow, seqnum, rb->len, dtp->seqq_len);
     stats->rx_pkt++;
     stats->rx_byte += rb->len;
     RPD(1, "[%lu] inserted\n", (long unsigned)seqnum);
@@ -1733,6 +1759,7 @@ seqq_push(struct flow_entry *flow, struct rl_buf *rb)
 static void
 seqq_pop_many(struct dtp *dtp, rl_seq_t max_sdu_gap, struct rb_list *qrbs)
 {
+    struct flow_entry *flow = container_of(dtp, struct flow_entry, dtp);
     struct rl_buf *qrb, *tmp;
 
     rb_list_init(qrbs);
@@ -1742,6 +1769,7 @@ seqq_pop_many(struct dtp *dtp, rl_seq_t max_sdu_gap, struct rb_list *qrbs)
         if (pci->seqnum - dtp->rcv_next_seq_num <= max_sdu_gap) {
             rb_list_del(qrb);
             dtp->seqq_len--;
+            trace_rlite_seqq_pop(flow, pci->seqnum, qrb->len, dtp->seqq_len);
             rb_list_enq(qrb, qrbs);
             dtp->rcv_next_seq_num = pci->seqnum + 1;
             RPD(1, "[%lu] popped out from seqq\n", (long unsigned)pci->seqnum);
@@ -1916,6 +1944,10 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
     }
 
 out:
+    if ((dtp->flags & DTP_F_TX_BLOCKED) && !flow_blocked(&flow->cfg, dtp)) {
+        dtp->flags &= ~DTP_F_TX_BLOCKED;
+        trace_rlite_fc_unblock(flow, dtp);
+    }
     spin_unlock_bh(&dtp->lock);
 
     rl_buf_free(rb);
@@ -2090,6 +2122,8 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
 
     spin_lock_bh(&dtp->lock);
 
+    trace_rlite_sdu_rx(flow, seqnum, rb->len, dtp->seqq_len);
+
     if (DTCP_PRESENT(flow->cfg.dtcp)) {
         mod_timer(&dtp->rcv_inact_tmr, jiffies + 2 * dtp->mpl_r_a);
     }
@@ -2148,6 +2182,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         RPD(1, "Dropping duplicate PDU [seq=%lu]\n", (long unsigned)seqnum);
         rl_buf_free(rb);
         stats->rx_err++;
+        this_cpu_inc(flow->stats->rx_dup_drop);
 
         if ((flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) &&
             dtp->rcv_next_seq_num >= dtp->last_lwe_sent) {
@@ -2258,6 +2293,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         rb  = NULL;
         crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
         stats->rx_err++;
+        this_cpu_inc(flow->stats->rx_gap_drop);
 
     } else {
         /* What is not dropped nor delivered goes in the sequencing queue.
@@ -2383,6 +2419,7 @@ static struct ipcp_factory normal_factory = {
     .ops.pduft_flush_by_flow = rl_pduft_flush_by_flow,
     .ops.pduft_del           = rl_pduft_del,
     .ops.pduft_del_addr      = rl_pduft_del_addr,
+    .ops.pduft_batch         = rl_pduft_batch,
     .ops.mgmt_sdu_build      = rl_normal_mgmt_sdu_build,
     .ops.sdu_rx              = rl_normal_sdu_rx,
     .ops.flow_writeable      = rl_normal_flow_writeable,
@@ -27,6 +27,7 @@
 
 #include "rlite/utils.h"
 #include "rlite/common.h"
+#include "rlite/kernel-msg.h"
 #include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/wait.h>
@@ -42,6 +43,8 @@
 #include <linux/uaccess.h>
 #include <linux/uio.h>
 #include <linux/hashtable.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
 
 #include "kerconfig.h"
 
@@ -176,6 +179,8 @@ union rl_buf_ctx {
     struct {
         /* Used in the RX datapath for flow control. */
         rlm_seq_t cons_seqnum;
+        /* Time of insertion in the userspace queue. */
+        ktime_t tstamp;
     } rx;
 };
 
@@ -459,6 +464,8 @@ struct ipcp_ops {
     int (*pduft_flush)(struct ipcp_entry *ipcp);
     int (*pduft_flush_by_flow)(struct ipcp_entry *ipcp,
                                const struct flow_entry *flow);
+    int (*pduft_batch)(struct ipcp_entry *ipcp, const struct rl_pduft_op *ops,
+                       struct flow_entry **flows, unsigned int n);
     int (*mgmt_sdu_build)(struct ipcp_entry *ipcp,
                           const struct rl_mgmt_hdr *hdr, struct rl_buf *rb,
                           struct ipcp_entry **lower_ipcp,
@@ -606,6 +613,7 @@ struct dtp {
 #define DTP_F_DRF_SET (1 << 0)
 #define DTP_F_DRF_EXPECTED (1 << 1)
 #define DTP_F_TIMERS_INITIALIZED (1 << 2)
+#define DTP_F_TX_BLOCKED (1 << 3) /* writers backpressured, for tracing */
     uint8_t flags;
 };
 
@@ -630,7 +638,7 @@ struct flow_entry {
 
     void *priv;
 
-    struct rl_flow_stats stats;
+    struct rl_flow_stats __percpu *stats;
     uint32_t uid;             /* unique id */
     struct list_head node_rm; /* for flows_removeq */
     unsigned long expires;    /* absolute time in jiffies */
@@ -642,13 +650,20 @@ struct flow_entry {
 #define RL_FLOW_DEL_POSTPONED (1 << 4) /* flow removal has been postponed */
 #define RL_FLOW_INITIATOR (1 << 5)     /* local node initiated this flow */
     uint8_t flags;
+    /* Set by the IPCP supporting the flow when it cannot carry traffic
+     * (e.g. the link is down). Read by the datapath without locks. */
+    bool down;
     struct hlist_node node;
     struct hlist_node node_cep;
 };
 
 struct pduft_entry {
     struct rl_pci_match match;
-    struct flow_entry *flow;
+    /* Group of lower flows the matching PDUs are spread over. */
+    struct flow_entry *flows[RL_PDUFT_ECMP_MAX];
+    unsigned int num_flows;
+    /* Lower flow used when the selected one is down, if not NULL. */
+    struct flow_entry *backup;
     struct hlist_node node; /* for the pdu_ft hash table */
 };
 
@@ -733,6 +748,20 @@ void flow_make_mortal(struct flow_entry *flow);
 
 void rl_flow_shutdown(struct flow_entry *flow);
 
+/* Map a latency sample (in nanoseconds) to a flow histogram bucket. */
+static inline unsigned int
+rl_flow_lat_bucket(s64 ns)
+{
+    unsigned int bucket;
+
+    if (ns < NSEC_PER_USEC) {
+        return 0;
+    }
+    bucket = ilog2((u64)ns / NSEC_PER_USEC) + 1;
+
+    return min(bucket, RL_FLOW_LAT_BUCKETS - 1U);
+}
+
 void rl_iodevs_shutdown_by_ipcp(struct ipcp_entry *ipcp);
 
 void rl_iodevs_probe_ipcp_references(struct ipcp_entry *ipcp);
@@ -773,6 +802,7 @@ struct rl_sched {
     struct rl_sched_ops ops;
     wait_queue_head_t wqh;
     spinlock_t qlock;
+    unsigned int qlen; /* PDUs in the queue, protected by qlock */
 #define RL_SCHED_PRIV(_sched) ((void *)(_sched)->priv)
     /* Private data allocated at the end of the struct. */
     char priv[0];
@@ -786,8 +816,8 @@ struct rl_normal {
 
     /* Implementation of the PDU Forwarding Table (PDUFT): a lock, a
      * default entry, and two hash tables. One of the has tables maps
-     * (dst_addr) --> (lower_flow). The other maps
-     * (dst_addr, src_addr, dst_cepid, src_cepid, qosid) --> (lower_flow)
+     * (dst_addr) --> (lower_flows). The other maps
+     * (dst_addr, src_addr, dst_cepid, src_cepid, qosid) --> (lower_flows)
      */
     rwlock_t pduft_lock;
     struct flow_entry *pduft_dflt;
@@ -813,6 +843,8 @@ int rl_pduft_flush_by_flow(struct ipcp_entry *ipcp,
                            const struct flow_entry *flow);
 int rl_pduft_set(struct ipcp_entry *ipcp, const struct rl_pci_match *match,
                  struct flow_entry *flow);
+int rl_pduft_batch(struct ipcp_entry *ipcp, const struct rl_pduft_op *ops,
+                   struct flow_entry **flows, unsigned int n);
 struct flow_entry *rl_pduft_lookup(struct rl_normal *priv,
                                    const struct rl_pci_match *pci);
 
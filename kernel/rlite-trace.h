@@ -0,0 +1,199 @@
+/*
+ * Tracepoints for the datapath of the normal IPC process.
+ *
+ * Copyright (C) 2026 agent
+ * Author: agent <agent@local>
+ *
+ * This file is part of rlite.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * The events are exported under events/rlite/ in tracefs, and can be
+ * consumed with ftrace, perf or eBPF programs. Every event identifies the
+ * flow with the (ipcp, port) pair. The output format is parsed by the
+ * rlite-trace tool, so it must be kept in sync with user/tools/rlite-trace.c.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rlite
+
+#if !defined(__RLITE_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __RLITE_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+/* Events related to a PDU of an N-flow, carrying the length of the
+ * queue involved in the event. */
+DECLARE_EVENT_CLASS(rlite_flow_pdu,
+
+    TP_PROTO(const struct flow_entry *flow, u64 seqnum, unsigned int len,
+             unsigned int qlen),
+
+    TP_ARGS(flow, seqnum, len, qlen),
+
+    TP_STRUCT__entry(
+        __field(u16, ipcp)
+        __field(u16, port)
+        __field(u64, seqnum)
+        __field(unsigned int, len)
+        __field(unsigned int, qlen)
+    ),
+
+    TP_fast_assign(
+        __entry->ipcp   = flow->txrx.ipcp->id;
+        __entry->port   = flow->local_port;
+        __entry->seqnum = seqnum;
+        __entry->len    = len;
+        __entry->qlen   = qlen;
+    ),
+
+    TP_printk("ipcp=%u port=%u seq=%llu len=%u qlen=%u", __entry->ipcp,
+              __entry->port, (unsigned long long)__entry->seqnum,
+              __entry->len, __entry->qlen)
+);
+
+/* A PDU is handed to EFCP by rl_normal_sdu_write(). The queue is the
+ * closed window queue. */
+DEFINE_EVENT(rlite_flow_pdu, rlite_sdu_write,
+    TP_PROTO(const struct flow_entry *flow, u64 seqnum, unsigned int len,
+             unsigned int qlen),
+    TP_ARGS(flow, seqnum, len, qlen));
+
+/* A DT PDU is received by rl_normal_sdu_rx(). The queue is the
+ * sequencing queue. */
+DEFINE_EVENT(rlite_flow_pdu, rlite_sdu_rx,
+    TP_PROTO(const struct flow_entry *flow, u64 seqnum, unsigned int len,
+             unsigned int qlen),
+    TP_ARGS(flow, seqnum, len, qlen));
+
+/* A PDU enters or leaves the sequencing queue. */
+DEFINE_EVENT(rlite_flow_pdu, rlite_seqq_push,
+    TP_PROTO(const struct flow_entry *flow, u64 seqnum, unsigned int len,
+             unsigned int qlen),
+    TP_ARGS(flow, seqnum, len, qlen));
+
+DEFINE_EVENT(rlite_flow_pdu, rlite_seqq_pop,
+    TP_PROTO(const struct flow_entry *flow, u64 seqnum, unsigned int len,
+             unsigned int qlen),
+    TP_ARGS(flow, seqnum, len, qlen));
+
+/* A PDU is retransmitted by the RTX timer. The queue is the
+ * retransmission queue. */
+DEFINE_EVENT(rlite_flow_pdu, rlite_rtx_fire,
+    TP_PROTO(const struct flow_entry *flow, u64 seqnum, unsigned int len,
+             unsigned int qlen),
+    TP_ARGS(flow, seqnum, len, qlen));
+
+/* Flow control starts or stops backpressuring the writers of a flow. */
+DECLARE_EVENT_CLASS(rlite_flow_fc,
+
+    TP_PROTO(const struct flow_entry *flow, const struct dtp *dtp),
+
+    TP_ARGS(flow, dtp),
+
+    TP_STRUCT__entry(
+        __field(u16, ipcp)
+        __field(u16, port)
+        __field(u64, next_seq)
+        __field(u64, snd_lwe)
+        __field(u64, snd_rwe)
+        __field(unsigned int, cwq_len)
+        __field(unsigned int, rtxq_len)
+    ),
+
+    TP_fast_assign(
+        __entry->ipcp     = flow->txrx.ipcp->id;
+        __entry->port     = flow->local_port;
+        __entry->next_seq = dtp->next_seq_num_to_use;
+        __entry->snd_lwe  = dtp->snd_lwe;
+        __entry->snd_rwe  = dtp->snd_rwe;
+        __entry->cwq_len  = dtp->cwq_len;
+        __entry->rtxq_len = dtp->rtxq_len;
+    ),
+
+    TP_printk("ipcp=%u port=%u next_seq=%llu snd_lwe=%llu snd_rwe=%llu "
+              "cwq=%u rtxq=%u",
+              __entry->ipcp, __entry->port,
+              (unsigned long long)__entry->next_seq,
+              (unsigned long long)__entry->snd_lwe,
+              (unsigned long long)__entry->snd_rwe, __entry->cwq_len,
+              __entry->rtxq_len)
+);
+
+DEFINE_EVENT(rlite_flow_fc, rlite_fc_block,
+    TP_PROTO(const struct flow_entry *flow, const struct dtp *dtp),
+    TP_ARGS(flow, dtp));
+
+DEFINE_EVENT(rlite_flow_fc, rlite_fc_unblock,
+    TP_PROTO(const struct flow_entry *flow, const struct dtp *dtp),
+    TP_ARGS(flow, dtp));
+
+/* A PDU enters or leaves the RMT scheduler queue of an IPCP. The port is
+ * the one of the N-1 flow, and the PDU is identified by its destination
+ * and sequence number. */
+DECLARE_EVENT_CLASS(rlite_rmt_pdu,
+
+    TP_PROTO(const struct ipcp_entry *ipcp, const struct flow_entry *lower_flow,
+             const struct rina_pci *pci, unsigned int qlen),
+
+    TP_ARGS(ipcp, lower_flow, pci, qlen),
+
+    TP_STRUCT__entry(
+        __field(u16, ipcp)
+        __field(u16, port)
+        __field(u64, dst_addr)
+        __field(u32, dst_cep)
+        __field(u8, pdu_type)
+        __field(u64, seqnum)
+        __field(unsigned int, qlen)
+    ),
+
+    TP_fast_assign(
+        __entry->ipcp     = ipcp->id;
+        __entry->port     = lower_flow->local_port;
+        __entry->dst_addr = pci->dst_addr;
+        __entry->dst_cep  = pci->dst_cep;
+        __entry->pdu_type = pci->pdu_type;
+        __entry->seqnum   = pci->seqnum;
+        __entry->qlen     = qlen;
+    ),
+
+    TP_printk("ipcp=%u port=%u dst=%llu cep=%u type=%u seq=%llu qlen=%u",
+              __entry->ipcp, __entry->port,
+              (unsigned long long)__entry->dst_addr, __entry->dst_cep,
+              __entry->pdu_type, (unsigned long long)__entry->seqnum,
+              __entry->qlen)
+);
+
+DEFINE_EVENT(rlite_rmt_pdu, rlite_rmt_enq,
+    TP_PROTO(const struct ipcp_entry *ipcp, const struct flow_entry *lower_flow,
+             const struct rina_pci *pci, unsigned int qlen),
+    TP_ARGS(ipcp, lower_flow, pci, qlen));
+
+DEFINE_EVENT(rlite_rmt_pdu, rlite_rmt_deq,
+    TP_PROTO(const struct ipcp_entry *ipcp, const struct flow_entry *lower_flow,
+             const struct rina_pci *pci, unsigned int qlen),
+    TP_ARGS(ipcp, lower_flow, pci, qlen));
+
+#endif /* __RLITE_TRACE_H__ */
+
+/* This part must be outside the multi-read protection. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rlite-trace
+#include <trace/define_trace.h>
@@ -1041,11 +1041,15 @@ shim_eth_netdev_notify(struct notifier_block *nb, unsigned long event,
                 switch (event) {
                 case NETDEV_UP:
                     ntfy.flow_state = RL_FLOW_STATE_UP;
+                    WRITE_ONCE(flow->down, false);
                     PD("flow %u goes up\n", flow->local_port);
                     break;
 
                 case NETDEV_DOWN:
+                    /* Let the upper IPCP reroute the traffic right away,
+                     * before the notification is processed. */
                     ntfy.flow_state = RL_FLOW_STATE_DOWN;
+                    WRITE_ONCE(flow->down, true);
                     PD("flow %u goes down\n", flow->local_port);
                     break;
 
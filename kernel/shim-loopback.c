@@ -35,6 +35,8 @@
 #include <linux/wait.h>
 #include <linux/sched.h>
 #include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
 
 struct rx_entry {
     struct rl_buf *rb;
@@ -42,62 +44,104 @@ struct rx_entry {
     struct flow_entry *rx_flow;
 };
 
-#define RX_POW 8
-#define RX_ENTRIES (1 << RX_POW)
+/* Default number of entries of each receive ring, used in
+ * queued mode. It can be changed through the rx_entries module parameter,
+ * and it is always rounded up to a power of two. The new value only
+ * applies to IPCPs created afterwards. */
+static unsigned int rx_entries = 256;
+module_param(rx_entries, uint, 0644);
+MODULE_PARM_DESC(rx_entries, "Number of entries of RX rings");
+
+/* Receive queue. There is one ring per online CPU (at creation time), and
+ * each flow always uses the same ring, so that its SDUs are delivered in
+ * order. The producers of a ring (the senders on the flows that map to
+ * it) are serialized by prod_lock, while the consumer is the rcv work
+ * item, which is never reentrant. As a result, producers and consumer
+ * only share the head and tail indices, with acquire/release semantics. */
+struct rl_shim_loopback_rxq {
+    struct rl_shim_loopback *priv;
+    struct rx_entry *rxr;
+    struct work_struct rcv;
+
+    /* Consumer index, only written by rcv_work(). */
+    unsigned int rdh ____cacheline_aligned_in_smp;
+
+    /* Producer index, only written by rl_shim_loopback_sdu_write(), and
+     * counter for drop-fract, both protected by prod_lock. */
+    spinlock_t prod_lock ____cacheline_aligned_in_smp;
+    unsigned int rdt;
+    uint32_t drop_cur;
+};
 
 struct rl_shim_loopback {
     struct ipcp_entry *ipcp;
 
     uint32_t drop_fract;
-    uint32_t drop_cur;
 
     /* Queuing data structures. */
     uint16_t queued; /* bool */
-    struct rx_entry rxr[RX_ENTRIES];
-    unsigned int rdh;
-    unsigned int rdt;
+    unsigned int rx_mask;
+    unsigned int num_rxq;
+    struct rl_shim_loopback_rxq *rxq;
 
+    /* Serializes configuration changes. */
     spinlock_t lock;
-    struct work_struct rcv;
 };
 
+static inline unsigned int
+rxq_next(struct rl_shim_loopback *priv, unsigned int idx)
+{
+    return (idx + 1) & priv->rx_mask;
+}
+
+/* The receive ring used by the SDUs written on 'tx_flow'. */
+static inline struct rl_shim_loopback_rxq *
+rxq_of(struct rl_shim_loopback *priv, struct flow_entry *tx_flow)
+{
+    return priv->rxq + tx_flow->local_port % priv->num_rxq;
+}
+
 static void
 rcv_work(struct work_struct *w)
 {
-    struct rl_shim_loopback *priv =
-        container_of(w, struct rl_shim_loopback, rcv);
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(priv->ipcp->stats);
+    struct rl_shim_loopback_rxq *q =
+        container_of(w, struct rl_shim_loopback_rxq, rcv);
+    struct rl_shim_loopback *priv = q->priv;
 
     for (;;) {
-        struct rl_buf *rb = NULL;
+        struct rl_ipcp_stats *stats;
         struct flow_entry *rx_flow;
         struct flow_entry *tx_flow;
+        unsigned int rdh = q->rdh;
+        struct rl_buf *rb;
         int ret;
 
-        spin_lock_bh(&priv->lock);
-        if (priv->rdh != priv->rdt) {
-            rb        = priv->rxr[priv->rdh].rb;
-            rx_flow   = priv->rxr[priv->rdh].rx_flow;
-            tx_flow   = priv->rxr[priv->rdh].tx_flow;
-            priv->rdh = (priv->rdh + 1) & (RX_ENTRIES - 1);
-
-            stats->tx_pkt++;
-            stats->tx_byte += rb->len;
-            stats->rx_pkt++;
-            stats->rx_byte += rb->len;
+        if (rdh == smp_load_acquire(&q->rdt)) {
+            break; /* ring is empty */
         }
-        spin_unlock_bh(&priv->lock);
 
-        if (!rb) {
-            break;
-        }
+        rb      = q->rxr[rdh].rb;
+        rx_flow = q->rxr[rdh].rx_flow;
+        tx_flow = q->rxr[rdh].tx_flow;
+        /* Release the slot to the producer. */
+        smp_store_release(&q->rdh, rxq_next(priv, rdh));
+
+        /* The per-CPU statistics are also updated in softirq context. */
+        local_bh_disable();
+        stats = this_cpu_ptr(priv->ipcp->stats);
+        stats->tx_pkt++;
+        stats->tx_byte += rb->len;
+        stats->rx_pkt++;
+        stats->rx_byte += rb->len;
+        local_bh_enable();
 
         ret = rl_sdu_rx_flow(priv->ipcp, rx_flow, rb, true);
         if (unlikely(ret)) {
-            spin_lock_bh(&priv->lock);
+            local_bh_disable();
+            stats = this_cpu_ptr(priv->ipcp->stats);
             stats->tx_err++;
             stats->rx_err++;
-            spin_unlock_bh(&priv->lock);
+            local_bh_enable();
         }
         flow_put(rx_flow);
 
@@ -106,10 +150,25 @@ rcv_work(struct work_struct *w)
     }
 }
 
+static void
+rl_shim_loopback_free_rings(struct rl_shim_loopback *priv)
+{
+    unsigned int i;
+
+    for (i = 0; i < priv->num_rxq; i++) {
+        if (priv->rxq[i].rxr) {
+            rl_free(priv->rxq[i].rxr, RL_MT_SHIMDATA);
+        }
+    }
+    rl_free(priv->rxq, RL_MT_SHIMDATA);
+}
+
 static void *
 rl_shim_loopback_create(struct ipcp_entry *ipcp)
 {
     struct rl_shim_loopback *priv;
+    unsigned int nentries;
+    unsigned int i;
 
     priv = rl_alloc(sizeof(*priv), GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
     if (!priv) {
@@ -119,11 +178,36 @@ rl_shim_loopback_create(struct ipcp_entry *ipcp)
     priv->ipcp       = ipcp;
     priv->drop_fract = 0; /* No drops by default. */
     priv->queued     = 0; /* No queue by default. */
-    INIT_WORK(&priv->rcv, rcv_work);
     spin_lock_init(&priv->lock);
-    priv->rdt = priv->rdh = 0;
 
-    PD("New IPC created [%p]\n", priv);
+    nentries      = roundup_pow_of_two(clamp(READ_ONCE(rx_entries), 2U, 65536U));
+    priv->rx_mask = nentries - 1;
+
+    priv->num_rxq = max(num_online_cpus(), 1U);
+    priv->rxq     = rl_alloc(priv->num_rxq * sizeof(priv->rxq[0]),
+                         GFP_KERNEL | __GFP_ZERO, RL_MT_SHIMDATA);
+    if (!priv->rxq) {
+        rl_free(priv, RL_MT_SHIM);
+        return NULL;
+    }
+
+    for (i = 0; i < priv->num_rxq; i++) {
+        struct rl_shim_loopback_rxq *q = priv->rxq + i;
+
+        q->priv = priv;
+        spin_lock_init(&q->prod_lock);
+        INIT_WORK(&q->rcv, rcv_work);
+        q->rxr = rl_alloc(nentries * sizeof(q->rxr[0]),
+                          GFP_KERNEL | __GFP_ZERO, RL_MT_SHIMDATA);
+        if (!q->rxr) {
+            rl_shim_loopback_free_rings(priv);
+            rl_free(priv, RL_MT_SHIM);
+            return NULL;
+        }
+    }
+
+    PD("New IPC created [%p], %u RX rings of %u entries\n", priv,
+       priv->num_rxq, nentries);
 
     return priv;
 }
@@ -132,14 +216,20 @@ static void
 rl_shim_loopback_destroy(struct ipcp_entry *ipcp)
 {
     struct rl_shim_loopback *priv = ipcp->priv;
+    unsigned int i;
 
-    cancel_work_sync(&priv->rcv);
+    for (i = 0; i < priv->num_rxq; i++) {
+        struct rl_shim_loopback_rxq *q = priv->rxq + i;
 
-    while (priv->rdh != priv->rdt) {
-        rl_buf_free(priv->rxr[priv->rdh].rb);
-        priv->rdh = (priv->rdh + 1) & (RX_ENTRIES - 1);
+        cancel_work_sync(&q->rcv);
+
+        while (q->rdh != q->rdt) {
+            rl_buf_free(q->rxr[q->rdh].rb);
+            q->rdh = rxq_next(priv, q->rdh);
+        }
     }
 
+    rl_shim_loopback_free_rings(priv);
     rl_free(priv, RL_MT_SHIM);
 
     PD("IPC [%p] destroyed\n", priv);
@@ -274,35 +364,37 @@ static bool
 rl_shim_loopback_flow_writeable(struct flow_entry *flow)
 {
     struct rl_shim_loopback *priv = flow->txrx.ipcp->priv;
-    bool ret                      = true;
+    struct rl_shim_loopback_rxq *q;
 
-    if (priv->queued) {
-        spin_lock_bh(&priv->lock);
-        ret = (((priv->rdt + 1) & (RX_ENTRIES - 1)) != priv->rdh);
-        spin_unlock_bh(&priv->lock);
+    if (!READ_ONCE(priv->queued)) {
+        return true;
     }
 
-    return ret;
+    /* Check the ring that the next write on this flow is going to use. */
+    q = rxq_of(priv, flow);
+
+    return rxq_next(priv, READ_ONCE(q->rdt)) != smp_load_acquire(&q->rdh);
 }
 
 static int
 rl_shim_loopback_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *tx_flow,
                            struct rl_buf *rb, unsigned flags)
 {
-    struct rl_ipcp_stats *stats   = raw_cpu_ptr(ipcp->stats);
-    struct rl_shim_loopback *priv = ipcp->priv;
+    struct rl_shim_loopback *priv  = ipcp->priv;
+    struct rl_shim_loopback_rxq *q = rxq_of(priv, tx_flow);
+    struct rl_ipcp_stats *stats;
     struct flow_entry *rx_flow;
     int ret = 0;
 
-    if (unlikely(priv->drop_fract)) {
+    if (unlikely(READ_ONCE(priv->drop_fract))) {
         bool drop = false;
 
-        spin_lock_bh(&priv->lock);
-        if (++priv->drop_cur >= priv->drop_fract) {
-            priv->drop_cur = 0;
-            drop           = true;
+        spin_lock_bh(&q->prod_lock);
+        if (++q->drop_cur >= READ_ONCE(priv->drop_fract)) {
+            q->drop_cur = 0;
+            drop        = true;
         }
-        spin_unlock_bh(&priv->lock);
+        spin_unlock_bh(&q->prod_lock);
 
         if (drop) {
             rl_buf_free(rb);
@@ -316,34 +408,38 @@ rl_shim_loopback_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *tx_flow,
         return -ENXIO;
     }
 
-    if (priv->queued) {
+    if (READ_ONCE(priv->queued)) {
+        unsigned int rdt;
         unsigned int next;
 
-        spin_lock_bh(&priv->lock);
-        next = (priv->rdt + 1) & (RX_ENTRIES - 1);
-        if (unlikely(next == priv->rdh)) {
+        spin_lock_bh(&q->prod_lock);
+        rdt  = q->rdt;
+        next = rxq_next(priv, rdt);
+        if (unlikely(next == smp_load_acquire(&q->rdh))) {
             ret = -EAGAIN;
         } else {
             flow_get_ref(tx_flow);
-            priv->rxr[priv->rdt].rb      = rb;
-            priv->rxr[priv->rdt].tx_flow = tx_flow;
-            priv->rxr[priv->rdt].rx_flow = rx_flow;
-            priv->rdt                    = next;
+            q->rxr[rdt].rb      = rb;
+            q->rxr[rdt].tx_flow = tx_flow;
+            q->rxr[rdt].rx_flow = rx_flow;
+            /* Publish the entry to the consumer. */
+            smp_store_release(&q->rdt, next);
         }
-        spin_unlock_bh(&priv->lock);
+        spin_unlock_bh(&q->prod_lock);
 
         if (ret) {
             flow_put(rx_flow);
             return ret;
         }
-        schedule_work(&priv->rcv);
+        schedule_work(&q->rcv);
 
     } else {
         size_t len = rb->len;
 
         ret = rl_sdu_rx_flow(ipcp, rx_flow, rb, true);
 
-        spin_lock_bh(&priv->lock);
+        local_bh_disable();
+        stats = this_cpu_ptr(ipcp->stats);
         if (unlikely(ret)) {
             stats->tx_err++;
             stats->rx_err++;
@@ -354,7 +450,7 @@ rl_shim_loopback_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *tx_flow,
             stats->rx_pkt++;
             stats->rx_byte += len;
         }
-        spin_unlock_bh(&priv->lock);
+        local_bh_enable();
 
         flow_put(rx_flow);
     }
@@ -375,9 +471,15 @@ rl_shim_loopback_config(struct ipcp_entry *ipcp, const char *param_name,
         spin_unlock_bh(&priv->lock);
 
     } else if (strcmp(param_name, "drop-fract") == 0) {
+        unsigned int i;
+
         spin_lock_bh(&priv->lock);
         ret = rl_configstr_to_u32(param_value, &priv->drop_fract, NULL);
-        priv->drop_cur = 0;
+        for (i = 0; i < priv->num_rxq; i++) {
+            spin_lock(&priv->rxq[i].prod_lock);
+            priv->rxq[i].drop_cur = 0;
+            spin_unlock(&priv->rxq[i].prod_lock);
+        }
         spin_unlock_bh(&priv->lock);
     }
 
@@ -28,9 +28,13 @@
 #include <thread>
 #include <condition_variable>
 #include <mutex>
+#include <chrono>
+#include <vector>
 #include <unistd.h>
 #include <cstdlib>
+#include <cstring>
 #include <errno.h>
+#include <poll.h>
 
 #include <sys/types.h>  /* system data type definitions */
 #include <sys/socket.h> /* socket specific definitions */
@@ -42,6 +46,33 @@
 
 using namespace std;
 
+/* Number of heap allocations performed so far, used by the benchmark. */
+static size_t num_allocs = 0;
+
+void *
+operator new(size_t size)
+{
+    void *p = std::malloc(size ? size : 1);
+
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    num_allocs++;
+    return p;
+}
+
+void
+operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void
+operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
 /* Synchronization for the client to start after the server has started. */
 static std::condition_variable server_ready_cond;
 static std::mutex mtx;
@@ -447,6 +478,456 @@ test_cdap_client(int port)
     return 0;
 }
 
+/* A sample of messages covering all the fields and all the types of
+ * object value. */
+static std::vector<CDAPMessage>
+sample_messages()
+{
+    std::vector<CDAPMessage> msgs;
+    struct CDAPAuthValue av;
+    CDAPMessage m;
+
+    av.name     = "user";
+    av.password = "secret";
+    av.other    = string("\0\1\2", 3);
+    m.m_connect(gpb::AUTH_PASSWD, &av, "rina-echo|1|server|", "rinaperf||");
+    m.invoke_id = 1;
+    msgs.push_back(m);
+
+    m.m_create("flow", "/dif/ra/fa/flows/1", 15, 3, "filter");
+    m.invoke_id = 12345;
+    m.set_obj_value(int32_t(-1));
+    msgs.push_back(m);
+    m.set_obj_value(int64_t(-(1LL << 40)));
+    msgs.push_back(m);
+    m.set_obj_value(string("string value"));
+    msgs.push_back(m);
+    m.set_obj_value(true);
+    msgs.push_back(m);
+    m.set_obj_value(float(3.0));
+    msgs.push_back(m);
+    m.set_obj_value(double(1 << 30));
+    msgs.push_back(m);
+
+    string bytes(1000, 'x');
+    m.m_write("a_data", "/a_data");
+    m.invoke_id = 7;
+    m.flags     = gpb::F_SYNC;
+    m.set_obj_value(bytes.data(), bytes.size());
+    msgs.push_back(m);
+
+    m.m_read_r("dft_entry", "/dif/ra/dft/entries/n1", 0, -22,
+               "no such entry");
+    m.invoke_id = 3;
+    m.version   = 132;
+    msgs.push_back(m);
+
+    return msgs;
+}
+
+/* Check that the direct encoder produces the same bytes as the protobuf
+ * serialization of gpb::CDAPMessage, and that the direct decoder produces
+ * the same message as the conversion from gpb::CDAPMessage. */
+static int
+test_wire_format()
+{
+    for (const auto &m : sample_messages()) {
+        gpb::CDAPMessage gm = m;
+        std::vector<char> buf;
+        string ref, dec;
+        CDAPMessage dm;
+
+        gm.SerializeToString(&ref);
+        msg_ser_stateless(&m, &buf);
+        if (string(buf.data(), buf.size()) != ref) {
+            PE("Direct encoding differs from the protobuf one\n");
+            m.dump();
+            return -1;
+        }
+
+        for (bool borrow : {false, true}) {
+            if (dm.wire_decode(ref.data(), ref.size(), borrow)) {
+                PE("Direct decoding failed\n");
+                return -1;
+            }
+            static_cast<gpb::CDAPMessage>(dm).SerializeToString(&dec);
+            if (dec != ref) {
+                PE("Direct decoding differs from the protobuf one\n");
+                dm.dump();
+                return -1;
+            }
+        }
+
+        /* Truncated messages must be rejected. */
+        if (!dm.wire_decode(ref.data(), ref.size() - 1)) {
+            PE("Truncated message not rejected\n");
+            return -1;
+        }
+    }
+
+    PI("Wire format test passed\n");
+
+    return 0;
+}
+
+/* Measure the messages encoded and decoded per second, and the heap
+ * allocations per message, through gpb::CDAPMessage and with the direct
+ * encoder and decoder, for an A-DATA message of 'objlen' bytes. */
+static int
+wire_benchmark(unsigned int num, size_t objlen)
+{
+    using Clock = std::chrono::steady_clock;
+    string obj(objlen, 'x');
+    std::vector<char> buf;
+    unsigned int errors = 0;
+    CDAPMessage m;
+
+    m.m_write("a_data", "/a_data");
+    m.invoke_id = 7;
+    m.set_obj_value(obj.data(), obj.size());
+
+    auto report = [num](const char *what, Clock::duration d, size_t allocs) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d);
+
+        cout << "    " << what << ": "
+             << num * 1000000ULL / std::max<long long>(us.count(), 1)
+             << " msgs/s, " << double(allocs) / num << " allocs/msg" << endl;
+    };
+    string ref;
+
+    static_cast<gpb::CDAPMessage>(m).SerializeToString(&ref);
+    cout << "CDAP encoding of " << objlen << " bytes objects:" << endl;
+
+    size_t allocs0 = num_allocs;
+    auto start     = Clock::now();
+    for (unsigned int i = 0; i < num; i++) {
+        gpb::CDAPMessage gm = m;
+#ifdef HAVE_GPB_BYTE_SIZE_LONG
+        size_t len = gm.ByteSizeLong();
+#else
+        size_t len = gm.ByteSize();
+#endif
+        char *serbuf = new char[len];
+
+        gm.SerializeToArray(serbuf, len);
+        errors += len != ref.size() || memcmp(serbuf, ref.data(), len);
+        delete[] serbuf;
+    }
+    report("gpb encode", Clock::now() - start, num_allocs - allocs0);
+
+    allocs0 = num_allocs;
+    start   = Clock::now();
+    for (unsigned int i = 0; i < num; i++) {
+        msg_ser_stateless(&m, &buf);
+        errors += buf.size() != ref.size() ||
+                  memcmp(buf.data(), ref.data(), buf.size());
+    }
+    report("direct encode", Clock::now() - start, num_allocs - allocs0);
+
+    allocs0 = num_allocs;
+    start   = Clock::now();
+    for (unsigned int i = 0; i < num; i++) {
+        gpb::CDAPMessage gm;
+
+        gm.ParseFromArray(buf.data(), buf.size());
+        CDAPMessage dm(gm);
+        errors += dm.invoke_id != m.invoke_id;
+    }
+    report("gpb decode", Clock::now() - start, num_allocs - allocs0);
+
+    allocs0 = num_allocs;
+    start   = Clock::now();
+    for (unsigned int i = 0; i < num; i++) {
+        CDAPMessage dm;
+
+        dm.wire_decode(buf.data(), buf.size(), /*borrow=*/true);
+        errors += dm.invoke_id != m.invoke_id;
+    }
+    report("direct decode", Clock::now() - start, num_allocs - allocs0);
+
+    if (errors) {
+        PE("%u messages encoded or decoded incorrectly\n", errors);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Exchange messages larger than a read over a datagram socket, and over
+ * a stream socket with framing. With framing, small messages sent back to
+ * back are expected to be received with fewer reads than messages. */
+static int
+test_large_messages()
+{
+    const size_t kLargeLen = 1 << 20;
+    const int kNumSmall    = 100;
+
+    for (bool framed : {false, true}) {
+        string large(framed ? kLargeLen : 100000, 'x');
+        unsigned int buffered = 0;
+        int sv[2];
+
+        if (socketpair(AF_UNIX, framed ? SOCK_STREAM : SOCK_DGRAM, 0, sv)) {
+            perror("socketpair()");
+            return -1;
+        }
+
+        CDAPConn cconn(sv[0]), sconn(sv[1]);
+
+        cconn.set_framed(framed);
+        sconn.set_framed(framed);
+
+        /* The sender needs its own thread, as the large message does not
+         * fit the socket buffer. */
+        std::thread snd([&cconn, &large, framed, kNumSmall]() {
+            CDAPMessage m;
+
+            if (cconn.connect("client", "server", gpb::AUTH_NONE, nullptr)) {
+                return;
+            }
+            m.m_write("blob", "/blob");
+            m.set_obj_value(large.data(), large.size());
+            cconn.msg_send(&m, 0);
+            for (int i = 0; framed && i < kNumSmall; i++) {
+                m.m_write("small", "/small/" + to_string(i));
+                m.set_obj_value(int32_t(i));
+                cconn.msg_send(&m, 0);
+            }
+        });
+
+        bool ok = sconn.accept() != nullptr;
+        auto m  = ok ? sconn.msg_recv() : nullptr;
+        const char *objbuf;
+        size_t objlen;
+
+        ok = ok && m != nullptr;
+        if (ok) {
+            m->get_obj_value(objbuf, objlen);
+            ok = objlen == large.size() &&
+                 !memcmp(objbuf, large.data(), objlen);
+        }
+        for (int i = 0; ok && framed && i < kNumSmall; i++) {
+            int32_t v;
+
+            m  = sconn.msg_recv();
+            ok = m != nullptr;
+            if (ok) {
+                m->get_obj_value(v);
+                ok       = v == i;
+                buffered += sconn.msg_buffered();
+            }
+        }
+        snd.join();
+        close(sv[0]);
+        close(sv[1]);
+
+        if (!ok) {
+            PE("Large message test failed (framed=%d)\n", framed);
+            return -1;
+        }
+        PI("%zu bytes message received%s, %u messages already buffered\n",
+           large.size(), framed ? " with framing" : "", buffered);
+    }
+
+    return 0;
+}
+
+/* Receive framed messages as an event loop does: wait for the file
+ * descriptor only if no whole message is buffered, and read at most once
+ * for each message. Some messages take many reads. */
+static int
+test_event_loop()
+{
+    const int kNumMsgs  = 1000;
+    const size_t kBlob  = 100000;
+    int received        = 0;
+    unsigned int blocks = 0;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        perror("socketpair()");
+        return -1;
+    }
+
+    CDAPConn cconn(sv[0]), sconn(sv[1]);
+
+    cconn.set_framed(true);
+    sconn.set_framed(true);
+
+    std::thread snd([&cconn, kNumMsgs, kBlob]() {
+        string blob(kBlob, 'y');
+        CDAPMessage m;
+
+        if (cconn.connect("client", "server", gpb::AUTH_NONE, nullptr)) {
+            return;
+        }
+        for (int i = 0; i < kNumMsgs; i++) {
+            if (i % 100 == 99) {
+                m.m_write("blob", "/blob");
+                m.set_obj_value(blob.data(), blob.size());
+            } else {
+                m.m_write("small", "/small");
+                m.set_obj_value(int32_t(i));
+            }
+            cconn.msg_send(&m, 0);
+        }
+    });
+
+    bool ok = sconn.accept() != nullptr;
+
+    while (ok && received < kNumMsgs) {
+        struct pollfd pfd = {sv[1], POLLIN, 0};
+        const char *serbuf;
+        const char *objbuf;
+        size_t objlen;
+        int32_t v;
+        ssize_t n;
+
+        if (!sconn.msg_buffered() && poll(&pfd, 1, 5000) != 1) {
+            ok = false;
+            break;
+        }
+
+        n = sconn.msg_recv_raw(&serbuf, /*wait=*/false);
+        if (n < 0) {
+            ok = errno == EAGAIN;
+            blocks++;
+            continue;
+        }
+
+        auto m = sconn.msg_deser(serbuf, n);
+
+        if (!m) {
+            ok = false;
+        } else if (received % 100 == 99) {
+            m->get_obj_value(objbuf, objlen);
+            ok = m->obj_class == "blob" && objlen == kBlob;
+        } else {
+            m->get_obj_value(v);
+            ok = m->obj_class == "small" && v == received;
+        }
+        received++;
+    }
+    snd.join();
+    close(sv[0]);
+    close(sv[1]);
+
+    if (!ok) {
+        PE("Event loop test failed after %d messages\n", received);
+        return -1;
+    }
+    PI("%d messages received by the event loop, %u incomplete reads\n",
+       received, blocks);
+
+    return 0;
+}
+
+/* A framed endpoint and an unframed one cannot talk to each other, as
+ * the framing must be enabled on both the sides of a flow. Check that the
+ * connection fails, in both the directions, rather than delivering some
+ * garbage or blocking. */
+static int
+test_framing_mismatch()
+{
+    for (bool client_framed : {false, true}) {
+        int client_ret = 0;
+        int sv[2];
+
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+            perror("socketpair()");
+            return -1;
+        }
+
+        CDAPConn cconn(sv[0]), sconn(sv[1]);
+
+        cconn.set_framed(client_framed);
+        sconn.set_framed(!client_framed);
+
+        std::thread cli([&cconn, &client_ret]() {
+            client_ret =
+                cconn.connect("client", "server", gpb::AUTH_NONE, nullptr);
+        });
+
+        bool accepted = sconn.accept() != nullptr;
+
+        close(sv[1]);
+        cli.join();
+        close(sv[0]);
+
+        if (accepted || client_ret == 0) {
+            PE("Framing mismatch not detected (client framed=%d)\n",
+               client_framed);
+            return -1;
+        }
+    }
+    PI("Framing mismatch detected\n");
+
+    return 0;
+}
+
+/* Check the expiry of the pending invoke ids, and measure the cost of
+ * getting and putting an id with an increasing number of outstanding
+ * ones, which should not depend on that number. */
+static int
+invoke_id_benchmark(unsigned int max_outstanding)
+{
+    using Clock = std::chrono::steady_clock;
+
+    {
+        InvokeIdMgr mgr(std::chrono::seconds(0));
+
+        for (int i = 0; i < 1000; i++) {
+            mgr.get_invoke_id();
+            mgr.get_invoke_id_remote(i + 1);
+        }
+        usleep(1000);
+        mgr.get_invoke_id();
+        mgr.get_invoke_id_remote(1);
+        if (mgr.size() != 2) {
+            PE("%u invoke ids not discarded\n", mgr.size() - 2);
+            return -1;
+        }
+    }
+
+    cout << "Invoke ids:" << endl;
+    for (unsigned int outstanding = 1000; outstanding <= max_outstanding;
+         outstanding *= 10) {
+        const unsigned int num = 200000;
+        InvokeIdMgr mgr;
+        std::vector<int> ids;
+        unsigned int errors = 0;
+
+        for (unsigned int i = 0; i < outstanding; i++) {
+            ids.push_back(mgr.get_invoke_id());
+            errors += mgr.get_invoke_id_remote(i + 1) != 0;
+        }
+
+        /* Replace the oldest outstanding id with a new one, on both the
+         * local and the remote side. */
+        auto start = Clock::now();
+        for (unsigned int i = 0; i < num; i++) {
+            unsigned int j = i % outstanding;
+
+            errors += mgr.put_invoke_id(ids[j]) != 0;
+            ids[j] = mgr.get_invoke_id();
+            errors += mgr.put_invoke_id_remote(j + 1) != 0;
+            errors += mgr.get_invoke_id_remote(j + 1) != 0;
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      Clock::now() - start)
+                      .count();
+
+        if (errors || mgr.size() != 2 * outstanding) {
+            PE("%u invoke id operations failed\n", errors);
+            return -1;
+        }
+        cout << "    " << outstanding << " outstanding: " << ns / num
+             << " ns per get/put pair" << endl;
+    }
+
+    return 0;
+}
+
 void
 usage()
 {
@@ -481,6 +962,13 @@ main(int argc, char **argv)
         }
     }
 
+    if (test_wire_format() || wire_benchmark(200000, 64) ||
+        wire_benchmark(200000, 1024) || invoke_id_benchmark(100000) ||
+        test_large_messages() || test_event_loop() ||
+        test_framing_mismatch()) {
+        return -1;
+    }
+
     std::thread srv(test_cdap_server, port);
     srv.detach();
 
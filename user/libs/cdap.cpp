@@ -23,11 +23,16 @@
 
 #include <iostream>
 #include <string>
+#include <cstring>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <errno.h>
 #include <chrono>
 #include <memory>
+#include <limits>
 
 #include "rlite/utils.h"
 #include "rina/cdap.hpp"
@@ -279,7 +284,7 @@ CDAPConn::connect(const std::string &src, const std::string &dst,
     }
 
     rm = msg_recv();
-    if (rm->op_code != gpb::M_CONNECT_R) {
+    if (!rm || rm->op_code != gpb::M_CONNECT_R) {
         return -1;
     }
 
@@ -292,7 +297,7 @@ CDAPConn::accept()
     std::unique_ptr<CDAPMessage> rm = msg_recv();
     CDAPMessage m;
 
-    if (rm->op_code != gpb::M_CONNECT) {
+    if (!rm || rm->op_code != gpb::M_CONNECT) {
         return nullptr;
     }
 
@@ -331,45 +336,63 @@ InvokeIdMgr::InvokeIdMgr(std::chrono::seconds ds)
     invoke_id_next = 1;
 }
 
-/* Discard pending ids that have been there for too much time. */
+/* Discard pending ids that have been there for too much time. Only the
+ * front of the expiry queue is looked at, so that the cost is amortized
+ * over the insertions. */
 void
-InvokeIdMgr::__discard(unordered_set<Id, IdHasher> &pending)
+InvokeIdMgr::__discard(PendingIds &pending)
 {
-    vector<unordered_set<Id, IdHasher>::iterator> torm;
-    auto now = std::chrono::system_clock::now();
-
-    for (auto i = pending.begin(); i != pending.end(); i++) {
-        if (now - i->created > discard_time) {
-            torm.push_back(i);
-        }
+    if (discard_time == std::chrono::seconds::max()) {
+        return;
     }
 
-    for (unsigned int j = 0; j < torm.size(); j++) {
-        pending.erase(torm[j]);
+    auto now = Clock::now();
+
+    while (!pending.expiry.empty() &&
+           now - pending.expiry.front().first > discard_time) {
+        auto mit = pending.ids.find(pending.expiry.front().second);
+
+        if (mit != pending.ids.end() &&
+            mit->second == pending.expiry.front().first) {
+            pending.ids.erase(mit);
+        }
+        pending.expiry.pop_front();
     }
 }
 
 void
-InvokeIdMgr::discard()
+InvokeIdMgr::__insert(PendingIds &pending, int invoke_id)
 {
-    if (discard_time != std::chrono::seconds::max()) {
-        __discard(pending_invoke_ids);
-        __discard(pending_invoke_ids_remote);
+    auto now = Clock::now();
+
+    pending.ids[invoke_id] = now;
+    pending.expiry.push_back(std::make_pair(now, invoke_id));
+
+    /* Drop the entries of the ids that are no longer pending, if they
+     * are the majority of the queue. */
+    if (pending.expiry.size() > 2 * pending.ids.size() + 64) {
+        std::deque<std::pair<Clock::time_point, int>> expiry;
+
+        for (const auto &e : pending.expiry) {
+            auto mit = pending.ids.find(e.second);
+
+            if (mit != pending.ids.end() && mit->second == e.first) {
+                expiry.push_back(e);
+            }
+        }
+        pending.expiry.swap(expiry);
     }
 }
 
 int
-InvokeIdMgr::__put_invoke_id(unordered_set<Id, IdHasher> &pending,
-                             int invoke_id)
+InvokeIdMgr::__put_invoke_id(PendingIds &pending, int invoke_id)
 {
-    discard();
+    __discard(pending);
 
-    if (!pending.count(Id(invoke_id))) {
+    if (!pending.ids.erase(invoke_id)) {
         return -1;
     }
 
-    pending.erase(Id(invoke_id));
-
     NPD("put %d\n", invoke_id);
 
     return 0;
@@ -378,14 +401,17 @@ InvokeIdMgr::__put_invoke_id(unordered_set<Id, IdHasher> &pending,
 int
 InvokeIdMgr::get_invoke_id()
 {
-    discard();
+    __discard(pending_invoke_ids);
 
+    /* Skip 0 (not a valid invoke id) and the ids still pending. */
     do {
+        if (invoke_id_next == std::numeric_limits<int>::max()) {
+            invoke_id_next = 0;
+        }
         invoke_id_next++;
-    } while (pending_invoke_ids.count(Id(invoke_id_next)));
+    } while (pending_invoke_ids.ids.count(invoke_id_next));
 
-    pending_invoke_ids.insert(
-        Id(invoke_id_next, std::chrono::system_clock::now()));
+    __insert(pending_invoke_ids, invoke_id_next);
 
     NPD("got %d\n", invoke_id_next);
 
@@ -401,14 +427,13 @@ InvokeIdMgr::put_invoke_id(int invoke_id)
 int
 InvokeIdMgr::get_invoke_id_remote(int invoke_id)
 {
-    discard();
+    __discard(pending_invoke_ids_remote);
 
-    if (pending_invoke_ids_remote.count(Id(invoke_id))) {
+    if (pending_invoke_ids_remote.ids.count(invoke_id)) {
         return -1;
     }
 
-    pending_invoke_ids_remote.insert(
-        Id(invoke_id, std::chrono::system_clock::now()));
+    __insert(pending_invoke_ids_remote, invoke_id);
 
     NPD("got %d\n", invoke_id);
 
@@ -835,6 +860,550 @@ CDAPMessage::operator gpb::CDAPMessage() const
     return gm;
 }
 
+/* Minimal writer and reader for the protobuf wire format, used to encode
+ * and decode CDAP messages without an intermediate gpb::CDAPMessage. The
+ * writer only computes the length of the output if its buffer is
+ * nullptr. */
+namespace {
+
+enum WireType {
+    WireVarint  = 0,
+    WireFixed64 = 1,
+    WireBytes   = 2,
+    WireFixed32 = 5,
+};
+
+class WireWriter {
+    char *buf;
+    size_t len = 0;
+
+public:
+    WireWriter(char *b) : buf(b) {}
+    size_t size() const { return len; }
+
+    /* For nested messages, written directly at the cursor. */
+    char *cursor() const { return buf ? buf + len : nullptr; }
+    void advance(size_t n) { len += n; }
+
+    void raw(const void *p, size_t n)
+    {
+        if (buf) {
+            memcpy(buf + len, p, n);
+        }
+        len += n;
+    }
+
+    void varint(uint64_t v)
+    {
+        while (v >= 0x80) {
+            uint8_t b = static_cast<uint8_t>(v) | 0x80;
+
+            raw(&b, 1);
+            v >>= 7;
+        }
+        uint8_t b = static_cast<uint8_t>(v);
+        raw(&b, 1);
+    }
+
+    void tag(int field, WireType wt)
+    {
+        varint((static_cast<uint32_t>(field) << 3) | wt);
+    }
+
+    /* Negative int32 values are sign extended, as protobuf does. */
+    void int_field(int field, int64_t v)
+    {
+        tag(field, WireVarint);
+        varint(static_cast<uint64_t>(v));
+    }
+
+    void bytes_field(int field, const char *p, size_t n)
+    {
+        tag(field, WireBytes);
+        varint(n);
+        raw(p, n);
+    }
+
+    void string_field(int field, const string &s)
+    {
+        bytes_field(field, s.data(), s.size());
+    }
+
+    void fixed32_field(int field, uint32_t v)
+    {
+        uint8_t b[4];
+
+        for (int i = 0; i < 4; i++) {
+            b[i] = static_cast<uint8_t>(v >> (8 * i));
+        }
+        tag(field, WireFixed32);
+        raw(b, sizeof(b));
+    }
+
+    void fixed64_field(int field, uint64_t v)
+    {
+        uint8_t b[8];
+
+        for (int i = 0; i < 8; i++) {
+            b[i] = static_cast<uint8_t>(v >> (8 * i));
+        }
+        tag(field, WireFixed64);
+        raw(b, sizeof(b));
+    }
+};
+
+class WireReader {
+    const uint8_t *p;
+    const uint8_t *end;
+
+public:
+    WireReader(const char *buf, size_t len)
+        : p(reinterpret_cast<const uint8_t *>(buf)), end(p + len)
+    {
+    }
+    bool done() const { return p == end; }
+
+    bool varint(uint64_t *v)
+    {
+        *v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (p == end) {
+                return false;
+            }
+            *v |= static_cast<uint64_t>(*p & 0x7f) << shift;
+            if (!(*p++ & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool fixed(unsigned int n, uint64_t *v)
+    {
+        if (static_cast<size_t>(end - p) < n) {
+            return false;
+        }
+        *v = 0;
+        for (unsigned int i = 0; i < n; i++) {
+            *v |= static_cast<uint64_t>(*p++) << (8 * i);
+        }
+        return true;
+    }
+
+    bool bytes(const char **b, size_t *n)
+    {
+        uint64_t l;
+
+        if (!varint(&l) || static_cast<uint64_t>(end - p) < l) {
+            return false;
+        }
+        *b = reinterpret_cast<const char *>(p);
+        *n = l;
+        p += l;
+        return true;
+    }
+
+    /* Read the next field. For length delimited fields, 'b' and 'n'
+     * describe the payload; otherwise 'v' contains the value. */
+    bool field(int *num, WireType *wt, uint64_t *v, const char **b, size_t *n)
+    {
+        uint64_t t;
+
+        if (!varint(&t) || (t >> 3) == 0 || (t >> 3) > INT32_MAX) {
+            return false;
+        }
+        *num = static_cast<int>(t >> 3);
+        *wt  = static_cast<WireType>(t & 0x7);
+        switch (*wt) {
+        case WireVarint:
+            return varint(v);
+        case WireFixed64:
+            return fixed(8, v);
+        case WireFixed32:
+            return fixed(4, v);
+        case WireBytes:
+            return bytes(b, n);
+        }
+        return false; /* groups are not supported */
+    }
+};
+
+} // namespace
+
+size_t
+CDAPMessage::obj_value_write(char *buf) const
+{
+    WireWriter w(buf);
+
+    /* Same conversions as operator gpb::CDAPMessage(). */
+    switch (obj_value.ty) {
+    case ObjValType::I32:
+        w.int_field(gpb::ObjValue::kIntvalFieldNumber, obj_value.u.i32);
+        break;
+
+    case ObjValType::I64:
+        w.int_field(gpb::ObjValue::kInt64ValFieldNumber, obj_value.u.i64);
+        break;
+
+    case ObjValType::STRING:
+        w.string_field(gpb::ObjValue::kStrvalFieldNumber, obj_value.str);
+        break;
+
+    case ObjValType::FLOAT:
+        w.fixed32_field(gpb::ObjValue::kFloatvalFieldNumber,
+                        static_cast<uint32_t>(obj_value.u.fp_single));
+        break;
+
+    case ObjValType::DOUBLE:
+        w.fixed64_field(gpb::ObjValue::kDoublevalFieldNumber,
+                        static_cast<uint64_t>(obj_value.u.fp_double));
+        break;
+
+    case ObjValType::BOOL:
+        w.int_field(gpb::ObjValue::kBoolvalFieldNumber, obj_value.u.boolean);
+        break;
+
+    case ObjValType::BYTES:
+        w.bytes_field(gpb::ObjValue::kBytevalFieldNumber, obj_value.u.buf.ptr,
+                      obj_value.u.buf.len);
+        break;
+
+    default:
+        break;
+    }
+
+    return w.size();
+}
+
+/* The fields are written in the same order, and under the same conditions,
+ * as the serialization of operator gpb::CDAPMessage(), so that the output
+ * is the same. */
+size_t
+CDAPMessage::wire_write(char *buf) const
+{
+    WireWriter w(buf);
+    string apn, api, aen, aei;
+
+    w.int_field(FLNUM(AbsSyntax), abs_syntax);
+    w.int_field(FLNUM(OpCode), op_code);
+    if (invoke_id) {
+        w.int_field(FLNUM(InvokeId), invoke_id);
+    }
+    w.int_field(FLNUM(Flags), flags);
+    w.string_field(FLNUM(ObjClass), obj_class);
+    w.string_field(FLNUM(ObjName), obj_name);
+    if (obj_inst) {
+        w.int_field(FLNUM(ObjInst), obj_inst);
+    }
+    if (obj_value.ty != ObjValType::NONE) {
+        size_t len = obj_value_write(nullptr);
+
+        w.tag(FLNUM(ObjValue), WireBytes);
+        w.varint(len);
+        w.advance(obj_value_write(w.cursor()));
+    }
+    w.int_field(FLNUM(Result), result);
+    if (scope) {
+        w.int_field(FLNUM(Scope), scope);
+    }
+    if (!filter.empty()) {
+        w.string_field(FLNUM(Filter), filter);
+    }
+    if (auth_mech != gpb::AUTH_NONE) {
+        auto auth_value_write = [this](WireWriter &aw) {
+            aw.string_field(gpb::AuthValue::kAuthNameFieldNumber,
+                            auth_value.name);
+            aw.string_field(gpb::AuthValue::kAuthPasswordFieldNumber,
+                            auth_value.password);
+            aw.string_field(gpb::AuthValue::kAuthOtherFieldNumber,
+                            auth_value.other);
+        };
+        WireWriter av(nullptr);
+
+        auth_value_write(av);
+        w.int_field(FLNUM(AuthMech), auth_mech);
+        w.tag(FLNUM(AuthValue), WireBytes);
+        w.varint(av.size());
+        auth_value_write(w);
+    }
+    if (!dst_appl.empty()) {
+        utils::rina_components_from_string(dst_appl, apn, api, aen, aei);
+        w.string_field(FLNUM(DestAeInst), aei);
+        w.string_field(FLNUM(DestAeName), aen);
+        w.string_field(FLNUM(DestApInst), api);
+        w.string_field(FLNUM(DestApName), apn);
+    }
+    if (!src_appl.empty()) {
+        utils::rina_components_from_string(src_appl, apn, api, aen, aei);
+        w.string_field(FLNUM(SrcAeInst), aei);
+        w.string_field(FLNUM(SrcAeName), aen);
+        w.string_field(FLNUM(SrcApInst), api);
+        w.string_field(FLNUM(SrcApName), apn);
+    }
+    if (!result_reason.empty()) {
+        w.string_field(FLNUM(ResultReason), result_reason);
+    }
+    w.int_field(FLNUM(Version), version);
+
+    return w.size();
+}
+
+/* Decode a message, with the same result as CDAPMessage(gpb::CDAPMessage)
+ * on the parsed message. Strings are copied, while the object value is
+ * borrowed from 'buf' if requested. */
+int
+CDAPMessage::wire_decode(const char *buf, size_t len, bool borrow)
+{
+    /* Wire type of each field of gpb::ObjValue. */
+    static const WireType kObjValueWireTypes[] = {
+        WireVarint,  WireVarint, WireVarint,  WireVarint,  WireVarint,
+        WireBytes,   WireBytes,  WireFixed32, WireFixed64, WireVarint,
+    };
+    struct {
+        bool has[gpb::ObjValue::kBoolvalFieldNumber + 1] = {};
+        uint64_t v[gpb::ObjValue::kBoolvalFieldNumber + 1] = {};
+        const char *b[gpb::ObjValue::kBoolvalFieldNumber + 1] = {};
+        size_t n[gpb::ObjValue::kBoolvalFieldNumber + 1] = {};
+    } ov;
+    string apn, api, aen, aei, sapn, sapi, saen, saei;
+    bool has_auth_mech = false, has_auth_value = false;
+    WireReader r(buf, len);
+    CDAPAuthValue av;
+
+    clear();
+    while (!r.done()) {
+        const char *b = nullptr;
+        uint64_t v    = 0;
+        size_t n      = 0;
+        WireType wt;
+        int num;
+
+        if (!r.field(&num, &wt, &v, &b, &n)) {
+            return -1;
+        }
+
+        /* Fields with an unexpected wire type are skipped, as unknown
+         * fields. */
+        bool bytes = wt == WireBytes;
+        bool ival  = wt == WireVarint;
+        switch (num) {
+        case FLNUM(AbsSyntax):
+            if (ival) {
+                abs_syntax = static_cast<int32_t>(v);
+            }
+            break;
+        case FLNUM(OpCode):
+            if (ival && gpb::OpCode_IsValid(static_cast<int>(v))) {
+                op_code = static_cast<gpb::OpCode>(v);
+            }
+            break;
+        case FLNUM(InvokeId):
+            if (ival) {
+                invoke_id = static_cast<int32_t>(v);
+            }
+            break;
+        case FLNUM(Flags):
+            if (ival && gpb::CDAPFlags_IsValid(static_cast<int>(v))) {
+                flags = static_cast<gpb::CDAPFlags>(v);
+            }
+            break;
+        case FLNUM(ObjClass):
+            if (bytes) {
+                obj_class.assign(b, n);
+            }
+            break;
+        case FLNUM(ObjName):
+            if (bytes) {
+                obj_name.assign(b, n);
+            }
+            break;
+        case FLNUM(ObjInst):
+            if (ival) {
+                obj_inst = static_cast<int64_t>(v);
+            }
+            break;
+        case FLNUM(ObjValue):
+            if (bytes) {
+                /* Repeated occurrences are merged, as protobuf does. */
+                WireReader ovr(b, n);
+
+                while (!ovr.done()) {
+                    const char *ob = nullptr;
+                    uint64_t ovv   = 0;
+                    size_t on      = 0;
+                    WireType owt;
+                    int onum;
+
+                    if (!ovr.field(&onum, &owt, &ovv, &ob, &on)) {
+                        return -1;
+                    }
+                    if (onum <= gpb::ObjValue::kBoolvalFieldNumber &&
+                        owt == kObjValueWireTypes[onum]) {
+                        ov.has[onum] = true;
+                        ov.v[onum]   = ovv;
+                        ov.b[onum]   = ob;
+                        ov.n[onum]   = on;
+                    }
+                }
+            }
+            break;
+        case FLNUM(Result):
+            if (ival) {
+                result = static_cast<int32_t>(v);
+            }
+            break;
+        case FLNUM(Scope):
+            if (ival) {
+                scope = static_cast<int32_t>(v);
+            }
+            break;
+        case FLNUM(Filter):
+            if (bytes) {
+                filter.assign(b, n);
+            }
+            break;
+        case FLNUM(AuthMech):
+            if (ival && gpb::AuthType_IsValid(static_cast<int>(v))) {
+                auth_mech     = static_cast<gpb::AuthType>(v);
+                has_auth_mech = true;
+            }
+            break;
+        case FLNUM(AuthValue):
+            if (bytes) {
+                WireReader avr(b, n);
+
+                has_auth_value = true;
+                while (!avr.done()) {
+                    const char *ab = nullptr;
+                    uint64_t avv   = 0;
+                    size_t an      = 0;
+                    WireType awt;
+                    int anum;
+
+                    if (!avr.field(&anum, &awt, &avv, &ab, &an)) {
+                        return -1;
+                    }
+                    if (awt != WireBytes) {
+                        continue;
+                    }
+                    switch (anum) {
+                    case gpb::AuthValue::kAuthNameFieldNumber:
+                        av.name.assign(ab, an);
+                        break;
+                    case gpb::AuthValue::kAuthPasswordFieldNumber:
+                        av.password.assign(ab, an);
+                        break;
+                    case gpb::AuthValue::kAuthOtherFieldNumber:
+                        av.other.assign(ab, an);
+                        break;
+                    }
+                }
+            }
+            break;
+        case FLNUM(DestAeInst):
+            if (bytes) {
+                aei.assign(b, n);
+            }
+            break;
+        case FLNUM(DestAeName):
+            if (bytes) {
+                aen.assign(b, n);
+            }
+            break;
+        case FLNUM(DestApInst):
+            if (bytes) {
+                api.assign(b, n);
+            }
+            break;
+        case FLNUM(DestApName):
+            if (bytes) {
+                apn.assign(b, n);
+            }
+            break;
+        case FLNUM(SrcAeInst):
+            if (bytes) {
+                saei.assign(b, n);
+            }
+            break;
+        case FLNUM(SrcAeName):
+            if (bytes) {
+                saen.assign(b, n);
+            }
+            break;
+        case FLNUM(SrcApInst):
+            if (bytes) {
+                sapi.assign(b, n);
+            }
+            break;
+        case FLNUM(SrcApName):
+            if (bytes) {
+                sapn.assign(b, n);
+            }
+            break;
+        case FLNUM(ResultReason):
+            if (bytes) {
+                result_reason.assign(b, n);
+            }
+            break;
+        case FLNUM(Version):
+            if (ival) {
+                version = static_cast<int64_t>(v);
+            }
+            break;
+        }
+    }
+
+    /* Convert object value, with the same precedence as
+     * CDAPMessage(gpb::CDAPMessage). */
+    if (ov.has[gpb::ObjValue::kIntvalFieldNumber]) {
+        set_obj_value(
+            static_cast<int32_t>(ov.v[gpb::ObjValue::kIntvalFieldNumber]));
+    } else if (ov.has[gpb::ObjValue::kSintvalFieldNumber]) {
+        uint32_t z =
+            static_cast<uint32_t>(ov.v[gpb::ObjValue::kSintvalFieldNumber]);
+
+        set_obj_value(static_cast<int32_t>((z >> 1) ^ (~(z & 1) + 1)));
+    } else if (ov.has[gpb::ObjValue::kInt64ValFieldNumber]) {
+        set_obj_value(
+            static_cast<int64_t>(ov.v[gpb::ObjValue::kInt64ValFieldNumber]));
+    } else if (ov.has[gpb::ObjValue::kSint64ValFieldNumber]) {
+        uint64_t z = ov.v[gpb::ObjValue::kSint64ValFieldNumber];
+
+        set_obj_value(static_cast<int64_t>((z >> 1) ^ (~(z & 1) + 1)));
+    } else if (ov.has[gpb::ObjValue::kStrvalFieldNumber]) {
+        set_obj_value(string(ov.b[gpb::ObjValue::kStrvalFieldNumber],
+                             ov.n[gpb::ObjValue::kStrvalFieldNumber]));
+    } else if (ov.has[gpb::ObjValue::kFloatvalFieldNumber]) {
+        set_obj_value(static_cast<float>(
+            static_cast<uint32_t>(ov.v[gpb::ObjValue::kFloatvalFieldNumber])));
+    } else if (ov.has[gpb::ObjValue::kDoublevalFieldNumber]) {
+        set_obj_value(
+            static_cast<double>(ov.v[gpb::ObjValue::kDoublevalFieldNumber]));
+    } else if (ov.has[gpb::ObjValue::kBoolvalFieldNumber]) {
+        set_obj_value(ov.v[gpb::ObjValue::kBoolvalFieldNumber] != 0);
+    } else if (ov.has[gpb::ObjValue::kBytevalFieldNumber]) {
+        const char *b = ov.b[gpb::ObjValue::kBytevalFieldNumber];
+        size_t n      = ov.n[gpb::ObjValue::kBytevalFieldNumber];
+
+        if (borrow) {
+            set_obj_value(b, n);
+        } else {
+            std::unique_ptr<char[]> copy(new char[n]);
+
+            memcpy(copy.get(), b, n);
+            set_obj_value(std::move(copy), n);
+        }
+    }
+
+    if (has_auth_mech && has_auth_value) {
+        auth_value = av;
+    }
+    dst_appl = utils::rina_string_from_components(apn, api, aen, aei);
+    src_appl = utils::rina_string_from_components(sapn, sapi, saen, saei);
+
+    return 0;
+}
+
 bool
 CDAPMessage::valid(bool check_invoke_id) const
 {
@@ -1068,31 +1637,26 @@ CDAPConn::conn_fsm_run(CDAPMessage *m, bool sender)
 int
 msg_ser_stateless(CDAPMessage *m, char **buf, size_t *len)
 {
-    gpb::CDAPMessage gm;
-
-    *buf = nullptr;
-    *len = 0;
-
-    gm = static_cast<gpb::CDAPMessage>(*m);
-
-#ifdef HAVE_GPB_BYTE_SIZE_LONG
-    *len = gm.ByteSizeLong();
-#else
-    *len = gm.ByteSize();
-#endif
+    *len = m->wire_size();
     *buf = new char[*len];
-
-    gm.SerializeToArray(*buf, *len);
+    m->wire_encode(*buf);
 
     return 0;
 }
 
 int
-CDAPConn::msg_ser(CDAPMessage *m, int invoke_id, char **buf, size_t *len)
+msg_ser_stateless(const CDAPMessage *m, std::vector<char> *buf)
 {
-    *buf = nullptr;
-    *len = 0;
+    buf->resize(m->wire_size());
+    m->wire_encode(buf->data());
+
+    return 0;
+}
 
+/* Validate a message to be sent and assign its invoke id. */
+int
+CDAPConn::msg_ser_prepare(CDAPMessage *m, int invoke_id)
+{
     m->version = version;
 
     if (!m->valid(false)) {
@@ -1123,45 +1687,71 @@ CDAPConn::msg_ser(CDAPMessage *m, int invoke_id, char **buf, size_t *len)
         }
     }
 
+    return 0;
+}
+
+int
+CDAPConn::msg_ser(CDAPMessage *m, int invoke_id, char **buf, size_t *len)
+{
+    *buf = nullptr;
+    *len = 0;
+
+    if (msg_ser_prepare(m, invoke_id)) {
+        return -1;
+    }
+
     return msg_ser_stateless(m, buf, len);
 }
 
 int
 CDAPConn::msg_send(CDAPMessage *m, int invoke_id)
 {
-    size_t serlen;
-    char *serbuf;
-    ssize_t n;
+    size_t hdrlen = framed ? kFrameHdrLen : 0;
+    size_t ofs    = 0;
+    size_t len;
 
-    n = msg_ser(m, invoke_id, &serbuf, &serlen);
-    if (n) {
+    if (msg_ser_prepare(m, invoke_id)) {
         return 0;
     }
 
-    n = write(fd, serbuf, serlen);
-    if (n != (ssize_t)serlen) {
-        if (n < 0) {
-            perror("write(cdap_msg)");
-        } else {
-            PE("Partial write %zd/%zu\n", n, serlen);
-        }
+    len = m->wire_size();
+    if (framed && len > kFrameMaxLen) {
+        PE("Message too long (%zu bytes)\n", len);
         return -1;
     }
+    sndbuf.resize(hdrlen + len);
+    for (size_t i = 0; i < hdrlen; i++) {
+        sndbuf[i] = static_cast<char>(len >> (8 * (hdrlen - 1 - i)));
+    }
+    m->wire_encode(sndbuf.data() + hdrlen);
 
-    delete[] serbuf;
+    /* Without framing, a message must be written at once. */
+    do {
+        ssize_t n = write(fd, sndbuf.data() + ofs, sndbuf.size() - ofs);
+
+        if (n < 0) {
+            perror("write(cdap_msg)");
+            return -1;
+        }
+        if (!framed && n != (ssize_t)sndbuf.size()) {
+            PE("Partial write %zd/%zu\n", n, sndbuf.size());
+            return -1;
+        }
+        ofs += n;
+    } while (ofs < sndbuf.size());
 
-    return n;
+    return ofs;
 }
 
 std::unique_ptr<CDAPMessage>
-msg_deser_stateless(const char *serbuf, size_t serlen)
+msg_deser_stateless(const char *serbuf, size_t serlen, bool borrow)
 {
-    std::unique_ptr<CDAPMessage> m;
-    gpb::CDAPMessage gm;
-
-    gm.ParseFromArray(serbuf, serlen);
+    auto m = utils::make_unique<CDAPMessage>();
 
-    m = utils::make_unique<CDAPMessage>(gm);
+    if (m->wire_decode(serbuf, serlen, borrow)) {
+        PE("Malformed CDAP message (%zu bytes)\n", serlen);
+        return nullptr;
+    }
 
     if (!m->valid(true)) {
         return nullptr;
@@ -1203,19 +1793,131 @@ CDAPConn::msg_deser(const char *serbuf, size_t serlen)
     return m;
 }
 
+/* Length of the frame that starts at rcv_head, including the header, or 0
+ * if the header has not been received yet. */
+size_t
+CDAPConn::frame_len() const
+{
+    size_t len = 0;
+
+    if (rcv_tail - rcv_head < kFrameHdrLen) {
+        return 0;
+    }
+    for (size_t i = 0; i < kFrameHdrLen; i++) {
+        len = (len << 8) | static_cast<uint8_t>(rcvbuf[rcv_head + i]);
+    }
+
+    return kFrameHdrLen + len;
+}
+
+bool
+CDAPConn::msg_buffered() const
+{
+    size_t len = frame_len();
+
+    return framed && len && rcv_tail - rcv_head >= len;
+}
+
 std::unique_ptr<CDAPMessage>
 CDAPConn::msg_recv()
 {
-    char serbuf[4096];
-    int n;
+    const char *buf;
+    ssize_t n = msg_recv_raw(&buf);
 
-    n = read(fd, serbuf, sizeof(serbuf));
     if (n < 0) {
-        perror("read(cdap_msg)");
         return nullptr;
     }
 
-    return msg_deser(serbuf, n);
+    return msg_deser(buf, n);
+}
+
+ssize_t
+CDAPConn::msg_recv_raw(const char **buf, bool wait)
+{
+    /* Minimum size of the receive buffer, to get many messages with a
+     * single read. */
+    const size_t kRecvBufLen = 65536;
+    bool did_read            = false;
+    ssize_t n;
+
+    if (!framed) {
+        /* One message per read. Make room for the whole message, if the
+         * file descriptor can tell its size, or if the message can be
+         * peeked (datagram sockets). The message must be there already,
+         * so wait for it if needed. */
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int avail         = 0;
+
+        if (wait && poll(&pfd, 1, -1) < 0) {
+            perror("poll(cdap_msg)");
+            return -1;
+        }
+        if (ioctl(fd, FIONREAD, &avail)) {
+            n     = recv(fd, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+            avail = n > 0 ? n : 0;
+        }
+        if (rcvbuf.size() < std::max<size_t>(avail, kRecvBufLen)) {
+            rcvbuf.resize(std::max<size_t>(avail, kRecvBufLen));
+        }
+        n = read(fd, rcvbuf.data(), rcvbuf.size());
+        if (n < 0) {
+            perror("read(cdap_msg)");
+            return -1;
+        }
+        *buf = rcvbuf.data();
+
+        return n;
+    }
+
+    for (;;) {
+        size_t len = frame_len();
+
+        if (len > kFrameHdrLen + kFrameMaxLen) {
+            PE("Frame too long (%zu bytes)\n", len);
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (len && rcv_tail - rcv_head >= len) {
+            /* A whole message is already buffered. It stays where it is
+             * until the next call, even if the buffer becomes empty. */
+            *buf = rcvbuf.data() + rcv_head + kFrameHdrLen;
+            rcv_head += len;
+            if (rcv_head == rcv_tail) {
+                rcv_head = rcv_tail = 0;
+            }
+            return len - kFrameHdrLen;
+        }
+        if (did_read && !wait) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        /* Move the partial frame at the beginning of the buffer, and make
+         * room for the rest of it. */
+        if (rcv_head) {
+            memmove(rcvbuf.data(), rcvbuf.data() + rcv_head,
+                    rcv_tail - rcv_head);
+            rcv_tail -= rcv_head;
+            rcv_head = 0;
+        }
+        if (rcvbuf.size() < std::max(len, kRecvBufLen)) {
+            rcvbuf.resize(std::max(len, kRecvBufLen));
+        }
+
+        n = read(fd, rcvbuf.data() + rcv_tail, rcvbuf.size() - rcv_tail);
+        if (n < 0) {
+            perror("read(cdap_msg)");
+            return -1;
+        }
+        if (n == 0) {
+            PE("Connection closed with %zu bytes pending\n",
+               rcv_tail - rcv_head);
+            errno = EPIPE;
+            return -1;
+        }
+        rcv_tail += n;
+        did_read = true;
+    }
 }
 
 int
@@ -470,6 +470,108 @@ rl_conf_flow_get_stats(rl_port_t port_id, struct rl_flow_stats *stats)
     return rl_conf_flow_get_info(port_id, stats, NULL);
 }
 
+static int
+flow_stats_append(struct list_head *stats,
+                  const struct rl_kmsg_flow_stats_dump_resp *resp)
+{
+    const struct rl_flow_stats_entry *se = resp->entries.slots.raw;
+    unsigned int i;
+
+    if (resp->entries.elem_size != sizeof(*se)) {
+        PE("Unexpected flow stats entry size %u\n", resp->entries.elem_size);
+        errno = EPROTO;
+        return -1;
+    }
+
+    for (i = 0; i < resp->entries.num_elements; i++, se++) {
+        struct rl_flow_stats_info *info, *scan;
+
+        info = rl_alloc(sizeof(*info), RL_MT_CONF);
+        if (!info) {
+            PE("Out of memory\n");
+            errno = ENOMEM;
+            return -1;
+        }
+
+        info->ipcp_id    = se->ipcp_id;
+        info->local_port = se->port_id;
+        info->stats      = se->stats;
+
+        /* Insert into the list sorting by IPCP id first and then by
+         * local port id. Scan backwards, since entries of the same IPCP
+         * tend to arrive in order. */
+        list_for_each_entry_reverse (scan, stats, node) {
+            if (info->ipcp_id > scan->ipcp_id ||
+                (info->ipcp_id == scan->ipcp_id &&
+                 info->local_port > scan->local_port)) {
+                break;
+            }
+        }
+        list_add_front(&info->node, &scan->node);
+    }
+
+    return 0;
+}
+
+int
+rl_conf_flows_stats_fetch(struct list_head *stats, rl_ipcp_id_t ipcp_id)
+{
+    struct rl_kmsg_flow_stats_dump_resp *resp;
+    struct rl_kmsg_flow_stats_dump msg;
+    int end = 0;
+    int ret;
+    int fd;
+
+    fd = rina_open();
+    if (fd < 0) {
+        return fd;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.hdr.msg_type = RLITE_KER_FLOW_STATS_DUMP;
+    msg.hdr.event_id = 1;
+    msg.ipcp_id      = ipcp_id;
+
+    /* A single request, the kernel streams back as many responses as
+     * needed, the last one having the 'end' flag set. */
+    ret = rl_write_msg(fd, RLITE_MB(&msg), 0);
+    rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&msg));
+    if (ret < 0) {
+        PE("Failed to issue request to the kernel\n");
+        goto out;
+    }
+
+    while (!end) {
+        resp = (struct rl_kmsg_flow_stats_dump_resp *)wait_for_next_msg(fd,
+                                                                        3000);
+        if (!resp) {
+            ret = -1;
+            break;
+        }
+        assert(resp->hdr.msg_type == RLITE_KER_FLOW_STATS_DUMP_RESP);
+        assert(resp->hdr.event_id == msg.hdr.event_id);
+        ret = flow_stats_append(stats, resp);
+        end = resp->end || ret;
+        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(resp));
+        rl_free(resp, RL_MT_MSG);
+    }
+out:
+    close(fd);
+
+    return ret;
+}
+
+void
+rl_conf_flows_stats_purge(struct list_head *stats)
+{
+    struct rl_flow_stats_info *info, *tmp;
+
+    list_for_each_entry_safe (info, tmp, stats, node) {
+        list_del(&info->node);
+        rl_free(info, RL_MT_CONF);
+    }
+}
+
 /* Support for fetching registration information in kernel space. */
 
 static int
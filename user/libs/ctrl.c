@@ -37,6 +37,7 @@
 #include <time.h>
 #include <sys/ioctl.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
 #include "rlite/kernel-msg.h"
 #include "rlite/utils.h"
 #include "rlite/ctrl.h"
@@ -85,19 +86,124 @@ rl_read_next_msg(int rfd, int quiet)
     return resp;
 }
 
+int
+rl_ctrl_ring_open(int rfd, uint32_t size, struct rl_ctrl_ring *ring)
+{
+    void *addr;
+
+    memset(ring, 0, sizeof(*ring));
+
+    /* Allocate the ring. The kernel starts using it only when it is
+     * mapped, so nothing is lost if mmap() fails. */
+    if (ioctl(rfd, RLITE_IOCTL_CTRL_RING, size)) {
+        return -1;
+    }
+
+    ring->fd     = rfd;
+    ring->maplen = RL_CTRL_RING_DATA_OFS + size;
+    addr = mmap(NULL, ring->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, rfd, 0);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+
+    ring->hdr  = (struct rl_ctrl_ring_hdr *)addr;
+    ring->data = ((uint8_t *)addr) + RL_CTRL_RING_DATA_OFS;
+    ring->size = size;
+
+    return 0;
+}
+
+void
+rl_ctrl_ring_close(struct rl_ctrl_ring *ring)
+{
+    if (ring->hdr) {
+        munmap(ring->hdr, ring->maplen);
+        ring->hdr = NULL;
+    }
+}
+
+int
+rl_ctrl_ring_read_batch(struct rl_ctrl_ring *ring, struct rl_msg_base **msgs,
+                        unsigned int max)
+{
+    unsigned int max_resp_size = rl_numtables_max_size(
+        rl_ker_numtables,
+        sizeof(rl_ker_numtables) / sizeof(struct rl_msg_layout));
+    uint32_t head = ring->hdr->head;
+    uint32_t tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+    unsigned int n = 0;
+    int ret        = 0;
+
+    while (head != tail && n < max) {
+        uint32_t ofs = head & (ring->size - 1);
+        struct rl_ctrl_ring_rec *rec;
+        struct rl_msg_base *msg;
+
+        rec = (struct rl_ctrl_ring_rec *)(ring->data + ofs);
+        if (rec->len == RL_CTRL_RING_WRAP) {
+            head += ring->size - ofs;
+            continue;
+        }
+
+        msg = RLITE_MB(rl_alloc(max_resp_size, RL_MT_MSG));
+        if (!msg) {
+            errno = ENOMEM;
+            ret   = -1;
+            break;
+        }
+
+        /* A malformed record is skipped, so that it cannot block the
+         * ring. */
+        if (deserialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX, rec + 1,
+                                  rec->len, (void *)msg, max_resp_size)) {
+            PE("Problems during deserialization\n");
+            rl_free(msg, RL_MT_MSG);
+            errno = EPROTO;
+            ret   = -1;
+        } else {
+            msgs[n++] = msg;
+        }
+        head += (sizeof(*rec) + rec->len + RL_CTRL_RING_ALIGN - 1) &
+                ~(RL_CTRL_RING_ALIGN - 1);
+    }
+
+    /* Messages have been copied out: give the space back to the kernel,
+     * and tell it if it is waiting for space. The fence orders the store
+     * to head before the load of notify, which the kernel sets before
+     * checking head again. */
+    __atomic_store_n(&ring->hdr->head, head, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->hdr->notify, __ATOMIC_RELAXED)) {
+        ioctl(ring->fd, RLITE_IOCTL_CTRL_RING_CONSUMED);
+    }
+
+    return n > 0 ? (int)n : ret;
+}
+
+int
+rl_ctrl_stats_get(int rfd, struct rl_ctrl_stats *stats)
+{
+    return ioctl(rfd, RLITE_IOCTL_CTRL_STATS, stats);
+}
+
 int
 rl_write_msg(int rfd, const struct rl_msg_base *msg, int quiet)
 {
-    char serbuf[4096];
+    char serbuf_stack[4096];
+    char *serbuf = serbuf_stack;
     unsigned int serlen;
     int ret;
 
-    /* Serialize the message. */
+    /* Serialize the message. Large messages (e.g. batched updates) are
+     * serialized into a temporary heap buffer. */
     serlen = rl_msg_serlen(rl_ker_numtables, RLITE_KER_MSG_MAX, msg);
-    if (serlen > sizeof(serbuf)) {
-        PE("Serialized message would be too long [%u]\n", serlen);
-        errno = EINVAL;
-        return -1;
+    if (serlen > sizeof(serbuf_stack)) {
+        serbuf = rl_alloc(serlen, RL_MT_MSG);
+        if (!serbuf) {
+            PE("Out of memory\n");
+            errno = ENOMEM;
+            return -1;
+        }
     }
     serlen =
         serialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX, serbuf, msg);
@@ -120,6 +226,10 @@ rl_write_msg(int rfd, const struct rl_msg_base *msg, int quiet)
         ret = 0;
     }
 
+    if (serbuf != serbuf_stack) {
+        rl_free(serbuf, RL_MT_MSG);
+    }
+
     return ret;
 }
 
@@ -22,6 +22,7 @@
  */
 
 #include <iostream>
+#include <fstream>
 #include <list>
 #include <string>
 #include <cstdint>
@@ -36,6 +37,14 @@
 #include <map>
 #include <unordered_map>
 #include <chrono>
+#include <vector>
+#include <cstdlib>
+#include <cerrno>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/vfs.h>
+#include <sys/stat.h>
+#include <linux/magic.h>
 
 #include "rlite/cpputils.hpp"
 #include "rlite/raft.hpp"
@@ -43,17 +52,78 @@
 using namespace std;
 using namespace raft;
 
+/* A private directory created with mkdtemp() under 'base', removed
+ * together with its content on destruction. */
+class TempDir {
+    string path;
+
+public:
+    TempDir(const string &base)
+    {
+        string tmpl = base + "/raft-test-XXXXXX";
+        std::vector<char> buf(tmpl.begin(), tmpl.end());
+
+        buf.push_back('\0');
+        if (mkdtemp(buf.data())) {
+            path = buf.data();
+        }
+    }
+    ~TempDir()
+    {
+        DIR *dir;
+
+        if (path.empty() || !(dir = opendir(path.c_str()))) {
+            return;
+        }
+        while (struct dirent *ent = readdir(dir)) {
+            if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")) {
+                unlink((path + "/" + ent->d_name).c_str());
+            }
+        }
+        closedir(dir);
+        rmdir(path.c_str());
+    }
+    RL_NONCOPIABLE(TempDir);
+    const string &get() const { return path; }
+};
+
+/* Where the tests keep the log files. */
+static string test_dir = "/tmp";
+
 static string
-logfile(const string &replica)
+logfile(const string &replica, const string &dir = test_dir)
 {
-    return string("/tmp/raft_test_") + replica + "_log";
+    return dir + "/raft_test_" + replica + "_log";
+}
+
+/* The time seen by the TestReplica instances, which only moves forward
+ * when a test advances it. */
+static chrono::steady_clock::time_point test_clock;
+
+/* The test commands are 32 bit values. Any bytes following the value are
+ * just padding. */
+static string
+cmd_string(uint32_t cmd)
+{
+    return string(reinterpret_cast<const char *>(&cmd), sizeof(cmd));
+}
+
+static uint32_t
+cmd_value(const string &command)
+{
+    uint32_t cmd = 0;
+
+    assert(command.size() >= sizeof(cmd));
+    memcpy(&cmd, command.data(), sizeof(cmd));
+    return cmd;
 }
 
 class TestReplica : public RaftSM {
     /* Commands committed to the replicated state machine. */
     list<uint32_t> committed_commands;
     list<string> peers;
-    bool failed = false;
+    bool failed   = false;
+    bool isolated = false;
 
 public:
     TestReplica() = default;
@@ -61,18 +131,59 @@ public:
     TestReplica(const std::string &smname, const ReplicaId &myname,
                 std::string logname, const list<string> &others)
         : RaftSM(smname, myname, logname,
-                 /*cmd_size=*/sizeof(uint32_t), std::cerr, std::cout),
+                 /*legacy_cmd_size=*/sizeof(uint32_t), std::cerr, std::cout),
           peers(others)
     {
     }
     ~TestReplica() { shutdown(); }
 
+    virtual chrono::steady_clock::time_point clock_now() const override
+    {
+        return test_clock;
+    }
+
     /* Apply (commit) a command to the replicated state machine. */
     virtual int apply(LogIndex index, Term term,
-                      const char *const serbuf) override
+                      const string &command) override
+    {
+        std::vector<string> commands;
+
+        /* Plain commands are four bytes long, and may well start with
+         * the marker of packed commands. */
+        if (command.size() == sizeof(uint32_t) || !commands_packed(command)) {
+            committed_commands.push_back(cmd_value(command));
+            return 0;
+        }
+        if (commands_unpack(command, &commands)) {
+            return -1;
+        }
+        for (const auto &cmd : commands) {
+            committed_commands.push_back(cmd_value(cmd));
+        }
+        return 0;
+    }
+
+    /* The snapshot is the list of the commands committed so far. */
+    virtual int snapshot_serialize(string &state) override
+    {
+        for (uint32_t cmd : committed_commands) {
+            state.append(reinterpret_cast<const char *>(&cmd), sizeof(cmd));
+        }
+        return 0;
+    }
+
+    virtual int snapshot_restore(const string &state) override
     {
-        uint32_t cmd = *(reinterpret_cast<const uint32_t *>(serbuf));
-        committed_commands.push_back(cmd);
+        if (state.size() % sizeof(uint32_t) != 0) {
+            return -1;
+        }
+        committed_commands.clear();
+        for (size_t ofs = 0; ofs < state.size(); ofs += sizeof(uint32_t)) {
+            uint32_t cmd;
+
+            memcpy(&cmd, state.data() + ofs, sizeof(cmd));
+            committed_commands.push_back(cmd);
+        }
         return 0;
     }
 
@@ -85,8 +196,12 @@ public:
         committed_commands.clear();
     }
 
-    /* Is this replica alive? */
-    bool up() const { return !failed; }
+    /* Called to emulate a network partition that isolates the replica
+     * from the others, or to heal it. The replica keeps its state. */
+    void isolate(bool yes) { isolated = yes; }
+
+    /* Is this replica alive and reachable? */
+    bool up() const { return !failed && !isolated; }
 
     /* Called to emulate a replica trying to recover after failure. */
     int respawn(RaftSMOutput *out)
@@ -120,6 +235,11 @@ public:
 
     bool something_committed() const { return !committed_commands.empty(); }
 
+    uint32_t last_command() const
+    {
+        return committed_commands.empty() ? 0 : committed_commands.back();
+    }
+
     /* Go over the commands committed so far, and check if there
      * are any missing numbers (adding them to the output argument). */
     set<uint32_t> get_missing_commands(set<uint32_t> acc, uint32_t Max) const
@@ -215,10 +335,13 @@ enum class ElectionType {
     Conflicting,
 };
 
-/* Returns 0 on test success, 1 on test failure, -1 on error. */
+/* Returns 0 on test success, 1 on test failure, -1 on error. The log
+ * cache of the replicas has 'log_cache_size' entries, and the replicas
+ * take a snapshot every 'snapshot_threshold' entries (if not zero). */
 int
 run_simulation(const list<TestEvent> &external_events,
-               ElectionType election_type)
+               ElectionType election_type, size_t log_cache_size,
+               LogIndex snapshot_threshold)
 {
     list<string> names = {"r1", "r2", "r3", "r4", "r5"};
     map<string, std::unique_ptr<TestReplica>> replicas;
@@ -265,6 +388,8 @@ run_simulation(const list<TestEvent> &external_events,
         /* Zero the retransmission timeout, because this would make
          * the test fail, as time is emulated. */
         sm->set_retransmission_timeout(std::chrono::seconds::zero());
+        sm->set_log_cache_size(log_cache_size);
+        sm->set_snapshot_threshold(snapshot_threshold);
         replicas[local] = std::move(sm);
     }
 
@@ -332,17 +457,21 @@ run_simulation(const list<TestEvent> &external_events,
             auto *rvr = dynamic_cast<RaftRequestVoteResp *>(p.second.get());
             auto *ae  = dynamic_cast<RaftAppendEntries *>(p.second.get());
             auto *aer = dynamic_cast<RaftAppendEntriesResp *>(p.second.get());
-            int r     = 0;
+            auto *is  = dynamic_cast<RaftInstallSnapshot *>(p.second.get());
+            bool dropped_snapshot = false;
+            int r                 = 0;
 
             assert(replicas.count(p.first));
             if (!replicas[p.first]->up()) {
                 /* Replica is currently down, we just drop this message.
                  * In case of append entries message, we modify it to pretend
                  * it's an heartbeat, so that it's not considered an
-                 * interesting event in the check below. */
+                 * interesting event in the check below. The same holds for
+                 * the snapshot, that the leader keeps sending. */
                 if (ae) {
                     ae->entries.clear();
                 }
+                dropped_snapshot = (is != nullptr);
             } else if (rv) {
                 r = replicas[p.first]->request_vote_input(*rv, &output_next);
             } else if (rvr) {
@@ -353,12 +482,15 @@ run_simulation(const list<TestEvent> &external_events,
             } else if (aer) {
                 r = replicas[p.first]->append_entries_resp_input(*aer,
                                                                  &output_next);
+            } else if (is) {
+                r = replicas[p.first]->install_snapshot_input(*is,
+                                                              &output_next);
             } else {
                 assert(false);
             }
 
             /* All messages are interesting events, except for heartbeats. */
-            if (!ae || !ae->entries.empty()) {
+            if ((!ae || !ae->entries.empty()) && !dropped_snapshot) {
                 t_last_ievent = t;
             }
 
@@ -446,9 +578,8 @@ run_simulation(const list<TestEvent> &external_events,
                 if (leader) {
                     cout << "Submitting command " << next.cmd << " to "
                          << leader->local_name() << endl;
-                    if (leader->submit(
-                            reinterpret_cast<const char *>(&next.cmd), nullptr,
-                            &output_next)) {
+                    if (leader->submit(cmd_string(next.cmd), nullptr,
+                                       &output_next)) {
                         return -1;
                     }
                 } else {
@@ -570,6 +701,1008 @@ run_simulation(const list<TestEvent> &external_events,
     return 0;
 }
 
+/* Deliver the messages produced by the replicas to their destinations,
+ * until no more messages are produced. Timers are ignored, and the
+ * messages for the replicas that are down are dropped. The reads served
+ * or failed along the way are collected in 'output'. If 'ae_bytes' is
+ * not nullptr, the size of the entries (term and command) carried by the
+ * delivered RaftAppendEntries is added to it. If 'hints' is false, the
+ * conflict hints are removed from the RaftAppendEntriesResp. */
+template <class Replica>
+static int
+deliver_all(map<string, std::unique_ptr<Replica>> &replicas,
+            RaftSMOutput &output, uint64_t *ae_bytes = nullptr,
+            bool hints = true)
+{
+    while (!output.output_messages.empty()) {
+        RaftSMOutput output_next;
+
+        for (const auto &p : output.output_messages) {
+            auto *rv  = dynamic_cast<RaftRequestVote *>(p.second.get());
+            auto *rvr = dynamic_cast<RaftRequestVoteResp *>(p.second.get());
+            auto *ae  = dynamic_cast<RaftAppendEntries *>(p.second.get());
+            auto *aer = dynamic_cast<RaftAppendEntriesResp *>(p.second.get());
+            auto *is  = dynamic_cast<RaftInstallSnapshot *>(p.second.get());
+            auto *ri  = dynamic_cast<RaftReadIndex *>(p.second.get());
+            auto *rir = dynamic_cast<RaftReadIndexResp *>(p.second.get());
+            Replica *r = replicas[p.first].get();
+            int ret    = -1;
+
+            if (!r->up()) {
+                continue;
+            } else if (rv) {
+                ret = r->request_vote_input(*rv, &output_next);
+            } else if (rvr) {
+                ret = r->request_vote_resp_input(*rvr, &output_next);
+            } else if (ae) {
+                if (ae_bytes) {
+                    for (const auto &e : ae->entries) {
+                        *ae_bytes += sizeof(e.first) + e.second->size();
+                    }
+                }
+                ret = r->append_entries_input(*ae, &output_next);
+            } else if (aer) {
+                if (!hints) {
+                    aer->conflict_term  = 0;
+                    aer->conflict_index = 0;
+                }
+                ret = r->append_entries_resp_input(*aer, &output_next);
+            } else if (is) {
+                ret = r->install_snapshot_input(*is, &output_next);
+            } else if (ri) {
+                ret = r->read_index_input(*ri, &output_next);
+            } else if (rir) {
+                ret = r->read_index_resp_input(*rir, &output_next);
+            }
+            if (ret) {
+                return -1;
+            }
+        }
+        output_next.reads_ready.splice(output_next.reads_ready.begin(),
+                                       output.reads_ready);
+        output_next.reads_failed.splice(output_next.reads_failed.begin(),
+                                        output.reads_failed);
+        output = std::move(output_next);
+    }
+
+    return 0;
+}
+
+/* Create the replicas in 'names', each one having all the others as
+ * peers and its log in 'dir', and boot them. The logs left by previous
+ * runs are removed, unless 'keep_logs' is set. 'setup' is called on each
+ * replica before it boots. */
+template <class Replica, class Setup>
+static int
+make_cluster(map<string, std::unique_ptr<Replica>> &replicas,
+             const list<string> &names, const string &dir,
+             RaftSMOutput &output, Setup setup, bool keep_logs = false)
+{
+    replicas.clear();
+    for (const auto &local : names) {
+        string logfilename = logfile(local, dir);
+        list<string> peers;
+
+        for (const auto &peer : names) {
+            if (peer != local) {
+                peers.push_back(peer);
+            }
+        }
+        if (!keep_logs) {
+            remove(logfilename.c_str());
+        }
+        remove((logfilename + ".snap").c_str());
+        replicas[local] = utils::make_unique<Replica>(local + "-sm", local,
+                                                      logfilename, peers);
+        replicas[local]->set_verbosity(RaftSM::kVerboseQuiet);
+        setup(*replicas[local]);
+        if (replicas[local]->respawn(&output)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+template <class Replica>
+static int
+make_cluster(map<string, std::unique_ptr<Replica>> &replicas,
+             const list<string> &names, const string &dir,
+             RaftSMOutput &output)
+{
+    return make_cluster(replicas, names, dir, output, [](Replica &) {});
+}
+
+/* Let the election timer of 'name' expire, and deliver the messages of
+ * the election. */
+template <class Replica>
+static int
+elect(map<string, std::unique_ptr<Replica>> &replicas, const string &name,
+      RaftSMOutput &output)
+{
+    return replicas[name]->timer_expired(RaftTimerType::Election, &output) ||
+           deliver_all(replicas, output);
+}
+
+/* Let the heartbeat timer of 'name' expire, and deliver the messages
+ * produced. */
+template <class Replica>
+static int
+heartbeat(map<string, std::unique_ptr<Replica>> &replicas, const string &name,
+          RaftSMOutput &output)
+{
+    return replicas[name]->timer_expired(RaftTimerType::HeartBeat, &output) ||
+           deliver_all(replicas, output);
+}
+
+/* Check that a log written with fixed size entries (the format used by the
+ * previous versions) is converted when the replicas boot, that a
+ * partially written entry at the end of a log is discarded, and that
+ * a corrupted entry in the middle of a log is not. */
+static int
+log_migration_test(const string &dir, uint32_t num_entries)
+{
+    list<string> names = {"r1", "r2", "r3"};
+    map<string, std::unique_ptr<TestReplica>> replicas;
+    RaftSMOutput output;
+
+    for (const auto &local : names) {
+        uint32_t header[32] = {0x89ae01caU, /*current_term=*/1};
+
+        /* Header (magic number, current term, no vote, no snapshot)
+         * followed by the entries, each one made of term and command. */
+        ofstream fout(logfile(local, dir), ios::binary | ios::trunc);
+        fout.write(reinterpret_cast<const char *>(header), sizeof(header));
+        for (uint32_t cmd = 1; cmd <= num_entries; cmd++) {
+            uint32_t entry[2] = {/*term=*/1, cmd};
+
+            fout.write(reinterpret_cast<const char *>(entry), sizeof(entry));
+        }
+    }
+    if (make_cluster(replicas, names, dir, output, [](TestReplica &) {},
+                     /*keep_logs=*/true)) {
+        cout << "Migration test: failed to boot" << endl;
+        return -1;
+    }
+
+    /* Let r1 win the election, and commit one more entry. */
+    TestReplica *leader = replicas["r1"].get();
+    auto commit         = [&](uint32_t cmd) -> int {
+        return leader->submit(cmd_string(cmd), nullptr, &output) ||
+               deliver_all(replicas, output) ||
+               heartbeat(replicas, "r1", output);
+    };
+
+    if (elect(replicas, "r1", output) || !leader->leader() ||
+        commit(num_entries + 1)) {
+        cout << "Migration test: replication failed" << endl;
+        return -1;
+    }
+    for (const auto &kv : replicas) {
+        if (!kv.second->check(num_entries + 1)) {
+            cout << "Migration test: " << kv.first
+                 << " does not have all the entries" << endl;
+            return 1;
+        }
+    }
+
+    /* Append half of an entry to the log of r3, as if it crashed while
+     * writing it. */
+    TestReplica *follower = replicas["r3"].get();
+    uint32_t torn[5]      = {/*length=*/sizeof(uint32_t), /*term=*/2,
+                        /*checksum=*/0, /*hdr_checksum=*/0, num_entries + 2};
+
+    follower->fail();
+    ofstream fout(logfile("r3", dir), ios::binary | ios::app);
+    fout.write(reinterpret_cast<const char *>(torn), sizeof(torn) - 2);
+    fout.close();
+    if (follower->respawn(&output) || commit(num_entries + 2)) {
+        cout << "Migration test: r3 failed to recover" << endl;
+        return -1;
+    }
+    if (!follower->check(num_entries + 2)) {
+        cout << "Migration test: r3 does not have all the entries" << endl;
+        return 1;
+    }
+
+    /* Corrupt the length of the first entry in the log of r2, which must
+     * refuse to boot rather than discard all the entries that follow. */
+    TestReplica *corrupted = replicas["r2"].get();
+    uint32_t length        = 0xffffU;
+
+    corrupted->fail();
+    fstream fio(logfile("r2", dir), ios::binary | ios::in | ios::out);
+    fio.seekp(128);
+    fio.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    fio.close();
+    if (!corrupted->respawn(&output)) {
+        cout << "Migration test: r2 booted with a corrupted log" << endl;
+        return 1;
+    }
+    corrupted->fail();
+    cout << "Migration test: " << num_entries << " entries converted" << endl;
+
+    return 0;
+}
+
+/* Check the replication towards followers that are behind: a follower that
+ * missed many entries gets them a window at a time, as it acks them, and
+ * a follower with a long conflicting suffix is brought back in sync with
+ * one rejection per conflicting term (or one per entry without the hints
+ * of the followers). */
+static int
+replication_window_test(uint32_t num_entries, LogIndex window)
+{
+    list<string> names = {"p1", "p2", "p3"};
+    map<string, std::unique_ptr<TestReplica>> replicas;
+    RaftSMOutput output;
+
+    auto spawn_all = [&]() -> int {
+        return make_cluster(replicas, names, test_dir, output,
+                            [window](TestReplica &r) {
+                                r.set_retransmission_timeout(
+                                    std::chrono::seconds::zero());
+                                r.set_replication_window(window);
+                            });
+    };
+    auto elect_leader = [&](const string &name) -> int {
+        return elect(replicas, name, output) || !replicas[name]->leader();
+    };
+    auto submit = [&](TestReplica *leader, uint32_t first, uint32_t last,
+                      bool hints) -> int {
+        std::vector<string> bufs;
+
+        for (uint32_t cmd = first; cmd <= last;) {
+            bufs.clear();
+            for (; cmd <= last && bufs.size() < 64; cmd++) {
+                bufs.push_back(cmd_string(cmd));
+            }
+            if (leader->submit_batch(bufs, nullptr, &output) ||
+                deliver_all(replicas, output, nullptr, hints)) {
+                return -1;
+            }
+        }
+        return leader->timer_expired(RaftTimerType::HeartBeat, &output) ||
+               deliver_all(replicas, output, nullptr, hints);
+    };
+    auto info = [](TestReplica *leader,
+                   const string &name) -> RaftSM::FollowerInfo {
+        for (const auto &f : leader->followers_info()) {
+            if (f.id == name) {
+                return f;
+            }
+        }
+        assert(false);
+        return RaftSM::FollowerInfo();
+    };
+
+    /* A follower misses most of the entries. When it comes back, the
+     * leader keeps at most 'window' entries in flight towards it. */
+    if (spawn_all() || elect_leader("p1")) {
+        return -1;
+    }
+    TestReplica *leader = replicas["p1"].get();
+
+    replicas["p3"]->fail();
+    if (submit(leader, 1, num_entries, true) ||
+        replicas["p3"]->respawn(&output) ||
+        leader->timer_expired(RaftTimerType::HeartBeat, &output)) {
+        return -1;
+    }
+    if (info(leader, "p3").inflight != window) {
+        cout << "Window test: " << info(leader, "p3").inflight
+             << " entries in flight, " << window << " expected" << endl;
+        return 1;
+    }
+    if (deliver_all(replicas, output) ||
+        leader->timer_expired(RaftTimerType::HeartBeat, &output) ||
+        deliver_all(replicas, output)) {
+        return -1;
+    }
+    if (!replicas["p3"]->check(num_entries) || info(leader, "p3").lag != 0) {
+        cout << "Window test: p3 did not catch up" << endl;
+        return 1;
+    }
+
+    for (bool hints : {true, false}) {
+        /* p1 appends entries that only it gets, then fails. Meanwhile
+         * p2 becomes leader and commits as many entries, and then p3 is
+         * elected. */
+        if (spawn_all() || elect_leader("p1") ||
+            submit(leader = replicas["p1"].get(), 1, 10, hints)) {
+            return -1;
+        }
+        replicas["p2"]->fail();
+        replicas["p3"]->fail();
+        if (submit(leader, 11, 10 + num_entries, hints)) {
+            return -1;
+        }
+        replicas["p1"]->fail();
+        if (replicas["p2"]->respawn(&output) ||
+            replicas["p3"]->respawn(&output) || elect_leader("p2") ||
+            submit(leader = replicas["p2"].get(), 11, 10 + num_entries,
+                   hints) ||
+            elect_leader("p3")) {
+            return -1;
+        }
+        leader = replicas["p3"].get();
+
+        /* p1 comes back, and the next entry finds its conflicting
+         * suffix. */
+        if (replicas["p1"]->respawn(&output) ||
+            submit(leader, 11 + num_entries, 11 + num_entries, hints)) {
+            return -1;
+        }
+        if (!replicas["p1"]->check(11 + num_entries)) {
+            cout << "Backtracking test: p1 is not in sync" << endl;
+            return 1;
+        }
+        cout << "Backtracking over " << num_entries << " conflicting entries "
+             << (hints ? "with" : "without") << " hints: "
+             << info(leader, "p1").rejections << " rejections" << endl;
+        if (hints && info(leader, "p1").rejections != 1) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Check that the reads served without writing to the log are linearizable,
+ * i.e. they reflect all the writes completed before they were issued, when
+ * they are served by the followers, by a leader that has been replaced
+ * without knowing it, by a new leader, and by a leader under the lease. */
+static int
+read_linearizability_test()
+{
+    list<string> names = {"q1", "q2", "q3"};
+    map<string, std::unique_ptr<TestReplica>> replicas;
+    /* For each read in progress, the replica that serves it and the last
+     * write completed when it was issued. */
+    map<uint64_t, pair<string, uint32_t>> reads;
+    set<uint64_t> failed;
+    uint32_t completed = 0;
+    uint64_t read_id   = 0;
+    RaftSMOutput output;
+
+    if (make_cluster(replicas, names, test_dir, output, [](TestReplica &r) {
+            r.set_retransmission_timeout(std::chrono::seconds::zero());
+        })) {
+        return -1;
+    }
+    /* A write completes when the leader has applied it. The followers
+     * learn about it later. */
+    auto write = [&](const string &name, uint32_t cmd) -> int {
+        if (replicas[name]->submit(cmd_string(cmd), nullptr, &output) ||
+            deliver_all(replicas, output) ||
+            replicas[name]->last_command() != cmd) {
+            return -1;
+        }
+        completed = cmd;
+        return 0;
+    };
+    auto read = [&](const string &name) -> int {
+        reads[++read_id] = make_pair(name, completed);
+        return replicas[name]->read_request(read_id, &output);
+    };
+    /* Check the reads served or failed so far, returning the number of
+     * the ones served with a stale state. */
+    auto check = [&]() -> int {
+        int stale = 0;
+
+        for (uint64_t id : output.reads_ready) {
+            const auto &r = reads[id];
+
+            if (replicas[r.first]->last_command() < r.second) {
+                cout << "Read test: read " << id << " on " << r.first
+                     << " is stale" << endl;
+                stale++;
+            }
+            reads.erase(id);
+        }
+        for (uint64_t id : output.reads_failed) {
+            failed.insert(id);
+            reads.erase(id);
+        }
+        output.reads_ready.clear();
+        output.reads_failed.clear();
+        return stale;
+    };
+
+    if (elect(replicas, "q1", output) || !replicas["q1"]->leader()) {
+        return -1;
+    }
+    for (uint32_t cmd = 1; cmd <= 10; cmd++) {
+        if (write("q1", cmd)) {
+            return -1;
+        }
+    }
+
+    /* Reads on all the replicas, with a write in the middle. The followers
+     * have not applied the last writes yet, and need to wait for them. */
+    for (int i = 0; i < 30; i++) {
+        if (read("q1") || read("q2") || read("q3") ||
+            (i == 15 && write("q1", 11))) {
+            return -1;
+        }
+    }
+    if (deliver_all(replicas, output) || check() || !reads.empty() ||
+        !failed.empty()) {
+        cout << "Read test: reads not served" << endl;
+        return 1;
+    }
+
+    /* The leader q1 is isolated, and q2 takes its place. The reads on q1
+     * are never served, the reads on the others see the new writes. */
+    replicas["q1"]->isolate(true);
+    if (read("q1") || heartbeat(replicas, "q1", output)) {
+        return -1;
+    }
+    output.output_messages.clear(); /* q1 cannot talk to anyone */
+    if (elect(replicas, "q2", output) || !replicas["q2"]->leader() ||
+        write("q2", 12) || write("q2", 13) || read("q3") || read("q2") ||
+        deliver_all(replicas, output) || check()) {
+        cout << "Read test: reads after the partition failed" << endl;
+        return 1;
+    }
+    if (read("q1") || heartbeat(replicas, "q1", output)) {
+        return -1;
+    }
+    output.output_messages.clear();
+    if (check() || reads.size() != 2 || !replicas["q1"]->leader()) {
+        cout << "Read test: the deposed leader served a read" << endl;
+        return 1;
+    }
+
+    /* When the partition heals, the deposed leader steps down and its
+     * reads fail, so that they can be retried elsewhere. */
+    replicas["q1"]->isolate(false);
+    if (heartbeat(replicas, "q2", output) ||
+        heartbeat(replicas, "q2", output) || check() || !reads.empty() ||
+        failed.size() != 2 || replicas["q1"]->leader()) {
+        cout << "Read test: reads of the deposed leader did not fail" << endl;
+        return 1;
+    }
+
+    /* A new leader with nothing committed in its term commits an empty
+     * entry before serving reads, which is not applied. */
+    LogIndex last_index = replicas["q3"]->last_index();
+
+    if (elect(replicas, "q3", output) || !replicas["q3"]->leader() ||
+        read("q3") || read("q1") || deliver_all(replicas, output) || check() ||
+        !reads.empty() || replicas["q3"]->last_index() != last_index + 1 ||
+        heartbeat(replicas, "q3", output)) {
+        cout << "Read test: reads on the new leader failed" << endl;
+        return 1;
+    }
+    for (const auto &kv : replicas) {
+        if (!kv.second->check(completed)) {
+            cout << "Read test: " << kv.first << " is not in sync" << endl;
+            return 1;
+        }
+    }
+
+    /* With leases, once the leadership is confirmed the leader serves the
+     * reads right away, and the others do not vote for a new leader until
+     * the lease expires. */
+    TestReplica *leader = replicas["q3"].get();
+
+    for (const auto &kv : replicas) {
+        if (kv.second->set_read_lease(std::chrono::milliseconds(50))) {
+            return -1;
+        }
+    }
+    if (read("q3") || deliver_all(replicas, output) || check() ||
+        !reads.empty()) {
+        return -1;
+    }
+    for (int i = 0; i < 100; i++) {
+        if (read("q3")) {
+            return -1;
+        }
+    }
+    if (!output.output_messages.empty() || check() || !reads.empty() ||
+        leader->get_stats().reads_lease != 100) {
+        cout << "Read test: reads not served under the lease" << endl;
+        return 1;
+    }
+
+    /* Once the lease expires, the leadership must be confirmed again. */
+    test_clock += std::chrono::milliseconds(60);
+    if (read("q3") || output.output_messages.empty() || check() ||
+        reads.size() != 1 || deliver_all(replicas, output) || check() ||
+        !reads.empty()) {
+        cout << "Read test: read after the lease expired failed" << endl;
+        return 1;
+    }
+
+    Term term = replicas["q2"]->curr_term();
+
+    if (elect(replicas, "q1", output) || replicas["q1"]->leader() ||
+        !leader->leader() || replicas["q2"]->curr_term() != term) {
+        cout << "Read test: vote granted during the lease" << endl;
+        return 1;
+    }
+
+    /* After an election timeout without the leader, a new one can be
+     * elected, and it serves the reads with the last writes. */
+    test_clock += replicas["q1"]->get_election_timeout_max();
+    if (elect(replicas, "q1", output) || !replicas["q1"]->leader() ||
+        read("q1") || read("q2") || deliver_all(replicas, output) || check() ||
+        !reads.empty()) {
+        cout << "Read test: election after the lease failed" << endl;
+        return 1;
+    }
+
+    cout << "Read test: " << read_id << " linearizable reads, "
+         << failed.size() << " failed on a deposed leader, "
+         << leader->get_stats().reads_lease << " served under the lease"
+         << endl;
+
+    return 0;
+}
+
+/* Measure the replication throughput (entries committed per second by the
+ * leader) against the number of entries submitted in a batch, for three
+ * replicas whose logs are stored in 'dir'. Time is real here, as each
+ * batch costs a flush of the log on each replica. The number of entries
+ * must be a multiple of the batch sizes. */
+static int
+wal_benchmark(const string &dir, uint32_t num_entries)
+{
+    list<string> names = {"r1", "r2", "r3"};
+    struct statfs sfs;
+
+    if (statfs(dir.c_str(), &sfs)) {
+        return 0; /* Not available here. */
+    }
+    cout << "Raft log on " << dir
+         << (sfs.f_type == TMPFS_MAGIC ? " (tmpfs)" : "") << ":" << endl;
+
+    for (uint32_t batch : {1, 4, 16, 64, 256}) {
+        map<string, std::unique_ptr<TestReplica>> replicas;
+        RaftSMOutput output;
+
+        /* Let r1 win the election. */
+        if (make_cluster(replicas, names, dir, output) ||
+            elect(replicas, "r1", output) || !replicas["r1"]->leader()) {
+            cout << "    r1 could not become leader" << endl;
+            return -1;
+        }
+
+        TestReplica *leader   = replicas["r1"].get();
+        auto start            = chrono::steady_clock::now();
+        unsigned int flushes0 = leader->get_stats().log_flushes;
+        std::vector<string> bufs(batch);
+
+        for (uint32_t cmd = 1; cmd <= num_entries;) {
+            for (uint32_t i = 0; i < batch; i++, cmd++) {
+                bufs[i] = cmd_string(cmd);
+            }
+            if (leader->submit_batch(bufs, nullptr, &output) ||
+                deliver_all(replicas, output)) {
+                return -1;
+            }
+        }
+
+        uint64_t usecs = chrono::duration_cast<chrono::microseconds>(
+                             chrono::steady_clock::now() - start)
+                             .count();
+        auto stats           = leader->get_stats();
+        unsigned int flushes = stats.log_flushes - flushes0;
+
+        if (!leader->check(num_entries)) {
+            cout << "    Leader did not commit all the entries" << endl;
+            return -1;
+        }
+        cout << "    batch " << batch << ": "
+             << num_entries * 1000000ULL / std::max(usecs, uint64_t(1))
+             << " entries/s, " << flushes << " leader log flushes, "
+             << stats.log_cache_hits * 100ULL /
+                    std::max(stats.log_cache_hits + stats.log_cache_misses, 1U)
+             << "% log cache hits" << endl;
+    }
+
+    return 0;
+}
+
+/* Measure the registration throughput and latency against the batch
+ * window of the leader, for three replicas whose logs are stored in 'dir'.
+ * Registrations arrive at a constant rate; those arriving within the
+ * window (up to kBatchMaxCommands) are packed in a single log entry;
+ * with no window each registration has its own log entry. The
+ * arrival times are simulated, while the time needed to commit each entry
+ * is real, as it costs a flush of the log on each replica. */
+static int
+batch_window_benchmark(const string &dir, uint32_t num_regs,
+                       uint32_t regs_per_sec)
+{
+    const size_t kBatchMaxCommands = 64;
+    const size_t kRegistrationSize = 64; /* roughly a DFT entry */
+    list<string> names             = {"r1", "r2", "r3"};
+    struct statfs sfs;
+
+    if (statfs(dir.c_str(), &sfs)) {
+        return 0; /* Not available here. */
+    }
+    cout << "Batch window with " << regs_per_sec
+         << " registrations/s offered, Raft log on " << dir << ":" << endl;
+
+    for (uint32_t window_ms : {0, 1, 2, 5, 10}) {
+        map<string, std::unique_ptr<TestReplica>> replicas;
+        const chrono::microseconds window(window_ms * 1000);
+        chrono::microseconds now(0), latency(0);
+        unsigned int entries = 0;
+        RaftSMOutput output;
+
+        /* Let r1 win the election. */
+        if (make_cluster(replicas, names, dir, output) ||
+            elect(replicas, "r1", output) || !replicas["r1"]->leader()) {
+            cout << "    r1 could not become leader" << endl;
+            return -1;
+        }
+
+        TestReplica *leader = replicas["r1"].get();
+        auto arrival        = [regs_per_sec](uint32_t cmd) {
+            return chrono::microseconds((cmd - 1) * 1000000ULL / regs_per_sec);
+        };
+
+        for (uint32_t cmd = 1; cmd <= num_regs;) {
+            std::vector<string> commands;
+            chrono::microseconds close = arrival(cmd) + window;
+            uint32_t first             = cmd;
+
+            /* Collect the registrations arriving within the window. */
+            do {
+                string command = cmd_string(cmd);
+
+                command.resize(kRegistrationSize, 'x');
+                commands.push_back(std::move(command));
+                cmd++;
+            } while (window_ms && cmd <= num_regs && arrival(cmd) <= close &&
+                     commands.size() < kBatchMaxCommands);
+            if (!window_ms || commands.size() == kBatchMaxCommands) {
+                close = arrival(cmd - 1);
+            }
+
+            /* The leader submits the entry when the window closes, or when
+             * it is done with the previous one. */
+            auto start = chrono::steady_clock::now();
+
+            if (leader->submit(RaftSM::commands_pack(commands), nullptr,
+                               &output) ||
+                deliver_all(replicas, output)) {
+                return -1;
+            }
+            now = std::max(now, close) +
+                  chrono::duration_cast<chrono::microseconds>(
+                      chrono::steady_clock::now() - start);
+            entries++;
+            for (uint32_t c = first; c < cmd; c++) {
+                latency += now - arrival(c);
+            }
+        }
+
+        if (!leader->check(num_regs)) {
+            cout << "    Leader did not commit all the registrations" << endl;
+            return -1;
+        }
+        cout << "    window " << window_ms << " ms: "
+             << num_regs * 1000000ULL /
+                    std::max(uint64_t(now.count()), uint64_t(1))
+             << " registrations/s, " << entries << " log entries, "
+             << latency.count() / num_regs << " us mean latency" << endl;
+    }
+
+    return 0;
+}
+
+/* A replicated state machine whose state does not grow with the log: a
+ * table of kNumKeys keys, where each command overwrites the value of the
+ * key (command % kNumKeys). */
+class KVReplica : public RaftSM {
+    map<uint32_t, uint32_t> table;
+    list<string> peers;
+    bool failed = false;
+
+public:
+    /* Number of entries applied since the last respawn. */
+    unsigned int applied = 0;
+
+    static constexpr uint32_t kNumKeys = 1024;
+
+    RL_NONCOPIABLE(KVReplica);
+    KVReplica(const std::string &smname, const ReplicaId &myname,
+              std::string logname, const list<string> &others)
+        : RaftSM(smname, myname, logname,
+                 /*legacy_cmd_size=*/sizeof(uint32_t), std::cerr, std::cout),
+          peers(others)
+    {
+    }
+    ~KVReplica() { shutdown(); }
+
+    virtual int apply(LogIndex index, Term term,
+                      const string &command) override
+    {
+        uint32_t cmd = cmd_value(command);
+
+        table[cmd % kNumKeys] = cmd;
+        applied++;
+        return 0;
+    }
+
+    virtual int snapshot_serialize(string &state) override
+    {
+        for (const auto &kv : table) {
+            state.append(reinterpret_cast<const char *>(&kv.first),
+                         sizeof(kv.first));
+            state.append(reinterpret_cast<const char *>(&kv.second),
+                         sizeof(kv.second));
+        }
+        return 0;
+    }
+
+    virtual int snapshot_restore(const string &state) override
+    {
+        if (state.size() % (2 * sizeof(uint32_t)) != 0) {
+            return -1;
+        }
+        table.clear();
+        for (size_t ofs = 0; ofs < state.size(); ofs += 2 * sizeof(uint32_t)) {
+            uint32_t key, value;
+
+            memcpy(&key, state.data() + ofs, sizeof(key));
+            memcpy(&value, state.data() + ofs + sizeof(key), sizeof(value));
+            table[key] = value;
+        }
+        return 0;
+    }
+
+    void fail()
+    {
+        failed = true;
+        table.clear();
+    }
+
+    bool up() const { return !failed; }
+
+    int respawn(RaftSMOutput *out)
+    {
+        failed  = false;
+        applied = 0;
+        return init(peers, out);
+    };
+
+    bool cross_check(const KVReplica &o) const { return table == o.table; }
+};
+
+/* Disk space used by a file, in KiB (0 if the file does not exist). */
+static unsigned long
+file_kib(const string &path)
+{
+    struct stat st;
+
+    if (stat(path.c_str(), &st)) {
+        return 0;
+    }
+    return static_cast<unsigned long>(st.st_blocks) * 512 / 1024;
+}
+
+/* Measure the restart of a follower (recovery of the replicated state
+ * machine from the disk) after 'num_entries' log entries have been
+ * committed, its disk usage, and the time needed by a follower to catch
+ * up after missing 'missed' entries. Three replicas of a KVReplica are
+ * used, without snapshots and with a snapshot every 'threshold' entries.
+ * Time is real. */
+static int
+snapshot_benchmark(const string &dir, uint32_t num_entries, uint32_t missed,
+                   LogIndex threshold)
+{
+    list<string> names = {"r1", "r2", "r3"};
+    map<string, std::unique_ptr<KVReplica>> replicas;
+    RaftSMOutput output;
+    struct statfs sfs;
+
+    if (statfs(dir.c_str(), &sfs)) {
+        return 0; /* Not available here. */
+    }
+    cout << "Raft log of " << num_entries << " entries on " << dir << ", ";
+    if (threshold) {
+        cout << "snapshot every " << threshold << " entries:" << endl;
+    } else {
+        cout << "no snapshots:" << endl;
+    }
+
+    /* Let r1 win the election. Retransmissions are not delayed, so that
+     * each heartbeat resumes the replication towards a follower that was
+     * down. */
+    if (make_cluster(replicas, names, dir, output,
+                     [threshold](KVReplica &r) {
+                         r.set_snapshot_threshold(threshold);
+                     }) ||
+        elect(replicas, "r1", output) || !replicas["r1"]->leader()) {
+        cout << "    r1 could not become leader" << endl;
+        return -1;
+    }
+
+    KVReplica *leader   = replicas["r1"].get();
+    KVReplica *follower = replicas["r3"].get();
+    string logfilename  = logfile("r3", dir);
+
+    leader->set_retransmission_timeout(std::chrono::seconds::zero());
+
+    /* Submit the commands in [first, last] in batches, and let the
+     * followers apply them with an heartbeat. */
+    auto submit = [&](uint32_t first, uint32_t last) -> int {
+        std::vector<string> bufs;
+
+        for (uint32_t cmd = first; cmd <= last;) {
+            bufs.clear();
+            for (; cmd <= last && bufs.size() < 256; cmd++) {
+                bufs.push_back(cmd_string(cmd));
+            }
+            if (leader->submit_batch(bufs, nullptr, &output) ||
+                deliver_all(replicas, output)) {
+                return -1;
+            }
+        }
+        return 0;
+    };
+    auto msecs_since = [](chrono::steady_clock::time_point start) -> double {
+        return chrono::duration_cast<chrono::microseconds>(
+                   chrono::steady_clock::now() - start)
+                   .count() /
+               1000.0;
+    };
+
+    if (submit(1, num_entries) || heartbeat(replicas, "r1", output)) {
+        return -1;
+    }
+    cout << "    disk usage of a replica: " << file_kib(logfilename)
+         << " KiB log + " << file_kib(logfilename + ".snap")
+         << " KiB snapshot" << endl;
+
+    /* Restart the follower. */
+    follower->fail();
+
+    auto start = chrono::steady_clock::now();
+
+    if (follower->respawn(&output) || heartbeat(replicas, "r1", output)) {
+        return -1;
+    }
+    double restart_ms = msecs_since(start);
+
+    if (!follower->cross_check(*leader)) {
+        cout << "    Follower state does not match after restart" << endl;
+        return -1;
+    }
+    cout << "    restart of a follower: " << restart_ms << " ms, "
+         << follower->applied << " entries replayed" << endl;
+
+    /* Let the follower miss some entries, then restart it. */
+    follower->fail();
+    if (submit(num_entries + 1, num_entries + missed)) {
+        return -1;
+    }
+    start = chrono::steady_clock::now();
+    if (follower->respawn(&output) || heartbeat(replicas, "r1", output)) {
+        return -1;
+    }
+    double catchup_ms = msecs_since(start);
+
+    if (!follower->cross_check(*leader)) {
+        cout << "    Follower state does not match after catch up" << endl;
+        return -1;
+    }
+    cout << "    catch up of a follower that missed " << missed
+         << " entries: " << catchup_ms << " ms, " << follower->applied
+         << " entries replayed, "
+         << follower->get_stats().snapshots_installed
+         << " snapshots received" << endl;
+
+    return 0;
+}
+
+/* Compare the size of the log and of the entries carried by the
+ * RaftAppendEntries for a workload of DFT registrations, with commands
+ * padded to the fixed size of the previous log format (64 bytes) and with
+ * variable size commands (opcode, application name and IPCP name). Three
+ * replicas of a KVReplica are used, which only look at the first bytes of
+ * each command. */
+static int
+dft_log_benchmark(const string &dir, uint32_t num_entries)
+{
+    const size_t kLegacyDFTCommandSize = 64;
+    list<string> names                 = {"r1", "r2", "r3"};
+    struct statfs sfs;
+
+    if (statfs(dir.c_str(), &sfs)) {
+        return 0; /* Not available here. */
+    }
+    cout << "DFT workload of " << num_entries << " entries on " << dir << ":"
+         << endl;
+
+    /* Application names as produced by apname2string(), some of them
+     * longer than what the fixed size commands could store. */
+    auto dft_command = [](uint32_t i) -> string {
+        string appl;
+
+        switch (i % 4) {
+        case 0:
+            appl = "rina-echo-async|" + to_string(i) + "||";
+            break;
+        case 1:
+            appl = "rinaperf|client-" + to_string(i) + "||";
+            break;
+        case 2:
+            appl = "media-streaming-frontend|" + to_string(i) + "|control|";
+            break;
+        default:
+            appl = "dns|1||";
+            break;
+        }
+
+        return string(1, i % 8 == 7 ? /*del=*/2 : /*set=*/1) + appl + '\0' +
+               "n" + to_string(i % 64) + ".dc.DIF|1||";
+    };
+
+    for (bool padded : {true, false}) {
+        map<string, std::unique_ptr<KVReplica>> replicas;
+        string leader_log = logfile("r1", dir);
+        uint64_t ae_bytes = 0, cmd_bytes = 0, truncated = 0;
+        std::vector<string> bufs;
+        RaftSMOutput output;
+        struct stat st;
+
+        if (make_cluster(replicas, names, dir, output) ||
+            elect(replicas, "r1", output) || !replicas["r1"]->leader()) {
+            cout << "    r1 could not become leader" << endl;
+            return -1;
+        }
+
+        KVReplica *leader = replicas["r1"].get();
+
+        for (uint32_t i = 1; i <= num_entries;) {
+            bufs.clear();
+            for (; i <= num_entries && bufs.size() < 256; i++) {
+                string cmd = dft_command(i);
+
+                cmd_bytes += cmd.size();
+                if (padded) {
+                    /* The fixed size commands had room for 31 characters
+                     * of application name and 30 of IPCP name. */
+                    size_t sep = cmd.find('\0');
+
+                    truncated += sep - 1 > 31 || cmd.size() - sep - 1 > 30;
+                    cmd.resize(kLegacyDFTCommandSize, '\0');
+                }
+                bufs.push_back(std::move(cmd));
+            }
+            if (leader->submit_batch(bufs, nullptr, &output) ||
+                deliver_all(replicas, output, &ae_bytes)) {
+                return -1;
+            }
+        }
+        if (stat(leader_log.c_str(), &st)) {
+            return -1;
+        }
+
+        cout << "    " << (padded ? "64 byte commands" : "variable size")
+             << ": " << (st.st_size - 128) / num_entries
+             << " log bytes/entry, " << ae_bytes / (2 * num_entries)
+             << " AppendEntries bytes/entry per follower";
+        if (padded) {
+            cout << ", " << truncated * 100 / num_entries
+                 << "% commands truncated";
+        } else {
+            cout << ", " << cmd_bytes / num_entries << " command bytes/entry";
+        }
+        cout << endl;
+    }
+
+    return 0;
+}
+
 /*
  * Test vectors for the Raft implementation. A current limitation is that all
  * tests are positive. Each test vector is crafted in such a way that a majority
@@ -662,11 +1795,36 @@ main(int argc, char **argv)
          Fail(1500, F, 7), Fail(1550, L, 8), Respawn(1600, 5),
          Respawn(1600, 6), Respawn(1600, 7), Req(1700),
          Req(1700),        Respawn(1710, 4), Respawn(1710, 8)}};
+    auto usage = []() {
+        cout << "raft-test [-b] [TEST_NUMBER]\n"
+                "          -b run the benchmarks\n"
+                "          -h show this help and exit\n";
+    };
+    const char *tmpdir = getenv("TMPDIR");
+    TempDir dir(tmpdir ? tmpdir : "/tmp");
+    bool benchmarks   = false;
     int test_counter  = 1;
     int test_selector = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hb")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
 
-    if (argc > 1) {
-        test_selector = std::stoi(argv[1]);
+        case 'b':
+            benchmarks = true;
+            break;
+
+        default:
+            usage();
+            return -1;
+        }
+    }
+
+    if (optind < argc) {
+        test_selector = std::stoi(argv[optind]);
         if (test_selector < 1 ||
             test_selector > static_cast<int>(test_vectors.size())) {
             cerr << "Invalid test selector " << test_selector << endl;
@@ -674,14 +1832,37 @@ main(int argc, char **argv)
         }
     }
 
+    if (dir.get().empty()) {
+        cerr << "Failed to create a temporary directory: " << strerror(errno)
+             << endl;
+        return -1;
+    }
+    test_dir = dir.get();
+
     srand(time(0));
 
+    /* Run each test with the default log cache, with a log cache so small
+     * that most of the entries are read from the log file, and with the
+     * replicas taking a snapshot every two entries (so that the followers
+     * that were down get the snapshot from the leader). */
+    const std::vector<std::pair<size_t, LogIndex>> configs = {
+        {RaftSM::kLogCacheEntries, 0}, {2, 0}, {RaftSM::kLogCacheEntries, 2}};
+
     for (const auto &vector : test_vectors) {
         int ret;
 
-        if (test_selector <= 0 || test_selector == test_counter) {
-            ret = run_simulation(vector, ElectionType::Conflicting);
-            cout << "Test #: " << test_counter;
+        for (const auto &config : configs) {
+            if (test_selector > 0 && test_selector != test_counter) {
+                break;
+            }
+            ret = run_simulation(vector, ElectionType::Conflicting,
+                                 config.first, config.second);
+            cout << "Test #: " << test_counter << " (log cache "
+                 << config.first;
+            if (config.second) {
+                cout << ", snapshot every " << config.second << " entries";
+            }
+            cout << ")";
             switch (ret) {
             case -1:
                 cout << ": error occurred" << endl;
@@ -699,5 +1880,54 @@ main(int argc, char **argv)
         ++test_counter;
     }
 
+    if (test_selector <= 0) {
+        /* Conversion of a log written by a previous version. */
+        if (log_migration_test(test_dir, 1000)) {
+            return -1;
+        }
+
+        /* Replication towards followers that are behind. */
+        if (replication_window_test(1000, 64)) {
+            return -1;
+        }
+
+        /* Reads served without writing to the log, under leader
+         * changes. */
+        if (read_linearizability_test()) {
+            return -1;
+        }
+    }
+
+    if (benchmarks) {
+        /* The benchmarks that need a RAM-backed file system use
+         * /dev/shm, if available. */
+        TempDir shm("/dev/shm");
+        const string &ramdir = shm.get().empty() ? test_dir : shm.get();
+
+        /* Throughput of the replication on a RAM-backed file system and
+         * on disk (under TMPDIR). */
+        if ((!shm.get().empty() && wal_benchmark(shm.get(), 4096)) ||
+            wal_benchmark(test_dir, 512)) {
+            return -1;
+        }
+
+        /* Registration throughput and latency against the batch window. */
+        if (batch_window_benchmark(test_dir, 1024, 5000)) {
+            return -1;
+        }
+
+        /* Restart and catch up of a follower on a log with 1M entries,
+         * without and with snapshots. */
+        if (snapshot_benchmark(ramdir, 1000000, 131072, 0) ||
+            snapshot_benchmark(ramdir, 1000000, 131072, 65536)) {
+            return -1;
+        }
+
+        /* Log size and replication bandwidth for a DFT workload. */
+        if (dft_log_benchmark(ramdir, 65536)) {
+            return -1;
+        }
+    }
+
     return 0;
 }
@@ -24,9 +24,15 @@
 #include "rlite/raft.hpp"
 #include <cassert>
 #include <cstring>
+#include <cstddef>
 #include <cstdio>
 #include <cmath>
+#include <climits>
+#include <cerrno>
+#include <algorithm>
+#include <functional>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -39,21 +45,19 @@ namespace raft {
 int
 RaftSM::log_open(bool first_boot)
 {
-    std::ios_base::openmode mode = ios::in | ios::out | ios::binary;
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC;
 
     if (first_boot) {
-        mode |= ios::trunc;
-    } else {
-        mode |= ios::ate;
+        flags |= O_TRUNC;
     }
 
-    if (logfile.is_open()) {
+    if (logfd >= 0) {
         /* The user could call init() multiple times in a raw, e.g. because
          * of crashes or bugs. We need to close the logfile before reopen it. */
-        logfile.close();
+        close(logfd);
     }
-    logfile.open(logfilename, mode);
-    if (logfile.fail()) {
+    logfd = open(logfilename.c_str(), flags, 0644);
+    if (logfd < 0) {
         IOS_ERR() << "Failed to open logfile '" << logfilename
                   << "': " << strerror(errno) << endl;
         return -1;
@@ -77,6 +81,10 @@ RaftSM::init(const list<ReplicaId> peers, RaftSMOutput *out)
     if ((ret = log_open(first_boot))) {
         return ret;
     }
+    if (first_boot) {
+        /* A leftover snapshot would not match the new log. */
+        remove(snapfilename.c_str());
+    }
 
     /* Reset state to default values (useful in case init() is
      * called twice). */
@@ -89,12 +97,20 @@ RaftSM::init(const list<ReplicaId> peers, RaftSMOutput *out)
     last_log_index  = 0;
     last_log_term   = 0;
     votes_collected = 0;
+    log_base        = 0;
+    log_base_term   = 0;
+    snapshot_chunks.clear();
+    snapshot_chunks_index = 0;
+    snapshot_chunks_term  = 0;
+    log_offsets.assign(1, static_cast<uint64_t>(kLogEntriesOfs));
+    log_cache_truncate(0);
 
     if (first_boot) {
         char null[kLogVotedForSize];
 
         /* Initialize the log header. Write an 4 byte magic
-         * number, a 4 bytes current_term and a null voted_for. */
+         * number, a 4 bytes current_term, a null voted_for and
+         * a null snapshot index and term. */
         if ((ret = log_u32_write(kLogMagicOfs, kLogMagicNumber))) {
             return ret;
         }
@@ -105,6 +121,12 @@ RaftSM::init(const list<ReplicaId> peers, RaftSMOutput *out)
         if ((ret = log_buf_write(kLogVotedForOfs, null, kLogVotedForSize))) {
             return ret;
         }
+        if ((ret = log_u32_write(kLogBaseIndexOfs, 0))) {
+            return ret;
+        }
+        if ((ret = log_u32_write(kLogBaseTermOfs, 0))) {
+            return ret;
+        }
         last_log_index = 0;
         if (verbosity >= kVerboseInfo) {
             IOS_INF() << "Raft log initialized on first boot" << endl;
@@ -112,16 +134,16 @@ RaftSM::init(const list<ReplicaId> peers, RaftSMOutput *out)
 
     } else {
         char id_buf[kLogVotedForSize];
-        long log_size;
+        uint32_t magic = 0;
 
-        /* Get pointer is at the end because of ios::ate. We can then compute
-         * the last log entry. */
-        log_size = static_cast<long>(logfile.tellg()) - kLogEntriesOfs;
-        if (log_size < 0 || log_size % log_entry_size != 0) {
-            IOS_ERR() << "Log size " << log_size << " is invalid" << endl;
-            return -1;
+        /* A log with fixed size entries, written by a previous version,
+         * is converted to the current format. */
+        if ((ret = log_u32_read(kLogMagicOfs, &magic))) {
+            return ret;
+        }
+        if (magic == kLogMagicNumberFixed && (ret = log_convert())) {
+            return ret;
         }
-        last_log_index = log_size / log_entry_size;
 
         /* Check the magic number and load current term and current
          * voted candidate. */
@@ -169,6 +191,28 @@ RaftSM::init(const list<ReplicaId> peers, RaftSMOutput *out)
                       << endl;
             return -1;
         }
+
+        /* The log file starts after the entries covered by the snapshot (if
+         * any), which also tells the index of the first entry. */
+        if ((ret = log_u32_read(kLogBaseIndexOfs, &log_base))) {
+            return ret;
+        }
+        if ((ret = log_u32_read(kLogBaseTermOfs, &log_base_term))) {
+            return ret;
+        }
+        /* Find the position of all the entries, and so the last one. */
+        if ((ret = log_scan())) {
+            return ret;
+        }
+        last_log_index = log_base + log_offsets.size() - 1;
+        if ((ret = log_entry_get_term(last_log_index, &last_log_term))) {
+            return -1;
+        }
+
+        /* Restore the replicated state machine from the snapshot. */
+        if ((ret = snapshot_load())) {
+            return ret;
+        }
         if (verbosity >= kVerboseInfo) {
             IOS_INF() << "Raft log recovered" << endl;
         }
@@ -178,7 +222,8 @@ RaftSM::init(const list<ReplicaId> peers, RaftSMOutput *out)
         servers[rid].match_index      = 0;
         servers[rid].next_index_acked = servers[rid].next_index_unacked =
             last_log_index + 1;
-        servers[rid].last_ae_time = std::chrono::system_clock::now();
+        servers[rid].last_ae_time  = clock_now();
+        servers[rid].last_ack_time = servers[rid].last_ae_time;
     }
 
     /* Initialization is complete, we can set the election timer and return to
@@ -197,74 +242,116 @@ RaftSM::shutdown()
         IOS_ERR() << "Failed to remove log file '" << logfilename
                   << "': " << strerror(errno) << endl;
     }
+    if (remove(snapfilename.c_str()) && errno != ENOENT) {
+        IOS_ERR() << "Failed to remove snapshot file '" << snapfilename
+                  << "': " << strerror(errno) << endl;
+    }
 }
 
 RaftSM::~RaftSM()
 {
-    if (logfile.is_open()) {
-        logfile.close();
+    if (logfd >= 0) {
+        close(logfd);
     }
 }
 
 int
-RaftSM::log_disk_flush()
+RaftSM::file_sync(int fd)
 {
     int ret;
-    int fd;
-
-    logfile << std::flush;
-
-    fd = open(logfilename.c_str(), O_APPEND);
-    if (fd < 0) {
-        IOS_ERR() << "Failed to open logfile for disk flush ["
-                  << strerror(errno) << "]" << endl;
-        return fd;
-    }
 
     if ((ret = fdatasync(fd))) {
         IOS_ERR() << "Failed to flush logfile contents to disk ["
                   << strerror(errno) << "]" << endl;
-        close(fd);
         return ret;
     }
-
-    close(fd);
+    stats.log_flushes++;
 
     return 0;
 }
 
 int
-RaftSM::log_u32_write(unsigned long pos, uint32_t val)
+RaftSM::log_disk_flush()
+{
+    return file_sync(logfd);
+}
+
+/* Atomically replace the file 'name' with the (already flushed) file
+ * 'tmpname', and flush the directory to make the rename persistent. */
+int
+RaftSM::file_replace(const string &tmpname, const string &name)
 {
-    logfile.seekp(pos);
-    if (logfile.fail()) {
-        IOS_ERR() << "Failed to seek log at position " << pos << endl;
+    size_t slash = name.rfind('/');
+    string dir   = slash == string::npos ? string(".") : name.substr(0, slash);
+    int dirfd;
+
+    if (rename(tmpname.c_str(), name.c_str())) {
+        IOS_ERR() << "Failed to rename '" << tmpname << "' to '" << name
+                  << "': " << strerror(errno) << endl;
+        remove(tmpname.c_str());
         return -1;
     }
-    logfile.write(reinterpret_cast<const char *>(&val), sizeof(val));
-    if (logfile.fail()) {
-        IOS_ERR() << "Failed to write u32 at position " << pos << endl;
-        return -1;
+
+    /* The rename has happened anyway, so a failure here is reported
+     * but not returned. */
+    dirfd = open(dir.empty() ? "/" : dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (dirfd < 0 || fsync(dirfd)) {
+        IOS_ERR() << "Failed to flush directory '" << dir
+                  << "': " << strerror(errno) << endl;
     }
-    return log_disk_flush();
+    if (dirfd >= 0) {
+        close(dirfd);
+    }
+
+    return 0;
 }
 
+/* Write the buffers described by 'iov' at position 'pos' of the file
+ * (the log or a file that will replace it), without flushing. The iovec
+ * array may be modified. */
 int
-RaftSM::log_u32_read(unsigned long pos, uint32_t *val)
+RaftSM::log_writev(int fd, unsigned long pos, struct iovec *iov, int iovcnt)
 {
-    logfile.seekg(pos);
-    if (logfile.fail() || logfile.eof()) {
-        IOS_ERR() << "Failed to seek log at position " << pos << endl;
-        return -1;
-    }
-    logfile.read(reinterpret_cast<char *>(val), sizeof(*val));
-    if (logfile.fail() || logfile.eof()) {
-        IOS_ERR() << "Failed to read u32 at position " << pos << endl;
-        return -1;
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(fd, iov, std::min(iovcnt, IOV_MAX), pos);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            IOS_ERR() << "Failed to write log at position " << pos << " ["
+                      << strerror(errno) << "]" << endl;
+            return -1;
+        }
+        pos += n;
+
+        /* Skip what has been written, handling short writes. */
+        for (; iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len;
+             iov++, iovcnt--) {
+            n -= iov->iov_len;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
     }
+
     return 0;
 }
 
+int
+RaftSM::log_u32_write(unsigned long pos, uint32_t val)
+{
+    return log_buf_write(pos, reinterpret_cast<const char *>(&val),
+                         sizeof(val));
+}
+
+int
+RaftSM::log_u32_read(unsigned long pos, uint32_t *val)
+{
+    return log_buf_read(pos, reinterpret_cast<char *>(val), sizeof(*val));
+}
+
 int
 RaftSM::magic_check()
 {
@@ -276,37 +363,296 @@ RaftSM::magic_check()
     return (magic != kLogMagicNumber) ? -1 : 0;
 }
 
+/* CRC-32C (Castagnoli) of a buffer, continuing from 'crc'. */
+static uint32_t
+crc32c(uint32_t crc, const char *buf, size_t len)
+{
+    static const std::vector<uint32_t> table = []() {
+        std::vector<uint32_t> t(256);
+
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82f63b78U : (c >> 1);
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    while (len--) {
+        crc = table[(crc ^ static_cast<uint8_t>(*buf++)) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+uint32_t
+RaftSM::log_record_checksum(const LogRecordHeader &hdr, const char *command)
+{
+    LogRecordHeader h = hdr;
+
+    h.checksum     = 0;
+    h.hdr_checksum = 0;
+    return crc32c(crc32c(0, reinterpret_cast<const char *>(&h), sizeof(h)),
+                  command, hdr.length);
+}
+
+uint32_t
+RaftSM::log_header_checksum(const LogRecordHeader &hdr)
+{
+    return crc32c(0, reinterpret_cast<const char *>(&hdr),
+                  offsetof(LogRecordHeader, hdr_checksum));
+}
+
+/* Look for a complete record with a valid header starting anywhere after
+ * 'pos'. Returns 1 if there is one, 0 if there is none, -1 on error. */
 int
-RaftSM::log_buf_write(unsigned long pos, const char *buf, size_t len)
+RaftSM::log_valid_record_after(uint64_t pos, uint64_t size)
+{
+    std::vector<char> buf(kLogScanChunkBytes + sizeof(LogRecordHeader));
+
+    for (pos++; size - pos >= sizeof(LogRecordHeader);) {
+        size_t n = std::min<uint64_t>(buf.size(), size - pos);
+        size_t i;
+
+        if (log_buf_read(pos, buf.data(), n)) {
+            return -1;
+        }
+        for (i = 0; i + sizeof(LogRecordHeader) <= n; i++) {
+            LogRecordHeader hdr;
+
+            memcpy(&hdr, buf.data() + i, sizeof(hdr));
+            if (log_header_checksum(hdr) == hdr.hdr_checksum &&
+                pos + i + sizeof(hdr) + hdr.length <= size) {
+                return 1;
+            }
+        }
+        pos += i;
+    }
+
+    return 0;
+}
+
+/* Read the whole log to find the position of each entry. A partially
+ * written entry at the end of the log (because of a crash during an
+ * append) is discarded, while a corrupted entry in the middle of the
+ * log is an error. An entry with a corrupted header is only considered
+ * partially written if no valid entry follows it. */
+int
+RaftSM::log_scan()
 {
-    logfile.seekp(pos);
-    if (logfile.fail()) {
-        IOS_ERR() << "Failed to seek log at position " << pos << endl;
+    std::vector<char> buf;
+    uint64_t buf_pos = 0; /* position of buf[0] in the log */
+    uint64_t pos     = kLogEntriesOfs;
+    uint64_t size;
+    struct stat st;
+
+    if (fstat(logfd, &st)) {
+        IOS_ERR() << "Failed to stat logfile '" << logfilename
+                  << "': " << strerror(errno) << endl;
         return -1;
     }
-    logfile.write(buf, len);
-    if (logfile.fail()) {
-        IOS_ERR() << "Failed to write " << len << " bytes at position " << pos
-                  << endl;
+    size = st.st_size;
+    if (size < kLogEntriesOfs) {
+        IOS_ERR() << "Log size " << size << " is invalid" << endl;
         return -1;
     }
-    return log_disk_flush();
+
+    /* Load in 'buf' at least 'len' bytes starting from 'pos'. */
+    auto buf_fill = [&](uint64_t len) -> int {
+        if (pos + len <= buf_pos + buf.size()) {
+            return 0;
+        }
+        buf_pos = pos;
+        len = std::max(len, static_cast<uint64_t>(kLogScanChunkBytes));
+        buf.resize(std::min(len, size - pos));
+        return log_buf_read(pos, buf.data(), buf.size());
+    };
+
+    log_offsets.assign(1, pos);
+    while (size - pos >= sizeof(LogRecordHeader)) {
+        LogRecordHeader hdr;
+        uint64_t end;
+
+        if (buf_fill(sizeof(hdr))) {
+            return -1;
+        }
+        memcpy(&hdr, buf.data() + (pos - buf_pos), sizeof(hdr));
+        if (log_header_checksum(hdr) != hdr.hdr_checksum) {
+            int ret = log_valid_record_after(pos, size);
+
+            if (ret < 0) {
+                return -1;
+            }
+            if (ret > 0) {
+                IOS_ERR() << "Log entry " << log_base + log_offsets.size()
+                          << " is corrupted" << endl;
+                return -1;
+            }
+            break;
+        }
+        end = pos + sizeof(hdr) + hdr.length;
+        if (end > size) {
+            break;
+        }
+        if (buf_fill(end - pos)) {
+            return -1;
+        }
+        if (log_record_checksum(hdr, buf.data() + (pos - buf_pos) +
+                                         sizeof(hdr)) != hdr.checksum) {
+            if (end < size) {
+                IOS_ERR() << "Log entry " << log_base + log_offsets.size()
+                          << " is corrupted" << endl;
+                return -1;
+            }
+            break;
+        }
+        pos = end;
+        log_offsets.push_back(pos);
+    }
+
+    if (pos < size) {
+        IOS_INF() << "Discarding " << size - pos
+                  << " bytes of a partially written log entry" << endl;
+        if (ftruncate(logfd, pos)) {
+            IOS_ERR() << "Failed to truncate log to " << pos
+                      << " bytes: " << strerror(errno) << endl;
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
+/* Convert a log written by a previous version, where each entry was
+ * made of the term followed by a command of legacy_command_size bytes.
+ * The converted log atomically replaces the old one. */
 int
-RaftSM::log_buf_read(unsigned long pos, char *buf, size_t len)
+RaftSM::log_convert()
 {
-    logfile.seekg(pos);
-    if (logfile.fail() || logfile.eof()) {
-        IOS_ERR() << "Failed to seek log at position " << pos << endl;
+    const size_t entry_size = sizeof(Term) + legacy_command_size;
+    const size_t chunk_entries =
+        std::max<size_t>(1, kLogScanChunkBytes / entry_size);
+    string tmpname = logfilename + ".tmp";
+    char header[kLogEntriesOfs];
+    uint32_t magic = kLogMagicNumber;
+    uint64_t num_entries;
+    uint64_t wpos;
+    std::vector<char> in;
+    std::string out;
+    struct stat st;
+    int fd;
+    int ret = 0;
+
+    if (fstat(logfd, &st)) {
+        IOS_ERR() << "Failed to stat logfile '" << logfilename
+                  << "': " << strerror(errno) << endl;
+        return -1;
+    }
+    if (legacy_command_size == 0 ||
+        static_cast<uint64_t>(st.st_size) < kLogEntriesOfs ||
+        (st.st_size - kLogEntriesOfs) % entry_size != 0) {
+        IOS_ERR() << "Cannot convert log with fixed size entries (size "
+                  << st.st_size << ")" << endl;
         return -1;
     }
-    logfile.read(buf, len);
-    if (logfile.fail() || logfile.eof()) {
-        IOS_ERR() << "Failed to read " << len << " bytes at position " << pos
+    num_entries = (st.st_size - kLogEntriesOfs) / entry_size;
+
+    /* Same header, with the new magic number. */
+    if ((ret = log_buf_read(0, header, sizeof(header)))) {
+        return ret;
+    }
+    memcpy(header + kLogMagicOfs, &magic, sizeof(magic));
+
+    fd = open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        IOS_ERR() << "Failed to open '" << tmpname << "': " << strerror(errno)
                   << endl;
         return -1;
     }
+    out.assign(header, sizeof(header));
+    in.resize(chunk_entries * entry_size);
+    wpos = 0;
+    for (uint64_t i = 0; !ret && (i < num_entries || !out.empty());) {
+        size_t n = std::min<uint64_t>(chunk_entries, num_entries - i);
+        struct iovec iov;
+
+        if (n > 0) {
+            ret = log_buf_read(kLogEntriesOfs + i * entry_size, in.data(),
+                               n * entry_size);
+        }
+        for (size_t j = 0; !ret && j < n; j++) {
+            const char *entry = in.data() + j * entry_size;
+            LogRecordHeader hdr;
+
+            memcpy(&hdr.term, entry, sizeof(Term));
+            hdr.length       = static_cast<uint32_t>(legacy_command_size);
+            hdr.checksum     = log_record_checksum(hdr, entry + sizeof(Term));
+            hdr.hdr_checksum = log_header_checksum(hdr);
+            out.append(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+            out.append(entry + sizeof(Term), legacy_command_size);
+        }
+        iov.iov_base = const_cast<char *>(out.data());
+        iov.iov_len  = out.size();
+        if (!ret) {
+            ret = log_writev(fd, wpos, &iov, 1);
+        }
+        wpos += out.size();
+        out.clear();
+        i += n;
+    }
+    if (ret || (ret = file_sync(fd)) ||
+        (ret = file_replace(tmpname, logfilename))) {
+        close(fd);
+        remove(tmpname.c_str());
+        return ret;
+    }
+    close(logfd);
+    logfd = fd;
+
+    if (verbosity >= kVerboseInfo) {
+        IOS_INF() << "Log with fixed size entries converted (" << num_entries
+                  << " entries)" << endl;
+    }
+
+    return 0;
+}
+
+int
+RaftSM::log_buf_write(unsigned long pos, const char *buf, size_t len)
+{
+    struct iovec iov;
+    int ret;
+
+    iov.iov_base = const_cast<char *>(buf);
+    iov.iov_len  = len;
+    if ((ret = log_writev(logfd, pos, &iov, 1))) {
+        return ret;
+    }
+    return log_disk_flush();
+}
+
+int
+RaftSM::log_buf_read(unsigned long pos, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = pread(logfd, buf, len, pos);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            IOS_ERR() << "Failed to read " << len << " bytes at position "
+                      << pos << endl;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        pos += n;
+    }
     return 0;
 }
 
@@ -429,6 +775,7 @@ RaftSM::catch_up_term(Term term, RaftSMOutput *out)
     if ((ret = log_u32_write(kLogCurrentTermOfs, current_term))) {
         return ret;
     }
+    reads_fail(out);
     if ((ret = back_to_follower(out))) {
         return ret;
     }
@@ -436,31 +783,141 @@ RaftSM::catch_up_term(Term term, RaftSMOutput *out)
     return 1;
 }
 
+const RaftSM::LogCacheSlot *
+RaftSM::log_cache_lookup(LogIndex index)
+{
+    if (!log_cache.empty()) {
+        const LogCacheSlot &slot = log_cache[index % log_cache.size()];
+
+        if (slot.index == index) {
+            stats.log_cache_hits++;
+            return &slot;
+        }
+    }
+    stats.log_cache_misses++;
+
+    return nullptr;
+}
+
+void
+RaftSM::log_cache_insert(LogIndex index, Term term, LogCommand command)
+{
+    if (log_cache.empty()) {
+        return;
+    }
+
+    LogCacheSlot &slot = log_cache[index % log_cache.size()];
+
+    slot.index   = index;
+    slot.term    = term;
+    slot.command = std::move(command);
+}
+
+/* Drop the cached entries that follow 'index'. */
+void
+RaftSM::log_cache_truncate(LogIndex index)
+{
+    for (LogCacheSlot &slot : log_cache) {
+        if (slot.index > index) {
+            slot = LogCacheSlot();
+        }
+    }
+}
+
+/* Position of a log entry in the log file. */
+unsigned long
+RaftSM::log_entry_pos(LogIndex index) const
+{
+    assert(index > log_base && index <= last_log_index + 1);
+    return log_offsets[index - 1 - log_base];
+}
+
 int
 RaftSM::log_entry_get_term(LogIndex index, Term *term)
 {
-    if (index == 0) {
-        *term = 0;
+    if (index == log_base) {
+        /* This is also the case of index 0. */
+        *term = log_base_term;
         return 0;
     }
 
-    if (index > last_log_index) {
+    if (index < log_base || index > last_log_index) {
         return 1; /* no such entry */
     }
 
-    return log_u32_read(kLogEntriesOfs + (index - 1) * log_entry_size, term);
+    if (const LogCacheSlot *slot = log_cache_lookup(index)) {
+        *term = slot->term;
+        return 0;
+    }
+
+    return log_u32_read(log_entry_pos(index) + offsetof(LogRecordHeader, term),
+                        term);
 }
 
+/* Get the term and the command of a log entry. The command is shared with
+ * the log cache, if the entry is there. */
 int
-RaftSM::log_entry_get_command(LogIndex index, char *const serbuf)
+RaftSM::log_entry_get(LogIndex index, Term *term, LogCommand *command)
 {
-    if (index == 0 || index > last_log_index) {
+    int ret;
+
+    if (index <= log_base || index > last_log_index) {
         return 1; /* no such entry */
     }
 
-    return log_buf_read(
-        kLogEntriesOfs + (index - 1) * log_entry_size + sizeof(Term), serbuf,
-        log_command_size);
+    if (const LogCacheSlot *slot = log_cache_lookup(index)) {
+        *term    = slot->term;
+        *command = slot->command;
+        return 0;
+    }
+
+    /* Read the whole entry at once, and verify it. */
+    unsigned long pos = log_entry_pos(index);
+    std::vector<char> buf(log_entry_pos(index + 1) - pos);
+    LogRecordHeader hdr;
+
+    if ((ret = log_buf_read(pos, buf.data(), buf.size()))) {
+        return ret;
+    }
+    memcpy(&hdr, buf.data(), sizeof(hdr));
+    if (hdr.length != buf.size() - sizeof(hdr) ||
+        hdr.hdr_checksum != log_header_checksum(hdr) ||
+        hdr.checksum != log_record_checksum(hdr, buf.data() + sizeof(hdr))) {
+        IOS_ERR() << "Log entry " << index << " is corrupted" << endl;
+        return -1;
+    }
+    *term    = hdr.term;
+    *command = std::make_shared<const std::string>(buf.data() + sizeof(hdr),
+                                                    hdr.length);
+
+    return 0;
+}
+
+/* Find the first entry in the interval (log_base, hi] whose term is not
+ * smaller than 'term', or hi + 1 if there is none. The terms of the log
+ * entries do not decrease, so a binary search is enough. */
+int
+RaftSM::log_term_search(Term term, LogIndex hi, LogIndex *index)
+{
+    LogIndex lo = log_base + 1;
+
+    assert(hi <= last_log_index);
+    for (hi++; lo < hi;) {
+        LogIndex mid = lo + (hi - lo) / 2;
+        Term mid_term;
+
+        if (log_entry_get_term(mid, &mid_term)) {
+            return -1;
+        }
+        if (mid_term >= term) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    *index = lo;
+
+    return 0;
 }
 
 /* Prepare a RaftAppendEntries for each follower. If there are no log entries
@@ -469,62 +926,44 @@ RaftSM::log_entry_get_command(LogIndex index, char *const serbuf)
  * The 'strategy' argument defines which entries are sent to each peer:
  *   - If LogReplicateStrategy::Unacked, all the log entries that are
  *     currently unacked are selected (both the ones yet to be sent and the
- *     ones already sent but yet unacked). This strategy is used to implement
- *     retransmissions.
+ *     ones already sent but yet unacked), if the retransmission timeout
+ *     expired. This strategy is used to implement retransmissions.
  *   - If LogReplicateStrategy::Unsent, only the log entries that have
  *     not been sent yet are selected. This enables pipelining of client
  *     submissions.
+ * In both cases, the entries in flight towards a follower are limited by
+ * the replication window.
  *
  *      <===Acked===><===Sent-but-unacked===><===Yet-to-be-sent===>
  * */
 int
 RaftSM::prepare_append_entries(LogReplicateStrategy strategy, RaftSMOutput *out)
 {
-    auto now = std::chrono::system_clock::now();
+    auto now = clock_now();
+
+    if (read_rounds_wanted()) {
+        /* Start a new round of leadership confirmation. */
+        read_rounds.push_back(std::make_pair(++read_seq, now));
+        if (read_rounds.size() > kReadRoundsMax) {
+            read_rounds.pop_front();
+        }
+    }
 
     for (auto &kv : servers) {
+        int ret;
+
         if (strategy == LogReplicateStrategy::Unacked &&
+            kv.second.next_index_unacked > kv.second.next_index_acked &&
             now >= kv.second.last_ae_time + RtxTimeout) {
             kv.second.next_index_unacked = kv.second.next_index_acked;
-            if (kv.second.next_index_unacked < last_log_index) {
-                IOS_INF() << "Retransmitting to " << kv.first << endl;
-            }
+            kv.second.retransmissions++;
+            IOS_INF() << "Retransmitting to " << kv.first << endl;
         }
 
-        do {
-            auto msg            = utils::make_unique<RaftAppendEntries>();
-            msg->term           = current_term;
-            msg->leader_id      = local_id;
-            msg->leader_commit  = commit_index;
-            msg->prev_log_index = kv.second.next_index_unacked - 1;
-            if (log_entry_get_term(msg->prev_log_index, &msg->prev_log_term)) {
-                return -1;
-            }
-
-            LogIndex i = kv.second.next_index_unacked;
-            for (size_t chunk_bytes = 0;
-                 i <= last_log_index && chunk_bytes <= kMaxLogChunkBytes; i++) {
-                auto bufcopy =
-                    std::unique_ptr<char[]>(new char[log_command_size]);
-                Term term = 0;
-                int ret;
-
-                if ((ret = log_entry_get_term(i, &term))) {
-                    return ret;
-                }
-                if ((ret = log_entry_get_command(i, bufcopy.get()))) {
-                    return ret;
-                }
-                chunk_bytes += log_entry_size;
-                msg->entries.push_back(
-                    std::make_pair(term, std::move(bufcopy)));
-            }
-            kv.second.next_index_unacked = i;
-            if (!msg->entries.empty()) {
-                kv.second.last_ae_time = now;
-            }
-            out->output_messages.push_back(make_pair(kv.first, std::move(msg)));
-        } while (kv.second.next_index_unacked < last_log_index);
+        if ((ret = replicate_to(kv.first, kv.second, /*heartbeat=*/true,
+                                out))) {
+            return ret;
+        }
     }
 
     out->timer_commands.push_back(RaftTimerCmd(this, RaftTimerType::HeartBeat,
@@ -533,62 +972,195 @@ RaftSM::prepare_append_entries(LogReplicateStrategy strategy, RaftSMOutput *out)
     return 0;
 }
 
-/* Append a new entry to the end of our log, and updates last log index. */
+/* Prepare the RaftAppendEntries messages that carry to a follower the
+ * entries not sent yet, as long as they fit in its replication window.
+ * If 'heartbeat' is true, a message is prepared even if there are no
+ * entries to be sent. */
 int
-RaftSM::append_log_entry(const Term term, const char *serbuf)
+RaftSM::replicate_to(const ReplicaId &id, Server &follower, bool heartbeat,
+                     RaftSMOutput *out)
 {
-    LogIndex new_index      = last_log_index + 1;
-    unsigned long entry_pos = kLogEntriesOfs + (new_index - 1) * log_entry_size;
-    int ret                 = 0;
+    auto now = clock_now();
 
-    /* First write the current term. */
-    if ((ret = log_u32_write(entry_pos, term))) {
-        return ret;
-    }
+    if (follower.next_index_unacked <= log_base) {
+        /* The follower needs entries that are not in the log anymore,
+         * send the snapshot and continue with the entries that follow
+         * it. */
+        int ret;
 
-    /* Second, serialize the log entry and write the serialized content. */
-    if ((ret = log_buf_write(entry_pos + sizeof(Term), serbuf,
-                             log_command_size))) {
-        return ret;
+        if ((ret = prepare_install_snapshot(id, out))) {
+            return ret;
+        }
+        follower.next_index_unacked = log_base + 1;
+        follower.last_ae_time       = now;
     }
 
-    /* Update our last log index and term. */
-    last_log_index = new_index;
-    last_log_term  = term;
+    do {
+        if (!heartbeat && follower.next_index_unacked -
+                                  follower.next_index_acked >=
+                              replication_window) {
+            break; /* the window is full */
+        }
 
-    if (verbosity >= kVerboseInfo) {
-        IOS_INF() << "Append log entry term=" << last_log_term
-                  << ", index=" << last_log_index << endl;
+        auto msg            = utils::make_unique<RaftAppendEntries>();
+        msg->term           = current_term;
+        msg->leader_id      = local_id;
+        msg->leader_commit  = commit_index;
+        msg->prev_log_index = follower.next_index_unacked - 1;
+        msg->read_seq       = read_rounds_wanted() ? read_seq : 0;
+        follower.commit_sent = commit_index;
+        if (log_entry_get_term(msg->prev_log_index, &msg->prev_log_term)) {
+            return -1;
+        }
+
+        LogIndex i = follower.next_index_unacked;
+        for (size_t chunk_bytes = 0;
+             i <= last_log_index && chunk_bytes <= kMaxLogChunkBytes &&
+             i - follower.next_index_acked < replication_window;
+             i++) {
+            LogCommand command;
+            Term term = 0;
+            int ret;
+
+            if ((ret = log_entry_get(i, &term, &command))) {
+                return ret;
+            }
+            chunk_bytes += sizeof(Term) + command->size();
+            msg->entries.push_back(std::make_pair(term, std::move(command)));
+        }
+        if (!msg->entries.empty() &&
+            follower.next_index_unacked == follower.next_index_acked) {
+            /* Nothing was in flight. */
+            follower.last_ae_time = now;
+        }
+        follower.next_index_unacked = i;
+        out->output_messages.push_back(make_pair(id, std::move(msg)));
+        heartbeat = false;
+    } while (follower.next_index_unacked <= last_log_index);
+
+    return 0;
+}
+
+/* Prepare the RaftInstallSnapshot messages that carry the current snapshot
+ * to a follower. */
+int
+RaftSM::prepare_install_snapshot(const ReplicaId &follower, RaftSMOutput *out)
+{
+    string data;
+    LogIndex index;
+    Term term;
+    size_t ofs = 0;
+
+    if (snapshot_read(&index, &term, &data)) {
+        IOS_ERR() << "Cannot read the snapshot for " << follower << endl;
+        return -1;
     }
 
-    return ret;
+    do {
+        auto msg                 = utils::make_unique<RaftInstallSnapshot>();
+        msg->term                = current_term;
+        msg->leader_id           = local_id;
+        msg->last_included_index = index;
+        msg->last_included_term  = term;
+        msg->offset              = ofs;
+        msg->data                = data.substr(ofs, kMaxSnapshotChunkBytes);
+        ofs += msg->data.size();
+        msg->done = ofs >= data.size();
+        out->output_messages.push_back(make_pair(follower, std::move(msg)));
+    } while (ofs < data.size());
+
+    if (verbosity >= kVerboseInfo) {
+        IOS_INF() << "Sending snapshot (last index " << index << ", "
+                  << data.size() << " bytes) to " << follower << endl;
+    }
+
+    return 0;
 }
 
+/* Append new entries to the end of our log, and update last log index.
+ * The whole batch is written with a single system call and a single disk
+ * flush (group commit). */
 int
-RaftSM::apply_committed_entries()
+RaftSM::append_log_entries(
+    const std::vector<std::pair<Term, LogCommand>> &entries)
 {
-    std::unique_ptr<char[]> serbuf;
+    unsigned long pos = log_entry_pos(last_log_index + 1);
+    std::vector<struct iovec> iov(2 * entries.size());
+    std::vector<LogRecordHeader> hdrs(entries.size());
+    int ret;
+
+    if (entries.empty()) {
+        return 0;
+    }
+
+    /* Each entry is made of the header followed by the serialized
+     * command. */
+    for (size_t i = 0; i < entries.size(); i++) {
+        const std::string &command = *entries[i].second;
 
+        hdrs[i].length          = static_cast<uint32_t>(command.size());
+        hdrs[i].term            = entries[i].first;
+        hdrs[i].checksum        = log_record_checksum(hdrs[i], command.data());
+        hdrs[i].hdr_checksum    = log_header_checksum(hdrs[i]);
+        iov[2 * i].iov_base     = &hdrs[i];
+        iov[2 * i].iov_len      = sizeof(LogRecordHeader);
+        iov[2 * i + 1].iov_base = const_cast<char *>(command.data());
+        iov[2 * i + 1].iov_len  = command.size();
+    }
+
+    if ((ret = log_writev(logfd, pos, iov.data(),
+                          static_cast<int>(iov.size())))) {
+        return ret;
+    }
+    if ((ret = log_disk_flush())) {
+        return ret;
+    }
+    stats.log_entries_written += entries.size();
+    for (size_t i = 0; i < entries.size(); i++) {
+        pos += sizeof(LogRecordHeader) + hdrs[i].length;
+        stats.log_bytes_written += sizeof(LogRecordHeader) + hdrs[i].length;
+        log_offsets.push_back(pos);
+        log_cache_insert(last_log_index + 1 + i, entries[i].first,
+                         entries[i].second);
+    }
+
+    /* Update our last log index and term. */
+    last_log_index += entries.size();
+    last_log_term = entries.back().first;
+
+    if (verbosity >= kVerboseInfo) {
+        IOS_INF() << "Append " << entries.size()
+                  << " log entries term=" << last_log_term
+                  << ", last index=" << last_log_index << endl;
+    }
+
+    return 0;
+}
+
+int
+RaftSM::apply_committed_entries()
+{
     for (; last_applied < commit_index; last_applied++) {
         LogIndex next = last_applied + 1;
+        LogCommand command;
         Term term;
-        int ret;
 
-        if (log_entry_get_term(next, &term) != 0) {
+        if (log_entry_get(next, &term, &command) != 0) {
             return -1;
         }
-        if (!serbuf) {
-            serbuf = std::unique_ptr<char[]>(new char[log_command_size]);
+        if (!command->empty()) {
+            apply(next, term, *command);
         }
-        if ((ret = log_entry_get_command(next, serbuf.get()))) {
-            return ret;
-        }
-        apply(next, term, serbuf.get());
         if (verbosity >= kVerboseInfo) {
             IOS_INF() << "Entry " << next << " applied" << endl;
         }
     }
 
+    if (snapshot_threshold > 0 &&
+        last_applied - log_base >= snapshot_threshold) {
+        return take_snapshot();
+    }
+
     return 0;
 }
 
@@ -596,18 +1168,16 @@ RaftSM::apply_committed_entries()
 int
 RaftSM::log_truncate(LogIndex index)
 {
-    assert(index <= last_log_index);
+    assert(index >= log_base && index <= last_log_index);
     if (index == last_log_index) {
         return 0; /* nothing to do */
     }
-    /* Close the log file, truncate it and reopen. */
-    logfile.close();
-    if (truncate(logfilename.c_str(),
-                 kLogEntriesOfs + log_entry_size * index)) {
+    if (ftruncate(logfd, log_entry_pos(index + 1))) {
         IOS_ERR() << "Failed to truncate log from " << last_log_index
                   << " entries to " << index << " entries" << endl;
         return -1;
     }
+    log_offsets.resize(index - log_base + 1);
 
     if (verbosity >= kVerboseInfo) {
         IOS_INF() << "Log truncated: " << last_log_index << " entries --> "
@@ -615,8 +1185,258 @@ RaftSM::log_truncate(LogIndex index)
     }
     stats.discarded += last_log_index - index;
     last_log_index = index;
+    log_cache_truncate(index);
+    log_entry_get_term(last_log_index, &last_log_term);
+
+    return 0;
+}
+
+/* Drop from the log the entries up to 'index' (included), which are
+ * covered by a snapshot whose last entry has term 'term'. The entries
+ * that follow are kept if the log agrees with the snapshot on the entry
+ * 'index', otherwise the whole log is discarded. The log file is
+ * rewritten, so that the disk space is released, and it atomically
+ * replaces the old one. */
+int
+RaftSM::log_compact(LogIndex index, Term term)
+{
+    string tmpname = logfilename + ".tmp";
+    char header[kLogEntriesOfs];
+    std::vector<char> suffix;
+    std::vector<uint64_t> offsets(1, static_cast<uint64_t>(kLogEntriesOfs));
+    struct iovec iov[2];
+    Term index_term = 0;
+    int fd;
+    int ret;
+
+    if (index <= log_base) {
+        return 0; /* nothing to do */
+    }
 
-    return log_open(/*first_boot=*/false);
+    if (index > last_log_index || log_entry_get_term(index, &index_term) ||
+        index_term != term) {
+        if ((ret = log_truncate(log_base))) {
+            return ret;
+        }
+    } else if (index < last_log_index) {
+        unsigned long start = log_entry_pos(index + 1);
+
+        suffix.resize(log_offsets.back() - start);
+        if ((ret = log_buf_read(start, suffix.data(), suffix.size()))) {
+            return ret;
+        }
+        /* The entries kept move right after the header. */
+        offsets.assign(log_offsets.begin() + (index - log_base),
+                       log_offsets.end());
+        for (uint64_t &ofs : offsets) {
+            ofs = ofs - start + kLogEntriesOfs;
+        }
+    }
+
+    /* Same header as the current log, except for the snapshot index
+     * and term. */
+    if ((ret = log_buf_read(0, header, sizeof(header)))) {
+        return ret;
+    }
+    memcpy(header + kLogBaseIndexOfs, &index, sizeof(index));
+    memcpy(header + kLogBaseTermOfs, &term, sizeof(term));
+
+    fd = open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        IOS_ERR() << "Failed to open '" << tmpname << "': " << strerror(errno)
+                  << endl;
+        return -1;
+    }
+    iov[0].iov_base = header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = suffix.data();
+    iov[1].iov_len  = suffix.size();
+    if ((ret = log_writev(fd, 0, iov, 2)) || (ret = file_sync(fd)) ||
+        (ret = file_replace(tmpname, logfilename))) {
+        close(fd);
+        remove(tmpname.c_str());
+        return ret;
+    }
+    close(logfd);
+    logfd = fd;
+    log_offsets.swap(offsets);
+
+    if (verbosity >= kVerboseInfo) {
+        IOS_INF() << "Log compacted: entries " << log_base + 1 << "-" << index
+                  << " dropped, " << log_offsets.size() - 1
+                  << " entries left" << endl;
+    }
+    log_base      = index;
+    log_base_term = term;
+    if (last_log_index < index) {
+        last_log_index = index;
+        last_log_term  = term;
+    }
+
+    return 0;
+}
+
+/* Write the snapshot file, made of a 16 bytes header (magic number, index
+ * and term of the last entry covered, size of the state) followed by the
+ * serialized state of the replicated state machine. The new snapshot
+ * atomically replaces the old one. */
+int
+RaftSM::snapshot_write(LogIndex index, Term term, const string &data)
+{
+    string tmpname  = snapfilename + ".tmp";
+    uint32_t hdr[4] = {kSnapshotMagicNumber, index, term,
+                       static_cast<uint32_t>(data.size())};
+    struct iovec iov[2];
+    int fd;
+    int ret;
+
+    fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        IOS_ERR() << "Failed to open '" << tmpname << "': " << strerror(errno)
+                  << endl;
+        return -1;
+    }
+    iov[0].iov_base = hdr;
+    iov[0].iov_len  = sizeof(hdr);
+    iov[1].iov_base = const_cast<char *>(data.data());
+    iov[1].iov_len  = data.size();
+    ret             = log_writev(fd, 0, iov, 2);
+    if (!ret) {
+        ret = file_sync(fd);
+    }
+    close(fd);
+    if (ret) {
+        remove(tmpname.c_str());
+        return ret;
+    }
+
+    return file_replace(tmpname, snapfilename);
+}
+
+/* Read the snapshot file. Returns 1 if there is no snapshot. */
+int
+RaftSM::snapshot_read(LogIndex *index, Term *term, string *data)
+{
+    ifstream fin(snapfilename, ios::binary);
+    uint32_t hdr[4];
+
+    if (!fin.good()) {
+        return 1;
+    }
+    fin.read(reinterpret_cast<char *>(hdr), sizeof(hdr));
+    if (!fin || hdr[0] != kSnapshotMagicNumber) {
+        IOS_ERR() << "Snapshot content is corrupted or invalid" << endl;
+        return -1;
+    }
+    data->resize(hdr[3]);
+    fin.read(&(*data)[0], data->size());
+    if (!fin) {
+        IOS_ERR() << "Snapshot is truncated" << endl;
+        return -1;
+    }
+    *index = hdr[1];
+    *term  = hdr[2];
+
+    return 0;
+}
+
+/* Restore the replicated state machine from the snapshot file on boot. */
+int
+RaftSM::snapshot_load()
+{
+    string data;
+    LogIndex index;
+    Term term;
+    int ret;
+
+    if ((ret = snapshot_read(&index, &term, &data)) < 0) {
+        return ret;
+    }
+    if (ret > 0) {
+        if (log_base > 0) {
+            IOS_ERR() << "Snapshot file '" << snapfilename << "' is missing"
+                      << endl;
+            return -1;
+        }
+        return 0; /* no snapshot */
+    }
+    if (index < log_base) {
+        IOS_ERR() << "Snapshot is older than the log" << endl;
+        return -1;
+    }
+    if (snapshot_restore(data)) {
+        IOS_ERR() << "Failed to restore the snapshot" << endl;
+        return -1;
+    }
+    commit_index = last_applied = index;
+    if (verbosity >= kVerboseInfo) {
+        IOS_INF() << "Snapshot recovered, last index " << index << endl;
+    }
+
+    /* The log may still contain the entries covered by the snapshot, if
+     * we crashed before compacting it. */
+    return log_compact(index, term);
+}
+
+int
+RaftSM::take_snapshot()
+{
+    string data;
+    Term term;
+    int ret;
+
+    if (last_applied <= log_base) {
+        return 0; /* nothing to do */
+    }
+    if (snapshot_serialize(data)) {
+        IOS_ERR() << "Snapshots are not supported" << endl;
+        return -1;
+    }
+    if (log_entry_get_term(last_applied, &term)) {
+        return -1;
+    }
+    if ((ret = snapshot_write(last_applied, term, data))) {
+        return ret;
+    }
+    if ((ret = log_compact(last_applied, term))) {
+        return ret;
+    }
+    stats.snapshots_taken++;
+    if (verbosity >= kVerboseInfo) {
+        IOS_INF() << "Snapshot taken, last index " << last_applied << ", "
+                  << data.size() << " bytes" << endl;
+    }
+
+    return 0;
+}
+
+/* Replace the state of the replicated state machine with a snapshot
+ * received from the leader. */
+int
+RaftSM::install_snapshot(LogIndex index, Term term, const string &data)
+{
+    int ret;
+
+    if (snapshot_restore(data)) {
+        IOS_ERR() << "Failed to restore the snapshot" << endl;
+        return -1;
+    }
+    if ((ret = snapshot_write(index, term, data))) {
+        return ret;
+    }
+    if ((ret = log_compact(index, term))) {
+        return ret;
+    }
+    commit_index = std::max(commit_index, index);
+    last_applied = index;
+    stats.snapshots_installed++;
+    if (verbosity >= kVerboseInfo) {
+        IOS_INF() << "Snapshot installed, last index " << index << endl;
+    }
+
+    /* Entries that follow the snapshot may be already committed, if the
+     * log was kept. */
+    return apply_committed_entries();
 }
 
 int
@@ -636,6 +1456,20 @@ RaftSM::request_vote_input(const RaftRequestVote &msg, RaftSMOutput *out)
                   << ", last_log_index=" << msg.last_log_index << ")" << endl;
     }
 
+    if (ReadLease.count() > 0 && msg.term > current_term &&
+        (lease_holding() ||
+         (!leader_id.empty() &&
+          clock_now() < last_leader_contact + ElectionTimeoutMin))) {
+        /* With leases, the leader must not be replaced as long as the
+         * majority that granted its lease hears from it. Ignore the
+         * candidate, without catching up with its term. */
+        if (verbosity >= kVerboseInfo) {
+            IOS_INF() << "Vote for " << msg.candidate_id
+                      << " denied, the leader is alive" << endl;
+        }
+        return 0;
+    }
+
     if ((ret = catch_up_term(msg.term, out)) < 0) {
         return ret;
     }
@@ -726,8 +1560,10 @@ RaftSM::request_vote_resp_input(const RaftRequestVoteResp &resp,
         kv.second.match_index      = 0;
         kv.second.next_index_acked = kv.second.next_index_unacked =
             last_log_index + 1;
-        kv.second.last_ae_time = std::chrono::system_clock::now();
+        kv.second.last_ae_time  = clock_now();
+        kv.second.last_ack_time = kv.second.last_ae_time;
     }
+    read_seq_confirmed = read_seq;
 
     /* Prepare heartbeat messages for the other replicas and set the
      * heartbeat timer. */
@@ -771,6 +1607,7 @@ RaftSM::append_entries_input(const RaftAppendEntries &msg, RaftSMOutput *out)
     resp->term        = current_term;
     resp->follower_id = local_id;
     resp->log_index   = msg.prev_log_index;
+    resp->read_seq    = msg.read_seq;
 
     if (msg.term < current_term) {
         /* Sender is outdated. Just reply false. */
@@ -784,29 +1621,75 @@ RaftSM::append_entries_input(const RaftAppendEntries &msg, RaftSMOutput *out)
         return ret;
     }
 
-    leader_id = msg.leader_id;
+    leader_id           = msg.leader_id;
+    last_leader_contact = clock_now();
+
+    /* A heartbeat that confirms the leadership is checked like any other
+     * request, as the leader uses the response. */
+    if (!msg.entries.empty() || msg.read_seq) {
+        LogIndex prev_log_index   = msg.prev_log_index;
+        Term leader_prev_log_term = msg.prev_log_term;
+        auto first                = msg.entries.begin();
+
+        /* Skip the entries that are covered by our snapshot. They are
+         * committed, and so they match our ones. */
+        for (; prev_log_index < log_base && first != msg.entries.end();
+             first++) {
+            prev_log_index++;
+            leader_prev_log_term = first->first;
+        }
 
-    if (!msg.entries.empty()) {
         /* Check if we can accept the received entries. */
-        if ((ret = log_entry_get_term(msg.prev_log_index, &prev_log_term)) <
-            0) {
+        if (prev_log_index < log_base) {
+            resp->success   = true;
+            resp->log_index = prev_log_index;
+        } else if ((ret = log_entry_get_term(prev_log_index,
+                                             &prev_log_term)) < 0) {
             return ret;
+        } else {
+            resp->success = prev_log_index <= last_log_index && ret == 0 &&
+                            leader_prev_log_term == prev_log_term;
         }
-        resp->success = msg.prev_log_index <= last_log_index && ret == 0 &&
-                        msg.prev_log_term == prev_log_term;
-        if (resp->success) {
-            if ((ret = log_truncate(msg.prev_log_index))) {
-                return ret;
+        if (resp->success && prev_log_index >= log_base) {
+            /* Skip the entries that we already have (e.g. because the
+             * request was retransmitted), so that the log is truncated only
+             * if an entry conflicts with ours. */
+            LogIndex index = prev_log_index;
+            Term term;
+
+            for (; first != msg.entries.end() && index < last_log_index;
+                 first++, index++) {
+                if (log_entry_get_term(index + 1, &term)) {
+                    return -1;
+                }
+                if (term != first->first) {
+                    break;
+                }
             }
-            for (const auto &entry : msg.entries) {
-                Term term                = entry.first;
-                const char *const serbuf = entry.second.get();
+            if (first != msg.entries.end()) {
+                std::vector<std::pair<Term, LogCommand>> entries(
+                    first, msg.entries.end());
 
-                if ((ret = append_log_entry(term, serbuf))) {
+                if ((ret = log_truncate(index))) {
                     return ret;
                 }
+                if ((ret = append_log_entries(entries))) {
+                    return ret;
+                }
+                index = last_log_index;
+            }
+            resp->log_index = index;
+        } else if (!resp->success) {
+            /* Tell the leader where our log diverges. */
+            if (prev_log_index > last_log_index) {
+                resp->conflict_index = last_log_index + 1;
+            } else {
+                resp->conflict_term = prev_log_term;
+                if (log_term_search(prev_log_term, prev_log_index,
+                                    &resp->conflict_index)) {
+                    return -1;
+                }
             }
-            resp->log_index = last_log_index;
         }
     }
 
@@ -815,16 +1698,97 @@ RaftSM::append_entries_input(const RaftAppendEntries &msg, RaftSMOutput *out)
         if ((ret = apply_committed_entries())) {
             return ret;
         }
+        waiting_reads_release(out);
     }
 
-    /* We need to reply only if this is not an heartbeat message. */
-    if (!msg.entries.empty()) {
+    /* We need to reply only if this is not an heartbeat message, or if
+     * the leader is confirming its leadership. */
+    if (!msg.entries.empty() || msg.read_seq) {
         out->output_messages.push_back(make_pair(leader_id, std::move(resp)));
     }
 
     return 0;
 }
 
+int
+RaftSM::install_snapshot_input(const RaftInstallSnapshot &msg,
+                               RaftSMOutput *out)
+{
+    std::unique_ptr<RaftAppendEntriesResp> resp;
+    int ret;
+
+    if (check_output_arg(out)) {
+        return -1;
+    }
+
+    if (verbosity >= kVerboseInfo) {
+        IOS_INF() << "Received InstallSnapshot(term=" << msg.term
+                  << ", leader_id=" << msg.leader_id
+                  << ", last_included_index=" << msg.last_included_index
+                  << ", last_included_term=" << msg.last_included_term
+                  << ", offset=" << msg.offset << ", size=" << msg.data.size()
+                  << ", done=" << msg.done << ")" << endl;
+    }
+
+    if ((ret = catch_up_term(msg.term, out)) < 0) {
+        return ret;
+    }
+
+    resp              = utils::make_unique<RaftAppendEntriesResp>();
+    resp->term        = current_term;
+    resp->follower_id = local_id;
+    resp->log_index   = msg.last_included_index;
+
+    if (msg.term < current_term) {
+        /* Sender is outdated. Just reply false. */
+        resp->success = false;
+        out->output_messages.push_back(
+            make_pair(msg.leader_id, std::move(resp)));
+        return 0;
+    }
+
+    if ((ret = back_to_follower(out))) {
+        return ret;
+    }
+
+    leader_id           = msg.leader_id;
+    last_leader_contact = clock_now();
+
+    /* Collect the chunks, which must arrive in order. On a gap we wait for
+     * the leader to send the snapshot again. */
+    if (msg.offset == 0) {
+        snapshot_chunks.clear();
+        snapshot_chunks_index = msg.last_included_index;
+        snapshot_chunks_term  = msg.last_included_term;
+    } else if (msg.last_included_index != snapshot_chunks_index ||
+               msg.last_included_term != snapshot_chunks_term ||
+               msg.offset != snapshot_chunks.size()) {
+        return 0;
+    }
+    snapshot_chunks += msg.data;
+    if (!msg.done) {
+        return 0;
+    }
+
+    /* A snapshot that is not more recent than our state machine brings
+     * nothing new. */
+    if (msg.last_included_index > last_applied) {
+        if ((ret = install_snapshot(msg.last_included_index,
+                                    msg.last_included_term, snapshot_chunks))) {
+            return ret;
+        }
+        waiting_reads_release(out);
+    }
+    std::string().swap(snapshot_chunks);
+    snapshot_chunks_index = 0;
+    snapshot_chunks_term  = 0;
+
+    resp->success = true;
+    out->output_messages.push_back(make_pair(leader_id, std::move(resp)));
+
+    return 0;
+}
+
 int
 RaftSM::append_entries_resp_input(const RaftAppendEntriesResp &resp,
                                   RaftSMOutput *out)
@@ -856,6 +1820,11 @@ RaftSM::append_entries_resp_input(const RaftAppendEntriesResp &resp,
         return 0;
     }
 
+    if (!leader()) {
+        /* Response to a leader of an older term. */
+        return 0;
+    }
+
     if (!servers.count(resp.follower_id)) {
         IOS_ERR() << "Replica " << resp.follower_id << " does not exist"
                   << endl;
@@ -863,19 +1832,29 @@ RaftSM::append_entries_resp_input(const RaftAppendEntriesResp &resp,
     }
 
     Server &follower = servers[resp.follower_id];
+    auto now         = clock_now();
+
+    follower.last_ack_time = now;
 
     if (resp.success) {
         LogIndex next_commit_index = commit_index;
 
-        /* On success we update the next_index_acked. */
-        if (resp.log_index + 1 >= follower.next_index_acked) {
+        /* On success we update the next_index_acked. With many requests
+         * in flight the responses may be reordered, so we never go
+         * backwards. */
+        if (resp.log_index > last_log_index) {
+            IOS_ERR() << "Invalid resp.log_index " << resp.log_index
+                      << " beyond the last log entry " << last_log_index
+                      << endl;
+            return 0;
+        }
+        if (resp.log_index + 1 > follower.next_index_acked) {
             follower.next_index_acked = resp.log_index + 1;
-            follower.match_index      = resp.log_index;
-        } else {
-            IOS_ERR()
-                << "Invalid resp.log_index, match_index would go backwards "
-                << follower.match_index << " --> " << resp.log_index << endl;
+            follower.last_ae_time     = now;
         }
+        follower.match_index = std::max(follower.match_index, resp.log_index);
+        follower.next_index_unacked =
+            std::max(follower.next_index_unacked, follower.next_index_acked);
         /* Try to update the commit_index. We need to find the highest N
          * such that N > commit_index and that match_index >= N for a majority
          * of the replicas (we as a leader count as a replica that has
@@ -916,17 +1895,352 @@ RaftSM::append_entries_resp_input(const RaftAppendEntriesResp &resp,
                 }
             }
         }
-    } else {
+    } else if (resp.log_index + 1 == follower.next_index_acked) {
         /* Failure comes from log inconsistencies. We need to decrement
-         * next_index_acked and next_index_unacked and retry. */
-        follower.next_index_acked = follower.next_index_unacked =
-            std::max(static_cast<LogIndex>(1),
-                     std::min(resp.log_index, follower.next_index_acked - 1));
+         * next_index_acked and next_index_unacked and retry. The hints of
+         * the follower allow to skip all its entries of the conflicting
+         * term, or all the entries it does not have. Only the rejection
+         * of the first request in flight is considered, as the rejections
+         * of the following ones are implied. */
+        LogIndex next =
+            resp.conflict_index ? resp.conflict_index : resp.log_index;
+
+        if (resp.conflict_term > 0 && resp.log_index <= last_log_index) {
+            LogIndex index;
+            Term term;
+
+            /* If we have entries with the conflicting term, restart from
+             * the one that follows our last one. */
+            if (log_term_search(resp.conflict_term + 1, resp.log_index,
+                                &index)) {
+                return -1;
+            }
+            if (index - 1 > log_base && !log_entry_get_term(index - 1, &term) &&
+                term == resp.conflict_term) {
+                next = index;
+            }
+        }
+        next = std::max(static_cast<LogIndex>(1),
+                        std::min(next, resp.log_index));
+        if (next <= follower.match_index) {
+            /* This should never happen, as the follower log is persistent,
+             * but do not insist on entries the follower does not have. */
+            IOS_ERR() << "Replica " << resp.follower_id
+                      << " lost acked entries after " << next - 1 << endl;
+            follower.match_index = next - 1;
+        }
+        if (verbosity >= kVerboseInfo) {
+            IOS_INF() << "Backtracking " << resp.follower_id << " "
+                      << follower.next_index_acked << " --> " << next << endl;
+        }
+        follower.next_index_acked = follower.next_index_unacked = next;
+        follower.rejections++;
+    }
+
+    /* Keep the replication window full. */
+    if (follower.next_index_unacked <= last_log_index) {
+        if ((ret = replicate_to(resp.follower_id, follower,
+                                /*heartbeat=*/false, out))) {
+            return ret;
+        }
+    }
+
+    /* Any response to our term confirms the leadership, even if the
+     * request was rejected. */
+    if (resp.read_seq > follower.read_seq_acked) {
+        follower.read_seq_acked = resp.read_seq;
+        read_rounds_update();
+    }
+    if (!leader_reads.empty()) {
+        return leader_reads_serve(out);
+    }
+
+    return 0;
+}
+
+/* True if an entry of the current term is committed. Only then the leader
+ * knows that its commit index is the one of the cluster. */
+bool
+RaftSM::committed_in_term()
+{
+    Term term;
+
+    return log_entry_get_term(commit_index, &term) == 0 &&
+           term == current_term;
+}
+
+bool
+RaftSM::lease_holding() const
+{
+    return ReadLease.count() > 0 && clock_now() < lease_expiry;
+}
+
+/* Called on the leader when a replica acks a round of leadership
+ * confirmation, to find the last round acked by a majority (we as a leader
+ * ack all of them). The lease lasts from the time the round was started. */
+void
+RaftSM::read_rounds_update()
+{
+    std::vector<uint64_t> acked;
+    unsigned int needed = quorum() - 1;
+    uint64_t confirmed  = read_seq;
+
+    if (needed > 0) {
+        for (const auto &kv : servers) {
+            acked.push_back(kv.second.read_seq_acked);
+        }
+        std::sort(acked.begin(), acked.end(), std::greater<uint64_t>());
+        confirmed = acked[needed - 1];
+    }
+
+    if (confirmed <= read_seq_confirmed) {
+        return;
+    }
+    read_seq_confirmed = confirmed;
+    for (; !read_rounds.empty() && read_rounds.front().first <= confirmed;
+         read_rounds.pop_front()) {
+        if (read_rounds.front().first == confirmed) {
+            lease_expiry = read_rounds.front().second + ReadLease;
+        }
+    }
+}
+
+/* Register a read on the leader, either local or forwarded by a follower.
+ * It is served once a round of leadership confirmation started after now
+ * is confirmed. */
+int
+RaftSM::leader_read_register(uint64_t id, const ReplicaId &origin,
+                             RaftSMOutput *out)
+{
+    PendingRead read;
+    int ret;
+
+    read.id     = id;
+    read.origin = origin;
+    read.seq    = read_seq + 1;
+    leader_reads.push_back(read);
+
+    if (!committed_in_term() && last_log_term != current_term) {
+        /* A new leader does not know which entries are committed until an
+         * entry of its term is. Append an empty one, which also starts
+         * the round. */
+        std::vector<std::pair<Term, LogCommand>> entries;
+
+        entries.push_back(
+            make_pair(current_term, std::make_shared<const std::string>()));
+        if ((ret = append_log_entries(entries))) {
+            return ret;
+        }
+        return prepare_append_entries(LogReplicateStrategy::Unsent, out);
+    }
+
+    if (lease_holding()) {
+        return leader_reads_serve(out);
+    }
+
+    if (read_seq == read_seq_confirmed) {
+        /* No round in flight, start one right away. Otherwise the read
+         * waits for the next round, together with the others. */
+        return prepare_append_entries(LogReplicateStrategy::Unsent, out);
+    }
+
+    return 0;
+}
+
+/* Serve the reads on the leader whose round of leadership confirmation
+ * completed, or all of them under the lease. The leader has applied all
+ * the committed entries, so its commit index is the read index. */
+int
+RaftSM::leader_reads_serve(RaftSMOutput *out)
+{
+    bool lease = lease_holding();
+
+    if (!committed_in_term()) {
+        return 0; /* wait for an entry of the current term */
+    }
+
+    for (auto it = leader_reads.begin(); it != leader_reads.end();) {
+        if (it->seq <= read_seq_confirmed) {
+            stats.reads_confirmed++;
+        } else if (lease) {
+            stats.reads_lease++;
+        } else {
+            it++;
+            continue;
+        }
+        if (it->origin.empty()) {
+            out->reads_ready.push_back(it->id);
+        } else {
+            auto resp        = utils::make_unique<RaftReadIndexResp>();
+            resp->term       = current_term;
+            resp->read_id    = it->id;
+            resp->read_index = commit_index;
+            resp->success    = true;
+            out->output_messages.push_back(
+                make_pair(it->origin, std::move(resp)));
+
+            /* The follower may not know the read index is committed. */
+            auto sit = servers.find(it->origin);
+            if (sit != servers.end() &&
+                sit->second.commit_sent < commit_index) {
+                int ret;
+
+                if ((ret = replicate_to(sit->first, sit->second,
+                                        /*heartbeat=*/true, out))) {
+                    return ret;
+                }
+            }
+        }
+        it = leader_reads.erase(it);
+    }
+
+    if (!leader_reads.empty() && read_seq == read_seq_confirmed) {
+        /* Some reads arrived while the last round was in flight. */
+        return prepare_append_entries(LogReplicateStrategy::Unsent, out);
     }
 
     return 0;
 }
 
+/* Serve the reads on a follower whose read index has been applied. */
+void
+RaftSM::waiting_reads_release(RaftSMOutput *out)
+{
+    while (!waiting_reads.empty() &&
+           waiting_reads.begin()->first <= last_applied) {
+        out->reads_ready.push_back(waiting_reads.begin()->second);
+        waiting_reads.erase(waiting_reads.begin());
+    }
+}
+
+/* Fail the reads that depend on the leader of the current term, when the
+ * term changes. The reads waiting for their read index to be applied can
+ * still be served. */
+void
+RaftSM::reads_fail(RaftSMOutput *out)
+{
+    for (const PendingRead &read : leader_reads) {
+        if (read.origin.empty()) {
+            out->reads_failed.push_back(read.id);
+        } else {
+            auto resp        = utils::make_unique<RaftReadIndexResp>();
+            resp->term       = current_term;
+            resp->read_id    = read.id;
+            resp->read_index = 0;
+            resp->success    = false;
+            out->output_messages.push_back(
+                make_pair(read.origin, std::move(resp)));
+        }
+        stats.reads_failed++;
+    }
+    leader_reads.clear();
+    for (uint64_t id : forwarded_reads) {
+        out->reads_failed.push_back(id);
+        stats.reads_failed++;
+    }
+    forwarded_reads.clear();
+    read_rounds.clear();
+    read_seq_confirmed = read_seq;
+    lease_expiry       = std::chrono::steady_clock::time_point();
+}
+
+int
+RaftSM::read_index_input(const RaftReadIndex &msg, RaftSMOutput *out)
+{
+    int ret;
+
+    if (check_output_arg(out)) {
+        return -1;
+    }
+
+    if (verbosity >= kVerboseVery) {
+        IOS_INF() << "Received ReadIndex(term=" << msg.term
+                  << ", follower_id=" << msg.follower_id
+                  << ", read_id=" << msg.read_id << ")" << endl;
+    }
+
+    if ((ret = catch_up_term(msg.term, out)) < 0) {
+        return ret;
+    }
+
+    if (!leader()) {
+        auto resp        = utils::make_unique<RaftReadIndexResp>();
+        resp->term       = current_term;
+        resp->read_id    = msg.read_id;
+        resp->read_index = 0;
+        resp->success    = false;
+        out->output_messages.push_back(
+            make_pair(msg.follower_id, std::move(resp)));
+        return 0;
+    }
+
+    return leader_read_register(msg.read_id, msg.follower_id, out);
+}
+
+int
+RaftSM::read_index_resp_input(const RaftReadIndexResp &msg,
+                              RaftSMOutput *out)
+{
+    int ret;
+
+    if (check_output_arg(out)) {
+        return -1;
+    }
+
+    if (verbosity >= kVerboseVery) {
+        IOS_INF() << "Received ReadIndexResp(term=" << msg.term
+                  << ", read_id=" << msg.read_id
+                  << ", read_index=" << msg.read_index
+                  << ", success=" << msg.success << ")" << endl;
+    }
+
+    if ((ret = catch_up_term(msg.term, out)) < 0) {
+        return ret;
+    }
+
+    auto it = forwarded_reads.find(msg.read_id);
+    if (it == forwarded_reads.end()) {
+        return 0; /* already failed */
+    }
+    forwarded_reads.erase(it);
+
+    if (!msg.success) {
+        out->reads_failed.push_back(msg.read_id);
+        stats.reads_failed++;
+        return 0;
+    }
+
+    waiting_reads.insert(std::make_pair(msg.read_index, msg.read_id));
+    waiting_reads_release(out);
+
+    return 0;
+}
+
+std::vector<RaftSM::FollowerInfo>
+RaftSM::followers_info() const
+{
+    auto now = clock_now();
+    std::vector<FollowerInfo> infos;
+
+    for (const auto &kv : servers) {
+        FollowerInfo info;
+
+        info.id          = kv.first;
+        info.match_index = kv.second.match_index;
+        info.lag         = last_log_index - std::min(last_log_index,
+                                                     kv.second.match_index);
+        info.inflight =
+            kv.second.next_index_unacked - kv.second.next_index_acked;
+        info.rejections      = kv.second.rejections;
+        info.retransmissions = kv.second.retransmissions;
+        info.since_ack = std::chrono::duration_cast<std::chrono::milliseconds>(
+            now - kv.second.last_ack_time);
+        infos.push_back(info);
+    }
+
+    return infos;
+}
+
 int
 RaftSM::timer_expired(RaftTimerType type, RaftSMOutput *out)
 {
@@ -961,6 +2275,7 @@ RaftSM::timer_expired(RaftTimerType type, RaftSMOutput *out)
         }
         votes_collected = 1;
         leader_id.clear();
+        reads_fail(out);
         /* Reset the election timer in case we lose the election. */
         out->timer_commands.push_back(RaftTimerCmd(
             this, RaftTimerType::Election, RaftTimerAction::Restart,
@@ -995,9 +2310,19 @@ RaftSM::timer_expired(RaftTimerType type, RaftSMOutput *out)
 }
 
 int
-RaftSM::submit(const char *const serbuf, LogIndex *log_index_p,
+RaftSM::submit(const std::string &command, LogIndex *log_index_p,
                RaftSMOutput *out)
 {
+    return submit_batch(std::vector<std::string>(1, command), log_index_p,
+                        out);
+}
+
+int
+RaftSM::submit_batch(const std::vector<std::string> &commands,
+                     LogIndex *log_index_p, RaftSMOutput *out)
+{
+    std::vector<std::pair<Term, LogCommand>> entries;
+    LogIndex first_index = last_log_index + 1;
     int ret;
 
     if (!leader()) {
@@ -1006,8 +2331,12 @@ RaftSM::submit(const char *const serbuf, LogIndex *log_index_p,
         return -1;
     }
 
-    /* Serialize the new entry and append it to the local log. */
-    if ((ret = append_log_entry(current_term, serbuf))) {
+    /* Append the new entries to the local log. */
+    for (const std::string &command : commands) {
+        entries.push_back(make_pair(
+            current_term, std::make_shared<const std::string>(command)));
+    }
+    if ((ret = append_log_entries(entries))) {
         return ret;
     }
 
@@ -1018,9 +2347,83 @@ RaftSM::submit(const char *const serbuf, LogIndex *log_index_p,
     }
 
     if (log_index_p) {
-        *log_index_p = last_log_index;
+        *log_index_p = first_index;
+    }
+
+    return 0;
+}
+
+/* A packed entry is the marker followed by the commands, each one preceded
+ * by its length. */
+std::string
+RaftSM::commands_pack(const std::vector<std::string> &commands)
+{
+    std::string entry(1, static_cast<char>(kPackedCommandsMarker));
+
+    for (const std::string &command : commands) {
+        uint32_t length = static_cast<uint32_t>(command.size());
+
+        entry.append(reinterpret_cast<const char *>(&length), sizeof(length));
+        entry.append(command);
+    }
+
+    return entry;
+}
+
+int
+RaftSM::commands_unpack(const std::string &entry,
+                        std::vector<std::string> *commands)
+{
+    size_t ofs = 1;
+
+    if (!commands_packed(entry)) {
+        return -1;
+    }
+
+    while (ofs < entry.size()) {
+        uint32_t length;
+
+        if (entry.size() - ofs < sizeof(length)) {
+            return -1;
+        }
+        memcpy(&length, entry.data() + ofs, sizeof(length));
+        ofs += sizeof(length);
+        if (entry.size() - ofs < length) {
+            return -1;
+        }
+        commands->push_back(entry.substr(ofs, length));
+        ofs += length;
+    }
+
+    return 0;
+}
+
+int
+RaftSM::read_request(uint64_t id, RaftSMOutput *out)
+{
+    if (check_output_arg(out)) {
+        return -1;
     }
 
+    if (leader()) {
+        return leader_read_register(id, string(), out);
+    }
+
+    if (state != RaftState::Follower || leader_id.empty()) {
+        /* There is no leader to ask. */
+        out->reads_failed.push_back(id);
+        stats.reads_failed++;
+        return 0;
+    }
+
+    auto msg         = utils::make_unique<RaftReadIndex>();
+    msg->term        = current_term;
+    msg->follower_id = local_id;
+    msg->read_id     = id;
+    out->output_messages.push_back(make_pair(leader_id, std::move(msg)));
+    forwarded_reads.insert(id);
+    stats.reads_forwarded++;
+
     return 0;
 }
 
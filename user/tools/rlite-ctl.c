@@ -907,6 +907,7 @@ static int
 flows_show(int argc, char **argv, struct cmd_descriptor *cd)
 {
     struct list_head flows;
+    struct list_head stats;
     rl_ipcp_id_t ipcp_id = 0xffff; /* no IPCP */
 
     if (argc > 0) {
@@ -921,8 +922,12 @@ flows_show(int argc, char **argv, struct cmd_descriptor *cd)
     }
 
     list_init(&flows);
+    list_init(&stats);
     rl_conf_flows_fetch(&flows, ipcp_id);
+    rl_conf_flows_stats_fetch(&stats, ipcp_id);
     {
+        struct rl_flow_stats_info *si =
+            list_first_entry(&stats, struct rl_flow_stats_info, node);
         struct rl_flow_info *rl_flow;
         char specinfo[16];
 
@@ -930,16 +935,24 @@ flows_show(int argc, char **argv, struct cmd_descriptor *cd)
         list_for_each_entry (rl_flow, &flows, node) {
             char bbuf[3][32];
             size_t blen = 32;
-            struct rl_flow_stats stats;
+            struct rl_flow_stats *st;
             int ofs = 0;
-            int ret;
 
-            ret = rl_conf_flow_get_stats(rl_flow->local_port, &stats);
-            if (ret) {
-                /* This can fail because the flow disappeared since
-                 * it was fetched into 'flows'. */
+            /* Both lists are sorted by (ipcp_id, local_port), so we can
+             * walk them in parallel. */
+            while (&si->node != &stats &&
+                   (si->ipcp_id < rl_flow->ipcp_id ||
+                    (si->ipcp_id == rl_flow->ipcp_id &&
+                     si->local_port < rl_flow->local_port))) {
+                si = list_next_entry(si, node);
+            }
+            if (&si->node == &stats || si->ipcp_id != rl_flow->ipcp_id ||
+                si->local_port != rl_flow->local_port) {
+                /* This can happen because the flow disappeared or
+                 * appeared in between the two fetch operations. */
                 continue;
             }
+            st = &si->stats;
 
             memset(specinfo, '\0', sizeof(specinfo));
             if (rl_flow->flow_control) {
@@ -953,27 +966,53 @@ flows_show(int argc, char **argv, struct cmd_descriptor *cd)
             }
 
             PI_S("  ipcp %u, addr:port %llu:%u<-->%llu:%u, %s"
-                 "rx(pkt:%llu, %s, drop:%llu), "
-                 "tx(pkt:%llu, %s)\n",
+                 "rx(pkt:%llu, %s, drop:%llu/%llu/%llu/%llu), "
+                 "tx(pkt:%llu, %s, err:%llu)\n",
                  rl_flow->ipcp_id, (long long unsigned int)rl_flow->local_addr,
                  rl_flow->local_port,
                  (long long unsigned int)rl_flow->remote_addr,
-                 rl_flow->remote_port, specinfo,
-                 (long long unsigned)stats.rx_pkt,
-                 byteprint(bbuf[0], blen, stats.rx_byte),
-                 (long long unsigned)stats.rx_overrun_pkt,
-                 (long long unsigned)stats.tx_pkt,
-                 byteprint(bbuf[1], blen, stats.tx_byte));
+                 rl_flow->remote_port, specinfo, (long long unsigned)st->rx_pkt,
+                 byteprint(bbuf[0], blen, st->rx_byte),
+                 (long long unsigned)st->rx_overrun_pkt,
+                 (long long unsigned)st->rx_dup_drop,
+                 (long long unsigned)st->rx_seqq_drop,
+                 (long long unsigned)st->rx_gap_drop,
+                 (long long unsigned)st->tx_pkt,
+                 byteprint(bbuf[1], blen, st->tx_byte),
+                 (long long unsigned)st->tx_err);
         }
     }
+    rl_conf_flows_stats_purge(&stats);
     rl_conf_flows_purge(&flows);
 
     return 0;
 }
 
+static void
+flow_lat_print(const char *name, const uint64_t *hist)
+{
+    int i;
+
+    printf("    %-22s =", name);
+    for (i = 0; i < RL_FLOW_LAT_BUCKETS; i++) {
+        if (!hist[i]) {
+            continue;
+        }
+        if (i == 0) {
+            printf(" <1us:%llu", (long long unsigned)hist[i]);
+        } else if (i == RL_FLOW_LAT_BUCKETS - 1) {
+            printf(" >=%uus:%llu", 1U << (i - 1), (long long unsigned)hist[i]);
+        } else {
+            printf(" <%uus:%llu", 1U << i, (long long unsigned)hist[i]);
+        }
+    }
+    printf("\n");
+}
+
 static int
 flow_dump(int argc, char **argv, struct cmd_descriptor *cd)
 {
+    struct rl_flow_stats stats;
     struct rl_flow_dtp dtp;
     unsigned long port_id;
     int ret;
@@ -987,6 +1026,9 @@ flow_dump(int argc, char **argv, struct cmd_descriptor *cd)
     }
 
     ret = rl_conf_flow_get_dtp(port_id, &dtp);
+    if (ret == 0) {
+        ret = rl_conf_flow_get_stats(port_id, &stats);
+    }
     if (ret) {
         PE("Could not find flow with port id %lu\n", port_id);
         return ret;
@@ -1024,6 +1066,19 @@ flow_dump(int argc, char **argv, struct cmd_descriptor *cd)
         (unsigned long)dtp.last_lwe_sent, (unsigned long)dtp.last_seq_num_acked,
         (unsigned long)dtp.next_snd_ctl_seq, (unsigned long)dtp.seqq_len);
 
+    printf("    tx_err                 = %llu\n"
+           "    rx_overrun_pkt         = %llu\n"
+           "    rx_dup_drop            = %llu\n"
+           "    rx_seqq_drop           = %llu\n"
+           "    rx_gap_drop            = %llu\n",
+           (unsigned long long)stats.tx_err,
+           (unsigned long long)stats.rx_overrun_pkt,
+           (unsigned long long)stats.rx_dup_drop,
+           (unsigned long long)stats.rx_seqq_drop,
+           (unsigned long long)stats.rx_gap_drop);
+    flow_lat_print("rx_latency", stats.rx_lat);
+    flow_lat_print("tx_latency", stats.tx_lat);
+
     return 0;
 }
 
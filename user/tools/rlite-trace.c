@@ -0,0 +1,562 @@
+/*
+ * Aggregate rlite datapath tracepoints into latency and queueing histograms.
+ *
+ * Copyright (C) 2026 agent
+ * Author: agent <agent@local>
+ *
+ * This file is part of rlite.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/*
+ * The tool reads the events defined in kernel/rlite-trace.h, either live
+ * from the tracefs trace_pipe or from a file containing a saved trace, and
+ * matches pairs of events to measure:
+ *   - the time spent by PDUs in the RMT scheduler queue (rmt_enq/rmt_deq),
+ *     for each N-1 port;
+ *   - the time spent by PDUs in the sequencing queue (seqq_push/seqq_pop),
+ *     for each flow;
+ *   - the time writers of a flow are backpressured by flow control
+ *     (fc_block/fc_unblock);
+ * together with queue length histograms and per-flow event counters.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "rlite/list.h"
+
+#define HIST_BUCKETS 24
+#define PENDING_HASH_SIZE (1 << 16)
+
+/* Histogram with power-of-two buckets. Bucket i counts values in the
+ * range [2^(i-1), 2^i), bucket 0 counts zeros. */
+struct hist {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+/* Statistics for an (ipcp, port) pair. */
+struct port_stats {
+    unsigned int ipcp;
+    unsigned int port;
+
+    uint64_t tx;
+    uint64_t rx;
+    uint64_t rtx;
+    uint64_t fc_blocks;
+
+    struct hist rmtq_us;   /* time in the RMT queue */
+    struct hist rmtq_len;  /* RMT queue length at enqueue */
+    struct hist seqq_us;   /* time in the sequencing queue */
+    struct hist seqq_len;  /* sequencing queue length at push */
+    struct hist fc_us;     /* time blocked by flow control */
+    struct hist cwq_len;   /* closed window queue length at write */
+    struct hist rtxq_len;  /* retransmission queue length at rtx */
+
+    double fc_block_ts; /* timestamp of pending fc_block, or < 0 */
+
+    struct list_head node;
+};
+
+/* An event waiting for its matching event. */
+struct pending {
+    uint64_t key[4];
+    double ts;
+    struct pending *next;
+};
+
+/* Fields that can appear in an event. */
+struct event {
+    double ts;
+    char name[32];
+    unsigned int ipcp;
+    unsigned int port;
+    unsigned long long seq;
+    unsigned long long dst;
+    unsigned int cep;
+    unsigned int type;
+    unsigned int len;
+    unsigned int qlen;
+    unsigned int cwq;
+    unsigned int rtxq;
+};
+
+static struct list_head ports;
+static struct pending *rmtq_pending[PENDING_HASH_SIZE];
+static struct pending *seqq_pending[PENDING_HASH_SIZE];
+static uint64_t events_parsed;
+static uint64_t events_unmatched;
+static volatile sig_atomic_t stop;
+
+static void
+hist_add(struct hist *h, uint64_t val)
+{
+    unsigned int b = 0;
+
+    while (b < HIST_BUCKETS - 1 && val >= (1ULL << b)) {
+        b++;
+    }
+    h->buckets[b]++;
+    h->count++;
+    h->sum += val;
+    if (val > h->max) {
+        h->max = val;
+    }
+}
+
+/* Upper bound of the bucket containing the p-th percentile. */
+static uint64_t
+hist_percentile(const struct hist *h, unsigned int p)
+{
+    uint64_t target = (h->count * p + 99) / 100;
+    uint64_t acc    = 0;
+    unsigned int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        acc += h->buckets[b];
+        if (acc >= target) {
+            return b ? (1ULL << b) - 1 : 0;
+        }
+    }
+
+    return h->max;
+}
+
+static void
+hist_print(const char *title, const char *unit, const struct hist *h)
+{
+    uint64_t maxb = 0;
+    unsigned int b;
+
+    if (!h->count) {
+        return;
+    }
+
+    printf("    %s: count %llu avg %.1f p50 <=%llu p99 <=%llu max %llu %s\n",
+           title, (unsigned long long)h->count, (double)h->sum / h->count,
+           (unsigned long long)hist_percentile(h, 50),
+           (unsigned long long)hist_percentile(h, 99),
+           (unsigned long long)h->max, unit);
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        if (h->buckets[b] > maxb) {
+            maxb = h->buckets[b];
+        }
+    }
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        unsigned int bar;
+
+        if (!h->buckets[b]) {
+            continue;
+        }
+        bar = (unsigned int)((h->buckets[b] * 40 + maxb - 1) / maxb);
+        printf("        %10llu .. %-10llu %10llu |%.*s\n",
+               b ? (unsigned long long)(1ULL << (b - 1)) : 0ULL,
+               b ? (unsigned long long)(1ULL << b) - 1 : 0ULL,
+               (unsigned long long)h->buckets[b], bar,
+               "########################################");
+    }
+}
+
+static struct port_stats *
+port_stats_get(unsigned int ipcp, unsigned int port)
+{
+    struct port_stats *ps;
+
+    list_for_each_entry (ps, &ports, node) {
+        if (ps->ipcp == ipcp && ps->port == port) {
+            return ps;
+        }
+    }
+
+    ps = calloc(1, sizeof(*ps));
+    if (!ps) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    ps->ipcp        = ipcp;
+    ps->port        = port;
+    ps->fc_block_ts = -1.0;
+    list_add_tail(&ps->node, &ports);
+
+    return ps;
+}
+
+static unsigned int
+pending_hash(const uint64_t *key)
+{
+    uint64_t h = 1469598103934665603ULL;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        h = (h ^ key[i]) * 1099511628211ULL;
+    }
+
+    return (unsigned int)(h ^ (h >> 32)) & (PENDING_HASH_SIZE - 1);
+}
+
+static void
+pending_push(struct pending **table, const uint64_t *key, double ts)
+{
+    struct pending *p = malloc(sizeof(*p));
+
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(p->key, key, sizeof(p->key));
+    p->ts = ts;
+    /* Insert in front, so that a stale entry with the same key (e.g. a
+     * missed dequeue) is shadowed by the most recent one. */
+    p->next                   = table[pending_hash(key)];
+    table[pending_hash(key)] = p;
+}
+
+/* Returns the timestamp of the matching event, or a negative number. */
+static double
+pending_pop(struct pending **table, const uint64_t *key)
+{
+    struct pending **pp = &table[pending_hash(key)];
+
+    for (; *pp; pp = &(*pp)->next) {
+        struct pending *p = *pp;
+
+        if (!memcmp(p->key, key, sizeof(p->key))) {
+            double ts = p->ts;
+
+            *pp = p->next;
+            free(p);
+            return ts;
+        }
+    }
+
+    return -1.0;
+}
+
+static uint64_t
+usecs(double from, double to)
+{
+    return to > from ? (uint64_t)((to - from) * 1e6 + 0.5) : 0;
+}
+
+/* Parse a trace line like
+ *   "  task-123  [001] ..s1  4567.000123: rlite_seqq_push: ipcp=1 port=3 .."
+ * Returns 0 on success. */
+static int
+event_parse(char *line, struct event *ev)
+{
+    char *p = strstr(line, ": rlite_");
+    char *ts, *name, *args, *tok, *saveptr;
+
+    if (!p) {
+        return -1;
+    }
+
+    memset(ev, 0, sizeof(*ev));
+
+    /* The timestamp is the token right before the event name. */
+    *p = '\0';
+    ts = strrchr(line, ' ');
+    ev->ts = strtod(ts ? ts + 1 : line, NULL);
+
+    name = p + 2 + strlen("rlite_");
+    args = strchr(name, ':');
+    if (!args) {
+        return -1;
+    }
+    *args++ = '\0';
+    snprintf(ev->name, sizeof(ev->name), "%s", name);
+
+    for (tok = strtok_r(args, " \n", &saveptr); tok;
+         tok = strtok_r(NULL, " \n", &saveptr)) {
+        char *val = strchr(tok, '=');
+
+        if (!val) {
+            continue;
+        }
+        *val++ = '\0';
+        if (!strcmp(tok, "ipcp")) {
+            ev->ipcp = strtoul(val, NULL, 10);
+        } else if (!strcmp(tok, "port")) {
+            ev->port = strtoul(val, NULL, 10);
+        } else if (!strcmp(tok, "seq")) {
+            ev->seq = strtoull(val, NULL, 10);
+        } else if (!strcmp(tok, "dst")) {
+            ev->dst = strtoull(val, NULL, 10);
+        } else if (!strcmp(tok, "cep")) {
+            ev->cep = strtoul(val, NULL, 10);
+        } else if (!strcmp(tok, "type")) {
+            ev->type = strtoul(val, NULL, 10);
+        } else if (!strcmp(tok, "len")) {
+            ev->len = strtoul(val, NULL, 10);
+        } else if (!strcmp(tok, "qlen")) {
+            ev->qlen = strtoul(val, NULL, 10);
+        } else if (!strcmp(tok, "cwq")) {
+            ev->cwq = strtoul(val, NULL, 10);
+        } else if (!strcmp(tok, "rtxq")) {
+            ev->rtxq = strtoul(val, NULL, 10);
+        }
+    }
+
+    return 0;
+}
+
+static void
+event_process(const struct event *ev)
+{
+    struct port_stats *ps = port_stats_get(ev->ipcp, ev->port);
+    uint64_t key[4];
+    double ts;
+
+    events_parsed++;
+
+    if (!strcmp(ev->name, "rmt_enq") || !strcmp(ev->name, "rmt_deq")) {
+        key[0] = ((uint64_t)ev->ipcp << 32) | ev->type;
+        key[1] = ev->dst;
+        key[2] = ev->cep;
+        key[3] = ev->seq;
+        if (ev->name[4] == 'e') {
+            pending_push(rmtq_pending, key, ev->ts);
+            hist_add(&ps->rmtq_len, ev->qlen);
+        } else if ((ts = pending_pop(rmtq_pending, key)) >= 0) {
+            hist_add(&ps->rmtq_us, usecs(ts, ev->ts));
+        } else {
+            events_unmatched++;
+        }
+
+    } else if (!strcmp(ev->name, "seqq_push") ||
+               !strcmp(ev->name, "seqq_pop")) {
+        key[0] = ev->ipcp;
+        key[1] = ev->port;
+        key[2] = 0;
+        key[3] = ev->seq;
+        if (!strcmp(ev->name, "seqq_push")) {
+            pending_push(seqq_pending, key, ev->ts);
+            hist_add(&ps->seqq_len, ev->qlen);
+        } else if ((ts = pending_pop(seqq_pending, key)) >= 0) {
+            hist_add(&ps->seqq_us, usecs(ts, ev->ts));
+        } else {
+            events_unmatched++;
+        }
+
+    } else if (!strcmp(ev->name, "fc_block")) {
+        ps->fc_blocks++;
+        ps->fc_block_ts = ev->ts;
+
+    } else if (!strcmp(ev->name, "fc_unblock")) {
+        if (ps->fc_block_ts >= 0) {
+            hist_add(&ps->fc_us, usecs(ps->fc_block_ts, ev->ts));
+            ps->fc_block_ts = -1.0;
+        } else {
+            events_unmatched++;
+        }
+
+    } else if (!strcmp(ev->name, "sdu_write")) {
+        ps->tx++;
+        hist_add(&ps->cwq_len, ev->qlen);
+
+    } else if (!strcmp(ev->name, "sdu_rx")) {
+        ps->rx++;
+
+    } else if (!strcmp(ev->name, "rtx_fire")) {
+        ps->rtx++;
+        hist_add(&ps->rtxq_len, ev->qlen);
+    }
+}
+
+static void
+report(void)
+{
+    struct port_stats *ps;
+
+    printf("%llu events processed, %llu unmatched\n",
+           (unsigned long long)events_parsed,
+           (unsigned long long)events_unmatched);
+
+    list_for_each_entry (ps, &ports, node) {
+        printf("ipcp %u port %u: tx %llu rx %llu rtx %llu fc-blocks %llu\n",
+               ps->ipcp, ps->port, (unsigned long long)ps->tx,
+               (unsigned long long)ps->rx, (unsigned long long)ps->rtx,
+               (unsigned long long)ps->fc_blocks);
+        hist_print("rmt queueing", "us", &ps->rmtq_us);
+        hist_print("rmt queue length", "PDUs", &ps->rmtq_len);
+        hist_print("seqq residence", "us", &ps->seqq_us);
+        hist_print("seqq length", "PDUs", &ps->seqq_len);
+        hist_print("flow control blocked", "us", &ps->fc_us);
+        hist_print("cwq length", "PDUs", &ps->cwq_len);
+        hist_print("rtxq length", "PDUs", &ps->rtxq_len);
+    }
+}
+
+static const char *
+tracefs_dir(void)
+{
+    static const char *dirs[] = {"/sys/kernel/tracing",
+                                 "/sys/kernel/debug/tracing"};
+    unsigned int i;
+
+    for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        char path[128];
+
+        snprintf(path, sizeof(path), "%s/events/rlite", dirs[i]);
+        if (access(path, F_OK) == 0) {
+            return dirs[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int
+tracefs_enable(const char *dir, int enable)
+{
+    char path[128];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/events/rlite/enable", dir);
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "fopen(%s) failed [%s]\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "%d\n", enable ? 1 : 0);
+    fclose(f);
+
+    return 0;
+}
+
+static void
+sig_handler(int signum)
+{
+    stop = 1;
+}
+
+static void
+usage(void)
+{
+    printf("rlite-trace [OPTIONS]\n"
+           "   -h : show this help\n"
+           "   -f FILE : read events from FILE rather than from the "
+           "tracefs trace_pipe\n"
+           "   -d SECONDS : stop collecting after SECONDS\n"
+           "   -n : do not enable/disable the rlite events in tracefs\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *file  = NULL;
+    const char *dir   = NULL;
+    int manage_events = 1;
+    unsigned int secs = 0;
+    struct sigaction sa;
+    char line[1024];
+    FILE *f;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hf:d:n")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+
+        case 'f':
+            file = optarg;
+            break;
+
+        case 'd':
+            secs = atoi(optarg);
+            break;
+
+        case 'n':
+            manage_events = 0;
+            break;
+
+        default:
+            printf("    Unrecognized option %c\n", opt);
+            usage();
+            return -1;
+        }
+    }
+
+    list_init(&ports);
+
+    if (!file) {
+        static char pipe_path[128];
+
+        dir = tracefs_dir();
+        if (!dir) {
+            fprintf(stderr, "rlite tracepoints not found in tracefs "
+                            "(is rlite-normal loaded?)\n");
+            return -1;
+        }
+        snprintf(pipe_path, sizeof(pipe_path), "%s/trace_pipe", dir);
+        file = pipe_path;
+        if (manage_events && tracefs_enable(dir, 1)) {
+            return -1;
+        }
+    } else {
+        manage_events = 0;
+    }
+
+    /* No SA_RESTART, so that a blocking read on the trace_pipe is
+     * interrupted. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+    if (secs) {
+        alarm(secs);
+    }
+
+    f = fopen(file, "r");
+    if (!f) {
+        fprintf(stderr, "fopen(%s) failed [%s]\n", file, strerror(errno));
+        if (manage_events) {
+            tracefs_enable(dir, 0);
+        }
+        return -1;
+    }
+
+    while (!stop && fgets(line, sizeof(line), f)) {
+        struct event ev;
+
+        if (event_parse(line, &ev) == 0) {
+            event_process(&ev);
+        }
+    }
+    fclose(f);
+
+    if (manage_events) {
+        tracefs_enable(dir, 0);
+    }
+
+    report();
+
+    return 0;
+}
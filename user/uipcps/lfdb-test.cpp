@@ -28,8 +28,53 @@
 #include <chrono>
 #include <unistd.h>
 #include <cmath>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <map>
+#include <queue>
+#include <cstdlib>
+#include <new>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <malloc.h>
 
 #include "uipcp-normal-lfdb.hpp"
+#include "uipcp-normal-ribsync.hpp"
+#include "rlite/utils.h"
+
+/* Number of heap allocations performed so far, and number of bytes
+ * currently allocated, used by the benchmarks. */
+static size_t num_allocs = 0;
+static std::atomic<size_t> heap_bytes(0);
+
+void *
+operator new(size_t size)
+{
+    void *p = std::malloc(size ? size : 1);
+
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    num_allocs++;
+    heap_bytes += malloc_usable_size(p);
+    return p;
+}
+
+void
+operator delete(void *p) noexcept
+{
+    heap_bytes -= malloc_usable_size(p);
+    std::free(p);
+}
+
+void
+operator delete(void *p, size_t) noexcept
+{
+    heap_bytes -= malloc_usable_size(p);
+    std::free(p);
+}
 
 /* A type to represent a single routing table, excluding the default next
  * hop. */
@@ -69,8 +114,8 @@ struct TestLFDB : public rlite::LFDB {
             lf1.set_age(0);
             lf2.set_age(0);
 
-            db[lf1.local_node()][lf1.remote_node()] = lf1;
-            db[lf2.local_node()][lf2.remote_node()] = lf2;
+            add(lf1);
+            add(lf2);
         }
     }
 };
@@ -105,19 +150,1364 @@ reachable(const RoutingTables &rtables, int src_node, int dst_node,
     return cur == dst && expected_nhops == 0;
 }
 
+/* Build the forwarding table of the local node from the next hops computed
+ * by the LFDB, using 'node + 1' as address and 'next hop + 1' as port. All
+ * the equal cost next hops are used, if any, and the first LFA (if any) is
+ * used as backup. */
+static rlite::FwdTable
+fwd_table_build(const rlite::LFDB &lfdb)
+{
+    rlite::FwdTable table;
+
+    for (const auto &kv : lfdb.next_hops) {
+        rlm_addr_t dst_addr = std::stoi(kv.first) + 1;
+        auto ecmp           = lfdb.next_hops_ecmp.find(kv.first);
+        size_t num_nhops =
+            ecmp == lfdb.next_hops_ecmp.end() ? 1 : ecmp->second;
+        rl_port_t backup = rlite::kPortIdNone;
+        std::vector<rl_port_t> ports;
+
+        for (size_t i = 0; i < num_nhops; i++) {
+            ports.push_back(std::stoi(kv.second[i]) + 1);
+        }
+        std::sort(ports.begin(), ports.end());
+        if (kv.second.size() > num_nhops) {
+            backup = std::stoi(kv.second[num_nhops]) + 1;
+        }
+        table[dst_addr] = rlite::FwdEntry(kv.first, std::move(ports), backup);
+    }
+
+    return table;
+}
+
+/* Apply a list of PDUFT operations to a forwarding table, as the kernel
+ * would do. Returns -1 if the list is not well formed. */
+static int
+fwd_table_apply(rlite::FwdTable &table,
+                const std::vector<struct rl_pduft_op> &ops)
+{
+    for (size_t i = 0; i < ops.size(); i++) {
+        const struct rl_pduft_op &op = ops[i];
+
+        switch (op.op) {
+        case RL_PDUFT_OP_DEL:
+            table.erase(op.match.dst_addr);
+            break;
+        case RL_PDUFT_OP_SET:
+            table[op.match.dst_addr].ports.assign(1, op.local_port);
+            table[op.match.dst_addr].backup = rlite::kPortIdNone;
+            break;
+        case RL_PDUFT_OP_ADD:
+            if (i == 0 || (ops[i - 1].op != RL_PDUFT_OP_SET &&
+                           ops[i - 1].op != RL_PDUFT_OP_ADD) ||
+                ops[i - 1].match.dst_addr != op.match.dst_addr ||
+                table[op.match.dst_addr].ports.size() >= RL_PDUFT_ECMP_MAX) {
+                return -1;
+            }
+            table[op.match.dst_addr].ports.push_back(op.local_port);
+            break;
+        case RL_PDUFT_OP_BACKUP:
+            if (i == 0 || (ops[i - 1].op != RL_PDUFT_OP_SET &&
+                           ops[i - 1].op != RL_PDUFT_OP_ADD) ||
+                ops[i - 1].match.dst_addr != op.match.dst_addr) {
+                return -1;
+            }
+            table[op.match.dst_addr].backup = op.local_port;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Check that applying a list of PDUFT operations to the 'cur' forwarding
+ * table results in the 'next' one. */
+static bool
+fwd_table_check(rlite::FwdTable cur, const rlite::FwdTable &next,
+                const std::vector<struct rl_pduft_op> &ops)
+{
+    if (fwd_table_apply(cur, ops)) {
+        std::cout << "Malformed PDUFT batch" << std::endl;
+        return false;
+    }
+    for (const auto &kv : next) {
+        auto it = cur.find(kv.first);
+        if (it == cur.end() || !it->second.same_ports(kv.second)) {
+            std::cout << "PDUFT batch does not produce the new table"
+                      << std::endl;
+            return false;
+        }
+    }
+    if (cur.size() != next.size()) {
+        std::cout << "PDUFT batch leaves stale entries" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/* Measure the time needed to react to a link failure in a grid network of
+ * 'n' nodes, from the routing computation to the preparation of the
+ * kernel update messages, comparing a single batched PDUFT update with one
+ * message per changed entry. Also check that the computed batch transforms
+ * the old forwarding table into the new one. */
+static int
+fwd_table_update_test(int n, int verbosity)
+{
+    using Clock = std::chrono::steady_clock;
+    int sqn     = std::max(static_cast<int>(std::sqrt(n)), 2);
+    std::vector<struct rl_pduft_op> ops;
+    rlite::FwdTable old_table, new_table;
+    TestLFDB::LinksList links;
+    std::vector<char> serbuf;
+
+    for (int i = 0; i < sqn; i++) {
+        for (int j = 0; j < sqn - 1; j++) {
+            links.push_back({i * sqn + j, i * sqn + j + 1});
+            links.push_back({j * sqn + i, (j + 1) * sqn + i});
+        }
+    }
+
+    TestLFDB lfdb(links, /*lfa_enabled=*/false);
+
+    lfdb.compute_next_hops("0");
+    old_table = fwd_table_build(lfdb);
+
+    /* The link towards node 1 fails, so that the routes towards about half
+     * of the network must be moved to the other neighbor. */
+    auto start = Clock::now();
+    lfdb.del("0", "1");
+    lfdb.del("1", "0");
+    lfdb.compute_next_hops("0");
+    new_table = fwd_table_build(lfdb);
+    rlite::fwd_table_diff(old_table, new_table, ops);
+    auto t_compute = Clock::now() - start;
+
+    /* Apply the batch to the old table and compare. */
+    if (!fwd_table_check(old_table, new_table, ops)) {
+        return -1;
+    }
+
+    /* One batched message. */
+    struct rl_kmsg_ipcp_pduft_batch bmsg = {};
+    start                                = Clock::now();
+    bmsg.hdr.msg_type                    = RLITE_KER_IPCP_PDUFT_BATCH;
+    bmsg.ops.elem_size                   = sizeof(ops[0]);
+    bmsg.ops.num_elements                = ops.size();
+    bmsg.ops.slots.raw                   = ops.data();
+    serbuf.resize(rl_msg_serlen(rl_ker_numtables, RLITE_KER_MSG_MAX,
+                                RLITE_MB(&bmsg)));
+    size_t batch_bytes = serialize_rlite_msg(
+        rl_ker_numtables, RLITE_KER_MSG_MAX, serbuf.data(), RLITE_MB(&bmsg));
+    auto t_batch = Clock::now() - start;
+
+    /* One message per entry. */
+    size_t single_bytes = 0;
+    start               = Clock::now();
+    for (const auto &op : ops) {
+        struct rl_kmsg_ipcp_pduft_mod req = {};
+        char buf[128];
+
+        req.hdr.msg_type = op.op == RL_PDUFT_OP_SET ? RLITE_KER_IPCP_PDUFT_SET
+                                                    : RLITE_KER_IPCP_PDUFT_DEL;
+        req.local_port   = op.local_port;
+        req.match        = op.match;
+        single_bytes += serialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX,
+                                            buf, RLITE_MB(&req));
+    }
+    auto t_single = Clock::now() - start;
+
+    auto us = [](Clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+
+    std::cout << "PDUFT update after link failure (" << sqn * sqn
+              << " nodes): " << ops.size() << " changes, routing "
+              << us(t_compute) << " us" << std::endl;
+    std::cout << "    batched:   1 message, " << batch_bytes << " bytes, "
+              << us(t_batch) << " us" << std::endl;
+    std::cout << "    per-entry: " << ops.size() << " messages, "
+              << single_bytes << " bytes, " << us(t_single) << " us"
+              << std::endl;
+    if (verbosity >= 1) {
+        std::cout << "    " << sizeof(ops[0]) << " bytes per operation"
+                  << std::endl;
+    }
+
+    return 0;
+}
+
+/* Generate a random connected network with 'n' nodes and about 2n links:
+ * a random spanning tree plus n random links. */
+static TestLFDB::LinksList
+random_topology(int n)
+{
+    std::set<std::pair<int, int>> added;
+    TestLFDB::LinksList links;
+    std::mt19937 rng(n);
+
+    auto link_add = [&added, &links](int a, int b) {
+        if (a == b || !added.insert({std::min(a, b), std::max(a, b)}).second) {
+            return;
+        }
+        links.push_back({a, b});
+    };
+
+    for (int i = 1; i < n; i++) {
+        link_add(i, rng() % i);
+    }
+    for (int i = 0; i < n; i++) {
+        link_add(rng() % n, rng() % n);
+    }
+
+    return links;
+}
+
+/* Generate a k-ary fat-tree network with at least 'n' nodes, hosts
+ * included. Nodes 0 .. k^3/4 - 1 are the hosts, followed by the edge,
+ * aggregation and core switches. */
+static TestLFDB::LinksList
+fat_tree_topology(int n)
+{
+    TestLFDB::LinksList links;
+    int k = 4;
+
+    while (k * k * k / 4 + 5 * k * k / 4 < n) {
+        k += 2;
+    }
+
+    int h     = k / 2;
+    int hosts = k * k * k / 4;
+    int edge  = hosts;
+    int aggr  = edge + k * h;
+    int core  = aggr + k * h;
+
+    for (int p = 0; p < k; p++) {
+        for (int i = 0; i < h; i++) {
+            int e = edge + p * h + i;
+            int a = aggr + p * h + i;
+
+            for (int j = 0; j < h; j++) {
+                /* Host to edge switch. */
+                links.push_back({(p * h + i) * h + j, e});
+                /* Edge switch to aggregation switches. */
+                links.push_back({e, aggr + p * h + j});
+                /* Aggregation switch to core switches. */
+                links.push_back({a, core + i * h + j});
+            }
+        }
+    }
+
+    return links;
+}
+
+/* Check the routing table of 'source' against hop distances computed
+ * with a BFS, since all the links have unit cost. */
+static bool
+routing_check(const TestLFDB &lfdb, int source, int n)
+{
+    std::vector<std::vector<int>> adj(n);
+
+    for (const auto &link : lfdb.links) {
+        adj[link.first].push_back(link.second);
+        adj[link.second].push_back(link.first);
+    }
+
+    auto bfs = [&adj, n](int src) {
+        std::vector<int> dist(n, -1);
+        std::queue<int> q;
+
+        dist[src] = 0;
+        for (q.push(src); !q.empty(); q.pop()) {
+            for (int v : adj[q.front()]) {
+                if (dist[v] < 0) {
+                    dist[v] = dist[q.front()] + 1;
+                    q.push(v);
+                }
+            }
+        }
+        return dist;
+    };
+
+    std::unordered_map<int, std::vector<int>> neigh_dist;
+    std::vector<int> dist = bfs(source);
+    size_t reachable      = 0;
+
+    for (int v : adj[source]) {
+        neigh_dist[v] = bfs(v);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (i == source || dist[i] < 0) {
+            continue;
+        }
+        reachable++;
+
+        auto it = lfdb.next_hops.find(std::to_string(i));
+        if (it == lfdb.next_hops.end()) {
+            std::cout << "No route to node " << i << std::endl;
+            return false;
+        }
+
+        int nhop = std::stoi(it->second.front());
+        if (!neigh_dist.count(nhop) || neigh_dist[nhop][i] != dist[i] - 1) {
+            std::cout << "Next hop " << nhop << " towards node " << i
+                      << " is not on a shortest path" << std::endl;
+            return false;
+        }
+    }
+
+    return lfdb.next_hops.size() == reachable;
+}
+
+/* Measure the time and the number of allocations needed to compute the
+ * routing table of a node, for networks of increasing size up to
+ * 'max_nodes'. The first computation after a change of the LFDB includes
+ * the construction of the graph, while the following ones only run the
+ * Dijkstra algorithm and fill in the routing table. */
+static int
+routing_scaling_test(int max_nodes, int verbosity)
+{
+    using Clock = std::chrono::steady_clock;
+    std::vector<std::pair<std::string, TestLFDB::LinksList (*)(int)>>
+        topologies = {{"random", random_topology},
+                      {"fat-tree", fat_tree_topology}};
+
+    auto us = [](Clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+
+    for (int n : {1000, 5000, 10000, 50000}) {
+        if (n > max_nodes) {
+            break;
+        }
+
+        for (const auto &topo : topologies) {
+            TestLFDB::LinksList links = topo.second(n);
+            int num_nodes             = 0;
+
+            for (const auto &link : links) {
+                num_nodes = std::max(num_nodes,
+                                     std::max(link.first, link.second) + 1);
+            }
+
+            TestLFDB lfdb(links, /*lfa_enabled=*/false);
+
+            size_t allocs0 = num_allocs;
+            auto start     = Clock::now();
+            lfdb.compute_next_hops("0");
+            auto t_first        = Clock::now() - start;
+            size_t allocs_first = num_allocs - allocs0;
+
+            if (!routing_check(lfdb, 0, num_nodes)) {
+                std::cout << "Routing check failed for " << topo.first
+                          << " topology with " << num_nodes << " nodes"
+                          << std::endl;
+                return -1;
+            }
+
+            allocs0 = num_allocs;
+            start   = Clock::now();
+            lfdb.compute_next_hops("1");
+            auto t_next        = Clock::now() - start;
+            size_t allocs_next = num_allocs - allocs0;
+
+            std::cout << "Routing " << topo.first << " (" << num_nodes
+                      << " nodes, " << links.size() << " links): first "
+                      << us(t_first) << " us, " << allocs_first
+                      << " allocs; next " << us(t_next) << " us, "
+                      << allocs_next << " allocs" << std::endl;
+            if (verbosity >= 1) {
+                std::cout << "    " << lfdb.next_hops.size()
+                          << " routing table entries" << std::endl;
+            }
+
+            /* Run LFA from the node with most neighbors, with one thread
+             * and with a pool of threads, which must produce the same
+             * routing table. */
+            std::unordered_map<int, int> degree;
+            int hub = 0;
+
+            for (const auto &link : links) {
+                degree[link.first]++;
+                degree[link.second]++;
+            }
+            for (const auto &kv : degree) {
+                if (kv.second > degree[hub]) {
+                    hub = kv.first;
+                }
+            }
+
+            NextHops lfa_routes;
+
+            for (unsigned int threads : {1, 4}) {
+                TestLFDB lfa_lfdb(links, /*lfa_enabled=*/true);
+
+                lfa_lfdb.lfa_threads = threads;
+                start                = Clock::now();
+                lfa_lfdb.compute_next_hops(std::to_string(hub));
+                auto t_lfa = Clock::now() - start;
+
+                if (threads == 1) {
+                    lfa_routes = std::move(lfa_lfdb.next_hops);
+                } else if (lfa_routes != lfa_lfdb.next_hops) {
+                    std::cout << "Parallel LFA computation produced a "
+                                 "different routing table"
+                              << std::endl;
+                    return -1;
+                }
+
+                const auto &times = lfa_lfdb.last_times;
+                std::cout << "    LFA from node " << hub << " ("
+                          << degree[hub] << " neighbors, " << threads
+                          << " threads): " << us(t_lfa) << " us [graph "
+                          << times.graph_us << ", spf " << times.spf_us
+                          << ", lfa-spf " << times.lfa_spf_us << ", merge "
+                          << times.merge_us << "]" << std::endl;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Set the cost of the link between 'a' and 'b', in both directions. */
+static void
+link_cost_set(rlite::LFDB &lfdb, int a, int b, unsigned int cost)
+{
+    for (int dir = 0; dir < 2; dir++) {
+        gpb::LowerFlow lf;
+
+        lf.set_local_node(std::to_string(dir ? b : a));
+        lf.set_remote_node(std::to_string(dir ? a : b));
+        lf.set_cost(cost);
+        lf.set_seqnum(1);
+        lf.set_state(true);
+        lf.set_age(0);
+        lfdb.add(lf);
+    }
+}
+
+/* Compare the convergence time of the incremental shortest path updates
+ * against the full recomputation, on random networks with random link
+ * costs where a link at a time changes cost, goes down or comes back up.
+ * After each change, the distances computed incrementally are checked
+ * against the full computation. At the end, the next hops are also
+ * checked, allowing for different choices in case of equal cost paths. */
+static int
+spf_convergence_test(int max_nodes, int verbosity)
+{
+    using Clock           = std::chrono::steady_clock;
+    const int num_changes = 100;
+    const std::string src = "0";
+
+    auto us = [](Clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+
+    for (int n : {1000, 5000, 10000, 50000}) {
+        if (n > max_nodes) {
+            break;
+        }
+
+        for (bool lfa : {false, true}) {
+            TestLFDB::LinksList links = random_topology(n);
+            std::vector<unsigned int> costs(links.size());
+            rlite::LFDB incr(lfa), full(lfa);
+            Clock::duration t_incr(0), t_full(0);
+            std::mt19937 rng(n + 1);
+
+            full.spf_incremental_max_changes = 0;
+            incr.lfa_threads                 = 4;
+            for (size_t l = 0; l < links.size(); l++) {
+                costs[l] = 1 + rng() % 1000;
+                link_cost_set(incr, links[l].first, links[l].second, costs[l]);
+                link_cost_set(full, links[l].first, links[l].second, costs[l]);
+            }
+            incr.compute_next_hops(src);
+            full.compute_next_hops(src);
+
+            for (int i = 0; i < num_changes; i++) {
+                size_t l = rng() % links.size();
+                int a    = links[l].first;
+                int b    = links[l].second;
+
+                if (costs[l] == 0) {
+                    costs[l] = 1 + rng() % 1000; /* link comes back up */
+                } else {
+                    switch (rng() % 3) {
+                    case 0:
+                        costs[l] = 0; /* link goes down */
+                        break;
+                    case 1:
+                        costs[l] += 1 + rng() % 1000;
+                        break;
+                    default:
+                        costs[l] = 1 + rng() % costs[l];
+                        break;
+                    }
+                }
+
+                for (rlite::LFDB *lfdb : {&incr, &full}) {
+                    if (costs[l] == 0) {
+                        lfdb->del(std::to_string(a), std::to_string(b));
+                        lfdb->del(std::to_string(b), std::to_string(a));
+                    } else {
+                        link_cost_set(*lfdb, a, b, costs[l]);
+                    }
+                }
+
+                auto start = Clock::now();
+                incr.compute_next_hops(src);
+                t_incr += Clock::now() - start;
+                start = Clock::now();
+                full.compute_next_hops(src);
+                t_full += Clock::now() - start;
+
+                if (incr.next_hops.size() != full.next_hops.size()) {
+                    std::cout << "Incremental SPF has "
+                              << incr.next_hops.size() << " routes, "
+                              << full.next_hops.size() << " expected"
+                              << std::endl;
+                    return -1;
+                }
+                for (const auto &kv : full.next_hops) {
+                    if (!incr.next_hops.count(kv.first) ||
+                        incr.distance(kv.first) != full.distance(kv.first)) {
+                        std::cout << "Incremental SPF computed a wrong "
+                                     "distance for node "
+                                  << kv.first << " after change #" << i
+                                  << std::endl;
+                        return -1;
+                    }
+                }
+            }
+
+            /* Each next hop must be on a shortest path, and the LFAs must
+             * be the same. The LFAs are compared leaving out the primary
+             * next hops, which may differ in case of equal cost paths. */
+            std::unordered_map<rlite::NodeId, std::vector<unsigned int>>
+                neigh_dists;
+
+            for (const auto &kv : full.db.at(full.nim.FindId(src))) {
+                const rlite::NodeId &neigh = full.nim.GetName(kv.first);
+
+                full.compute_next_hops(neigh);
+                for (int v = 0; v < n; v++) {
+                    neigh_dists[neigh].push_back(
+                        full.distance(std::to_string(v)));
+                }
+            }
+            full.compute_next_hops(src);
+
+            for (const auto &kv : incr.next_hops) {
+                const rlite::NodeId &nhop = kv.second.front();
+                gpb::LowerFlow lf;
+                std::vector<rlite::NodeId> a(kv.second.begin() + 1,
+                                             kv.second.end());
+                std::vector<rlite::NodeId> b(
+                    full.next_hops[kv.first].begin(),
+                    full.next_hops[kv.first].end());
+
+                b.erase(std::remove(b.begin(), b.end(), nhop), b.end());
+                b.erase(std::remove(b.begin(), b.end(),
+                                    full.next_hops[kv.first].front()),
+                        b.end());
+                a.erase(std::remove(a.begin(), a.end(),
+                                    full.next_hops[kv.first].front()),
+                        a.end());
+                if (!incr.find(src, nhop, &lf) || !neigh_dists.count(nhop) ||
+                    lf.cost() +
+                            neigh_dists[nhop][std::stoi(kv.first)] !=
+                        incr.distance(kv.first) ||
+                    a != b) {
+                    std::cout << "Incremental SPF computed a wrong next hop "
+                                 "for node "
+                              << kv.first << std::endl;
+                    return -1;
+                }
+            }
+
+            std::cout << "SPF convergence (" << n << " nodes, "
+                      << links.size() << " links" << (lfa ? ", LFA" : "")
+                      << "): incremental " << us(t_incr) / num_changes
+                      << " us, full " << us(t_full) / num_changes
+                      << " us per change" << std::endl;
+            if (verbosity >= 1) {
+                std::cout << "    " << incr.next_hops.size()
+                          << " routing table entries" << std::endl;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Split a routing table entry into the sorted list of equal cost next
+ * hops and the sorted list of the other next hops (LFAs). */
+static std::pair<std::vector<rlite::NodeId>, std::vector<rlite::NodeId>>
+ecmp_split(const rlite::LFDB &lfdb, const rlite::NodeId &dst)
+{
+    const std::vector<rlite::NodeId> &nhops = lfdb.next_hops.at(dst);
+    auto ecmp         = lfdb.next_hops_ecmp.find(dst);
+    size_t num_nhops  = ecmp == lfdb.next_hops_ecmp.end() ? 1 : ecmp->second;
+    std::vector<rlite::NodeId> head(nhops.begin(), nhops.begin() + num_nhops);
+    std::vector<rlite::NodeId> tail(nhops.begin() + num_nhops, nhops.end());
+
+    std::sort(head.begin(), head.end());
+    std::sort(tail.begin(), tail.end());
+
+    return std::make_pair(std::move(head), std::move(tail));
+}
+
+/* Check the equal cost next hops on a grid network, where each node out
+ * of the first row and column can be reached from the top left corner
+ * through both its neighbors. Then check that the incremental updates
+ * agree with the full computations on a random network with few distinct
+ * link costs, where equal cost paths are common, and that the PDUFT
+ * batches correctly update the groups of lower flows. */
+static int
+ecmp_test(int n, int verbosity)
+{
+    const int num_changes = 100;
+    const std::string src = "0";
+    int sqn = std::max(static_cast<int>(std::sqrt(n)), 2);
+    TestLFDB::LinksList links;
+
+    for (int i = 0; i < sqn; i++) {
+        for (int j = 0; j < sqn - 1; j++) {
+            links.push_back({i * sqn + j, i * sqn + j + 1});
+            links.push_back({j * sqn + i, (j + 1) * sqn + i});
+        }
+    }
+
+    TestLFDB grid(links, /*lfa_enabled=*/true);
+
+    grid.ecmp_enabled = true;
+    grid.compute_next_hops(src);
+    for (int v = 1; v < sqn * sqn; v++) {
+        std::vector<rlite::NodeId> expected;
+
+        if (v / sqn > 0) {
+            expected.push_back(std::to_string(sqn));
+        }
+        if (v % sqn > 0) {
+            expected.push_back("1");
+        }
+        std::sort(expected.begin(), expected.end());
+        if (ecmp_split(grid, std::to_string(v)).first != expected) {
+            std::cout << "Wrong equal cost next hops for node " << v
+                      << std::endl;
+            return -1;
+        }
+    }
+
+    links = random_topology(n);
+
+    std::vector<unsigned int> costs(links.size());
+    rlite::LFDB incr(/*lfa_enabled=*/true), full(/*lfa_enabled=*/true);
+    std::vector<struct rl_pduft_op> ops;
+    rlite::FwdTable table, new_table;
+    size_t max_ecmp_routes = 0;
+    std::mt19937 rng(n + 2);
+
+    incr.ecmp_enabled                = true;
+    full.ecmp_enabled                = true;
+    full.spf_incremental_max_changes = 0;
+    for (size_t l = 0; l < links.size(); l++) {
+        costs[l] = 1 + rng() % 3;
+        link_cost_set(incr, links[l].first, links[l].second, costs[l]);
+        link_cost_set(full, links[l].first, links[l].second, costs[l]);
+    }
+    incr.compute_next_hops(src);
+    table = fwd_table_build(incr);
+
+    for (int i = 0; i < num_changes; i++) {
+        size_t l = rng() % links.size();
+        int a    = links[l].first;
+        int b    = links[l].second;
+
+        costs[l] = costs[l] == 0 ? 1 + rng() % 3 : rng() % 4;
+        for (rlite::LFDB *lfdb : {&incr, &full}) {
+            if (costs[l] == 0) {
+                lfdb->del(std::to_string(a), std::to_string(b));
+                lfdb->del(std::to_string(b), std::to_string(a));
+            } else {
+                link_cost_set(*lfdb, a, b, costs[l]);
+            }
+            lfdb->compute_next_hops(src);
+        }
+
+        if (incr.next_hops.size() != full.next_hops.size() ||
+            incr.next_hops_ecmp.size() != full.next_hops_ecmp.size()) {
+            std::cout << "Incremental ECMP has " << incr.next_hops.size()
+                      << " routes, " << full.next_hops.size() << " expected"
+                      << std::endl;
+            return -1;
+        }
+        for (const auto &kv : full.next_hops) {
+            if (!incr.next_hops.count(kv.first) ||
+                ecmp_split(incr, kv.first) != ecmp_split(full, kv.first)) {
+                std::cout << "Incremental ECMP computed wrong next hops "
+                             "for node "
+                          << kv.first << " after change #" << i << std::endl;
+                return -1;
+            }
+        }
+        max_ecmp_routes = std::max(max_ecmp_routes, full.next_hops_ecmp.size());
+
+        new_table = fwd_table_build(incr);
+        rlite::fwd_table_diff(table, new_table, ops);
+        if (!fwd_table_check(table, new_table, ops)) {
+            return -1;
+        }
+        table = std::move(new_table);
+    }
+
+    if (max_ecmp_routes == 0) {
+        std::cout << "No equal cost routes found" << std::endl;
+        return -1;
+    }
+
+    std::cout << "ECMP (" << n << " nodes, " << links.size()
+              << " links): up to " << max_ecmp_routes
+              << " routes with equal cost next hops" << std::endl;
+    if (verbosity >= 1) {
+        std::cout << "    " << full.next_hops.size()
+                  << " routing table entries" << std::endl;
+    }
+
+    return 0;
+}
+
+/* Follow the forwarding tables of the nodes from 'src' to 'dst', with the
+ * link between 'a' and 'b' down. The first port of each entry is used.
+ * With 'frr', a node switches to the backup port of the entry when the
+ * primary one uses the failed link. Returns true if the packet reaches
+ * 'dst' without loops. */
+static bool
+frr_deliver(const std::vector<rlite::FwdTable> &tables, int src, int dst,
+            int a, int b, bool frr)
+{
+    int cur = src;
+
+    for (size_t hops = 0; hops < tables.size(); hops++) {
+        if (cur == dst) {
+            return true;
+        }
+
+        auto it = tables[cur].find(dst + 1);
+        if (it == tables[cur].end()) {
+            return false;
+        }
+
+        int next = it->second.ports.front() - 1;
+        if ((cur == a && next == b) || (cur == b && next == a)) {
+            if (!frr || it->second.backup == rlite::kPortIdNone) {
+                return false;
+            }
+            next = it->second.backup - 1;
+        }
+        cur = next;
+    }
+
+    return false;
+}
+
+/* Inject the failure of the busiest link of a node in a random network
+ * with random link costs, and count the packets lost while the routing
+ * converges, with and without the LFA backup entries (fast reroute).
+ * Each node sends a packet to each destination every 100 microseconds.
+ * The outage lasts for the initial delay of the routing computation
+ * plus the time to compute the new routing and forwarding tables. */
+static int
+frr_test(int n, int verbosity)
+{
+    using Clock                   = std::chrono::steady_clock;
+    TestLFDB::LinksList links     = random_topology(n);
+    const int src                 = 0;
+    const uint64_t pkt_intval_us  = 100;
+    const uint64_t spf_initial_us = 50000;
+    std::vector<rlite::FwdTable> tables(n);
+    rlite::LFDB lfdb(/*lfa_enabled=*/true);
+    std::mt19937 rng(n + 11);
+    std::map<int, int> nhop_routes;
+
+    for (size_t l = 0; l < links.size(); l++) {
+        link_cost_set(lfdb, links[l].first, links[l].second, 1 + rng() % 4);
+    }
+    for (int v = 0; v < n; v++) {
+        lfdb.compute_next_hops(std::to_string(v));
+        tables[v] = fwd_table_build(lfdb);
+    }
+
+    /* Fail the link towards the next hop used by most of the routes. */
+    for (const auto &kve : tables[src]) {
+        nhop_routes[kve.second.ports.front() - 1]++;
+    }
+    int a = src;
+    int b = std::max_element(nhop_routes.begin(), nhop_routes.end(),
+                             [](const std::pair<const int, int> &x,
+                                const std::pair<const int, int> &y) {
+                                 return x.second < y.second;
+                             })
+                ->first;
+
+    /* Measure the reconvergence of the source node. */
+    auto start = Clock::now();
+    lfdb.del(std::to_string(a), std::to_string(b));
+    lfdb.del(std::to_string(b), std::to_string(a));
+    lfdb.compute_next_hops(std::to_string(src));
+    rlite::FwdTable new_table = fwd_table_build(lfdb);
+    std::vector<struct rl_pduft_op> ops;
+    rlite::fwd_table_diff(tables[src], new_table, ops);
+    uint64_t outage_us =
+        spf_initial_us + std::chrono::duration_cast<std::chrono::microseconds>(
+                             Clock::now() - start)
+                             .count();
+
+    size_t affected = 0, lost_frr = 0, lost = 0;
+    for (int dst = 0; dst < n; dst++) {
+        if (dst == src || !tables[src].count(dst + 1)) {
+            continue;
+        }
+        bool ok     = frr_deliver(tables, src, dst, a, b, /*frr=*/false);
+        bool ok_frr = frr_deliver(tables, src, dst, a, b, /*frr=*/true);
+
+        if (!ok) {
+            affected++;
+        }
+        if (ok_frr && !ok &&
+            tables[src].at(dst + 1).backup == rlite::kPortIdNone) {
+            std::cout << "FRR delivered to " << dst << " without a backup"
+                      << std::endl;
+            return -1;
+        }
+        if (!ok_frr && tables[src].at(dst + 1).backup != rlite::kPortIdNone &&
+            tables[src].at(dst + 1).ports.front() - 1 == b) {
+            std::cout << "LFA backup towards " << dst << " is not loop free"
+                      << std::endl;
+            return -1;
+        }
+        lost += !ok;
+        lost_frr += !ok_frr;
+    }
+
+    if (affected == 0) {
+        std::cout << "Link failure did not affect any route" << std::endl;
+        return -1;
+    }
+
+    std::cout << "FRR (" << n << " nodes): failure of link " << a << "-" << b
+              << " affects " << affected << " routes, " << affected - lost_frr
+              << " protected by LFA" << std::endl;
+    std::cout << "    packets lost in " << outage_us / 1000
+              << " ms of outage: " << lost * outage_us / pkt_intval_us
+              << " without FRR, " << lost_frr * outage_us / pkt_intval_us
+              << " with FRR" << std::endl;
+    if (verbosity >= 1) {
+        std::cout << "    " << ops.size() << " PDUFT operations to converge"
+                  << std::endl;
+    }
+
+    return 0;
+}
+
+/* Compare the memory used to store the lower flows of a large network,
+ * and the bytes needed to flood them, before and after interning the
+ * node names. Each node floods its own lower flows in messages of up to
+ * 10 flows, and the hash tree synchronization pushes batches of random
+ * flows. The compact encoding is also checked to decode into the same
+ * lower flows. */
+static int
+compact_test(int n)
+{
+    TestLFDB::LinksList links = random_topology(n);
+    const int batch           = 10;
+    std::vector<gpb::LowerFlow> flows;
+    std::mt19937 rng(n);
+
+    auto node_name = [](int i) { return "n" + std::to_string(i) + ".IPCP"; };
+
+    for (const auto &link : links) {
+        for (int dir = 0; dir < 2; dir++) {
+            gpb::LowerFlow lf;
+
+            lf.set_local_node(node_name(dir ? link.second : link.first));
+            lf.set_remote_node(node_name(dir ? link.first : link.second));
+            lf.set_cost(1 + rng() % 4);
+            lf.set_seqnum(1 + rng() % 1000);
+            lf.set_state(true);
+            lf.set_age(rng() % 900);
+            flows.push_back(lf);
+        }
+    }
+
+    /* Memory used by the database, as stored before the interning. */
+    size_t bytes0 = heap_bytes;
+    size_t legacy_bytes;
+    {
+        std::unordered_map<std::string,
+                           std::unordered_map<std::string, gpb::LowerFlow>>
+            legacy;
+
+        for (const gpb::LowerFlow &lf : flows) {
+            legacy[lf.local_node()][lf.remote_node()] = lf;
+        }
+        legacy_bytes = heap_bytes - bytes0;
+    }
+
+    /* Memory used by the database and by the table of the names. */
+    rlite::LFDB lfdb(/*lfa_enabled=*/false);
+    size_t db_bytes;
+
+    for (const gpb::LowerFlow &lf : flows) {
+        lfdb.add(lf);
+    }
+    bytes0 = heap_bytes;
+    {
+        auto db  = lfdb.db;
+        auto nim = lfdb.nim;
+
+        db_bytes = heap_bytes - bytes0;
+    }
+
+    /* Bytes flooded, with both encodings. */
+    size_t flood_bytes[2] = {0, 0}, push_bytes[2] = {0, 0};
+    std::vector<gpb::LowerFlowList> lists;
+
+    std::sort(flows.begin(), flows.end(),
+              [](const gpb::LowerFlow &a, const gpb::LowerFlow &b) {
+                  return a.local_node() < b.local_node();
+              });
+    for (size_t i = 0; i < flows.size();) {
+        gpb::LowerFlowList lfl;
+
+        /* A node floods only its own lower flows. */
+        do {
+            *lfl.add_flows() = flows[i++];
+        } while (i < flows.size() && lfl.flows_size() < batch &&
+                 flows[i].local_node() == lfl.flows(0).local_node());
+        lists.push_back(std::move(lfl));
+    }
+    size_t num_flood = lists.size();
+    std::shuffle(flows.begin(), flows.end(), rng);
+    for (size_t i = 0; i < flows.size(); i += batch) {
+        gpb::LowerFlowList lfl;
+
+        for (size_t j = i; j < std::min(i + batch, flows.size()); j++) {
+            *lfl.add_flows() = flows[j];
+        }
+        lists.push_back(std::move(lfl));
+    }
+
+    for (size_t l = 0; l < lists.size(); l++) {
+        const gpb::LowerFlowList &lfl = lists[l];
+        gpb::LowerFlowList clfl       = lfl;
+        gpb::LowerFlowList rlfl;
+        std::string buf;
+
+        rlite::lower_flows_compact(clfl);
+        clfl.SerializeToString(&buf);
+        rlfl.ParseFromString(buf);
+        if (rlfl.flows_size() != 0 || rlite::lower_flows_expand(rlfl) ||
+            rlfl.SerializeAsString() != lfl.SerializeAsString()) {
+            std::cout << "Compact encoding does not decode into the same "
+                         "lower flows"
+                      << std::endl;
+            return -1;
+        }
+        size_t *bytes = l < num_flood ? flood_bytes : push_bytes;
+
+        bytes[0] += lfl.SerializeAsString().size();
+        bytes[1] += buf.size();
+    }
+
+    /* Malformed lists are rejected. */
+    {
+        gpb::LowerFlowList lfl = lists.front();
+
+        rlite::lower_flows_compact(lfl);
+        lfl.set_remote_ids(0, lfl.nodes_size());
+        if (rlite::lower_flows_expand(lfl) == 0) {
+            std::cout << "Malformed compact encoding accepted" << std::endl;
+            return -1;
+        }
+    }
+
+    std::cout << "Compact LFDB (" << n << " nodes, " << flows.size()
+              << " lower flows): memory " << legacy_bytes / 1024 << " KiB -> "
+              << db_bytes / 1024 << " KiB, flooding " << flood_bytes[0] / 1024
+              << " KiB -> " << flood_bytes[1] / 1024 << " KiB, hash tree sync "
+              << push_bytes[0] / 1024 << " KiB -> " << push_bytes[1] / 1024
+              << " KiB" << std::endl;
+
+    return 0;
+}
+
+/* An LFDB mirrored into a RibSync table, as the RoutingEngine does. */
+struct SyncedLFDB : public rlite::LFDB {
+    rlite::RibSync rs;
+
+    SyncedLFDB() : rlite::LFDB(/*lfa_enabled=*/false)
+    {
+        rs.table_register("lfdb", this, nullptr);
+    }
+
+    void flow_changed(const gpb::LowerFlow &lf, bool removed) override
+    {
+        std::string key = flow_key(lf.local_node(), lf.remote_node());
+
+        if (removed) {
+            rs.entry_remove("lfdb", key);
+        } else {
+            rs.entry_update("lfdb", key, flow_hash(lf), 0);
+        }
+    }
+
+    uint64_t root() const { return rs.root_hash("lfdb"); }
+};
+
+/* Check that the hash trees of two databases with the same lower flows
+ * are the same, independently of the order of the updates and of the age
+ * of the lower flows, and that they differ otherwise. */
+static int
+ribsync_test(int n)
+{
+    TestLFDB::LinksList links = random_topology(n);
+    SyncedLFDB a, b;
+    std::mt19937 rng(n + 3);
+
+    for (size_t l = 0; l < links.size(); l++) {
+        link_cost_set(a, links[l].first, links[l].second, 1);
+    }
+    std::shuffle(links.begin(), links.end(), rng);
+    for (size_t l = 0; l < links.size(); l++) {
+        link_cost_set(b, links[l].first, links[l].second, 5);
+        link_cost_set(b, links[l].first, links[l].second, 1);
+    }
+
+    if (a.root() != b.root() || a.rs.size("lfdb") != 2 * links.size()) {
+        std::cout << "Hash trees differ for the same lower flows" << std::endl;
+        return -1;
+    }
+
+    /* The age does not matter, the sequence number does. */
+    gpb::LowerFlow lf;
+
+    a.find("0", a.nim.GetName(a.db.at(a.nim.FindId("0")).begin()->first),
+           &lf);
+
+    lf.set_age(lf.age() + 100);
+    a.add(lf);
+    if (a.root() != b.root()) {
+        std::cout << "Hash trees depend on the age" << std::endl;
+        return -1;
+    }
+    lf.set_seqnum(lf.seqnum() + 1);
+    a.add(lf);
+    if (a.root() == b.root()) {
+        std::cout << "Hash trees do not depend on the seqnum" << std::endl;
+        return -1;
+    }
+    b.add(lf);
+    if (a.root() != b.root()) {
+        std::cout << "Hash trees differ after the same update" << std::endl;
+        return -1;
+    }
+
+    /* Removing the lower flows removes them from the tree. */
+    std::vector<rlite::NodeId> remotes;
+
+    for (const auto &kv : a.db.at(a.nim.FindId("0"))) {
+        remotes.push_back(a.nim.GetName(kv.first));
+    }
+    for (const rlite::NodeId &remote : remotes) {
+        a.del("0", remote);
+    }
+    if (a.rs.size("lfdb") != b.rs.size("lfdb") - remotes.size()) {
+        std::cout << "Stale entries after removing the lower flows"
+                  << std::endl;
+        return -1;
+    }
+    for (const rlite::NodeId &remote : remotes) {
+        b.find("0", remote, &lf);
+        a.add(lf);
+    }
+    if (a.root() != b.root()) {
+        std::cout << "Hash trees differ after re-adding the lower flows"
+                  << std::endl;
+        return -1;
+    }
+
+    std::cout << "LFDB hash trees (" << n << " nodes) OK" << std::endl;
+
+    return 0;
+}
+
+/* An LFDB mirrored into an SpfWorker, as the RoutingEngine does. */
+struct WorkerLFDB : public rlite::LFDB {
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool ready = false;
+    rlite::SpfWorker spf;
+
+    WorkerLFDB()
+        : rlite::LFDB(/*lfa_enabled=*/false),
+          spf(/*lfa_enabled=*/false, /*verbose=*/false,
+              [this]() { snapshot_ready(); })
+    {
+    }
+
+    void snapshot_ready()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        ready = true;
+        cond.notify_one();
+    }
+
+    void flow_changed(const gpb::LowerFlow &lf, bool removed) override
+    {
+        spf.flow_changed(lf, removed);
+    }
+
+    std::unique_ptr<rlite::NextHopsSnapshot> snapshot_wait()
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+
+        cond.wait(lk, [this] { return ready; });
+        ready = false;
+        return spf.snapshot_take();
+    }
+};
+
+/* Check that the routing tables computed by the SPF worker on its copy
+ * of the LFDB match the ones computed synchronously, while links change
+ * cost or go down. */
+static int
+spf_worker_test(int n)
+{
+    TestLFDB::LinksList links = random_topology(n);
+    const std::string src     = "0";
+    const int num_rounds      = 20;
+    std::mt19937 rng(n + 7);
+    WorkerLFDB lfdb;
+
+    lfdb.ecmp_enabled = true;
+    for (size_t l = 0; l < links.size(); l++) {
+        link_cost_set(lfdb, links[l].first, links[l].second, 1 + rng() % 4);
+    }
+
+    for (int round = 0; round < num_rounds; round++) {
+        for (int c = 0; c < 5; c++) {
+            const auto &link = links[rng() % links.size()];
+
+            if (rng() % 4 == 0) {
+                lfdb.del(std::to_string(link.first),
+                         std::to_string(link.second));
+                lfdb.del(std::to_string(link.second),
+                         std::to_string(link.first));
+            } else {
+                link_cost_set(lfdb, link.first, link.second, 1 + rng() % 4);
+            }
+        }
+
+        lfdb.spf.compute(src, lfdb.ecmp_enabled);
+        std::unique_ptr<rlite::NextHopsSnapshot> snap = lfdb.snapshot_wait();
+        lfdb.compute_next_hops(src);
+
+        /* The order of the equal cost next hops may differ, as the
+         * databases were filled in a different order. */
+        auto sorted = [](std::unordered_map<rlite::NodeId,
+                                            std::vector<rlite::NodeId>>
+                             table) {
+            for (auto &kv : table) {
+                std::sort(kv.second.begin(), kv.second.end());
+            }
+            return table;
+        };
+        if (!snap || sorted(snap->next_hops) != sorted(lfdb.next_hops) ||
+            snap->next_hops_ecmp != lfdb.next_hops_ecmp) {
+            std::cout << "SPF worker routing table differs at round " << round
+                      << std::endl;
+            return -1;
+        }
+    }
+
+    std::cout << "SPF worker (" << n << " nodes): " << num_rounds
+              << " routing tables OK" << std::endl;
+
+    return 0;
+}
+
+/* Check that the ids of the nodes that leave a ring network are reused by
+ * the nodes that take their place, and that the distances stay right. */
+static int
+node_ids_test(int n)
+{
+    std::vector<rlite::NodeId> names;
+    TestLFDB::LinksList links;
+    const int num_rounds = 3 * n;
+
+    for (int i = 0; i < n; i++) {
+        links.push_back({i, (i + 1) % n});
+        names.push_back(std::to_string(i));
+    }
+
+    TestLFDB lfdb(links, /*lfa_enabled=*/false);
+    auto link_set = [&lfdb](const rlite::NodeId &a, const rlite::NodeId &b,
+                            bool up) {
+        for (int dir = 0; dir < 2; dir++) {
+            gpb::LowerFlow lf;
+
+            if (!up) {
+                lfdb.del(dir ? b : a, dir ? a : b);
+                continue;
+            }
+            lf.set_local_node(dir ? b : a);
+            lf.set_remote_node(dir ? a : b);
+            lf.set_cost(1);
+            lf.set_seqnum(1);
+            lf.set_state(true);
+            lf.set_age(0);
+            lfdb.add(lf);
+        }
+    };
+
+    lfdb.compute_next_hops(names[0]);
+    size_t ids = lfdb.nim.size();
+
+    for (int round = 0; round < num_rounds; round++) {
+        /* Node p leaves, and a new one joins in the same position. */
+        int p      = 1 + round % (n - 1);
+        int prev_p = p - 1;
+        int next_p = (p + 1) % n;
+
+        link_set(names[prev_p], names[p], false);
+        link_set(names[p], names[next_p], false);
+        lfdb.compute_next_hops(names[0]);
+        names[p] = "n" + std::to_string(n + round);
+        link_set(names[prev_p], names[p], true);
+        link_set(names[p], names[next_p], true);
+        lfdb.compute_next_hops(names[0]);
+
+        for (int i = 0; i < n; i++) {
+            if (lfdb.distance(names[i]) !=
+                static_cast<unsigned int>(std::min(i, n - i))) {
+                std::cout << "Node ids test: wrong distance of " << names[i]
+                          << " at round " << round << std::endl;
+                return -1;
+            }
+        }
+    }
+
+    if (lfdb.nim.size() != ids) {
+        std::cout << "Node ids test: " << lfdb.nim.size() << " ids for " << n
+                  << " nodes" << std::endl;
+        return -1;
+    }
+
+    std::cout << "Node ids test: " << num_rounds << " nodes replaced, "
+              << ids << " ids" << std::endl;
+
+    return 0;
+}
+
+/* Same as node_ids_test(), but through an LFDB mirrored into an SpfWorker,
+ * with the graph disabled as in the RoutingEngine. The ids of the nodes
+ * that leave must be released by both copies of the database. */
+static int
+node_ids_worker_test(int n)
+{
+    std::vector<rlite::NodeId> names;
+    const int num_rounds = 3 * n;
+    WorkerLFDB lfdb;
+
+    auto link_set = [&lfdb](const rlite::NodeId &a, const rlite::NodeId &b,
+                            bool up) {
+        for (int dir = 0; dir < 2; dir++) {
+            gpb::LowerFlow lf;
+
+            if (!up) {
+                lfdb.del(dir ? b : a, dir ? a : b);
+                continue;
+            }
+            lf.set_local_node(dir ? b : a);
+            lf.set_remote_node(dir ? a : b);
+            lf.set_cost(1);
+            lf.set_seqnum(1);
+            lf.set_state(true);
+            lf.set_age(0);
+            lfdb.add(lf);
+        }
+    };
+
+    lfdb.graph_disable();
+    for (int i = 0; i < n; i++) {
+        names.push_back(std::to_string(i));
+    }
+    for (int i = 0; i < n; i++) {
+        link_set(names[i], names[(i + 1) % n], true);
+    }
+
+    for (int round = 0; round < num_rounds; round++) {
+        int p      = 1 + round % (n - 1);
+        int prev_p = p - 1;
+        int next_p = (p + 1) % n;
+
+        link_set(names[prev_p], names[p], false);
+        link_set(names[p], names[next_p], false);
+        names[p] = "n" + std::to_string(n + round);
+        link_set(names[prev_p], names[p], true);
+        link_set(names[p], names[next_p], true);
+
+        lfdb.spf.compute(names[0], /*ecmp=*/false);
+        std::unique_ptr<rlite::NextHopsSnapshot> snap = lfdb.snapshot_wait();
+
+        if (!snap || snap->next_hops.size() != static_cast<size_t>(n - 1) ||
+            !snap->next_hops.count(names[p])) {
+            std::cout << "Node ids worker test: wrong routing table at round "
+                      << round << std::endl;
+            return -1;
+        }
+
+        /* The worker may allocate the id of the new node before
+         * releasing the one of the node that left. */
+        if (lfdb.nim.size() != static_cast<size_t>(n) ||
+            lfdb.ids_pending() != 0 ||
+            snap->node_ids > static_cast<size_t>(n + 1) ||
+            snap->ids_pending != 0) {
+            std::cout << "Node ids worker test: " << lfdb.nim.size() << "/"
+                      << lfdb.ids_pending() << " ids in the LFDB, "
+                      << snap->node_ids << "/" << snap->ids_pending
+                      << " in the worker at round " << round << std::endl;
+            return -1;
+        }
+    }
+
+    std::cout << "Node ids worker test: " << num_rounds << " nodes replaced"
+              << std::endl;
+
+    return 0;
+}
+
 int
 main(int argc, char **argv)
 {
     auto usage = []() {
         std::cout << "lfdb-test -n SIZE\n"
+                     "          -b MAX_NODES (routing scaling benchmark)\n"
                      "          -v be verbose\n"
                      "          -h show this help and exit\n";
     };
     int verbosity = 0;
     int n         = 100;
+    int max_nodes = 1000;
     int opt;
 
-    while ((opt = getopt(argc, argv, "hvn:")) != -1) {
+    while ((opt = getopt(argc, argv, "hvn:b:")) != -1) {
         switch (opt) {
         case 'h':
             usage();
@@ -131,6 +1521,10 @@ main(int argc, char **argv)
             n = std::atoi(optarg);
             break;
 
+        case 'b':
+            max_nodes = std::atoi(optarg);
+            break;
+
         default:
             std::cout << "    Unrecognized option " << static_cast<char>(opt)
                       << std::endl;
@@ -249,7 +1643,7 @@ main(int argc, char **argv)
         auto start = std::chrono::system_clock::now();
 
         for (const auto &kv : lfdb.db) {
-            const rlite::NodeId &source = kv.first;
+            const rlite::NodeId &source = lfdb.nim.GetName(kv.first);
 
             lfdb.compute_next_hops(source);
             if (verbosity >= 2) {
@@ -284,5 +1678,41 @@ main(int argc, char **argv)
         counter++;
     }
 
-    return 0;
+    if (fwd_table_update_test(n, verbosity)) {
+        return -1;
+    }
+
+    if (ecmp_test(n, verbosity)) {
+        return -1;
+    }
+
+    if (frr_test(n, verbosity)) {
+        return -1;
+    }
+
+    if (ribsync_test(n)) {
+        return -1;
+    }
+
+    if (compact_test(10000)) {
+        return -1;
+    }
+
+    if (spf_worker_test(n)) {
+        return -1;
+    }
+
+    if (node_ids_test(n)) {
+        return -1;
+    }
+
+    if (node_ids_worker_test(n)) {
+        return -1;
+    }
+
+    if (routing_scaling_test(max_nodes, verbosity)) {
+        return -1;
+    }
+
+    return spf_convergence_test(max_nodes, verbosity);
 }
@@ -0,0 +1,479 @@
+/*
+ * Tests for the synchronization of fully replicated RIB tables (RibSync).
+ *
+ * Copyright (C) 2026 agent
+ * Author: agent <agent@local>
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "uipcp-normal-ribsync.hpp"
+#include "BaseRIB.pb.h"
+
+static const std::string DFTTable  = "/mgmt/dft/table";
+static const std::string LFDBTable = "/mgmt/routing/routing";
+
+/* A node with a DFT-like and an LFDB-like table, merging the received
+ * entries as the real components do (newer seqnum wins). */
+struct TestNode {
+    rlite::RibSync rs;
+    std::map<std::string, gpb::DFTEntry> dft;
+    std::map<std::string, gpb::LowerFlow> lfdb;
+
+    /* Maximum number of entries in a single message. */
+    static constexpr int kSyncLimit = 10;
+
+    TestNode()
+    {
+        rs.table_register(DFTTable, this,
+                          [this](const std::vector<std::string> &keys,
+                                 rlite::SyncPeer &peer) {
+                              return dft_push(keys, peer);
+                          });
+        rs.table_register(LFDBTable, this,
+                          [this](const std::vector<std::string> &keys,
+                                 rlite::SyncPeer &peer) {
+                              return lfdb_push(keys, peer);
+                          });
+    }
+
+    static size_t serlen(const ::google::protobuf::MessageLite &obj)
+    {
+#ifdef HAVE_GPB_BYTE_SIZE_LONG
+        return obj.ByteSizeLong() + 2;
+#else
+        return obj.ByteSize() + 2;
+#endif
+    }
+
+    bool dft_add(const gpb::DFTEntry &e)
+    {
+        std::string key = e.appl_name().ap_name();
+        auto it         = dft.find(key);
+
+        if (it != dft.end() && it->second.seqnum() >= e.seqnum()) {
+            return false;
+        }
+        dft[key] = e;
+        rs.entry_update(DFTTable, key, e.seqnum(), serlen(e));
+        return true;
+    }
+
+    bool lfdb_add(const gpb::LowerFlow &lf)
+    {
+        std::string key = lf.local_node();
+
+        key.push_back('\0');
+        key += lf.remote_node();
+
+        auto it = lfdb.find(key);
+
+        if (it != lfdb.end() && it->second.seqnum() >= lf.seqnum()) {
+            return false;
+        }
+        lfdb[key] = lf;
+        rs.entry_update(LFDBTable, key, lf.seqnum(), serlen(lf));
+        return true;
+    }
+
+    int dft_push(const std::vector<std::string> &keys,
+                 rlite::SyncPeer &peer) const
+    {
+        gpb::DFTSlice slice;
+        int ret = 0;
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            *slice.add_entries() = dft.at(keys[i]);
+            if (slice.entries_size() >= kSyncLimit || i == keys.size() - 1) {
+                CDAPMessage m;
+
+                m.m_create("dft_entries", DFTTable);
+                ret |= peer.send(m, slice);
+                slice = gpb::DFTSlice();
+            }
+        }
+
+        return ret;
+    }
+
+    int lfdb_push(const std::vector<std::string> &keys,
+                  rlite::SyncPeer &peer) const
+    {
+        gpb::LowerFlowList lfl;
+        int ret = 0;
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            *lfl.add_flows() = lfdb.at(keys[i]);
+            if (lfl.flows_size() >= kSyncLimit || i == keys.size() - 1) {
+                CDAPMessage m;
+
+                m.m_create("lfdb_entries", LFDBTable);
+                ret |= peer.send(m, lfl);
+                lfl = gpb::LowerFlowList();
+            }
+        }
+
+        return ret;
+    }
+
+    /* Process a message coming from a neighbor, using 'peer' to reply. */
+    int recv(const CDAPMessage *rm, rlite::SyncPeer &peer)
+    {
+        const char *objbuf;
+        size_t objlen;
+
+        if (rm->obj_name == rlite::RibSync::ObjName) {
+            return rs.rib_handler(rm, peer);
+        }
+
+        rm->get_obj_value(objbuf, objlen);
+        if (rm->obj_name == DFTTable) {
+            gpb::DFTSlice slice;
+
+            slice.ParseFromArray(objbuf, objlen);
+            for (const gpb::DFTEntry &e : slice.entries()) {
+                dft_add(e);
+            }
+        } else if (rm->obj_name == LFDBTable) {
+            gpb::LowerFlowList lfl;
+
+            lfl.ParseFromArray(objbuf, objlen);
+            for (const gpb::LowerFlow &lf : lfl.flows()) {
+                lfdb_add(lf);
+            }
+        } else {
+            return -1;
+        }
+
+        return 0;
+    }
+};
+
+/* One direction of a link between two test nodes. Messages are serialized
+ * as they would be on a management flow, and queued for the receiver. */
+struct TestPeer : public rlite::SyncPeer {
+    std::deque<std::string> queue;
+    size_t bytes    = 0;
+    size_t messages = 0;
+    size_t saved    = 0;
+
+    int send(CDAPMessage &m,
+             const ::google::protobuf::MessageLite &obj) override
+    {
+        std::string objbuf = obj.SerializeAsString();
+        std::unique_ptr<char[]> copy(new char[objbuf.size()]);
+        char *serbuf  = nullptr;
+        size_t serlen = 0;
+
+        objbuf.copy(copy.get(), objbuf.size());
+        m.set_obj_value(std::move(copy), objbuf.size());
+        if (msg_ser_stateless(&m, &serbuf, &serlen)) {
+            return -1;
+        }
+        queue.push_back(std::string(serbuf, serlen));
+        delete[] serbuf;
+        bytes += serlen;
+        messages++;
+
+        return 0;
+    }
+
+    void bytes_saved(size_t n) override { saved += n; }
+};
+
+/* Deliver the queued messages in both directions until the link is
+ * quiet. Returns the number of messages processed, or -1 on error. */
+static int
+link_run(TestNode &a, TestNode &b, TestPeer &a2b, TestPeer &b2a)
+{
+    int count = 0;
+
+    while (!a2b.queue.empty() || !b2a.queue.empty()) {
+        bool to_b          = !a2b.queue.empty();
+        TestPeer &in       = to_b ? a2b : b2a;
+        std::string serbuf = in.queue.front();
+        std::unique_ptr<CDAPMessage> rm;
+
+        in.queue.pop_front();
+        rm = msg_deser_stateless(serbuf.data(), serbuf.size());
+        if (!rm || (to_b ? b.recv(rm.get(), b2a) : a.recv(rm.get(), a2b))) {
+            std::cout << "Invalid message" << std::endl;
+            return -1;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+static gpb::DFTEntry
+dft_entry(int i, uint64_t seqnum)
+{
+    gpb::DFTEntry e;
+
+    e.mutable_appl_name()->set_ap_name("appl-" + std::to_string(i));
+    e.mutable_appl_name()->set_ap_instance(std::to_string(i % 7));
+    e.set_ipcp_name("n" + std::to_string(i % 97) + ".IPCP");
+    e.set_seqnum(seqnum);
+
+    return e;
+}
+
+static gpb::LowerFlow
+lower_flow(int i, uint32_t seqnum)
+{
+    gpb::LowerFlow lf;
+
+    lf.set_local_node("n" + std::to_string(i / 4) + ".IPCP");
+    lf.set_remote_node("n" + std::to_string((i * 31) % 2503) + ".IPCP");
+    lf.set_cost(1 + i % 3);
+    lf.set_seqnum(seqnum);
+    lf.set_state(true);
+    lf.set_age(0);
+
+    return lf;
+}
+
+static bool
+in_sync(const TestNode &a, const TestNode &b)
+{
+    return a.dft.size() == b.dft.size() && a.lfdb.size() == b.lfdb.size() &&
+           a.rs.root_hash(DFTTable) == b.rs.root_hash(DFTTable) &&
+           a.rs.root_hash(LFDBTable) == b.rs.root_hash(LFDBTable) &&
+           a.rs.size(DFTTable) == a.dft.size() &&
+           a.rs.size(LFDBTable) == a.lfdb.size();
+}
+
+/* Traffic needed to push both tables of 'node' in full, which is what the
+ * enrollment did before RibSync. */
+static size_t
+full_push_bytes(const TestNode &node)
+{
+    std::vector<std::string> keys;
+    TestPeer peer;
+
+    for (const auto &kv : node.dft) {
+        keys.push_back(kv.first);
+    }
+    node.dft_push(keys, peer);
+    keys.clear();
+    for (const auto &kv : node.lfdb) {
+        keys.push_back(kv.first);
+    }
+    node.lfdb_push(keys, peer);
+
+    return peer.bytes;
+}
+
+/* Synchronize 'b' (the enrollment initiator) with 'a', and report the
+ * traffic. */
+static int
+enrollment_run(const std::string &name, TestNode &a, TestNode &b)
+{
+    size_t full = full_push_bytes(a);
+    TestPeer a2b, b2a;
+    int msgs;
+
+    auto t_start = std::chrono::steady_clock::now();
+    b.rs.sync_start(DFTTable, b2a);
+    b.rs.sync_start(LFDBTable, b2a);
+    msgs = link_run(a, b, a2b, b2a);
+    auto delta = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - t_start);
+
+    if (msgs < 0) {
+        return -1;
+    }
+    if (!in_sync(a, b)) {
+        std::cout << name << ": tables not in sync" << std::endl;
+        return -1;
+    }
+
+    std::cout << "    " << name << ": " << (a2b.bytes + b2a.bytes) / 1000.0
+              << " KB in " << msgs << " messages ("
+              << (a2b.saved + b2a.saved) / 1000.0 << " KB saved), "
+              << "full push " << full / 1000.0 << " KB, " << delta.count()
+              << " us" << std::endl;
+
+    return 0;
+}
+
+/* Benchmark the traffic needed to synchronize two nodes with 'n'
+ * entries in each table, in the common enrollment scenarios. */
+static int
+enrollment_bench(int n)
+{
+    std::mt19937 rng(n);
+    std::uniform_int_distribution<int> dist(0, 999);
+    TestNode a, b, c, d;
+
+    std::cout << "RibSync enrollment traffic (" << n
+              << " entries per table):" << std::endl;
+
+    for (int i = 0; i < n; i++) {
+        a.dft_add(dft_entry(i, 1));
+        a.lfdb_add(lower_flow(i, 1));
+    }
+
+    /* A new node, with empty tables. */
+    if (enrollment_run("new node", a, b)) {
+        return -1;
+    }
+
+    /* A node that was already enrolled, which is missing some entries,
+     * has older versions of some others and some entries that the
+     * enroller does not have. */
+    for (int i = 0; i < n; i++) {
+        int x = dist(rng);
+
+        if (x < 5) {
+            continue;
+        }
+        c.dft_add(dft_entry(i, x < 10 ? 2 : 1));
+        c.lfdb_add(lower_flow(i, x < 15 ? 2 : 1));
+    }
+    for (int i = n; i < n + n / 200; i++) {
+        c.dft_add(dft_entry(i, 1));
+        c.lfdb_add(lower_flow(i, 1));
+    }
+    if (enrollment_run("re-enrollment (1.5% differences)", a, c)) {
+        return -1;
+    }
+
+    /* A node that is already in sync, as in the periodic refresh. */
+    for (const auto &kv : a.dft) {
+        d.dft_add(kv.second);
+    }
+    for (const auto &kv : a.lfdb) {
+        d.lfdb_add(kv.second);
+    }
+    if (enrollment_run("refresh (in sync)", a, d)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Check that the trees only depend on the content of the tables, and
+ * that the synchronization converges after random updates on both
+ * sides, with small tables too. */
+static int
+convergence_test(int n)
+{
+    std::mt19937 rng(n + 1);
+    std::uniform_int_distribution<int> dist(0, n - 1);
+
+    for (int round = 0; round < 10; round++) {
+        TestNode a, b;
+        TestPeer a2b, b2a;
+        int size = 1 + dist(rng);
+
+        for (int i = 0; i < size; i++) {
+            a.dft_add(dft_entry(dist(rng), 1 + dist(rng) % 3));
+            b.dft_add(dft_entry(dist(rng), 1 + dist(rng) % 3));
+            a.lfdb_add(lower_flow(dist(rng), 1 + dist(rng) % 3));
+            b.lfdb_add(lower_flow(dist(rng), 1 + dist(rng) % 3));
+        }
+
+        if (round % 2) {
+            a.rs.sync_start(DFTTable, a2b);
+            a.rs.sync_start(LFDBTable, a2b);
+        } else {
+            b.rs.sync_start(DFTTable, b2a);
+            b.rs.sync_start(LFDBTable, b2a);
+        }
+        if (link_run(a, b, a2b, b2a) < 0) {
+            return -1;
+        }
+        if (!in_sync(a, b)) {
+            std::cout << "Round " << round << ": tables not in sync"
+                      << std::endl;
+            return -1;
+        }
+
+        /* Removing and re-adding an entry gives the same root. */
+        uint64_t root          = a.rs.root_hash(DFTTable);
+        const std::string &key = a.dft.begin()->first;
+        const gpb::DFTEntry e  = a.dft.begin()->second;
+
+        a.rs.entry_remove(DFTTable, key);
+        if (a.rs.root_hash(DFTTable) == root) {
+            std::cout << "Root does not change on removal" << std::endl;
+            return -1;
+        }
+        a.rs.entry_update(DFTTable, key, e.seqnum(), TestNode::serlen(e));
+        if (a.rs.root_hash(DFTTable) != root) {
+            std::cout << "Root differs after re-insertion" << std::endl;
+            return -1;
+        }
+    }
+
+    std::cout << "RibSync convergence (" << n << " entries) OK" << std::endl;
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    auto usage = []() {
+        std::cout << "ribsync-test -n SIZE (entries per table)\n"
+                     "             -h show this help and exit\n";
+    };
+    int n = 10000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+
+        case 'n':
+            n = std::atoi(optarg);
+            break;
+
+        default:
+            std::cout << "    Unrecognized option " << static_cast<char>(opt)
+                      << std::endl;
+            usage();
+            return -1;
+        }
+    }
+
+    if (n < 1) {
+        usage();
+        return -1;
+    }
+
+    if (convergence_test(1000)) {
+        return -1;
+    }
+
+    return enrollment_bench(n);
+}
@@ -155,6 +155,38 @@ uipcp_pduft_flush(struct uipcp *uipcp)
     return ret;
 }
 
+/* Apply a list of PDUFT modifications with a single message. The kernel
+ * applies them atomically. */
+int
+uipcp_pduft_batch(struct uipcp *uipcp, const struct rl_pduft_op *ops,
+                  unsigned int n)
+{
+    struct rl_kmsg_ipcp_pduft_batch req;
+    int ret;
+
+    if (n > RL_PDUFT_BATCH_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    /* Create a request message. The ops array is not owned by the
+     * message, so we don't call rl_msg_free(). */
+    memset(&req, 0, sizeof(req));
+    req.hdr.msg_type     = RLITE_KER_IPCP_PDUFT_BATCH;
+    req.hdr.event_id     = 1;
+    req.ipcp_id          = uipcp->id;
+    req.ops.elem_size    = sizeof(*ops);
+    req.ops.num_elements = n;
+    req.ops.slots.raw    = (void *)ops;
+
+    ret = rl_write_msg(uipcp->cfd, RLITE_MB(&req), 1);
+    if (ret) {
+        UPE(uipcp, "rl_write_msg() failed [%s]\n", strerror(errno));
+    }
+
+    return ret;
+}
+
 /* This function is the inverse of flowspec2flowcfg(), and this property
  * must be manually preserved. */
 static void
@@ -362,14 +394,63 @@ struct uipcp_loop_fdh {
     struct list_head tmpnode; /* private for the uipcp_loop */
 };
 
+#define UIPCP_CTRL_RING_SIZE (1 << 16)
+#define UIPCP_CTRL_BATCH 32
+
+/* Dispatch a message posted by the kernel to the uipcp handler, and
+ * release it. */
+static void
+uipcp_loop_dispatch(struct uipcp *uipcp, struct rl_msg_base *msg)
+{
+    uipcp_msg_handler_t handler = NULL;
+
+    assert(msg->hdr.msg_type < RLITE_KER_MSG_MAX);
+
+    switch (msg->hdr.msg_type) {
+    case RLITE_KER_FA_REQ:
+        handler = uipcp->ops.fa_req;
+        break;
+
+    case RLITE_KER_FA_RESP:
+        handler = uipcp->ops.fa_resp;
+        break;
+
+    case RLITE_KER_APPL_REGISTER:
+        handler = uipcp->ops.appl_register;
+        break;
+
+    case RLITE_KER_FLOW_DEALLOCATED:
+        handler = uipcp->ops.flow_deallocated;
+        break;
+
+    case RLITE_KER_FA_REQ_ARRIVED:
+        handler = uipcp->ops.neigh_fa_req_arrived;
+        break;
+
+    case RLITE_KER_FLOW_STATE:
+        handler = uipcp->ops.flow_state_update;
+        break;
+
+    default:
+        UPE(uipcp, "Message type %u not handled\n", msg->hdr.msg_type);
+        break;
+    }
+
+    if (handler) {
+        handler(uipcp, msg);
+    }
+
+    rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(msg));
+    rl_free(msg, RL_MT_MSG);
+}
+
 static void *
 uipcp_loop(void *opaque)
 {
     struct uipcp *uipcp = opaque;
 
     for (;;) {
-        int maxfd                   = MAX(uipcp->cfd, uipcp->eventfd);
-        uipcp_msg_handler_t handler = NULL;
+        int maxfd = MAX(uipcp->cfd, uipcp->eventfd);
         struct uipcp_loop_fdh *fdh;
         struct timeval *top = NULL;
         struct rl_msg_base *msg;
@@ -514,50 +595,23 @@ uipcp_loop(void *opaque)
             continue;
         }
 
-        /* Read the next message posted by the kernel. */
-        msg = rl_read_next_msg(uipcp->cfd, 0);
-        if (!msg) {
-            continue;
-        }
-
-        assert(msg->hdr.msg_type < RLITE_KER_MSG_MAX);
-
-        switch (msg->hdr.msg_type) {
-        case RLITE_KER_FA_REQ:
-            handler = uipcp->ops.fa_req;
-            break;
-
-        case RLITE_KER_FA_RESP:
-            handler = uipcp->ops.fa_resp;
-            break;
-
-        case RLITE_KER_APPL_REGISTER:
-            handler = uipcp->ops.appl_register;
-            break;
+        if (uipcp->cring.hdr) {
+            /* Consume a batch of messages from the shared ring. */
+            struct rl_msg_base *msgs[UIPCP_CTRL_BATCH];
+            int n, i;
 
-        case RLITE_KER_FLOW_DEALLOCATED:
-            handler = uipcp->ops.flow_deallocated;
-            break;
-
-        case RLITE_KER_FA_REQ_ARRIVED:
-            handler = uipcp->ops.neigh_fa_req_arrived;
-            break;
-
-        case RLITE_KER_FLOW_STATE:
-            handler = uipcp->ops.flow_state_update;
-            break;
-
-        default:
-            UPE(uipcp, "Message type %u not handled\n", msg->hdr.msg_type);
-            break;
+            n = rl_ctrl_ring_read_batch(&uipcp->cring, msgs, UIPCP_CTRL_BATCH);
+            for (i = 0; i < n; i++) {
+                uipcp_loop_dispatch(uipcp, msgs[i]);
+            }
+            continue;
         }
 
-        if (handler) {
-            handler(uipcp, msg);
+        /* Read the next message posted by the kernel. */
+        msg = rl_read_next_msg(uipcp->cfd, 0);
+        if (msg) {
+            uipcp_loop_dispatch(uipcp, msg);
         }
-
-        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(msg));
-        rl_free(msg, RL_MT_MSG);
     }
 
     return NULL;
@@ -933,6 +987,14 @@ uipcp_add(struct uipcps *uipcps, struct rl_kmsg_ipcp_update *upd)
         goto err3;
     }
 
+    /* Receive kernel messages through a shared-memory ring, if supported,
+     * so that they can be consumed in batches. Otherwise fall back to
+     * read(). */
+    if (rl_ctrl_ring_open(uipcp->cfd, UIPCP_CTRL_RING_SIZE, &uipcp->cring)) {
+        PD("ctrl ring not available [%s], using read()\n", strerror(errno));
+        rl_ctrl_ring_close(&uipcp->cring);
+    }
+
     uipcp->eventfd = eventfd(0, 0);
     if (uipcp->eventfd < 0) {
         PE("eventfd() failed [%s]\n", strerror(errno));
@@ -969,6 +1031,7 @@ err5:
 err4:
     close(uipcp->eventfd);
 err3:
+    rl_ctrl_ring_close(&uipcp->cring);
     close(uipcp->cfd);
 err2:
     pthread_mutex_lock(&uipcps->lock);
@@ -1022,6 +1085,7 @@ uipcp_del(struct uipcp *uipcp)
         pthread_mutex_destroy(&uipcp->lock);
 
         close(uipcp->eventfd);
+        rl_ctrl_ring_close(&uipcp->cring);
         close(uipcp->cfd);
     }
 
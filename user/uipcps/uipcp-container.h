@@ -29,6 +29,7 @@
 #include "rlite/uipcps-msg.h"
 #include "rlite/kernel-msg.h"
 #include "rlite/list.h"
+#include "rlite/ctrl.h"
 #include "rlite/utils.h"
 
 #ifdef __cplusplus
@@ -224,6 +225,7 @@ struct flow_edge {
 struct uipcp {
     pthread_t th;
     int cfd;
+    struct rl_ctrl_ring cring; /* shared ring of cfd, if any */
     int eventfd;
     int loop_should_stop;
     pthread_mutex_t lock;
@@ -312,6 +314,9 @@ int uipcp_pduft_del(struct uipcp *uipcp, rl_port_t local_port,
 
 int uipcp_pduft_flush(struct uipcp *uipcp);
 
+int uipcp_pduft_batch(struct uipcp *uipcp, const struct rl_pduft_op *ops,
+                      unsigned int n);
+
 int uipcp_issue_fa_req_arrived(struct uipcp *uipcp, uint32_t kevent_id,
                                rl_port_t remote_port, rlm_cepid_t remote_cep,
                                rlm_qosid_t qos_id, rlm_addr_t remote_addr,
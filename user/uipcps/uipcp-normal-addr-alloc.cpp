@@ -29,7 +29,7 @@ public:
     int allocate(const std::string &ipcp_name, rlm_addr_t *addr) override;
     int rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src) override;
     int sync_neigh(const std::shared_ptr<NeighFlow> &nf,
-                   unsigned int limit) const override;
+                   size_t limit) const override;
 
     static std::string ReqObjClass;
 
@@ -58,18 +58,21 @@ DistributedAddrAllocator::dump(std::stringstream &ss) const
 
 int
 DistributedAddrAllocator::sync_neigh(const std::shared_ptr<NeighFlow> &nf,
-                                     unsigned int limit) const
+                                     size_t limit) const
 {
     int ret = 0;
 
     for (auto ati = addr_alloc_table.begin(); ati != addr_alloc_table.end();) {
         gpb::AddrAllocEntries l;
+        size_t bytes = 0;
 
-        while (l.entries_size() < static_cast<int>(limit) &&
-               ati != addr_alloc_table.end()) {
+        /* At least one entry per message. */
+        do {
+            bytes += gpb_embedded_size(ati->second);
             *l.add_entries() = ati->second;
             ati++;
-        }
+        } while (ati != addr_alloc_table.end() &&
+                 bytes + gpb_embedded_size(ati->second) <= limit);
 
         ret |= nf->sync_obj(true, ObjClass, TableName, &l);
     }
@@ -335,20 +338,29 @@ class CentralizedFaultTolerantAddrAllocator : public AddrAllocator {
     /* In case of state machine replica, a pointer to a Raft state
      * machine. */
     class Replica : public CeftReplica {
-        /* The structure of an address allocation command (i.e. a log entry
-         * for the Raft SM). The command contains the name of the IPCP for
+        /* An address allocation command (i.e. a log entry for the Raft
+         * SM) is made of the opcode followed by the name of the IPCP for
          * which we want to allocate or deallocate an address. Raft is only
          * needed to achieve consensus on the order of allocation and
          * deallocation operations. */
-        struct Command {
+        static constexpr uint8_t OpcodeSet = 1;
+        static constexpr uint8_t OpcodeDel = 2;
+
+        /* The structure of the commands in the logs written by previous
+         * versions, where all the commands had the same size. */
+        struct LegacyCommand {
             char ipcp_name[31];
             uint8_t opcode;
-            static constexpr uint8_t OpcodeSet = 1;
-            static constexpr uint8_t OpcodeDel = 2;
         } __attribute__((packed));
-        static_assert(sizeof(Command) ==
-                          sizeof(Command::ipcp_name) + sizeof(Command::opcode),
-                      "Invalid memory layout for class Replica::Command");
+        static_assert(sizeof(LegacyCommand) ==
+                          sizeof(LegacyCommand::ipcp_name) +
+                              sizeof(LegacyCommand::opcode),
+                      "Invalid memory layout for class Replica::LegacyCommand");
+
+        static std::string command_encode(uint8_t opcode,
+                                          const std::string &ipcp_name);
+        static int command_decode(const std::string &command, uint8_t *opcode,
+                                  std::string *ipcp_name);
 
         /* State machine implementation: a simple table mapping IPCP names
          * into addresses, plus a simple counter to keep the next address
@@ -364,7 +376,7 @@ class CentralizedFaultTolerantAddrAllocator : public AddrAllocator {
                           std::string("/tmp/ceft-aa-") +
                               std::to_string(aa->rib->uipcp->id) +
                               std::string("-") + aa->rib->myname,
-                          sizeof(Command), AddrAllocator::TableName)
+                          sizeof(LegacyCommand), AddrAllocator::TableName)
         {
             /* Allocate addresses for the replicas in advance. */
             std::vector<raft::ReplicaId> peersv(peers.begin(), peers.end());
@@ -373,10 +385,12 @@ class CentralizedFaultTolerantAddrAllocator : public AddrAllocator {
                 table[peer] = next_unused_address++;
             }
         };
-        int apply(const char *const serbuf, CDAPMessage *const rm) override;
+        int apply(const std::string &command, CDAPMessage *const rm) override;
         virtual int replica_process_rib_msg(
             const CDAPMessage *rm, rlm_addr_t src_addr,
             std::vector<CommandToSubmit> *commands) override;
+        int snapshot_serialize(std::string &state) override;
+        int snapshot_restore(const std::string &state) override;
         void dump(std::stringstream &ss) const;
 
         rlm_addr_t lookup(const std::string &ipcp_name) const
@@ -393,7 +407,7 @@ class CentralizedFaultTolerantAddrAllocator : public AddrAllocator {
     /* In case of client, a pointer to client-side data structures. */
     class Client : public CeftClient {
         struct Synchronizer {
-            std::condition_variable allocation_complete;
+            std::condition_variable_any allocation_complete;
             bool allocated     = false;
             rlm_addr_t address = RL_ADDR_NULL;
         };
@@ -496,7 +510,10 @@ CentralizedFaultTolerantAddrAllocator::reconfigure()
     peers = utils::strsplit<std::list>(replicas, ',');
 
     /* Create the client anyway. */
+    auto batch_window = rib->get_param_value<Msecs>(AddrAllocator::Prefix,
+                                                    "raft-batch-window");
     client = utils::make_unique<Client>(this, peers);
+    client->set_batch_window(batch_window);
     UPI(rib->uipcp, "Client initialized\n");
 
     /* I'm one of the replicas. Create a Raft state machine and
@@ -516,9 +533,19 @@ CentralizedFaultTolerantAddrAllocator::reconfigure()
             AddrAllocator::Prefix, "raft-heartbeat-timeout");
         auto rtx_timeout = rib->get_param_value<Msecs>(AddrAllocator::Prefix,
                                                        "raft-rtx-timeout");
+        auto snapshot_entries = rib->get_param_value<int>(
+            AddrAllocator::Prefix, "raft-snapshot-entries");
+        auto read_lease = rib->get_param_value<Msecs>(AddrAllocator::Prefix,
+                                                      "raft-read-lease");
         raft->set_election_timeout(election_timeout, election_timeout * 2);
         raft->set_heartbeat_timeout(heartbeat_timeout);
         raft->set_retransmission_timeout(rtx_timeout);
+        raft->set_snapshot_threshold(snapshot_entries);
+        raft->set_batch_window(batch_window);
+        if (raft->set_read_lease(read_lease)) {
+            UPW(rib->uipcp, "raft-read-lease must be shorter than the "
+                            "election timeout, leases disabled\n");
+        }
 
         return raft->init(peers);
     }
@@ -553,7 +580,7 @@ CentralizedFaultTolerantAddrAllocator::Client::allocate(
     rib->unlock();
 
     {
-        std::unique_lock<std::mutex> lk(rib->mutex);
+        std::unique_lock<RibMutex> lk(rib->mutex);
 
         while (!synchro->allocated) {
             if (synchro->allocation_complete.wait_for(lk, timeout) ==
@@ -627,35 +654,112 @@ CentralizedFaultTolerantAddrAllocator::Replica::dump(
         ss << "    " << std::setw(20) << kv.first;
         ss << ": " << kv.second << std::endl;
     }
+    dump_replication(ss);
+}
+
+std::string
+CentralizedFaultTolerantAddrAllocator::Replica::command_encode(
+    uint8_t opcode, const std::string &ipcp_name)
+{
+    return std::string(1, static_cast<char>(opcode)) + ipcp_name;
+}
+
+/* Decode a command, which may also come from a log written by a previous
+ * version. The name in a LegacyCommand never starts with an opcode. */
+int
+CentralizedFaultTolerantAddrAllocator::Replica::command_decode(
+    const std::string &command, uint8_t *opcode, std::string *ipcp_name)
+{
+    if (!command.empty() &&
+        (command[0] == OpcodeSet || command[0] == OpcodeDel)) {
+        *opcode    = command[0];
+        *ipcp_name = command.substr(1);
+        return 0;
+    }
+
+    if (command.size() == sizeof(LegacyCommand)) {
+        LegacyCommand c;
+
+        memcpy(&c, command.data(), sizeof(c));
+        c.ipcp_name[sizeof(c.ipcp_name) - 1] = '\0';
+        *opcode                              = c.opcode;
+        *ipcp_name                           = c.ipcp_name;
+        return 0;
+    }
+
+    return -1;
 }
 
 /* Apply a command to the replicated state machine. We just need to update our
  * map. */
 int
-CentralizedFaultTolerantAddrAllocator::Replica::apply(const char *const serbuf,
-                                                      CDAPMessage *const rm)
+CentralizedFaultTolerantAddrAllocator::Replica::apply(
+    const std::string &command, CDAPMessage *const rm)
 {
-    auto c = reinterpret_cast<const Command *const>(serbuf);
+    std::string ipcp_name;
+    uint8_t opcode;
 
-    assert(c->opcode == Command::OpcodeSet || c->opcode == Command::OpcodeDel);
-    if (c->opcode == Command::OpcodeSet) {
+    if (command_decode(command, &opcode, &ipcp_name) ||
+        (opcode != OpcodeSet && opcode != OpcodeDel)) {
+        UPE(rib->uipcp, "Invalid address allocation command\n");
+        return -1;
+    }
+    if (opcode == OpcodeSet) {
         /* Allocate an address (for now we use a trivial sequential strategy)
          * and update our table. */
-        table[c->ipcp_name] = next_unused_address;
+        table[ipcp_name] = next_unused_address;
         if (rm) {
             /* Update the response if we have one. */
             rm->set_obj_value((static_cast<int64_t>(next_unused_address)));
         }
-        UPD(rib->uipcp, "Commit %s <-- %lu\n", c->ipcp_name,
+        UPD(rib->uipcp, "Commit %s <-- %lu\n", ipcp_name.c_str(),
             (long unsigned)next_unused_address);
         next_unused_address++;
     } else {
-        table.erase(c->ipcp_name);
+        table.erase(ipcp_name);
     }
 
     return 0;
 }
 
+/* The snapshot contains the whole table and the next address to
+ * allocate. */
+int
+CentralizedFaultTolerantAddrAllocator::Replica::snapshot_serialize(
+    std::string &state)
+{
+    gpb::AddrAllocEntries entries;
+
+    for (const auto &kv : table) {
+        gpb::AddrAllocRequest *r = entries.add_entries();
+
+        r->set_requestor(kv.first);
+        r->set_address(kv.second);
+    }
+    entries.set_next_unused_address(next_unused_address);
+
+    return entries.SerializeToString(&state) ? 0 : -1;
+}
+
+int
+CentralizedFaultTolerantAddrAllocator::Replica::snapshot_restore(
+    const std::string &state)
+{
+    gpb::AddrAllocEntries entries;
+
+    if (!entries.ParseFromString(state)) {
+        UPE(rib->uipcp, "Invalid address allocation snapshot\n");
+        return -1;
+    }
+    table.clear();
+    for (const auto &r : entries.entries()) {
+        table[r.requestor()] = r.address();
+    }
+    next_unused_address = entries.next_unused_address();
+
+    return 0;
+}
+
 int
 CentralizedFaultTolerantAddrAllocator::Replica::replica_process_rib_msg(
     const CDAPMessage *rm, rlm_addr_t src_addr,
@@ -675,8 +779,9 @@ CentralizedFaultTolerantAddrAllocator::Replica::replica_process_rib_msg(
 
     /* Either we are the leader (so we can go ahead and serve the request),
      * or this is a request that does not require consensus (so we can serve it
-     * because it's ok to be eventually consistent). */
-    if (!(leader() || mit != table.end())) {
+     * because it's ok to be eventually consistent), or this is a read, which
+     * CeftReplica passes to us once it is linearizable. */
+    if (!(leader() || mit != table.end() || rm->op_code == gpb::M_READ)) {
         /* We are not the leader and this is not a read request. We
          * need to deny the request to preserve consistency. */
         UPD(uipcp, "Ignoring request, let the leader answer\n");
@@ -700,16 +805,9 @@ CentralizedFaultTolerantAddrAllocator::Replica::replica_process_rib_msg(
             rib->send_to_dst_addr(std::move(m), src_addr);
         } else {
             /* We are the leader here. Create a command and submit it to the
-             * Raft state machine. */
-            auto cbuf  = std::unique_ptr<char[]>(new char[sizeof(Command)]);
-            Command *c = reinterpret_cast<Command *>(cbuf.get());
-
-            /* Fill in the command struct (already serialized). */
-            strncpy(c->ipcp_name, ipcp_name.c_str(), sizeof(c->ipcp_name) - 1);
-            c->opcode = Command::OpcodeSet;
-
-            /* Return the command to the caller. */
-            commands->push_back(make_pair(std::move(cbuf), std::move(m)));
+             * Raft state machine (returning it to the caller). */
+            commands->push_back(make_pair(command_encode(OpcodeSet, ipcp_name),
+                                          std::move(m)));
         }
     } else if (rm->op_code == gpb::M_READ) {
         /* We received an an M_READ. Look up the IPCP in the map. */
@@ -759,7 +857,11 @@ UipcpRib::addra_lib_init()
          {"raft-heartbeat-timeout",
           PolicyParam(Msecs(int(CeftReplica::kHeartBeatTimeoutMsecs)))},
          {"raft-rtx-timeout",
-          PolicyParam(Msecs(int(CeftReplica::kRtxTimeoutMsecs)))}});
+          PolicyParam(Msecs(int(CeftReplica::kRtxTimeoutMsecs)))},
+         {"raft-snapshot-entries",
+          PolicyParam(int(CeftReplica::kSnapshotEntries))},
+         {"raft-read-lease", PolicyParam(Msecs(0))},
+         {"raft-batch-window", PolicyParam(Msecs(0))}});
 }
 
 } // namespace rlite
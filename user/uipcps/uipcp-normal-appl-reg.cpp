@@ -42,10 +42,29 @@ class FullyReplicatedDFT : public DFT {
     std::multimap<std::string, std::unique_ptr<gpb::DFTEntry>> dft_table;
     uint64_t seqnum_next = 1;
 
+    /* False if the table is not replicated through RibSync, because
+     * it is the state machine of a CentralizedFaultTolerantDFT replica. */
+    bool ribsync_enabled;
+
 public:
     RL_NODEFAULT_NONCOPIABLE(FullyReplicatedDFT);
-    FullyReplicatedDFT(UipcpRib *_ur) : DFT(_ur) {}
-    ~FullyReplicatedDFT() {}
+    FullyReplicatedDFT(UipcpRib *_ur, bool ribsync_enabled = true)
+        : DFT(_ur), ribsync_enabled(ribsync_enabled)
+    {
+        if (ribsync_enabled) {
+            rib->ribsync.table_register(
+                TableName, this,
+                [this](const std::vector<std::string> &keys, SyncPeer &peer) {
+                    return entries_push(keys, peer);
+                });
+        }
+    }
+    ~FullyReplicatedDFT()
+    {
+        if (ribsync_enabled) {
+            rib->ribsync.table_unregister(TableName, this);
+        }
+    }
 
     void dump(std::stringstream &ss) const override;
 
@@ -54,13 +73,123 @@ public:
     int appl_register(const struct rl_kmsg_appl_register *req) override;
     int rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src) override;
     int sync_neigh(const std::shared_ptr<NeighFlow> &nf,
-                   unsigned int limit) const override;
+                   size_t limit) const override;
     int neighs_refresh(size_t limit) override;
 
     void mod_table(const gpb::DFTEntry &e, bool add, gpb::DFTSlice *added,
-                   gpb::DFTSlice *removed);
+                   gpb::DFTSlice *removed, gpb::DFTSlice *stale = nullptr);
+
+    /* Copy all the entries of the table into 'slice'. */
+    void table_export(gpb::DFTSlice *slice) const;
+
+private:
+    /* Insert and remove entries, keeping the RibSync engine in sync. */
+    void table_insert(const std::string &appl_name,
+                      std::unique_ptr<gpb::DFTEntry> e);
+    void table_erase(
+        std::multimap<std::string, std::unique_ptr<gpb::DFTEntry>>::iterator
+            mit);
+    int entries_push(const std::vector<std::string> &keys,
+                     SyncPeer &peer) const;
+
+    static std::string entry_key(const std::string &appl_name,
+                                 const std::string &ipcp_name);
 };
 
+std::string
+FullyReplicatedDFT::entry_key(const std::string &appl_name,
+                              const std::string &ipcp_name)
+{
+    std::string key = appl_name;
+
+    key.push_back('\0');
+    key += ipcp_name;
+
+    return key;
+}
+
+void
+FullyReplicatedDFT::table_insert(const std::string &appl_name,
+                                 std::unique_ptr<gpb::DFTEntry> e)
+{
+#ifdef HAVE_GPB_BYTE_SIZE_LONG
+    size_t len = e->ByteSizeLong();
+#else
+    size_t len = e->ByteSize();
+#endif
+
+    /* The key covers the names, so the seqnum identifies the value. */
+    if (ribsync_enabled) {
+        rib->ribsync.entry_update(TableName,
+                                  entry_key(appl_name, e->ipcp_name()),
+                                  e->seqnum(), len + 2);
+    }
+    dft_table.insert(make_pair(appl_name, std::move(e)));
+}
+
+void
+FullyReplicatedDFT::table_erase(
+    multimap<string, std::unique_ptr<gpb::DFTEntry>>::iterator mit)
+{
+    if (ribsync_enabled) {
+        rib->ribsync.entry_remove(
+            TableName, entry_key(mit->first, mit->second->ipcp_name()));
+    }
+    dft_table.erase(mit);
+}
+
+/* Push the entries with the given RibSync keys to a neighbor. */
+int
+FullyReplicatedDFT::entries_push(const std::vector<std::string> &keys,
+                                 SyncPeer &peer) const
+{
+    const size_t limit = peer.obj_size_max();
+    gpb::DFTSlice dft_slice;
+    size_t bytes = 0;
+    int ret      = 0;
+
+    for (const std::string &key : keys) {
+        size_t sep = key.find('\0');
+
+        if (sep == std::string::npos) {
+            continue;
+        }
+
+        auto range = dft_table.equal_range(key.substr(0, sep));
+        auto mit   = range.first;
+
+        while (mit != range.second &&
+               mit->second->ipcp_name() != key.substr(sep + 1)) {
+            mit++;
+        }
+        if (mit == range.second) {
+            continue;
+        }
+
+        size_t len = gpb_embedded_size(*mit->second);
+
+        if (dft_slice.entries_size() > 0 && bytes + len > limit) {
+            CDAPMessage m;
+
+            m.m_create(ObjClass, TableName);
+            ret |= peer.send(m, dft_slice);
+            dft_slice = gpb::DFTSlice();
+            bytes     = 0;
+        }
+        *dft_slice.add_entries() = *mit->second;
+        bytes += len;
+    }
+
+    if (dft_slice.entries_size() > 0) {
+        CDAPMessage m;
+
+        m.m_create(ObjClass, TableName);
+        ret |= peer.send(m, dft_slice);
+    }
+
+    return ret;
+}
+
 int
 FullyReplicatedDFT::lookup_req(const std::string &appl_name,
                                std::string *dst_node,
@@ -151,7 +280,7 @@ FullyReplicatedDFT::appl_register(const struct rl_kmsg_appl_register *req)
 
         /* Insert the object into the RIB. */
 
-        dft_table.insert(make_pair(appl_name, std::move(dft_entry)));
+        table_insert(appl_name, std::move(dft_entry));
     } else {
         if (mit == range.second) {
             UPE(uipcp, "Application %s was not registered here\n",
@@ -160,7 +289,7 @@ FullyReplicatedDFT::appl_register(const struct rl_kmsg_appl_register *req)
         }
 
         /* Remove from the RIB. */
-        dft_table.erase(mit);
+        table_erase(mit);
     }
 
     UPD(uipcp, "Application %s %sregistered\n", appl_name.c_str(),
@@ -173,10 +302,12 @@ FullyReplicatedDFT::appl_register(const struct rl_kmsg_appl_register *req)
 
 /* Tries to add or remove an entry 'e' from the DFT multimap. If not nullptr,
  * the entries added and/or removed are appended to 'added' and 'removed'
- * respectively. */
+ * respectively, and the stale copies of entries that we unregistered are
+ * appended to 'stale'. */
 void
 FullyReplicatedDFT::mod_table(const gpb::DFTEntry &e, bool add,
-                              gpb::DFTSlice *added, gpb::DFTSlice *removed)
+                              gpb::DFTSlice *added, gpb::DFTSlice *removed,
+                              gpb::DFTSlice *stale)
 {
     string key = apname2string(e.appl_name());
     auto range = dft_table.equal_range(key);
@@ -192,16 +323,22 @@ FullyReplicatedDFT::mod_table(const gpb::DFTEntry &e, bool add,
     if (add) {
         bool collision = (mit != range.second);
 
+        if (!collision && stale && e.ipcp_name() == rib->myname) {
+            /* A neighbor missed the removal of one of our entries, and
+             * pushed it back while synchronizing. */
+            *stale->add_entries() = e;
+            return;
+        }
+
         if (!collision || e.seqnum() > mit->second->seqnum()) {
             if (collision) {
                 /* Remove the collided entry. */
                 if (removed) {
                     *removed->add_entries() = *mit->second;
                 }
-                dft_table.erase(mit);
+                table_erase(mit);
             }
-            dft_table.insert(
-                make_pair(key, utils::make_unique<gpb::DFTEntry>(e)));
+            table_insert(key, utils::make_unique<gpb::DFTEntry>(e));
             if (added) {
                 *added->add_entries() = e;
             }
@@ -213,7 +350,7 @@ FullyReplicatedDFT::mod_table(const gpb::DFTEntry &e, bool add,
         if (mit == range.second) {
             UPI(uipcp, "DFT entry does not exist\n");
         } else {
-            dft_table.erase(mit);
+            table_erase(mit);
             if (removed) {
                 *removed->add_entries() = e;
             }
@@ -248,11 +385,16 @@ FullyReplicatedDFT::rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src)
     }
 
     gpb::DFTSlice dft_slice;
-    gpb::DFTSlice prop_dft_add, prop_dft_del;
+    gpb::DFTSlice prop_dft_add, prop_dft_del, stale;
 
     dft_slice.ParseFromArray(objbuf, objlen);
     for (const gpb::DFTEntry &e : dft_slice.entries()) {
-        mod_table(e, add, &prop_dft_add, &prop_dft_del);
+        mod_table(e, add, &prop_dft_add, &prop_dft_del, &stale);
+    }
+
+    if (stale.entries_size() > 0 && src.nf) {
+        /* Tell the neighbor to remove them, it will propagate. */
+        src.nf->sync_obj(false, ObjClass, TableName, &stale);
     }
 
     /* Propagate the DFT entries update to the other neighbors,
@@ -285,52 +427,29 @@ FullyReplicatedDFT::dump(stringstream &ss) const
     ss << endl;
 }
 
-int
-FullyReplicatedDFT::sync_neigh(const std::shared_ptr<NeighFlow> &nf,
-                               unsigned int limit) const
+void
+FullyReplicatedDFT::table_export(gpb::DFTSlice *slice) const
 {
-    int ret = 0;
-
-    for (auto eit = dft_table.begin(); eit != dft_table.end();) {
-        gpb::DFTSlice dft_slice;
-
-        while (dft_slice.entries_size() < static_cast<int>(limit) &&
-               eit != dft_table.end()) {
-            *dft_slice.add_entries() = *eit->second;
-            eit++;
-        }
-
-        ret |= nf->sync_obj(true, ObjClass, TableName, &dft_slice);
+    for (const auto &kve : dft_table) {
+        *slice->add_entries() = *kve.second;
     }
+}
 
-    return ret;
+/* Only the enrollment initiator starts the comparison of the hash trees,
+ * and each side pushes the entries that the other one may miss. */
+int
+FullyReplicatedDFT::sync_neigh(const std::shared_ptr<NeighFlow> &nf,
+                               size_t limit) const
+{
+    return rib->ribsync_start(TableName, nf);
 }
 
-/* Propagate local entries (i.e. the ones corresponding to locally
- * registered applications) to all our neighbors. */
+/* Let each neighbor check whether its DFT is in sync with ours. The
+ * local entries do not expire, so there is no need to flood them. */
 int
 FullyReplicatedDFT::neighs_refresh(size_t limit)
 {
-    int ret = 0;
-
-    for (auto eit = dft_table.begin(); eit != dft_table.end();) {
-        gpb::DFTSlice dft_slice;
-
-        while (dft_slice.entries_size() < static_cast<int>(limit) &&
-               eit != dft_table.end()) {
-            if (eit->second->ipcp_name() == rib->myname) { /* local */
-                *dft_slice.add_entries() = *eit->second;
-            }
-            eit++;
-        }
-
-        if (dft_slice.entries_size()) {
-            ret |=
-                rib->neighs_sync_obj_all(true, ObjClass, TableName, &dft_slice);
-        }
-    }
-
-    return ret;
+    return rib->ribsync_neighs(TableName);
 }
 
 class CentralizedFaultTolerantDFT : public DFT {
@@ -340,18 +459,31 @@ class CentralizedFaultTolerantDFT : public DFT {
     /* In case of state machine replica, a pointer to a Raft state
      * machine. */
     class Replica : public CeftReplica {
-        /* The structure of a DFT command (i.e. a log entry for the Raft SM). */
-        struct Command {
+        /* A DFT command (i.e. a log entry for the Raft SM) is made of the
+         * opcode followed by the application name and the IPCP name,
+         * separated by a null character. */
+        static constexpr uint8_t OpcodeSet = 1;
+        static constexpr uint8_t OpcodeDel = 2;
+
+        /* The structure of the commands in the logs written by previous
+         * versions, where all the commands had the same size. */
+        struct LegacyCommand {
             char appl_name[32];
             char ipcp_name[31];
             uint8_t opcode;
-            static constexpr uint8_t OpcodeSet = 1;
-            static constexpr uint8_t OpcodeDel = 2;
         } __attribute__((packed));
-        static_assert(sizeof(Command) == sizeof(Command::ipcp_name) +
-                                             sizeof(Command::appl_name) +
-                                             sizeof(Command::opcode),
-                      "Invalid memory layout for class Replica::Command");
+        static_assert(sizeof(LegacyCommand) ==
+                          sizeof(LegacyCommand::ipcp_name) +
+                              sizeof(LegacyCommand::appl_name) +
+                              sizeof(LegacyCommand::opcode),
+                      "Invalid memory layout for class Replica::LegacyCommand");
+
+        static std::string command_encode(uint8_t opcode,
+                                          const std::string &appl_name,
+                                          const std::string &ipcp_name);
+        static int command_decode(const std::string &command, uint8_t *opcode,
+                                  std::string *appl_name,
+                                  std::string *ipcp_name);
 
         /* State machine implementation. Just reuse the implementation of
          * a fully replicated DFT. */
@@ -366,18 +498,25 @@ class CentralizedFaultTolerantDFT : public DFT {
                           std::string("/tmp/ceft-dft-") +
                               std::to_string(dft->rib->uipcp->id) +
                               std::string("-") + dft->rib->myname,
-                          sizeof(Command), DFT::TableName),
-              impl(utils::make_unique<FullyReplicatedDFT>(dft->rib)){};
-        int apply(const char *const serbuf, CDAPMessage *const rm) override;
+                          sizeof(LegacyCommand), DFT::TableName),
+              impl(utils::make_unique<FullyReplicatedDFT>(
+                  dft->rib, /*ribsync_enabled=*/false)){};
+        int apply(const std::string &command, CDAPMessage *const rm) override;
         int replica_process_rib_msg(
             const CDAPMessage *rm, rlm_addr_t src_addr,
             std::vector<CommandToSubmit> *commands) override;
+        int snapshot_serialize(std::string &state) override;
+        int snapshot_restore(const std::string &state) override;
         int lookup_req(const std::string &appl_name, std::string *dst_node,
                        const std::string &preferred, uint32_t cookie)
         {
             return impl->lookup_req(appl_name, dst_node, preferred, cookie);
         }
-        void dump(std::stringstream &ss) const { impl->dump(ss); };
+        void dump(std::stringstream &ss) const
+        {
+            impl->dump(ss);
+            dump_replication(ss);
+        };
     };
     std::unique_ptr<Replica> raft;
 
@@ -486,7 +625,10 @@ CentralizedFaultTolerantDFT::reconfigure()
     peers = utils::strsplit<std::list>(replicas, ',');
 
     /* Create the client anyway. */
+    auto batch_window =
+        rib->get_param_value<Msecs>(DFT::Prefix, "raft-batch-window");
     client = utils::make_unique<Client>(this, peers);
+    client->set_batch_window(batch_window);
     UPI(rib->uipcp, "Client initialized\n");
 
     /* I'm one of the replicas. Create a Raft state machine and
@@ -502,9 +644,19 @@ CentralizedFaultTolerantDFT::reconfigure()
             rib->get_param_value<Msecs>(DFT::Prefix, "raft-heartbeat-timeout");
         auto rtx_timeout =
             rib->get_param_value<Msecs>(DFT::Prefix, "raft-rtx-timeout");
+        auto snapshot_entries =
+            rib->get_param_value<int>(DFT::Prefix, "raft-snapshot-entries");
+        auto read_lease =
+            rib->get_param_value<Msecs>(DFT::Prefix, "raft-read-lease");
         raft->set_election_timeout(election_timeout, election_timeout * 2);
         raft->set_heartbeat_timeout(heartbeat_timeout);
         raft->set_retransmission_timeout(rtx_timeout);
+        raft->set_snapshot_threshold(snapshot_entries);
+        raft->set_batch_window(batch_window);
+        if (raft->set_read_lease(read_lease)) {
+            UPW(rib->uipcp, "raft-read-lease must be shorter than the "
+                            "election timeout, leases disabled\n");
+        }
 
         return raft->init(peers);
     }
@@ -627,20 +779,106 @@ CentralizedFaultTolerantDFT::Client::client_process_rib_msg(
     return 0;
 }
 
+std::string
+CentralizedFaultTolerantDFT::Replica::command_encode(
+    uint8_t opcode, const std::string &appl_name, const std::string &ipcp_name)
+{
+    std::string command(1, static_cast<char>(opcode));
+
+    command.reserve(1 + appl_name.size() + 1 + ipcp_name.size());
+    command += appl_name;
+    command += '\0';
+    command += ipcp_name;
+
+    return command;
+}
+
+/* Decode a command, which may also come from a log written by a previous
+ * version. The name in a LegacyCommand never starts with an opcode. */
+int
+CentralizedFaultTolerantDFT::Replica::command_decode(
+    const std::string &command, uint8_t *opcode, std::string *appl_name,
+    std::string *ipcp_name)
+{
+    if (!command.empty() &&
+        (command[0] == OpcodeSet || command[0] == OpcodeDel)) {
+        size_t sep = command.find('\0', 1);
+
+        if (sep == std::string::npos) {
+            return -1;
+        }
+        *opcode    = command[0];
+        *appl_name = command.substr(1, sep - 1);
+        *ipcp_name = command.substr(sep + 1);
+        return 0;
+    }
+
+    if (command.size() == sizeof(LegacyCommand)) {
+        LegacyCommand c;
+
+        memcpy(&c, command.data(), sizeof(c));
+        c.appl_name[sizeof(c.appl_name) - 1] = '\0';
+        c.ipcp_name[sizeof(c.ipcp_name) - 1] = '\0';
+        *opcode                              = c.opcode;
+        *appl_name                           = c.appl_name;
+        *ipcp_name                           = c.ipcp_name;
+        return 0;
+    }
+
+    return -1;
+}
+
 /* Apply a command to the replicated state machine. We just pass the command
  * to the same multimap implementation used by the fully replicated DFT. */
 int
-CentralizedFaultTolerantDFT::Replica::apply(const char *const serbuf,
+CentralizedFaultTolerantDFT::Replica::apply(const std::string &command,
                                             CDAPMessage *const rm)
 {
-    auto c = reinterpret_cast<const Command *const>(serbuf);
+    std::string appl_name, ipcp_name;
     gpb::DFTEntry e;
+    uint8_t opcode;
 
-    e.set_ipcp_name(c->ipcp_name);
-    e.set_allocated_appl_name(apname2gpb(c->appl_name));
+    if (command_decode(command, &opcode, &appl_name, &ipcp_name) ||
+        (opcode != OpcodeSet && opcode != OpcodeDel)) {
+        UPE(rib->uipcp, "Invalid DFT command\n");
+        return -1;
+    }
+    e.set_ipcp_name(ipcp_name);
+    e.set_allocated_appl_name(apname2gpb(appl_name));
     e.set_seqnum(seqnum_next++);
-    assert(c->opcode == Command::OpcodeSet || c->opcode == Command::OpcodeDel);
-    impl->mod_table(e, c->opcode == Command::OpcodeSet, nullptr, nullptr);
+    impl->mod_table(e, opcode == OpcodeSet, nullptr, nullptr);
+
+    return 0;
+}
+
+/* The snapshot contains all the entries of the table, with their
+ * sequence numbers, and the next sequence number to use. */
+int
+CentralizedFaultTolerantDFT::Replica::snapshot_serialize(std::string &state)
+{
+    gpb::DFTSlice slice;
+
+    impl->table_export(&slice);
+    slice.set_seqnum_next(seqnum_next);
+
+    return slice.SerializeToString(&state) ? 0 : -1;
+}
+
+int
+CentralizedFaultTolerantDFT::Replica::snapshot_restore(const std::string &state)
+{
+    gpb::DFTSlice slice;
+
+    if (!slice.ParseFromString(state)) {
+        UPE(rib->uipcp, "Invalid DFT snapshot\n");
+        return -1;
+    }
+    impl = utils::make_unique<FullyReplicatedDFT>(rib,
+                                                  /*ribsync_enabled=*/false);
+    for (const gpb::DFTEntry &e : slice.entries()) {
+        impl->mod_table(e, /*add=*/true, nullptr, nullptr);
+    }
+    seqnum_next = slice.seqnum_next();
 
     return 0;
 }
@@ -676,26 +914,20 @@ CentralizedFaultTolerantDFT::Replica::replica_process_rib_msg(
     }
 
     /* Either we are the leader (so we can go ahead and serve the request),
-     * or this is a read request that we can serve because it's ok to be
-     * eventually consistent. */
+     * or this is a read request, which CeftReplica passes to us once it is
+     * linearizable. */
 
     if (rm->op_code == gpb::M_WRITE || rm->op_code == gpb::M_DELETE) {
         /* We received an M_WRITE or M_DELETE as sent by
          * Client::appl_register() and we are the leader. Let's prepare a
          * request to be submitted to the Raft state machine. */
         gpb::DFTEntry dft_entry;
-        string appl_name;
-        auto cbuf  = std::unique_ptr<char[]>(new char[sizeof(Command)]);
-        Command *c = reinterpret_cast<Command *>(cbuf.get());
+        std::string command;
 
         dft_entry.ParseFromArray(objbuf, objlen);
-        appl_name = apname2string(dft_entry.appl_name());
-        /* Fill in the command struct (already serialized). */
-        strncpy(c->ipcp_name, dft_entry.ipcp_name().c_str(),
-                sizeof(c->ipcp_name) - 1);
-        strncpy(c->appl_name, appl_name.c_str(), sizeof(c->appl_name) - 1);
-        c->opcode = rm->op_code == gpb::M_WRITE ? Command::OpcodeSet
-                                                : Command::OpcodeDel;
+        command = command_encode(
+            rm->op_code == gpb::M_WRITE ? OpcodeSet : OpcodeDel,
+            apname2string(dft_entry.appl_name()), dft_entry.ipcp_name());
         /* Prepare the response. */
         auto m = utils::make_unique<CDAPMessage>();
         m->op_code =
@@ -705,7 +937,7 @@ CentralizedFaultTolerantDFT::Replica::replica_process_rib_msg(
         m->invoke_id = rm->invoke_id;
 
         /* Return the command to the caller. */
-        commands->push_back(std::make_pair(std::move(cbuf), std::move(m)));
+        commands->push_back(std::make_pair(std::move(command), std::move(m)));
     } else if (rm->op_code == gpb::M_READ) {
         /* We received an an M_READ sent by Client::lookup_req().
          * Recover the application name, look it up in the DFT and
@@ -753,7 +985,11 @@ UipcpRib::dft_lib_init()
          {"raft-heartbeat-timeout",
           PolicyParam(Msecs(int(CeftReplica::kHeartBeatTimeoutMsecs)))},
          {"raft-rtx-timeout",
-          PolicyParam(Msecs(int(CeftReplica::kRtxTimeoutMsecs)))}});
+          PolicyParam(Msecs(int(CeftReplica::kRtxTimeoutMsecs)))},
+         {"raft-snapshot-entries",
+          PolicyParam(int(CeftReplica::kSnapshotEntries))},
+         {"raft-read-lease", PolicyParam(Msecs(0))},
+         {"raft-batch-window", PolicyParam(Msecs(0))}});
 }
 
 } // namespace rlite
@@ -22,6 +22,8 @@
  */
 
 #include <vector>
+#include <iomanip>
+#include <iterator>
 #include <map>
 
 #include "uipcp-normal-ceft.hpp"
@@ -33,6 +35,10 @@ std::string CeftReplica::ReqVoteObjClass           = "raft_rv";
 std::string CeftReplica::ReqVoteRespObjClass       = "raft_rv_r";
 std::string CeftReplica::AppendEntriesObjClass     = "raft_ae";
 std::string CeftReplica::AppendEntriesRespObjClass = "raft_ae_r";
+std::string CeftReplica::InstallSnapshotObjClass   = "raft_is";
+std::string CeftReplica::ReadIndexObjClass         = "raft_ri";
+std::string CeftReplica::ReadIndexRespObjClass     = "raft_ri_r";
+std::string CeftReplica::BatchObjClass             = "ceft_batch";
 
 int
 CeftReplica::init(const std::list<raft::ReplicaId> &peers)
@@ -63,6 +69,10 @@ CeftReplica::process_sm_output(raft::RaftSMOutput out)
         auto *ae        = dynamic_cast<raft::RaftAppendEntries *>(msg);
         const auto *aer =
             dynamic_cast<const raft::RaftAppendEntriesResp *>(msg);
+        const auto *is = dynamic_cast<const raft::RaftInstallSnapshot *>(msg);
+        const auto *ri = dynamic_cast<const raft::RaftReadIndex *>(msg);
+        const auto *rir =
+            dynamic_cast<const raft::RaftReadIndexResp *>(msg);
         auto m = utils::make_unique<CDAPMessage>();
         std::unique_ptr<::google::protobuf::MessageLite> obj;
         std::string obj_class;
@@ -91,7 +101,10 @@ CeftReplica::process_sm_output(raft::RaftSMOutput out)
             for (const auto &p : ae->entries) {
                 gpb::RaftLogEntry *ge = mm->add_entries();
                 ge->set_term(p.first);
-                ge->set_buffer(p.second.get(), CommandSize);
+                ge->set_buffer(*p.second);
+            }
+            if (ae->read_seq) {
+                mm->set_read_seq(ae->read_seq);
             }
             obj       = std::move(mm);
             obj_class = AppendEntriesObjClass;
@@ -101,8 +114,41 @@ CeftReplica::process_sm_output(raft::RaftSMOutput out)
             mm->set_follower_id(aer->follower_id);
             mm->set_log_index(aer->log_index);
             mm->set_success(aer->success);
+            if (!aer->success) {
+                mm->set_conflict_term(aer->conflict_term);
+                mm->set_conflict_index(aer->conflict_index);
+            }
+            if (aer->read_seq) {
+                mm->set_read_seq(aer->read_seq);
+            }
             obj       = std::move(mm);
             obj_class = AppendEntriesRespObjClass;
+        } else if (is) {
+            auto mm = utils::make_unique<gpb::RaftInstallSnapshot>();
+            mm->set_term(is->term);
+            mm->set_leader_id(is->leader_id);
+            mm->set_last_included_index(is->last_included_index);
+            mm->set_last_included_term(is->last_included_term);
+            mm->set_offset(is->offset);
+            mm->set_data(is->data);
+            mm->set_done(is->done);
+            obj       = std::move(mm);
+            obj_class = InstallSnapshotObjClass;
+        } else if (ri) {
+            auto mm = utils::make_unique<gpb::RaftReadIndex>();
+            mm->set_term(ri->term);
+            mm->set_follower_id(ri->follower_id);
+            mm->set_read_id(ri->read_id);
+            obj       = std::move(mm);
+            obj_class = ReadIndexObjClass;
+        } else if (rir) {
+            auto mm = utils::make_unique<gpb::RaftReadIndexResp>();
+            mm->set_term(rir->term);
+            mm->set_read_id(rir->read_id);
+            mm->set_read_index(rir->read_index);
+            mm->set_success(rir->success);
+            obj       = std::move(mm);
+            obj_class = ReadIndexRespObjClass;
         } else {
             assert(false);
         }
@@ -142,13 +188,34 @@ CeftReplica::process_sm_output(raft::RaftSMOutput out)
         }
     }
 
+    /* Serve the client reads that are now linearizable. Reads that cannot
+     * be served here are dropped, and the client will retry. */
+    for (uint64_t id : out.reads_ready) {
+        auto mit = pending_reads.find(id);
+        std::vector<CommandToSubmit> commands;
+
+        if (mit == pending_reads.end()) {
+            continue;
+        }
+        replica_process_rib_msg(mit->second.m.get(),
+                                mit->second.requestor_addr, &commands);
+        assert(commands.empty());
+        pending_reads.erase(mit);
+    }
+    for (uint64_t id : out.reads_failed) {
+        if (pending_reads.erase(id)) {
+            UPD(rib->uipcp, "Read %llu cannot be served here\n",
+                (long long unsigned)id);
+        }
+    }
+
     return ret;
 }
 
 int
 CeftReplica::process_timeout()
 {
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
     raft::RaftSMOutput out;
 
     timer_expired(timer_type, &out);
@@ -156,42 +223,77 @@ CeftReplica::process_timeout()
     return process_sm_output(std::move(out));
 }
 
-/* Apply a command to the replicated state machine. */
+/* Show how far behind each follower is, if we are the leader. */
+void
+CeftReplica::dump_replication(std::stringstream &ss) const
+{
+    if (!leader()) {
+        return;
+    }
+
+    ss << "Raft replication (last log index " << last_index()
+       << "):" << std::endl;
+    for (const auto &f : followers_info()) {
+        ss << "    " << std::setw(20) << f.id << ": match " << f.match_index
+           << ", lag " << f.lag << ", in flight " << f.inflight
+           << ", rejections " << f.rejections << ", retransmissions "
+           << f.retransmissions << ", last ack " << f.since_ack.count()
+           << " ms ago" << std::endl;
+    }
+}
+
+/* Apply a command, or the commands packed in a log entry, to the
+ * replicated state machine. */
 int
 CeftReplica::apply(raft::LogIndex index, raft::Term term,
-                   const char *const serbuf)
+                   const std::string &command)
 {
-    std::unique_ptr<CDAPMessage> rm;
+    std::vector<std::string> commands;
 
-    /* Check if the committed entry has an associated client request. */
-    auto mit = pending.find(index);
-    if (mit != pending.end()) {
-        rm = std::move(mit->second->m);
+    if (!commands_packed(command)) {
+        commands.push_back(command);
+    } else if (commands_unpack(command, &commands)) {
+        UPE(rib->uipcp, "Invalid packed commands in log entry %u\n", index);
+        pending.erase(index);
+        return -1;
     }
 
-    /* Invoke the actual state machine update. This may modify the response (if
-     * any) with the result of the update. */
-    apply(serbuf, rm.get());
+    /* Check if the committed entry has associated client requests. */
+    auto mit = pending.find(index);
+
+    for (size_t i = 0; i < commands.size(); i++) {
+        PendingResp *pr = nullptr;
+        std::unique_ptr<CDAPMessage> rm;
+
+        if (mit != pending.end() && i < mit->second.size()) {
+            pr = mit->second[i].get();
+            rm = std::move(pr->m);
+        }
+
+        /* Invoke the actual state machine update. This may modify the
+         * response (if any) with the result of the update. */
+        apply(commands[i], rm.get());
 
-    if (mit != pending.end()) {
         /* We must check that the pending response really matches the committed
          * entry, i.e., that we were the leader that submitted the entry. This
          * is true if and only if the term with which this entry was committed
          * matches the one that we saved at submit time (when the pending
          * request was created). This safety property follows from the guarantee
          * that each term has one and only one leader. */
-        if (mit->second->term == term) {
-            /* Send the response to the client and flush the pending response.
-             */
+        if (rm && pr->term == term) {
+            /* Send the response to the client. */
             int invoke_id = rm->invoke_id;
-            rib->send_to_dst_addr(std::move(rm), mit->second->requestor_addr);
+            rib->send_to_dst_addr(std::move(rm), pr->requestor_addr);
             UPD(rib->uipcp,
                 "Pending response for index %u sent to client %llu "
                 "(invoke_id=%d)\n",
-                index, (long long unsigned)mit->second->requestor_addr,
-                invoke_id);
+                index, (long long unsigned)pr->requestor_addr, invoke_id);
         }
-        pending.erase(index);
+    }
+
+    if (mit != pending.end()) {
+        /* Flush the pending responses. */
+        pending.erase(mit);
     }
 
     return 0;
@@ -215,7 +317,10 @@ CeftReplica::rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src)
     if (!objbuf && (rm->obj_class == ReqVoteObjClass ||
                     rm->obj_class == ReqVoteRespObjClass ||
                     rm->obj_class == AppendEntriesObjClass ||
-                    rm->obj_class == AppendEntriesRespObjClass)) {
+                    rm->obj_class == AppendEntriesRespObjClass ||
+                    rm->obj_class == InstallSnapshotObjClass ||
+                    rm->obj_class == ReadIndexObjClass ||
+                    rm->obj_class == ReadIndexRespObjClass)) {
         UPE(uipcp, "No object value found\n");
         return 0;
     }
@@ -251,13 +356,12 @@ CeftReplica::rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src)
         ae->prev_log_index = mm.prev_log_index();
         ae->prev_log_term  = mm.prev_log_term();
         for (int i = 0; i < mm.entries_size(); i++) {
-            size_t bufsize = mm.entries(i).buffer().size();
-            auto bufcopy   = std::unique_ptr<char[]>(new char[bufsize]);
-            memcpy(bufcopy.get(), mm.entries(i).buffer().data(), bufsize);
-            ae->entries.push_back(
-                std::make_pair(mm.entries(i).term(), std::move(bufcopy)));
+            ae->entries.push_back(std::make_pair(
+                mm.entries(i).term(),
+                std::make_shared<const std::string>(mm.entries(i).buffer())));
         }
-        ret = append_entries_input(*ae, &out);
+        ae->read_seq = mm.read_seq();
+        ret          = append_entries_input(*ae, &out);
 
     } else if (rm->obj_class == AppendEntriesRespObjClass) {
         auto aer = utils::make_unique<raft::RaftAppendEntriesResp>();
@@ -267,30 +371,81 @@ CeftReplica::rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src)
         aer->term        = mm.term();
         aer->follower_id = mm.follower_id();
         aer->log_index   = mm.log_index();
-        aer->success     = mm.success();
-        ret              = append_entries_resp_input(*aer, &out);
-    } else {
-        /* This is not a message belonging to the raft protocol. Forward it
-         * to the underlying implementation. */
-        std::vector<CommandToSubmit> commands;
+        aer->success        = mm.success();
+        aer->conflict_term  = mm.conflict_term();
+        aer->conflict_index = mm.conflict_index();
+        aer->read_seq       = mm.read_seq();
+        ret                 = append_entries_resp_input(*aer, &out);
 
-        replica_process_rib_msg(rm, src.addr, &commands);
+    } else if (rm->obj_class == InstallSnapshotObjClass) {
+        auto is = utils::make_unique<raft::RaftInstallSnapshot>();
 
-        /* Submit commands to the raft state machine, if any. */
-        for (auto &command : commands) {
-            raft::LogIndex index;
+        gpb::RaftInstallSnapshot mm;
+        mm.ParseFromArray(objbuf, objlen);
+        is->term                = mm.term();
+        is->leader_id           = mm.leader_id();
+        is->last_included_index = mm.last_included_index();
+        is->last_included_term  = mm.last_included_term();
+        is->offset              = mm.offset();
+        is->data                = mm.data();
+        is->done                = mm.done();
+        ret                     = install_snapshot_input(*is, &out);
+
+    } else if (rm->obj_class == ReadIndexObjClass) {
+        auto ri = utils::make_unique<raft::RaftReadIndex>();
+
+        gpb::RaftReadIndex mm;
+        mm.ParseFromArray(objbuf, objlen);
+        ri->term        = mm.term();
+        ri->follower_id = mm.follower_id();
+        ri->read_id     = mm.read_id();
+        ret             = read_index_input(*ri, &out);
 
-            ret =
-                submit(reinterpret_cast<const char *const>(command.first.get()),
-                       &index, &out);
-            if (ret) {
-                UPE(uipcp, "Failed to submit command (%s) to the RaftSM\n",
-                    rm->obj_class.c_str());
+    } else if (rm->obj_class == ReadIndexRespObjClass) {
+        auto rir = utils::make_unique<raft::RaftReadIndexResp>();
+
+        gpb::RaftReadIndexResp mm;
+        mm.ParseFromArray(objbuf, objlen);
+        rir->term       = mm.term();
+        rir->read_id    = mm.read_id();
+        rir->read_index = mm.read_index();
+        rir->success    = mm.success();
+        ret             = read_index_resp_input(*rir, &out);
+
+    } else if (rm->obj_class == BatchObjClass) {
+        /* Requests coalesced by a client. Each one is processed as if it
+         * was received alone, and has its own response. */
+        std::vector<CommandToSubmit> commands;
+        gpb::CeftBatch mm;
+
+        mm.ParseFromArray(objbuf, objlen);
+        for (int i = 0; i < mm.requests_size(); i++) {
+            gpb::CDAPMessage gm;
+
+            if (!gm.ParseFromString(mm.requests(i))) {
+                UPE(uipcp, "Invalid request in a client batch\n");
                 continue;
             }
-            pending[index] = utils::make_unique<PendingResp>(
-                std::move(command.second), src.addr, curr_term());
+
+            CDAPMessage req(gm);
+
+            if (req.op_code == gpb::M_READ) {
+                ret |= read_submit(&req, src.addr, &out);
+            } else {
+                replica_process_rib_msg(&req, src.addr, &commands);
+            }
         }
+        ret |= commands_submit(commands, src.addr, &out);
+
+    } else if (rm->op_code == gpb::M_READ) {
+        ret = read_submit(rm, src.addr, &out);
+    } else {
+        /* This is not a message belonging to the raft protocol. Forward it
+         * to the underlying implementation. */
+        std::vector<CommandToSubmit> commands;
+
+        replica_process_rib_msg(rm, src.addr, &commands);
+        ret = commands_submit(commands, src.addr, &out);
     }
 
     if (ret) {
@@ -301,10 +456,107 @@ CeftReplica::rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src)
     return process_sm_output(std::move(out));
 }
 
+/* A client read, which any replica can serve once its replica of the state
+ * machine reflects all the writes completed before the read was issued. */
+int
+CeftReplica::read_submit(const CDAPMessage *rm, rlm_addr_t src_addr,
+                         raft::RaftSMOutput *out)
+{
+    uint64_t id = read_id_next++;
+
+    pending_reads[id].m              = utils::make_unique<CDAPMessage>(*rm);
+    pending_reads[id].requestor_addr = src_addr;
+
+    return read_request(id, out);
+}
+
+/* Queue the commands produced by the underlying implementation for a client
+ * request, to be submitted to the Raft state machine when the batch window
+ * expires or the batch is full. */
+int
+CeftReplica::commands_submit(std::vector<CommandToSubmit> &commands,
+                             rlm_addr_t src_addr, raft::RaftSMOutput *out)
+{
+    for (auto &command : commands) {
+        batch.push_back(std::make_pair(
+            std::move(command.first),
+            utils::make_unique<PendingResp>(std::move(command.second),
+                                            src_addr, curr_term())));
+    }
+
+    if (batch.empty()) {
+        return 0;
+    }
+    if (batch_window.count() == 0 || batch.size() >= kBatchMaxCommands) {
+        return batch_flush(out);
+    }
+    if (!batch_timer) {
+        batch_timer = utils::make_unique<TimeoutEvent>(
+            batch_window, rib->uipcp, this,
+            [](struct uipcp *uipcp, void *arg) {
+                auto replica = static_cast<CeftReplica *>(arg);
+                replica->batch_timer->fired();
+                replica->batch_timeout();
+            });
+    }
+
+    return 0;
+}
+
+int
+CeftReplica::batch_timeout()
+{
+    std::lock_guard<RibMutex> guard(rib->mutex);
+    raft::RaftSMOutput out;
+    int ret;
+
+    if ((ret = batch_flush(&out))) {
+        return ret;
+    }
+
+    return process_sm_output(std::move(out));
+}
+
+/* Submit the queued commands to the Raft state machine, packed in a single
+ * log entry. */
+int
+CeftReplica::batch_flush(raft::RaftSMOutput *out)
+{
+    std::vector<std::string> commands;
+    raft::LogIndex index;
+    int ret;
+
+    batch_timer = nullptr;
+    if (batch.empty()) {
+        return 0;
+    }
+
+    for (auto &command : batch) {
+        commands.push_back(std::move(command.first));
+    }
+    ret = submit(commands.size() == 1 ? commands[0] : commands_pack(commands),
+                 &index, out);
+    if (ret) {
+        UPE(rib->uipcp, "Failed to submit %zu commands to the RaftSM\n",
+            commands.size());
+        batch.clear();
+        return ret;
+    }
+
+    auto &resps = pending[index];
+    for (auto &command : batch) {
+        command.second->term = curr_term();
+        resps.push_back(std::move(command.second));
+    }
+    batch.clear();
+
+    return 0;
+}
+
 int
 CeftClient::process_timeout()
 {
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
 
     mod_pending_timer();
 
@@ -331,13 +583,10 @@ CeftClient::mod_pending_timer()
                 UPD(rib->uipcp, "Forgetting about raft leader %s\n",
                     leader_id.c_str());
                 leader_id.clear();
-            } else if (mit->second->replica == reader_id) {
-                /* We got a timeout on the selected reader,
-                 * let's forget about it. */
-                UPD(rib->uipcp, "Forgetting about selected reader %s\n",
-                    reader_id.c_str());
-                reader_id.clear();
             }
+            /* Do not select this replica for reads, until it answers
+             * again. */
+            unresponsive.insert(mit->second->replica);
             mit = pending.erase(mit);
         } else {
             if (mit->second->t < t_min) {
@@ -362,16 +611,69 @@ CeftClient::mod_pending_timer()
     }
 }
 
+/* Select the replica for the next read in round robin, skipping the
+ * unresponsive ones. All the replicas serve linearizable reads, so that
+ * the read throughput scales with their number. Returns an empty string
+ * if all of them are unresponsive. */
+raft::ReplicaId
+CeftClient::reader_select()
+{
+    for (size_t n = 0; n < replicas.size(); n++) {
+        auto it = replicas.begin();
+
+        std::advance(it, next_reader++ % replicas.size());
+        if (!unresponsive.count(*it)) {
+            return *it;
+        }
+    }
+
+    return raft::ReplicaId();
+}
+
 int
 CeftClient::send_to_replicas(std::unique_ptr<CDAPMessage> m,
                              std::unique_ptr<PendingReq> pr, OpSemantics sem)
 {
-    const raft::ReplicaId &selected_id =
-        (sem == OpSemantics::Get) ? reader_id : leader_id;
+    const raft::ReplicaId selected_id =
+        (sem == OpSemantics::Get) ? reader_select() : leader_id;
+
+    if (sem == OpSemantics::Put && !selected_id.empty() &&
+        batch_window.count() > 0) {
+        /* Coalesce this write with the other ones issued within the batch
+         * window, in a single message for the leader. */
+        int invoke_id;
+
+        if (!batch.empty() && batch_dst != selected_id) {
+            int ret = batch_flush();
+            if (ret) {
+                return ret;
+            }
+        }
+        m->invoke_id = invoke_id = rib->invoke_id_mgr.get_invoke_id();
+        pr->replica              = selected_id;
+        pending[invoke_id]       = std::move(pr);
+        batch_dst                = selected_id;
+        batch.push_back(std::move(m));
+        mod_pending_timer();
+        if (batch.size() >= CeftReplica::kBatchMaxCommands) {
+            return batch_flush();
+        }
+        if (!batch_timer) {
+            batch_timer = utils::make_unique<TimeoutEvent>(
+                batch_window, rib->uipcp, this,
+                [](struct uipcp *uipcp, void *arg) {
+                    auto cli = static_cast<CeftClient *>(arg);
+                    cli->batch_timer->fired();
+                    std::lock_guard<RibMutex> guard(cli->rib->mutex);
+                    cli->batch_flush();
+                });
+        }
+        return 0;
+    }
 
-    /* If we have a selected for this operation (leader or selected reader), we
-     * send it to that replica only; otherwise we send it to all the replicas.
-     */
+    /* If we have a selected replica for this operation (the leader or the
+     * next reader), we send it to that replica only; otherwise we send it
+     * to all the replicas. */
     for (const auto &r : replicas) {
         if (selected_id.empty() || r == selected_id) {
             auto mc  = utils::make_unique<CDAPMessage>(*m);
@@ -397,6 +699,46 @@ CeftClient::send_to_replicas(std::unique_ptr<CDAPMessage> m,
     return 0;
 }
 
+/* Send the coalesced write requests to the leader. */
+int
+CeftClient::batch_flush()
+{
+    gpb::CeftBatch mm;
+    int invoke_id;
+    int ret;
+
+    batch_timer = nullptr;
+    if (batch.size() <= 1) {
+        if (batch.empty()) {
+            return 0;
+        }
+        ret = rib->send_to_dst_node(std::move(batch[0]), batch_dst, nullptr,
+                                    nullptr);
+        batch.clear();
+        return ret;
+    }
+
+    for (const auto &m : batch) {
+        gpb::CDAPMessage gm = *m;
+
+        gm.SerializeToString(mm.add_requests());
+    }
+
+    auto m = utils::make_unique<CDAPMessage>();
+    m->m_write(CeftReplica::BatchObjClass, batch[0]->obj_name);
+    UPD(rib->uipcp, "Sending %zu requests to replica '%s'\n", batch.size(),
+        batch_dst.c_str());
+    batch.clear();
+
+    /* The batch itself is not answered, only the requests in it are. */
+    ret = rib->send_to_dst_node(std::move(m), batch_dst, &mm, &invoke_id);
+    if (!ret) {
+        rib->invoke_id_mgr.put_invoke_id(invoke_id);
+    }
+
+    return ret;
+}
+
 int
 CeftClient::rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src)
 {
@@ -419,13 +761,8 @@ CeftClient::rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src)
         return 0;
     }
 
-    if (rm->op_code == gpb::M_READ_R) {
-        /* The first reader that answers becomes our selected reader. */
-        if (reader_id.empty()) {
-            reader_id = pi->second->replica;
-            UPD(uipcp, "Selected reader: %s\n", reader_id.c_str());
-        }
-    } else {
+    unresponsive.erase(pi->second->replica);
+    if (rm->op_code != gpb::M_READ_R) {
         /* We assume it was the leader to answer. So now we know who the
          * leader is. */
         if (leader_id.empty()) {
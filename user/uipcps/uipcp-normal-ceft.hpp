@@ -33,9 +33,6 @@ namespace rlite {
  * implementing the access to the specific resource and the reaction to input
  * CDAP messages. */
 class CeftReplica : public raft::RaftSM {
-    /* Size of a command in the replicated state machine log. */
-    const size_t CommandSize;
-
     /* Name of the RIB object to use for Raft protocol communications. */
     const std::string RibObjName;
 
@@ -57,12 +54,33 @@ class CeftReplica : public raft::RaftSM {
         }
     };
 
-    std::unordered_map<raft::LogIndex, std::unique_ptr<PendingResp>> pending;
+    /* A log entry may pack many commands, each with its own response. */
+    std::unordered_map<raft::LogIndex,
+                       std::vector<std::unique_ptr<PendingResp>>>
+        pending;
+
+    /* Commands waiting to be packed in a single log entry, see
+     * set_batch_window(). */
+    std::vector<std::pair<std::string, std::unique_ptr<PendingResp>>> batch;
+    std::unique_ptr<TimeoutEvent> batch_timer;
+    Msecs batch_window = Msecs(0);
+
+    /* Client reads waiting for the local replica of the state machine to
+     * be up to date, see raft::RaftSM::read_request(). */
+    struct PendingRead {
+        std::unique_ptr<CDAPMessage> m;
+        rlm_addr_t requestor_addr;
+    };
+    std::unordered_map<uint64_t, PendingRead> pending_reads;
+    uint64_t read_id_next = 0;
 
     static std::string ReqVoteObjClass;
     static std::string ReqVoteRespObjClass;
     static std::string AppendEntriesObjClass;
     static std::string AppendEntriesRespObjClass;
+    static std::string InstallSnapshotObjClass;
+    static std::string ReadIndexObjClass;
+    static std::string ReadIndexRespObjClass;
 
 protected:
     UipcpRib *rib = nullptr;
@@ -71,9 +89,9 @@ public:
     RL_NODEFAULT_NONCOPIABLE(CeftReplica);
     CeftReplica(UipcpRib *rib, const std::string &smname,
                 const raft::ReplicaId &myname, std::string logname,
-                size_t cmd_size, const std::string rib_obj_name)
-        : raft::RaftSM(smname, myname, logname, cmd_size, std::cerr, std::cout),
-          CommandSize(cmd_size),
+                size_t legacy_cmd_size, const std::string rib_obj_name)
+        : raft::RaftSM(smname, myname, logname, legacy_cmd_size, std::cerr,
+                       std::cout),
           RibObjName(rib_obj_name),
           rib(rib)
     {
@@ -84,14 +102,38 @@ public:
     int process_sm_output(raft::RaftSMOutput out);
     int process_timeout();
     int apply(raft::LogIndex index, raft::Term term,
-              const char *const serbuf) override final;
+              const std::string &command) override final;
     int rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src);
-    virtual int apply(const char *const serbuf, CDAPMessage *const rm) = 0;
+    void dump_replication(std::stringstream &ss) const;
+    virtual int apply(const std::string &command, CDAPMessage *const rm) = 0;
     using CommandToSubmit =
-        std::pair<std::unique_ptr<char[]>, std::unique_ptr<CDAPMessage>>;
+        std::pair<std::string, std::unique_ptr<CDAPMessage>>;
     virtual int replica_process_rib_msg(
         const CDAPMessage *rm, rlm_addr_t src_addr,
         std::vector<CommandToSubmit> *commands) = 0;
+
+    /* Default number of applied log entries that triggers a snapshot
+     * of the replicated state machine. */
+    static constexpr int kSnapshotEntries = 1000;
+
+    /* The commands received within this time window are packed in a
+     * single log entry (0 to submit them right away). */
+    void set_batch_window(Msecs t) { batch_window = t; }
+
+    /* Maximum number of commands packed in a log entry, and of requests
+     * coalesced in a message by the clients. */
+    static constexpr size_t kBatchMaxCommands = 64;
+
+    /* Object class of the messages that carry many client requests. */
+    static std::string BatchObjClass;
+
+private:
+    int read_submit(const CDAPMessage *rm, rlm_addr_t src_addr,
+                    raft::RaftSMOutput *out);
+    int commands_submit(std::vector<CommandToSubmit> &commands,
+                        rlm_addr_t src_addr, raft::RaftSMOutput *out);
+    int batch_flush(raft::RaftSMOutput *out);
+    int batch_timeout();
 };
 
 /* The CeftClient class provides the client-side generic glue functionalities
@@ -110,8 +152,10 @@ protected:
     /* The leader, if we know who it is, otherwise the empty
      * string. */
     raft::ReplicaId leader_id;
-    /* The replica that responded first to an M_READ, if any. */
-    raft::ReplicaId reader_id;
+    /* Reads are spread over the replicas in round robin, skipping the
+     * ones that did not answer in time (until they answer again). */
+    size_t next_reader = 0;
+    std::set<raft::ReplicaId> unresponsive;
     std::unique_ptr<TimeoutEvent> timer;
 
     struct PendingReq {
@@ -128,11 +172,20 @@ protected:
     };
     std::unordered_map</*invoke_id*/ int, std::unique_ptr<PendingReq>> pending;
 
+    /* Write requests waiting to be sent to the leader in a single message,
+     * see set_batch_window(). */
+    std::vector<std::unique_ptr<CDAPMessage>> batch;
+    raft::ReplicaId batch_dst;
+    std::unique_ptr<TimeoutEvent> batch_timer;
+    Msecs batch_window = Msecs(0);
+
     enum class OpSemantics { Get, Put };
 
     int send_to_replicas(std::unique_ptr<CDAPMessage> m,
                          std::unique_ptr<PendingReq> pr, OpSemantics sem);
     void mod_pending_timer();
+    raft::ReplicaId reader_select();
+    int batch_flush();
 
 public:
     RL_NODEFAULT_NONCOPIABLE(CeftClient);
@@ -151,10 +204,11 @@ public:
                                        rlm_addr_t src_addr) = 0;
 
     /* For external hints. */
-    void set_leader_id(const raft::ReplicaId &name)
-    {
-        leader_id = reader_id = name;
-    }
+    void set_leader_id(const raft::ReplicaId &name) { leader_id = name; }
+
+    /* The write requests issued within this time window are sent to the
+     * leader in a single message (0 to send them right away). */
+    void set_batch_window(Msecs t) { batch_window = t; }
 
     /* Timeout in seconds for client requests to the replicas. */
     static constexpr int kTimeoutSecs = 5;
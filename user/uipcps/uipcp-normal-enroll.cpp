@@ -77,6 +77,30 @@ NeighFlow::~NeighFlow()
     }
 }
 
+void
+NeighFlow::conn_create()
+{
+    conn = utils::make_unique<CDAPConn>(flow_fd);
+    conn->set_framed(framed);
+}
+
+size_t
+NeighFlow::obj_size_max() const
+{
+    /* Room for the CDAP header and, on kernel-bound flows, for the EFCP
+     * header of the management PDU. */
+    const size_t hdr_room = 256;
+    size_t mss;
+
+    if (framed) {
+        return CDAPConn::kFrameMaxLen - hdr_room;
+    }
+
+    mss = rina_flow_mss_get(flow_fd);
+
+    return mss > hdr_room ? mss - hdr_room : 0;
+}
+
 /* Does not take ownership of m. */
 int
 NeighFlow::send_to_port_id(CDAPMessage *m, int invoke_id,
@@ -133,9 +157,9 @@ NeighFlow::send_to_port_id(CDAPMessage *m, int invoke_id,
         last_activity = std::chrono::system_clock::now();
         stats.win[0].bytes_sent += ret;
         if (last_activity - stats.t_last >= Secs(neighFlowStatsPeriod)) {
-            stats.win[1]            = stats.win[0];
-            stats.win[0].bytes_sent = stats.win[0].bytes_recvd = 0;
-            stats.t_last                                       = last_activity;
+            stats.win[1] = stats.win[0];
+            memset(&stats.win[0], 0, sizeof(stats.win[0]));
+            stats.t_last = last_activity;
         }
     }
 
@@ -224,7 +248,7 @@ NeighFlow::keepalive_tmr_start()
         [](struct uipcp *uipcp, void *arg) {
             int flow_fd   = reinterpret_cast<uintptr_t>(arg);
             UipcpRib *rib = UIPCP_RIB(uipcp);
-            std::lock_guard<std::mutex> guard(rib->mutex);
+            std::lock_guard<RibMutex> guard(rib->mutex);
             std::shared_ptr<Neighbor> neigh;
             std::shared_ptr<NeighFlow> nf;
 
@@ -298,7 +322,7 @@ Neighbor::n_flow_set(std::shared_ptr<NeighFlow> nf)
          * keepalive timer. */
         kbnf             = flows.begin()->second;
         nf->enroll_state = kbnf->enroll_state;
-        nf->conn         = utils::make_unique<CDAPConn>(nf->flow_fd);
+        nf->conn_create();
         if (kbnf->conn) {
             nf->conn->state_set(kbnf->conn->state_get());
         }
@@ -382,7 +406,7 @@ EnrollmentResources::enrollment_commit()
 
 /* To be called with RIB lock held. */
 std::unique_ptr<const CDAPMessage>
-EnrollmentResources::next_enroll_msg(std::unique_lock<std::mutex> &lk)
+EnrollmentResources::next_enroll_msg(std::unique_lock<RibMutex> &lk)
 {
     std::unique_ptr<const CDAPMessage> msg;
 
@@ -411,7 +435,7 @@ EnrollmentResources::next_enroll_msg(std::unique_lock<std::mutex> &lk)
 
 /* Default policy for the enrollment initiator (enrollee). */
 int
-EnrollmentResources::enrollee_default(std::unique_lock<std::mutex> &lk)
+EnrollmentResources::enrollee_default(std::unique_lock<RibMutex> &lk)
 {
     UipcpRib *rib       = neigh->rib;
     struct uipcp *uipcp = rib->uipcp;
@@ -586,7 +610,7 @@ EnrollmentResources::enrollee_thread()
 {
     UipcpRib *rib = neigh->rib;
     std::unique_ptr<const CDAPMessage> rm;
-    std::unique_lock<std::mutex> lk(rib->mutex);
+    std::unique_lock<RibMutex> lk(rib->mutex);
     /* Cleanup must be created after the lock guard, so that its
      * destructor is called before the lock guard destructor. */
     auto cleanup = utils::ScopedCleanup([this]() { this->enrollment_abort(); });
@@ -599,7 +623,7 @@ EnrollmentResources::enrollee_thread()
 
         /* We are the enrollment initiator, let's send an
          * M_CONNECT message. */
-        nf->conn = utils::make_unique<CDAPConn>(nf->flow_fd);
+        nf->conn_create();
 
         m.m_connect(gpb::AUTH_NONE, &av, rib->myname, neigh->ipcp_name);
 
@@ -714,7 +738,7 @@ EnrollmentResources::enrollee_thread()
 
 /* Default policy for the enrollment slave (enroller). */
 int
-EnrollmentResources::enroller_default(std::unique_lock<std::mutex> &lk)
+EnrollmentResources::enroller_default(std::unique_lock<RibMutex> &lk)
 {
     UipcpRib *rib = neigh->rib;
     std::unique_ptr<const CDAPMessage> rm;
@@ -883,7 +907,7 @@ EnrollmentResources::enroller_thread()
 {
     UipcpRib *rib = neigh->rib;
     std::unique_ptr<const CDAPMessage> rm;
-    std::unique_lock<std::mutex> lk(rib->mutex);
+    std::unique_lock<RibMutex> lk(rib->mutex);
     /* Cleanup must be created after the lock guard, so that its
      * destructor is called before the lock guard destructor. */
     auto cleanup = utils::ScopedCleanup([this]() { this->enrollment_abort(); });
@@ -1084,8 +1108,8 @@ operator==(const gpb::NeighborCandidate &a, const gpb::NeighborCandidate &o)
 int
 UipcpRib::sync_rib(const std::shared_ptr<NeighFlow> &nf)
 {
-    unsigned int limit = 10; /* Hardwired for now, but at least we limit. */
-    int ret            = 0;
+    size_t limit = nf->obj_size_max();
+    int ret      = 0;
 
     UPD(uipcp, "Starting RIB sync with neighbor '%s'\n",
         static_cast<string>(nf->neigh_name).c_str());
@@ -1102,12 +1126,15 @@ UipcpRib::sync_rib(const std::shared_ptr<NeighFlow> &nf)
         /* Scan all the neighbors I know about. */
         for (auto cit = neighbors_seen.begin(); cit != neighbors_seen.end();) {
             gpb::NeighborCandidateList ncl;
+            size_t bytes = 0;
 
-            while (ncl.candidates_size() < static_cast<int>(limit) &&
-                   cit != neighbors_seen.end()) {
+            /* At least one candidate per message. */
+            do {
+                bytes += gpb_embedded_size(cit->second);
                 *ncl.add_candidates() = cit->second;
                 cit++;
-            }
+            } while (cit != neighbors_seen.end() &&
+                     bytes + gpb_embedded_size(cit->second) <= limit);
 
             ret |= nf->sync_obj(true, Neighbor::ObjClass, Neighbor::TableName,
                                 &ncl);
@@ -1147,11 +1174,19 @@ UipcpRib::neighs_refresh_tmr_restart()
 void
 UipcpRib::neighs_refresh()
 {
-    std::lock_guard<std::mutex> guard(mutex);
-    size_t limit = 10;
+    std::lock_guard<RibMutex> guard(mutex);
+    size_t limit = SIZE_MAX;
 
     UPV(uipcp, "Refreshing neighbors RIB\n");
 
+    /* The messages are sent to all the neighbors, so they must fit the
+     * most constrained management flow. */
+    for (const auto &kvn : neighbors) {
+        if (kvn.second->has_flows()) {
+            limit = std::min(limit, kvn.second->mgmt_conn()->obj_size_max());
+        }
+    }
+
     routing->neighs_refresh(limit);
     dft->neighs_refresh(limit);
     {
@@ -1579,7 +1614,8 @@ Neighbor::flow_alloc(const char *supp_dif)
 
     topo_lower_flow_added(rib->uipcp->uipcps, rib->uipcp->id, lower_ipcp_id_);
 
-    reliable_spec(&relspec);
+    reliable_spec(&relspec, rib->get_param_value<bool>(
+                                UipcpRib::ResourceAllocPrefix, "framing"));
     alloc_reliable_flow =
         (rl_conf_ipcp_qos_supported(lower_ipcp_id_, &relspec) == 0);
     UPD(rib->uipcp, "N-1 DIF %s has%s reliable flows\n", supp_dif,
@@ -1611,6 +1647,7 @@ Neighbor::flow_alloc(const char *supp_dif)
                                              RL_PORT_ID_NONE, mgmt_fd,
                                              RL_IPCP_ID_NONE);
             nf->reliable = true;
+            nf->framed   = is_framed_spec(&relspec);
             UPD(rib->uipcp, "Management-only reliable N-1 flow allocated\n");
             mgmt_only_set(nf);
         }
@@ -1629,7 +1666,7 @@ UipcpRib::enroll(const char *neigh_name, const char *supp_dif_name,
     std::shared_ptr<NeighFlow> nf;
     int ret = 0;
 
-    std::unique_lock<std::mutex> lk(mutex);
+    std::unique_lock<RibMutex> lk(mutex);
     neigh = get_neighbor(string(neigh_name), true);
 
     /* Create an N-1 flow, if needed. */
@@ -1693,7 +1730,7 @@ int
 UipcpRib::enroller_enable(bool enable)
 {
     {
-        std::lock_guard<std::mutex> guard(this->mutex);
+        std::lock_guard<RibMutex> guard(this->mutex);
 
         if (enroller_enabled == enable) {
             return 0; /* nothing to do */
@@ -1760,7 +1797,7 @@ UipcpRib::lower_dif_detach(const std::string &lower_dif)
 void
 UipcpRib::enrollment_resources_cleanup()
 {
-    std::lock_guard<std::mutex> guard(mutex);
+    std::lock_guard<RibMutex> guard(mutex);
 
     for (auto mit = enrollment_resources.begin();
          mit != enrollment_resources.end();) {
@@ -1890,7 +1927,8 @@ UipcpRib::allocate_n_flows()
     /* Carry out allocations of N-flows. */
     struct rina_flow_spec relspec;
 
-    reliable_spec(&relspec);
+    reliable_spec(&relspec, get_param_value<bool>(
+                                UipcpRib::ResourceAllocPrefix, "framing"));
 
     for (const string &re : n_flow_allocations) {
         struct pollfd pfd;
@@ -1936,6 +1974,7 @@ UipcpRib::allocate_n_flows()
                 this, neigh->second->ipcp_name, string(uipcp->dif_name),
                 RL_PORT_ID_NONE, pfd.fd, RL_IPCP_ID_NONE);
             nf->reliable = true;
+            nf->framed   = is_framed_spec(&relspec);
             neigh->second->n_flow_set(nf);
         } else {
             UPE(uipcp, "Neighbor disappeared, closing N-flow %d\n", pfd.fd);
@@ -1948,7 +1987,7 @@ UipcpRib::allocate_n_flows()
 void
 UipcpRib::check_for_address_conflicts()
 {
-    std::lock_guard<std::mutex> guard(mutex);
+    std::lock_guard<RibMutex> guard(mutex);
     gpb::NeighborCandidate cand = neighbor_cand_get();
     bool need_to_change         = false;
     map<rlm_addr_t, string> m;
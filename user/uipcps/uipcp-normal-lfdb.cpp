@@ -26,24 +26,115 @@
 #include <iostream>
 #include <queue>
 #include <limits>
+#include <algorithm>
+#include <chrono>
 
 #include "BaseRIB.pb.h"
 #include "uipcp-normal-lfdb.hpp"
 
 namespace rlite {
 
+WorkerPool::WorkerPool(unsigned int num_workers) : next_job(0)
+{
+    for (unsigned int i = 1; i <= num_workers; i++) {
+        threads.emplace_back(&WorkerPool::worker_loop, this, i);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    start_cond.notify_all();
+    for (std::thread &th : threads) {
+        th.join();
+    }
+}
+
+void
+WorkerPool::jobs_drain(unsigned int worker)
+{
+    for (;;) {
+        size_t idx = next_job.fetch_add(1);
+
+        if (idx >= num_jobs) {
+            break;
+        }
+        (*job)(idx, worker);
+    }
+}
+
+void
+WorkerPool::worker_loop(unsigned int worker)
+{
+    uint64_t seen = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lk(mutex);
+
+            start_cond.wait(
+                lk, [this, seen] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+        }
+
+        jobs_drain(worker);
+
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (--busy == 0) {
+                done_cond.notify_one();
+            }
+        }
+    }
+}
+
+void
+WorkerPool::run(size_t n, const Job &j)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        job      = &j;
+        num_jobs = n;
+        next_job = 0;
+        busy     = threads.size();
+        generation++;
+    }
+    start_cond.notify_all();
+
+    jobs_drain(0);
+
+    std::unique_lock<std::mutex> lk(mutex);
+    done_cond.wait(lk, [this] { return busy == 0; });
+    job = nullptr;
+}
+
+LFDB::LFDB(bool lfa_enabled, bool verbose)
+    : lfa_enabled(lfa_enabled), verbose(verbose)
+{
+    unsigned int max_threads = kMaxLfaThreads;
+
+    lfa_threads = std::min(std::thread::hardware_concurrency(), max_threads);
+    lfa_threads = std::max(1U, lfa_threads);
+}
+
 void
 LFDB::dump(std::stringstream &ss) const
 {
     ss << "Lower Flow Database:" << std::endl;
     for (const auto &kvi : db) {
         for (const auto &kvj : kvi.second) {
-            const gpb::LowerFlow &flow = kvj.second;
+            const FlowEntry &flow = kvj.second;
 
-            ss << "    Local: " << flow.local_node()
-               << ", Remote: " << flow.remote_node()
-               << ", Cost: " << flow.cost() << ", Seqnum: " << flow.seqnum()
-               << ", State: " << flow.state() << ", Age: " << flow.age()
+            ss << "    Local: " << nim.GetName(kvi.first)
+               << ", Remote: " << nim.GetName(kvj.first)
+               << ", Cost: " << flow.cost << ", Seqnum: " << flow.seqnum
+               << ", State: " << flow.state << ", Age: " << flow.age
                << std::endl;
         }
     }
@@ -72,178 +163,842 @@ LFDB::dump_routing(std::stringstream &ss, const NodeId &local_node) const
             }
             ss << " ";
         }
+        auto ecmp = next_hops_ecmp.find(dst_node);
+        if (ecmp != next_hops_ecmp.end()) {
+            ss << " (" << ecmp->second << " equal cost)";
+        }
         ss << std::endl;
     }
 }
 
-void
-LFDB::compute_shortest_paths(
-    const NodeId &source_node,
-    const std::unordered_map<NodeId, std::vector<Edge>> &graph,
-    std::unordered_map<NodeId, DijkstraInfo> &info)
+uint64_t
+LFDB::flow_hash(const gpb::LowerFlow &lf)
 {
-    /* Per-node info stored in the priority queue. */
-    struct PQInfo {
-        NodeId node;
-        unsigned int dist;
-        PQInfo(const NodeId &node, unsigned int dist) : node(node), dist(dist)
-        {
+    const uint64_t fnv_prime = 1099511628211ULL;
+    uint64_t h               = 14695981039346656037ULL;
+
+    auto bytes_hash = [&h, fnv_prime](const void *data, size_t len) {
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+
+        for (size_t i = 0; i < len; i++) {
+            h = (h ^ p[i]) * fnv_prime;
         }
-        bool operator<(const PQInfo &other) const { return dist > other.dist; }
     };
-    std::priority_queue<PQInfo> frontier;
+    auto u32_hash = [&bytes_hash](uint32_t x) {
+        uint8_t le[4] = {uint8_t(x), uint8_t(x >> 8), uint8_t(x >> 16),
+                         uint8_t(x >> 24)};
+        bytes_hash(le, sizeof(le));
+    };
+
+    /* FNV-1a on a fixed layout, so that all the nodes agree. */
+    bytes_hash(lf.local_node().c_str(), lf.local_node().size() + 1);
+    bytes_hash(lf.remote_node().c_str(), lf.remote_node().size() + 1);
+    u32_hash(lf.cost());
+    u32_hash(lf.seqnum());
+    u32_hash(lf.state());
+
+    /* Final mixing, as the hashes are combined with XOR. */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+std::string
+LFDB::flow_key(const NodeId &local_node, const NodeId &remote_node)
+{
+    /* Node names cannot contain a NUL character. */
+    std::string key = local_node;
+
+    key.push_back('\0');
+    key += remote_node;
+
+    return key;
+}
+
+void
+LFDB::add(const gpb::LowerFlow &lf)
+{
+    NodeIdx local  = nim.GetId(lf.local_node());
+    NodeIdx remote = nim.GetId(lf.remote_node());
+    auto ins       = db[local].emplace(remote, FlowEntry());
+    FlowEntry &e   = ins.first->second;
+
+    if (ins.second) {
+        if (node_flows.size() < nim.size()) {
+            node_flows.resize(nim.size(), 0);
+        }
+        node_flows[local]++;
+        node_flows[remote]++;
+    }
 
-    /* Initialize the per-node info map. */
-    for (const auto &kvg : graph) {
-        struct DijkstraInfo inf;
+    e.cost   = lf.cost();
+    e.seqnum = lf.seqnum();
+    e.age    = lf.age();
+    e.state  = lf.state();
+    flow_changed(lf, /*removed=*/false);
 
-        inf.dist        = std::numeric_limits<unsigned int>::max();
-        info[kvg.first] = std::move(inf);
+    if (!graph_enabled) {
+        return;
     }
 
-    frontier.push({source_node, 0});
-    while (!frontier.empty()) {
-        /* Select the closest node from the ones in the frontier. */
-        PQInfo closer = frontier.top();
-        frontier.pop();
+    if (adj.size() < nim.size()) {
+        adj.resize(nim.size());
+    }
+
+    for (Edge &edge : adj[local]) {
+        if (edge.to == remote) {
+            if (edge.cost != lf.cost()) {
+                edge.cost = lf.cost();
+                graph_change(local, remote);
+            }
+            return;
+        }
+    }
+
+    adj[local].emplace_back(remote, lf.cost());
+    graph_change(local, remote);
+}
+
+bool
+LFDB::del(const NodeId &local_node, const NodeId &remote_node)
+{
+    NodeIdx local  = nim.FindId(local_node);
+    NodeIdx remote = nim.FindId(remote_node);
+    auto it        = db.find(local);
+
+    if (it == db.end()) {
+        return false;
+    }
+
+    auto fit = it->second.find(remote);
+
+    if (fit == it->second.end()) {
+        return false;
+    }
+    flow_changed(flow_get(local, remote, fit->second), /*removed=*/true);
+    it->second.erase(fit);
+    if (it->second.empty()) {
+        db.erase(it);
+    }
+
+    if (graph_enabled) {
+        std::vector<Edge> &edges = adj[local];
+
+        for (auto eit = edges.begin(); eit != edges.end(); eit++) {
+            if (eit->to == remote) {
+                *eit = edges.back();
+                edges.pop_back();
+                break;
+            }
+        }
+        graph_change(local, remote);
+    }
+    node_flows_dec(local);
+    node_flows_dec(remote);
+
+    return true;
+}
+
+void
+LFDB::node_flows_dec(NodeIdx i)
+{
+    if (--node_flows[i] != 0) {
+        return;
+    }
+    if (graph_enabled) {
+        ids_unused.push_back(i);
+    } else {
+        nim.Release(i);
+    }
+}
 
-        if (closer.dist == std::numeric_limits<unsigned int>::max()) {
+void
+LFDB::graph_disable()
+{
+    graph_enabled = false;
+
+    /* Free the graph and the shortest path trees, which refer to the
+     * pending ids. */
+    std::vector<std::vector<Edge>>().swap(adj);
+    std::vector<uint32_t>().swap(csr_offsets);
+    std::vector<Edge>().swap(csr_edges);
+    std::vector<Edge>().swap(csr_row);
+    std::vector<SpfWorkspace>().swap(workspaces);
+    std::vector<DijkstraInfo>().swap(local_info);
+    neigh_infos.clear();
+    neigh_infos.shrink_to_fit();
+    std::vector<std::pair<NodeIdx, NodeIdx>>().swap(graph_changes);
+    std::vector<NodeIdx>().swap(touched);
+    neigh_touched.clear();
+    neigh_touched.shrink_to_fit();
+    std::vector<uint8_t>().swap(node_mark);
+    local_root = kNodeIdxNone;
+    pool.reset();
+
+    for (NodeIdx i : ids_unused) {
+        if (node_flows[i] == 0) {
+            nim.Release(i);
+        }
+    }
+    std::vector<NodeIdx>().swap(ids_unused);
+}
+
+void
+LFDB::graph_change(NodeIdx a, NodeIdx b)
+{
+    csr_dirty = true;
+    if (graph_changes_overflow) {
+        return;
+    }
+    if (graph_changes.size() >= spf_incremental_max_changes) {
+        /* Too many changes, the next computation will start from
+         * scratch. */
+        graph_changes_overflow = true;
+        graph_changes.clear();
+        return;
+    }
+    graph_changes.emplace_back(a, b);
+}
+
+unsigned int
+LFDB::edge_cost(NodeIdx from, NodeIdx to) const
+{
+    for (uint32_t e = csr_offsets[from]; e < csr_offsets[from + 1]; e++) {
+        if (csr_edges[e].to == to) {
+            return csr_edges[e].cost;
+        }
+    }
+
+    return std::numeric_limits<unsigned int>::max();
+}
+
+/* Append to 'row' the edges of node 'i' that have a matching reverse edge
+ * with the same cost. */
+void
+LFDB::graph_row_build(NodeIdx i, std::vector<Edge> &row) const
+{
+    for (const Edge &edge : adj[i]) {
+        bool bidir = false;
+
+        for (const Edge &rev : adj[edge.to]) {
+            if (rev.to == i) {
+                bidir = (rev.cost == edge.cost);
+                break;
+            }
+        }
+
+        if (!bidir) {
+            /* Something is wrong, this could be malicious or erroneous. */
+            continue;
+        }
+        row.push_back(edge);
+    }
+}
+
+void
+LFDB::graph_build()
+{
+    size_t n = nim.size();
+
+    if (!csr_dirty && csr_offsets.size() == n + 1) {
+        return;
+    }
+
+    if (adj.size() < n) {
+        adj.resize(n);
+    }
+
+    if (!csr_offsets.empty() && !graph_changes_overflow) {
+        /* Only a few nodes changed: append the new nodes (if any) with
+         * no edges, and replace the rows of the changed nodes, shifting
+         * the rest of the array. */
+        csr_offsets.resize(n + 1, csr_edges.size());
+        for (const auto &change : graph_changes) {
+            for (NodeIdx i : {change.first, change.second}) {
+                uint32_t begin = csr_offsets[i];
+                uint32_t end   = csr_offsets[i + 1];
+                long delta;
+
+                csr_row.clear();
+                graph_row_build(i, csr_row);
+                delta = static_cast<long>(csr_row.size()) - (end - begin);
+                if (delta != 0) {
+                    csr_edges.erase(csr_edges.begin() + begin,
+                                    csr_edges.begin() + end);
+                    csr_edges.insert(csr_edges.begin() + begin,
+                                     csr_row.begin(), csr_row.end());
+                    for (size_t k = i + 1; k <= n; k++) {
+                        csr_offsets[k] += delta;
+                    }
+                } else {
+                    std::copy(csr_row.begin(), csr_row.end(),
+                              csr_edges.begin() + begin);
+                }
+            }
+        }
+    } else {
+        csr_offsets.resize(n + 1);
+        csr_edges.clear();
+        for (NodeIdx i = 0; i < n; i++) {
+            csr_offsets[i] = csr_edges.size();
+            graph_row_build(i, csr_edges);
+        }
+        csr_offsets[n] = csr_edges.size();
+    }
+    csr_dirty = false;
+
+    if (verbose) {
+        std::cout << "Graph [" << n << " nodes]:" << std::endl;
+        for (NodeIdx i = 0; i < n; i++) {
+            std::cout << nim.GetName(i) << ": {";
+            for (uint32_t e = csr_offsets[i]; e < csr_offsets[i + 1]; e++) {
+                std::cout << "(" << nim.GetName(csr_edges[e].to) << ","
+                          << csr_edges[e].cost << "), ";
+            }
+            std::cout << "}" << std::endl;
+        }
+    }
+}
+
+void
+LFDB::SpfWorkspace::heap_sift_up(uint32_t pos,
+                                  const std::vector<DijkstraInfo> &info)
+{
+    NodeIdx node      = heap[pos];
+    unsigned int dist = info[node].dist;
+
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 4;
+
+        if (info[heap[parent]].dist <= dist) {
             break;
         }
+        heap[pos]           = heap[parent];
+        heap_pos[heap[pos]] = pos;
+        pos                 = parent;
+    }
+    heap[pos]      = node;
+    heap_pos[node] = pos;
+}
 
-        DijkstraInfo &info_min = info[closer.node];
-        info_min.dist          = closer.dist;
+void
+LFDB::SpfWorkspace::heap_sift_down(uint32_t pos,
+                                    const std::vector<DijkstraInfo> &info)
+{
+    NodeIdx node      = heap[pos];
+    unsigned int dist = info[node].dist;
+    uint32_t size     = heap.size();
 
-        if (verbose) {
-            std::cout << "Selecting node " << closer.node << std::endl;
+    for (;;) {
+        uint32_t first         = pos * 4 + 1;
+        uint32_t last          = std::min(first + 4, size);
+        uint32_t best          = pos;
+        unsigned int best_dist = dist;
+
+        for (uint32_t c = first; c < last; c++) {
+            if (info[heap[c]].dist < best_dist) {
+                best      = c;
+                best_dist = info[heap[c]].dist;
+            }
+        }
+        if (best == pos) {
+            break;
         }
+        heap[pos]           = heap[best];
+        heap_pos[heap[pos]] = pos;
+        pos                 = best;
+    }
+    heap[pos]      = node;
+    heap_pos[node] = pos;
+}
 
-        auto graphit = graph.find(closer.node);
-        if (graphit == graph.end()) {
-            continue; /* nothing to do */
+/* Insert a node into the heap, or move it up if it is already there. */
+void
+LFDB::SpfWorkspace::heap_update(NodeIdx node,
+                                 const std::vector<DijkstraInfo> &info)
+{
+    if (heap_pos[node] == std::numeric_limits<uint32_t>::max()) {
+        heap.push_back(node);
+        heap_pos[node] = heap.size() - 1;
+    }
+    heap_sift_up(heap_pos[node], info);
+}
+
+/* Run the Dijkstra algorithm on the nodes currently in the heap. The
+ * nodes whose distance changes are appended to 'touched' (if not null). */
+void
+LFDB::spt_relax(SpfWorkspace &ws, NodeIdx root,
+                std::vector<DijkstraInfo> &info,
+                std::vector<NodeIdx> *touched) const
+{
+    std::vector<NodeIdx> &heap = ws.heap;
+
+    while (!heap.empty()) {
+        /* Select the closest node from the ones in the frontier. */
+        NodeIdx closer = heap.front();
+
+        ws.heap_pos[closer] = std::numeric_limits<uint32_t>::max();
+        heap.front()        = heap.back();
+        heap.pop_back();
+        if (!heap.empty()) {
+            ws.heap_sift_down(0, info);
         }
 
-        const std::vector<Edge> &edges = graphit->second;
+        const DijkstraInfo &info_min = info[closer];
+
+        if (verbose) {
+            std::cout << "Selecting node " << nim.GetName(closer) << std::endl;
+        }
 
         /* Apply relaxation rule and update the frontier. */
-        for (const Edge &edge : edges) {
+        for (uint32_t e = csr_offsets[closer]; e < csr_offsets[closer + 1];
+             e++) {
+            const Edge &edge      = csr_edges[e];
             DijkstraInfo &info_to = info[edge.to];
+            unsigned long long alt =
+                static_cast<unsigned long long>(info_min.dist) + edge.cost;
 
-            if (info_to.dist > info_min.dist + edge.cost) {
-                info_to.dist = info_min.dist + edge.cost;
-                info_to.nhop =
-                    (closer.node == source_node) ? edge.to : info_min.nhop;
-                frontier.push({edge.to, info_to.dist});
+            if (alt >= info_to.dist) {
+                continue;
+            }
+            info_to.dist   = static_cast<unsigned int>(alt);
+            info_to.nhop   = (closer == root) ? edge.to : info_min.nhop;
+            info_to.parent = closer;
+            ws.heap_update(edge.to, info);
+            if (touched) {
+                touched->push_back(edge.to);
             }
         }
     }
+}
+
+/* Compute the shortest path tree rooted at 'root' from scratch. */
+void
+LFDB::spt_full(SpfWorkspace &ws, NodeIdx root,
+               std::vector<DijkstraInfo> &info) const
+{
+    const unsigned int inf = std::numeric_limits<unsigned int>::max();
+
+    /* Initialize the per-node info and the priority queue. */
+    info.assign(nim.size(), DijkstraInfo{inf, kNodeIdxNone, kNodeIdxNone});
+    ws.heap_pos.resize(nim.size(), std::numeric_limits<uint32_t>::max());
+    ws.heap.clear();
+
+    info[root].dist = 0;
+    ws.heap_update(root, info);
+    spt_relax(ws, root, info, nullptr);
 
     if (verbose) {
         std::cout << "Dijkstra result:" << std::endl;
-        for (const auto &kvi : info) {
-            std::cout << "    Node: " << kvi.first
-                      << ", Dist: " << kvi.second.dist << std::endl;
+        for (NodeIdx i = 0; i < info.size(); i++) {
+            std::cout << "    Node: " << nim.GetName(i)
+                      << ", Dist: " << info[i].dist << std::endl;
         }
     }
 }
 
-int
-LFDB::compute_next_hops(const NodeId &local_node)
+void
+LFDB::compute_shortest_paths(NodeIdx source_node,
+                             std::vector<DijkstraInfo> &info)
+{
+    /* Update the graph with the changes to the Lower Flow Database. */
+    graph_build();
+    spt_full(workspace(0), source_node, info);
+}
+
+/* Update the shortest path tree rooted at 'root' after the changes listed
+ * in graph_changes, in the style of the Ramalingam-Reps algorithm. The
+ * subtrees hanging from tree edges whose cost increased (or that went
+ * away) are detached and reattached to the rest of the tree, while the
+ * endpoints of edges whose cost decreased are used as additional sources.
+ * The Dijkstra algorithm then only visits the nodes whose distance
+ * changes, which are appended to 'touched'. */
+void
+LFDB::spt_update(SpfWorkspace &ws, NodeIdx root,
+                 std::vector<DijkstraInfo> &info,
+                 std::vector<NodeIdx> &touched) const
 {
-    std::unordered_map<NodeId, std::unordered_map<NodeId, DijkstraInfo>>
-        neigh_infos;
-    std::unordered_map<NodeId, std::vector<Edge>> graph;
-    std::unordered_map<NodeId, DijkstraInfo> info;
+    std::vector<uint8_t> &node_mark = ws.node_mark;
+    std::vector<NodeIdx> &affected  = ws.affected;
+    const unsigned int inf = std::numeric_limits<unsigned int>::max();
+    enum { Unknown = 0, Affected, Unaffected };
+    size_t n = nim.size();
 
-    /* Clean up state left from the previous run. */
-    next_hops.clear();
+    info.resize(n, DijkstraInfo{inf, kNodeIdxNone, kNodeIdxNone});
+    ws.heap_pos.resize(n, std::numeric_limits<uint32_t>::max());
+    ws.heap.clear();
+    affected.clear();
 
-    /* Build the graph from the Lower Flow Database. */
-    graph[local_node] = std::vector<Edge>();
-    for (const auto &kvi : db) {
-        for (const auto &kvj : kvi.second) {
-            const gpb::LowerFlow *revlf;
+    /* Find the tree edges that got worse, and mark the roots of the
+     * subtrees to be detached. */
+    node_mark.assign(n, Unknown);
+    for (const auto &change : graph_changes) {
+        for (int dir = 0; dir < 2; dir++) {
+            NodeIdx u = dir ? change.second : change.first;
+            NodeIdx v = dir ? change.first : change.second;
+
+            if (info[v].parent == u && info[u].dist != inf &&
+                static_cast<unsigned long long>(info[u].dist) +
+                        edge_cost(u, v) >
+                    info[v].dist) {
+                node_mark[v] = Affected;
+                affected.push_back(v);
+            }
+        }
+    }
 
-            revlf = find(kvj.second.local_node(), kvj.second.remote_node());
+    if (!affected.empty()) {
+        /* Mark all the nodes below the detached subtree roots, walking
+         * up the tree from each node until a marked node is found. */
+        node_mark[root] = Unaffected;
+        for (NodeIdx i = 0; i < n; i++) {
+            NodeIdx x = i;
+            uint8_t mark;
 
-            if (revlf == nullptr || revlf->cost() != kvj.second.cost()) {
-                /* Something is wrong, this could be malicious or erroneous. */
-                continue;
+            while (node_mark[x] == Unknown && info[x].parent != kNodeIdxNone) {
+                x = info[x].parent;
             }
+            mark = node_mark[x] == Affected ? Affected : Unaffected;
+            for (x = i; x != kNodeIdxNone && node_mark[x] == Unknown;
+                 x = info[x].parent) {
+                node_mark[x] = mark;
+                if (mark == Affected) {
+                    affected.push_back(x);
+                }
+            }
+        }
 
-            graph[kvj.second.local_node()].emplace_back(
-                kvj.second.remote_node(), kvj.second.cost());
-            if (!graph.count(kvj.second.remote_node())) {
-                /* Make sure graph contains all the nodes, even if with
-                 * empty lists. */
-                graph[kvj.second.remote_node()] = std::vector<Edge>();
+        for (NodeIdx x : affected) {
+            info[x] = DijkstraInfo{inf, kNodeIdxNone, kNodeIdxNone};
+            touched.push_back(x);
+        }
+
+        /* Reattach the detached nodes through their best neighbor that is
+         * still in the tree. */
+        for (NodeIdx x : affected) {
+            for (uint32_t e = csr_offsets[x]; e < csr_offsets[x + 1]; e++) {
+                const Edge &edge              = csr_edges[e];
+                const DijkstraInfo &info_from = info[edge.to];
+                unsigned long long alt;
+
+                if (node_mark[edge.to] == Affected || info_from.dist == inf) {
+                    continue;
+                }
+                alt = static_cast<unsigned long long>(info_from.dist) +
+                      edge.cost;
+                if (alt < info[x].dist) {
+                    info[x].dist   = static_cast<unsigned int>(alt);
+                    info[x].nhop   = (edge.to == root) ? x : info_from.nhop;
+                    info[x].parent = edge.to;
+                }
+            }
+            if (info[x].dist != inf) {
+                ws.heap_update(x, info);
             }
         }
     }
 
-    if (verbose) {
-        std::cout << "Graph [" << db.size() << " nodes]:" << std::endl;
-        for (const auto &kvg : graph) {
-            std::cout << kvg.first << ": {";
-            for (const Edge &edge : kvg.second) {
-                std::cout << "(" << edge.to << "," << edge.cost << "), ";
+    /* Use the edges that got better as additional sources. */
+    for (const auto &change : graph_changes) {
+        for (int dir = 0; dir < 2; dir++) {
+            NodeIdx u         = dir ? change.second : change.first;
+            NodeIdx v         = dir ? change.first : change.second;
+            unsigned int cost = edge_cost(u, v);
+            unsigned long long alt;
+
+            if (info[u].dist == inf || cost == inf) {
+                continue;
+            }
+            alt = static_cast<unsigned long long>(info[u].dist) + cost;
+            if (alt < info[v].dist) {
+                info[v].dist   = static_cast<unsigned int>(alt);
+                info[v].nhop   = (u == root) ? v : info[u].nhop;
+                info[v].parent = u;
+                ws.heap_update(v, info);
+                touched.push_back(v);
             }
-            std::cout << "}" << std::endl;
         }
     }
 
-    /* Compute shortest paths rooted at the local node, and use the
-     * result to fill in the next_hops routing table. */
-    compute_shortest_paths(local_node, graph, info);
-    for (const auto &kvi : info) {
-        if (kvi.first == local_node ||
-            kvi.second.dist == std::numeric_limits<unsigned int>::max()) {
-            /* I don't need a next hop for myself. */
-            continue;
-        }
-        next_hops[kvi.first].push_back(kvi.second.nhop);
+    spt_relax(ws, root, info, &touched);
+}
+
+LFDB::SpfWorkspace &
+LFDB::workspace(unsigned int i)
+{
+    if (workspaces.size() <= i) {
+        workspaces.resize(i + 1);
     }
+    return workspaces[i];
+}
+
+/* Compute (or update) the shortest path trees rooted at the neighbors of
+ * the local node, spreading them over the worker pool. The graph is not
+ * modified while the workers run, and each worker only writes to its own
+ * workspace and to the trees assigned to it. */
+void
+LFDB::neigh_spts_compute(bool incremental)
+{
+    size_t num_jobs = neigh_infos.size();
+    WorkerPool::Job job = [this, incremental](size_t k, unsigned int w) {
+        SpfWorkspace &ws = workspaces[w];
+
+        if (incremental) {
+            neigh_touched[k].clear();
+            spt_update(ws, neigh_infos[k].first, neigh_infos[k].second,
+                       neigh_touched[k]);
+        } else {
+            spt_full(ws, neigh_infos[k].first, neigh_infos[k].second);
+        }
+    };
 
-    if (lfa_enabled) {
-        /* Compute the shortest paths rooted at each neighbor of the local
-         * node, storing the results into neigh_infos. */
-        for (const Edge &edge : graph[local_node]) {
-            compute_shortest_paths(edge.to, graph, neigh_infos[edge.to]);
+    neigh_touched.resize(num_jobs);
+
+    if (lfa_threads <= 1 || num_jobs <= 1) {
+        workspace(0);
+        for (size_t k = 0; k < num_jobs; k++) {
+            job(k, 0);
         }
+        return;
+    }
+
+    if (!pool || pool->size() != lfa_threads) {
+        pool = utils::make_unique<WorkerPool>(lfa_threads - 1);
+    }
+    workspace(pool->size() - 1);
+    pool->run(num_jobs, job);
+}
+
+/* Recompute the routing table entry for 'node' into 'table', using the
+ * shortest path trees rooted at the local node and at its neighbors. */
+void
+LFDB::next_hops_update(std::unordered_map<NodeId, std::vector<NodeId>> &table,
+                       std::unordered_map<NodeId, unsigned int> &ecmp_table,
+                       NodeIdx local, NodeIdx node) const
+{
+    const unsigned int inf = std::numeric_limits<unsigned int>::max();
+    const NodeId &name     = nim.GetName(node);
+
+    if (node == local || local_info[node].dist == inf) {
+        /* I don't need a next hop for myself. */
+        table.erase(name);
+        ecmp_table.erase(name);
+        return;
+    }
+
+    std::vector<NodeId> &lfas = table[name];
+    NodeIdx nhop              = local_info[node].nhop;
+
+    lfas.clear();
+    lfas.push_back(nim.GetName(nhop));
 
-        /* For each node V other than the local node ... */
-        for (const auto &kvv : graph) {
-            if (kvv.first == local_node) {
+    if (ecmp_enabled) {
+        /* Add each other neighbor U such that
+         * cost(local, U) + dist(U, V) == dist(local, V). */
+        for (size_t k = 0; k < neigh_infos.size(); k++) {
+            NodeIdx u = neigh_infos[k].first;
+            unsigned long long alt;
+
+            if (u == nhop) {
                 continue;
             }
+            alt = static_cast<unsigned long long>(
+                      csr_edges[csr_offsets[local] + k].cost) +
+                  neigh_infos[k].second[node].dist;
+            if (alt == local_info[node].dist) {
+                lfas.push_back(nim.GetName(u));
+            }
+        }
+        if (lfas.size() > 1) {
+            ecmp_table[name] = lfas.size();
+        } else {
+            ecmp_table.erase(name);
+        }
+    }
 
-            /* For each neighbor U of the local node, excluding U ... */
-            for (const auto &kvu : neigh_infos) {
-                if (kvu.first == kvv.first) {
-                    continue;
-                }
+    if (!lfa_enabled) {
+        return;
+    }
 
-                /* dist(U, V) < dist(U, local) + dist(local, V) */
-                if (neigh_infos[kvu.first][kvv.first].dist <
-                    neigh_infos[kvu.first][local_node].dist +
-                        info[kvv.first].dist) {
-                    bool dupl = false;
-
-                    for (const NodeId &lfa : next_hops[kvv.first]) {
-                        if (lfa == kvu.first) {
-                            dupl = true;
-                            break;
-                        }
-                    }
+    /* For each neighbor U of the local node, excluding the node itself ... */
+    for (const auto &kvu : neigh_infos) {
+        NodeIdx u                           = kvu.first;
+        const std::vector<DijkstraInfo> &ui = kvu.second;
 
-                    if (!dupl) {
-                        next_hops[kvv.first].push_back(kvu.first);
-                    }
+        if (u == node) {
+            continue;
+        }
+
+        /* dist(U, V) < dist(U, local) + dist(local, V) */
+        if (static_cast<unsigned long long>(ui[node].dist) <
+            static_cast<unsigned long long>(ui[local].dist) +
+                local_info[node].dist) {
+            const NodeId &lfa = nim.GetName(u);
+
+            if (std::find(lfas.begin(), lfas.end(), lfa) == lfas.end()) {
+                lfas.push_back(lfa);
+            }
+        }
+    }
+}
+
+int
+LFDB::compute_next_hops(const NodeId &local_node)
+{
+    using Clock   = std::chrono::steady_clock;
+    NodeIdx local = nim.FindId(local_node);
+    auto start    = Clock::now();
+    bool neigh_spts = lfa_enabled || ecmp_enabled;
+    size_t num_neighs;
+    bool incremental;
+    bool full_merge;
+
+    auto elapsed_us = [&start]() -> uint64_t {
+        auto now = Clock::now();
+        auto us =
+            std::chrono::duration_cast<std::chrono::microseconds>(now - start);
+
+        start = now;
+        return us.count();
+    };
+
+    last_times = PhaseTimes();
+
+    if (!graph_enabled) {
+        return -1; /* see graph_disable() */
+    }
+
+    if (local == kNodeIdxNone) {
+        /* We don't know about any lower flow. */
+        next_hops.clear();
+        next_hops_ecmp.clear();
+        return 0;
+    }
+
+    if (!ids_unused.empty()) {
+        /* Some ids are going to be released: recompute everything from
+         * scratch, so that no shortest path tree refers to them. */
+        graph_changes_overflow = true;
+        graph_changes.clear();
+    }
+
+    /* Phase 1: update the graph with the changes to the Lower Flow
+     * Database. */
+    graph_build();
+    num_neighs          = csr_offsets[local + 1] - csr_offsets[local];
+    last_times.graph_us = elapsed_us();
+
+    /* The previous trees can be updated incrementally if they were
+     * computed for the same local node and neighbors, and there are not
+     * too many changes. */
+    incremental = local == local_root && !graph_changes_overflow &&
+                  ecmp_enabled == ecmp_last;
+    if (incremental && neigh_spts) {
+        incremental = neigh_infos.size() == num_neighs;
+        for (size_t k = 0; incremental && k < num_neighs; k++) {
+            incremental =
+                neigh_infos[k].first == csr_edges[csr_offsets[local] + k].to;
+        }
+    }
+    full_merge = !incremental;
+    if (incremental && ecmp_enabled) {
+        /* The equal cost next hops also depend on the cost of the lower
+         * flows of the local node, for all the destinations. */
+        for (const auto &change : graph_changes) {
+            if (change.first == local || change.second == local) {
+                full_merge = true;
+            }
+        }
+    }
+    ecmp_last = ecmp_enabled;
+
+    /* Phase 2: shortest paths rooted at the local node. */
+    if (incremental) {
+        touched.clear();
+        spt_update(workspace(0), local, local_info, touched);
+    } else {
+        spt_full(workspace(0), local, local_info);
+        local_root = local;
+    }
+    last_times.spf_us = elapsed_us();
+
+    /* Phase 3: shortest paths rooted at each neighbor of the local
+     * node, storing the results into neigh_infos. */
+    if (neigh_spts) {
+        if (!incremental) {
+            neigh_infos.resize(num_neighs);
+            for (size_t k = 0; k < num_neighs; k++) {
+                neigh_infos[k].first = csr_edges[csr_offsets[local] + k].to;
+            }
+        }
+        neigh_spts_compute(incremental);
+        if (incremental) {
+            for (const auto &nt : neigh_touched) {
+                if (std::find(nt.begin(), nt.end(), local) != nt.end()) {
+                    /* dist(U, local) changed, which affects the LFAs for
+                     * all the destinations. */
+                    full_merge = true;
                 }
             }
         }
+        last_times.lfa_spf_us = elapsed_us();
     }
 
+    /* Phase 4: update the next_hops routing table. */
+    if (!full_merge) {
+        /* Only update the entries of the nodes whose distance from the
+         * local node (or its neighbors) changed. */
+        auto entry_update = [this, local](NodeIdx x) {
+            if (!node_mark[x]) {
+                node_mark[x] = 1;
+                next_hops_update(next_hops, next_hops_ecmp, local, x);
+            }
+        };
+
+        node_mark.assign(nim.size(), 0);
+        for (NodeIdx x : touched) {
+            entry_update(x);
+        }
+        for (const auto &nt : neigh_touched) {
+            for (NodeIdx x : nt) {
+                entry_update(x);
+            }
+        }
+    } else {
+        /* Build a new table, for each node V other than the local node,
+         * and replace the old one with it. */
+        next_hops_new.clear();
+        next_hops_new.reserve(local_info.size());
+        next_hops_ecmp_new.clear();
+        for (NodeIdx v = 0; v < local_info.size(); v++) {
+            next_hops_update(next_hops_new, next_hops_ecmp_new, local, v);
+        }
+        std::swap(next_hops, next_hops_new);
+        std::swap(next_hops_ecmp, next_hops_ecmp_new);
+        next_hops_new.clear();
+        next_hops_ecmp_new.clear();
+    }
+    last_times.merge_us = elapsed_us();
+
+    graph_changes.clear();
+    graph_changes_overflow = false;
+
+    /* Release the ids of the nodes that left. A node may have come back
+     * in the meantime (or left more than once). */
+    std::sort(ids_unused.begin(), ids_unused.end());
+    ids_unused.erase(std::unique(ids_unused.begin(), ids_unused.end()),
+                     ids_unused.end());
+    for (NodeIdx i : ids_unused) {
+        if (node_flows[i] == 0) {
+            nim.Release(i);
+        }
+    }
+    ids_unused.clear();
+
     if (verbose) {
         std::stringstream ss;
 
@@ -254,26 +1009,262 @@ LFDB::compute_next_hops(const NodeId &local_node)
     return 0;
 }
 
-gpb::LowerFlow *
-LFDB::find(const NodeId &local_node, const NodeId &remote_node)
+unsigned int
+LFDB::distance(const NodeId &node) const
 {
-    const gpb::LowerFlow *lf = _find(local_node, remote_node);
-    return const_cast<gpb::LowerFlow *>(lf);
+    NodeIdx nid = nim.FindId(node);
+
+    if (local_root == kNodeIdxNone || nid == kNodeIdxNone ||
+        nid >= local_info.size()) {
+        return std::numeric_limits<unsigned int>::max();
+    }
+
+    return local_info[nid].dist;
 }
 
-const gpb::LowerFlow *
-LFDB::_find(const NodeId &local_node, const NodeId &remote_node) const
+bool
+LFDB::find(const NodeId &local_node, const NodeId &remote_node,
+           gpb::LowerFlow *lf) const
 {
-    const auto it = db.find(local_node);
-    std::unordered_map<NodeId, gpb::LowerFlow>::const_iterator jt;
+    NodeIdx local  = nim.FindId(local_node);
+    NodeIdx remote = nim.FindId(remote_node);
+    const auto it  = db.find(local);
 
     if (it == db.end()) {
-        return nullptr;
+        return false;
+    }
+
+    const auto jt = it->second.find(remote);
+
+    if (jt == it->second.end()) {
+        return false;
+    }
+    if (lf) {
+        *lf = flow_get(local, remote, jt->second);
+    }
+
+    return true;
+}
+
+gpb::LowerFlow
+LFDB::flow_get(NodeIdx local, NodeIdx remote, const FlowEntry &e) const
+{
+    gpb::LowerFlow lf;
+
+    lf.set_local_node(nim.GetName(local));
+    lf.set_remote_node(nim.GetName(remote));
+    lf.set_cost(e.cost);
+    lf.set_seqnum(e.seqnum);
+    lf.set_state(e.state);
+    lf.set_age(e.age);
+
+    return lf;
+}
+
+SpfWorker::SpfWorker(bool lfa_enabled, bool verbose,
+                     std::function<void()> notify)
+    : lfdb(lfa_enabled, verbose), notify(std::move(notify))
+{
+    th = std::thread(&SpfWorker::worker_loop, this);
+}
+
+SpfWorker::~SpfWorker()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    cond.notify_one();
+    th.join();
+}
+
+void
+SpfWorker::flow_changed(const gpb::LowerFlow &lf, bool removed)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    FlowChange &c =
+        changes[LFDB::flow_key(lf.local_node(), lf.remote_node())];
+
+    c.lf      = lf;
+    c.removed = removed;
+}
+
+void
+SpfWorker::compute(const NodeId &node, bool ecmp)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        local_node   = node;
+        ecmp_enabled = ecmp;
+        requested    = true;
     }
+    cond.notify_one();
+}
+
+std::unique_ptr<NextHopsSnapshot>
+SpfWorker::snapshot_take()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    return std::move(snapshot);
+}
 
-    jt = it->second.find(remote_node);
+void
+SpfWorker::worker_loop()
+{
+    std::unique_lock<std::mutex> lk(mutex);
+
+    for (;;) {
+        std::unordered_map<std::string, FlowChange> batch;
+        NodeId node;
+
+        cond.wait(lk, [this] { return stopping || requested; });
+        if (stopping) {
+            return;
+        }
+        requested         = false;
+        node              = local_node;
+        lfdb.ecmp_enabled = ecmp_enabled;
+        batch.swap(changes);
+        lk.unlock();
 
-    return jt == it->second.end() ? nullptr : &jt->second;
+        /* Bring the private copy up to date and run the algorithms,
+         * without holding the lock. */
+        for (const auto &kv : batch) {
+            if (kv.second.removed) {
+                lfdb.del(kv.second.lf.local_node(),
+                         kv.second.lf.remote_node());
+            } else {
+                lfdb.add(kv.second.lf);
+            }
+        }
+        lfdb.compute_next_hops(node);
+
+        auto snap            = utils::make_unique<NextHopsSnapshot>();
+        snap->next_hops      = lfdb.next_hops;
+        snap->next_hops_ecmp = lfdb.next_hops_ecmp;
+        snap->times          = lfdb.last_times;
+        snap->node_ids       = lfdb.nim.size();
+        snap->ids_pending    = lfdb.ids_pending();
+
+        lk.lock();
+        snapshot = std::move(snap);
+        lk.unlock();
+        notify();
+        lk.lock();
+    }
+}
+
+void
+fwd_table_diff(const FwdTable &cur, const FwdTable &next,
+               std::vector<struct rl_pduft_op> &ops)
+{
+    ops.clear();
+
+    for (const auto &kve : cur) {
+        struct rl_pduft_op op = {};
+
+        if (next.count(kve.first)) {
+            continue; /* either unchanged or overwritten below */
+        }
+        op.op             = RL_PDUFT_OP_DEL;
+        op.local_port     = kve.second.ports.front();
+        op.match.dst_addr = kve.first;
+        ops.push_back(op);
+    }
+
+    for (const auto &kve : next) {
+        auto of               = cur.find(kve.first);
+        struct rl_pduft_op op = {};
+
+        if (of != cur.end() && of->second.same_ports(kve.second)) {
+            continue; /* This entry is already in place. */
+        }
+        op.op             = RL_PDUFT_OP_SET;
+        op.match.dst_addr = kve.first;
+        for (rl_port_t port : kve.second.ports) {
+            op.local_port = port;
+            ops.push_back(op);
+            op.op = RL_PDUFT_OP_ADD;
+        }
+        if (kve.second.backup != kPortIdNone) {
+            op.op         = RL_PDUFT_OP_BACKUP;
+            op.local_port = kve.second.backup;
+            ops.push_back(op);
+        }
+    }
+}
+
+void
+lower_flows_compact(gpb::LowerFlowList &lfl)
+{
+    std::unordered_map<std::string, uint32_t> ids;
+    gpb::LowerFlowList out;
+
+    auto node_id = [&ids, &out](const std::string &name) -> uint32_t {
+        auto it = ids.find(name);
+
+        if (it != ids.end()) {
+            return it->second;
+        }
+
+        uint32_t id = static_cast<uint32_t>(out.nodes_size());
+        ids[name]   = id;
+        out.add_nodes(name);
+        return id;
+    };
+
+    for (const gpb::LowerFlow &lf : lfl.flows()) {
+        out.add_local_ids(node_id(lf.local_node()));
+        out.add_remote_ids(node_id(lf.remote_node()));
+        out.add_costs(lf.cost());
+        out.add_seqnums(lf.seqnum());
+        out.add_states(lf.state());
+        out.add_ages(lf.age());
+    }
+
+    lfl.Swap(&out);
+}
+
+int
+lower_flows_expand(gpb::LowerFlowList &lfl)
+{
+    int n = lfl.local_ids_size();
+
+    if (n == 0) {
+        return 0; /* Not compact, or empty. */
+    }
+
+    if (lfl.remote_ids_size() != n || lfl.costs_size() != n ||
+        lfl.seqnums_size() != n || lfl.states_size() != n ||
+        lfl.ages_size() != n) {
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (lfl.local_ids(i) >= static_cast<uint32_t>(lfl.nodes_size()) ||
+            lfl.remote_ids(i) >= static_cast<uint32_t>(lfl.nodes_size())) {
+            return -1;
+        }
+
+        gpb::LowerFlow *lf = lfl.add_flows();
+
+        lf->set_local_node(lfl.nodes(lfl.local_ids(i)));
+        lf->set_remote_node(lfl.nodes(lfl.remote_ids(i)));
+        lf->set_cost(lfl.costs(i));
+        lf->set_seqnum(lfl.seqnums(i));
+        lf->set_state(lfl.states(i));
+        lf->set_age(lfl.ages(i));
+    }
+
+    lfl.clear_nodes();
+    lfl.clear_local_ids();
+    lfl.clear_remote_ids();
+    lfl.clear_costs();
+    lfl.clear_seqnums();
+    lfl.clear_states();
+    lfl.clear_ages();
+
+    return 0;
 }
 
 } // namespace rlite
@@ -25,101 +25,466 @@
 #include <list>
 #include <unordered_map>
 #include <memory>
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
 
 #include "BaseRIB.pb.h"
 #include "rlite/cpputils.hpp"
+#include "rlite/kernel-msg.h"
 
 namespace rlite {
 
-using NameId = std::string *;
+using NodeId = std::string;
+
+/* Dense integer identifier of a node, used to index the flat arrays of
+ * the graph algorithms. */
+using NodeIdx = uint32_t;
+static constexpr NodeIdx kNodeIdxNone = ~0U;
 
+/* Keeps a mapping between node names and dense integer ids, so that ids
+ * can be used as indices into vectors. Released ids are reused before
+ * allocating new ones, so that the ids stay below the peak number of
+ * nodes. */
 class NameIdsManager {
-    std::unordered_map<std::string, std::unique_ptr<std::string>> m;
+    std::unordered_map<NodeId, NodeIdx> m;
+    std::vector<NodeId> names;
+    std::vector<NodeIdx> free_ids;
 
-    NameId GetId(const std::string &name)
+public:
+    /* Returns the id of 'name', allocating a new one if needed. */
+    NodeIdx GetId(const NodeId &name)
     {
         const auto it = m.find(name);
         if (it != m.end()) {
-            return it->second.get();
+            return it->second;
         }
 
-        m[name] = utils::make_unique<std::string>(name);
-        return m[name].get();
+        NodeIdx nid;
+
+        if (!free_ids.empty()) {
+            nid = free_ids.back();
+            free_ids.pop_back();
+            names[nid] = name;
+        } else {
+            nid = static_cast<NodeIdx>(names.size());
+            names.push_back(name);
+        }
+        m[name] = nid;
+        return nid;
+    }
+
+    /* Forget the name of 'nid', so that the id can be reused. */
+    void Release(NodeIdx nid)
+    {
+        assert(nid < names.size());
+        m.erase(names[nid]);
+        names[nid].clear();
+        free_ids.push_back(nid);
+    }
+
+    /* Returns the id of 'name', or kNodeIdxNone if it is unknown. */
+    NodeIdx FindId(const NodeId &name) const
+    {
+        const auto it = m.find(name);
+        return it == m.end() ? kNodeIdxNone : it->second;
     }
 
-    std::string GetName(NameId nid)
+    const NodeId &GetName(NodeIdx nid) const
     {
-        assert(nid != nullptr);
-        return *nid;
+        assert(nid < names.size());
+        return names[nid];
     }
+
+    /* Upper bound of the ids in use. */
+    size_t size() const { return names.size(); }
 };
 
-using NodeId = std::string;
+/* A fixed pool of threads that run batches of independent jobs. */
+class WorkerPool {
+public:
+    using Job = std::function<void(size_t idx, unsigned int worker)>;
+
+    RL_NODEFAULT_NONCOPIABLE(WorkerPool);
+    WorkerPool(unsigned int num_workers);
+    ~WorkerPool();
+
+    /* Run job(idx, worker) for each idx in [0, num_jobs), and wait for
+     * all of them to complete. The calling thread takes part as worker 0,
+     * so 'worker' is always smaller than size(). */
+    void run(size_t num_jobs, const Job &job);
+
+    unsigned int size() const { return threads.size() + 1; }
+
+private:
+    void worker_loop(unsigned int worker);
+    void jobs_drain(unsigned int worker);
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_cond;
+    std::condition_variable done_cond;
+    const Job *job = nullptr;
+    size_t num_jobs = 0;
+    std::atomic<size_t> next_job;
+    unsigned int busy   = 0;
+    uint64_t generation = 0;
+    bool stopping       = false;
+};
 
 /* The Lower Flows database, with functionalities to compute the next hops,
  * i.e. the Dijkstra algorithm. This has also optional support for the Loop
  * Free Alternate algorithm. */
 struct LFDB {
     struct Edge {
-        NodeId to;
+        NodeIdx to;
         unsigned int cost;
 
-        Edge(const NodeId &to_, unsigned int cost_) : to(to_), cost(cost_) {}
-        Edge(Edge &&) = default;
+        Edge(NodeIdx to_, unsigned int cost_) : to(to_), cost(cost_) {}
     };
 
     struct DijkstraInfo {
         unsigned int dist;
-        NodeId nhop;
+        NodeIdx nhop;
+        NodeIdx parent;
     };
 
     /* Is Loop Free Alternate algorithm enabled ? */
     bool lfa_enabled;
 
+    /* Compute all the equal cost next hops for each destination, rather
+     * than only one. */
+    bool ecmp_enabled = false;
+
     /* Be verbose on routing computations. */
     bool verbose = false;
 
+    /* Maximum number of lower flow changes since the last computation
+     * that compute_next_hops() handles by incrementally updating the
+     * previous shortest path trees. With more changes (or if zero),
+     * the trees are recomputed from scratch. */
+    size_t spf_incremental_max_changes = 32;
+
+    /* Number of threads used to compute the shortest path trees rooted at
+     * the neighbors of the local node, for the LFA algorithm. */
+    unsigned int lfa_threads;
+
+    /* Duration of the phases of the last compute_next_hops() run, in
+     * microseconds: graph update, local shortest path tree, shortest
+     * path trees of the neighbors, and routing table update. */
+    struct PhaseTimes {
+        uint64_t graph_us   = 0;
+        uint64_t spf_us     = 0;
+        uint64_t lfa_spf_us = 0;
+        uint64_t merge_us   = 0;
+    } last_times;
+
 public:
-    LFDB(bool lfa_enabled, bool verbose = false)
-        : lfa_enabled(lfa_enabled), verbose(verbose)
-    {
-    }
+    LFDB(bool lfa_enabled, bool verbose = false);
+    virtual ~LFDB() {}
+
+    /* Maximum default value for lfa_threads. */
+    static constexpr unsigned int kMaxLfaThreads = 8;
 
-    /* Keeps a mapping between neighbor names (std::string objects) and
-     * numerical ids (NameId). */
+    /* Keeps a mapping between node names (std::string objects) and
+     * numerical ids (NodeIdx). */
     NameIdsManager nim;
 
-    /* Lower Flow Database. */
-    std::unordered_map<NodeId, std::unordered_map<NodeId, gpb::LowerFlow>> db;
+    /* A lower flow as stored in the database. The names of the two nodes
+     * are interned in 'nim', so that each name is stored once rather than
+     * in every lower flow (and in the keys of the database). */
+    struct FlowEntry {
+        uint32_t cost   = 0;
+        uint32_t seqnum = 0;
+        uint32_t age    = 0;
+        bool state      = false;
+    };
+
+    /* Lower Flow Database, where db[a][b] is the lower flow from node
+     * 'a' to node 'b'. Entries must be added and removed through add()
+     * and del(), to keep the graph in sync. */
+    std::unordered_map<NodeIdx, std::unordered_map<NodeIdx, FlowEntry>> db;
 
     /* The routing table computed by compute_next_hops(), or statically
      * updated. */
     std::unordered_map<NodeId, std::vector<NodeId>> next_hops;
     NodeId dflt_nhop;
 
-    const gpb::LowerFlow *find(const NodeId &local_node,
-                               const NodeId &remote_node) const
-    {
-        return _find(local_node, remote_node);
-    };
-    gpb::LowerFlow *find(const NodeId &local_node, const NodeId &remote_node);
-    const gpb::LowerFlow *_find(const NodeId &local_node,
-                                const NodeId &remote_node) const;
+    /* Number of equal cost next hops at the head of the next_hops entry
+     * of each destination, followed by the LFAs (if any). Only the
+     * destinations with more than one equal cost next hop are present. */
+    std::unordered_map<NodeId, unsigned int> next_hops_ecmp;
+
+    /* Look up a lower flow, and copy it into 'lf' (if not null). Returns
+     * false if the lower flow is not in the database. */
+    bool find(const NodeId &local_node, const NodeId &remote_node,
+              gpb::LowerFlow *lf = nullptr) const;
 
-    void compute_shortest_paths(
-        const NodeId &source_node,
-        const std::unordered_map<NodeId, std::vector<Edge>> &graph,
-        std::unordered_map<NodeId, DijkstraInfo> &info);
+    /* Build the LowerFlow message of an entry of the database. */
+    gpb::LowerFlow flow_get(NodeIdx local, NodeIdx remote,
+                            const FlowEntry &e) const;
+
+    /* Hash of a lower flow, covering all the fields but the age, which
+     * is local to each node. */
+    static uint64_t flow_hash(const gpb::LowerFlow &lf);
+
+    /* Key identifying a lower flow in the RIB synchronization. */
+    static std::string flow_key(const NodeId &local_node,
+                                const NodeId &remote_node);
+
+    /* Insert a lower flow into the database, overwriting the existing
+     * entry (if any). */
+    void add(const gpb::LowerFlow &lf);
+
+    /* Remove a lower flow from the database. Returns true if the entry
+     * was there. */
+    bool del(const NodeId &local_node, const NodeId &remote_node);
+
+    /* Called by add() and del() when a lower flow has been inserted,
+     * updated or removed, so that the database can be mirrored. */
+    virtual void flow_changed(const gpb::LowerFlow &lf, bool removed) {}
+
+    void compute_shortest_paths(NodeIdx source_node,
+                                std::vector<DijkstraInfo> &info);
 
     int compute_next_hops(const NodeId &local_node);
 
+    /* Stop maintaining the graph used by compute_next_hops(), which can't
+     * be called anymore, when the computations are delegated to an
+     * SpfWorker. Only the database and the node ids are kept, and the ids
+     * of the nodes left without lower flows are released right away. */
+    void graph_disable();
+
+    /* Number of node ids waiting to be released. */
+    size_t ids_pending() const { return ids_unused.size(); }
+
+    /* Distance of a node from the local node, according to the last run
+     * of compute_next_hops(). */
+    unsigned int distance(const NodeId &node) const;
+
     /* Dump the routing table. */
     void dump_routing(std::stringstream &ss, const NodeId &local_node) const;
 
     /* Dump the lower flows database. */
     void dump(std::stringstream &ss) const;
+
+private:
+    /* Outgoing lower flows of each node, indexed by NodeIdx. This mirrors
+     * the 'db' and it is updated incrementally by add() and del(). */
+    std::vector<std::vector<Edge>> adj;
+
+    /* Number of lower flows from or to each node, indexed by NodeIdx. The
+     * ids of the nodes left without lower flows are collected in
+     * 'ids_unused', and released by the next run of compute_next_hops()
+     * once it has recomputed all the shortest path trees, so that no
+     * state refers to them anymore. Without the graph, they are released
+     * by del(). */
+    std::vector<uint32_t> node_flows;
+    std::vector<NodeIdx> ids_unused;
+
+    /* The graph used by the shortest path computations, in Compressed
+     * Sparse Row format: the edges of node i are stored in
+     * csr_edges[csr_offsets[i]] ... csr_edges[csr_offsets[i+1]-1].
+     * Only the lower flows that have a matching reverse flow with the same
+     * cost are included. If the database changed since the last
+     * computation, only the rows of the changed nodes are rebuilt from
+     * 'adj', unless there are too many changes. */
+    std::vector<uint32_t> csr_offsets;
+    std::vector<Edge> csr_edges;
+    std::vector<Edge> csr_row;
+    bool csr_dirty = true;
+
+    /* False after graph_disable(). */
+    bool graph_enabled = true;
+
+    /* Scratch state of the shortest path computations, kept here to
+     * avoid allocations on each run. There is one for each thread taking
+     * part in the computations. The heap is a 4-ary min-heap of node
+     * indices, and heap_pos[i] is the position of node i in the heap. */
+    struct SpfWorkspace {
+        std::vector<NodeIdx> heap;
+        std::vector<uint32_t> heap_pos;
+        std::vector<uint8_t> node_mark;
+        std::vector<NodeIdx> affected;
+
+        void heap_sift_up(uint32_t pos, const std::vector<DijkstraInfo> &info);
+        void heap_sift_down(uint32_t pos,
+                            const std::vector<DijkstraInfo> &info);
+        void heap_update(NodeIdx node, const std::vector<DijkstraInfo> &info);
+    };
+    std::vector<SpfWorkspace> workspaces;
+
+    /* Threads used to compute the shortest path trees of the neighbors. */
+    std::unique_ptr<WorkerPool> pool;
+
+    /* Shortest path trees rooted at the local node and at its neighbors. */
+    std::vector<DijkstraInfo> local_info;
+    std::vector<std::pair<NodeIdx, std::vector<DijkstraInfo>>> neigh_infos;
+
+    /* Root of the shortest path tree stored in local_info. */
+    NodeIdx local_root = kNodeIdxNone;
+
+    /* Value of ecmp_enabled in the last run of compute_next_hops(). */
+    bool ecmp_last = false;
+
+    /* Pairs of nodes whose lower flows changed since the last run of
+     * compute_next_hops(), used for the incremental updates. */
+    std::vector<std::pair<NodeIdx, NodeIdx>> graph_changes;
+    bool graph_changes_overflow = false;
+
+    /* Nodes whose distance from the local node (or from the neighbors)
+     * changed in the last incremental update. */
+    std::vector<NodeIdx> touched;
+    std::vector<std::vector<NodeIdx>> neigh_touched;
+    std::vector<uint8_t> node_mark;
+
+    /* Routing table under construction, published into next_hops at the
+     * end of a full computation. */
+    std::unordered_map<NodeId, std::vector<NodeId>> next_hops_new;
+    std::unordered_map<NodeId, unsigned int> next_hops_ecmp_new;
+
+    void graph_row_build(NodeIdx i, std::vector<Edge> &row) const;
+    void graph_build();
+    void graph_change(NodeIdx a, NodeIdx b);
+    void node_flows_dec(NodeIdx i);
+    unsigned int edge_cost(NodeIdx from, NodeIdx to) const;
+    SpfWorkspace &workspace(unsigned int i);
+    void spt_relax(SpfWorkspace &ws, NodeIdx root,
+                   std::vector<DijkstraInfo> &info,
+                   std::vector<NodeIdx> *touched) const;
+    void spt_full(SpfWorkspace &ws, NodeIdx root,
+                  std::vector<DijkstraInfo> &info) const;
+    void spt_update(SpfWorkspace &ws, NodeIdx root,
+                    std::vector<DijkstraInfo> &info,
+                    std::vector<NodeIdx> &touched) const;
+    void neigh_spts_compute(bool incremental);
+    void next_hops_update(
+        std::unordered_map<NodeId, std::vector<NodeId>> &table,
+        std::unordered_map<NodeId, unsigned int> &ecmp_table, NodeIdx local,
+        NodeIdx node) const;
+};
+
+/* Routing table produced by a computation of an SpfWorker. */
+struct NextHopsSnapshot {
+    std::unordered_map<NodeId, std::vector<NodeId>> next_hops;
+    std::unordered_map<NodeId, unsigned int> next_hops_ecmp;
+    LFDB::PhaseTimes times;
+
+    /* Node ids in use (and waiting to be released) in the private LFDB,
+     * after the computation. */
+    size_t node_ids    = 0;
+    size_t ids_pending = 0;
 };
 
+/* Runs the next hops computations on a dedicated thread, so that the
+ * caller (e.g. the uipcp event loop) is not blocked by the shortest path
+ * algorithms. The thread works on a private copy of the LFDB, which the
+ * caller keeps up to date by reporting the changes of its own database
+ * through flow_changed(). The changes are handed over to the thread when
+ * a computation starts. Each computation publishes a new snapshot of
+ * the routing table, and the 'notify' callback (invoked by the thread)
+ * tells the caller to collect it with snapshot_take(). Requests issued
+ * while a computation is in progress are coalesced. */
+class SpfWorker {
+public:
+    RL_NODEFAULT_NONCOPIABLE(SpfWorker);
+    SpfWorker(bool lfa_enabled, bool verbose, std::function<void()> notify);
+    ~SpfWorker();
+
+    /* Record a change of the caller's LFDB, to be applied to the private
+     * copy before the next computation. */
+    void flow_changed(const gpb::LowerFlow &lf, bool removed);
+
+    /* Request a computation of the next hops of 'local_node'. */
+    void compute(const NodeId &local_node, bool ecmp_enabled);
+
+    /* Return the latest snapshot published, or nullptr if there is none
+     * since the last call. */
+    std::unique_ptr<NextHopsSnapshot> snapshot_take();
+
+private:
+    void worker_loop();
+
+    /* The private copy of the LFDB, only accessed by the thread. */
+    LFDB lfdb;
+
+    std::function<void()> notify;
+    std::thread th;
+
+    /* Protects the fields below. */
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    /* Changes not yet applied to the private copy, indexed by
+     * LFDB::flow_key(). Only the last change of each flow matters. */
+    struct FlowChange {
+        gpb::LowerFlow lf;
+        bool removed;
+    };
+    std::unordered_map<std::string, FlowChange> changes;
+
+    NodeId local_node;
+    bool ecmp_enabled = false;
+    bool requested    = false;
+    bool stopping     = false;
+    std::unique_ptr<NextHopsSnapshot> snapshot;
+};
+
+/* RL_PORT_ID_NONE as a port id, so that it can be compared with one. */
+static constexpr rl_port_t kPortIdNone = RL_PORT_ID_NONE;
+
+/* An entry of a forwarding table: the destination node and the local
+ * ports used to reach it. More than one port means that the traffic is
+ * spread over a group of lower flows (ECMP). The backup port, if any,
+ * leads to a loop free alternate next hop, and it is used by the kernel
+ * when the port selected from the group goes down (fast reroute). */
+struct FwdEntry {
+    NodeId node;
+    std::vector<rl_port_t> ports;
+    rl_port_t backup = kPortIdNone;
+
+    FwdEntry() = default;
+    FwdEntry(const NodeId &node, std::vector<rl_port_t> ports,
+             rl_port_t backup = kPortIdNone)
+        : node(node), ports(std::move(ports)), backup(backup)
+    {
+    }
+
+    /* The node is not part of the kernel state. */
+    bool same_ports(const FwdEntry &o) const
+    {
+        return ports == o.ports && backup == o.backup;
+    }
+};
+
+/* A forwarding table, mapping a destination address to an entry. */
+using FwdTable = std::unordered_map<rlm_addr_t, FwdEntry>;
+
+/* Compute the list of PDUFT operations that turn the 'cur' forwarding
+ * table into the 'next' one, to be applied with a single batched update.
+ * Stale entries are deleted first, then new or changed entries are set.
+ * The additional ports of a group follow the RL_PDUFT_OP_SET of the
+ * entry as RL_PDUFT_OP_ADD operations, followed by the backup port (if
+ * any) as a RL_PDUFT_OP_BACKUP operation. */
+void fwd_table_diff(const FwdTable &cur, const FwdTable &next,
+                    std::vector<struct rl_pduft_op> &ops);
+
+/* Convert a list of lower flows into the compact encoding, where the
+ * name of each node is carried only once, and the fields of the flows are
+ * stored in packed arrays. */
+void lower_flows_compact(gpb::LowerFlowList &lfl);
+
+/* Convert a list of lower flows from the compact encoding back into the
+ * regular one. Lists that are not compact are left untouched. Returns -1
+ * if the compact encoding is malformed. */
+int lower_flows_expand(gpb::LowerFlowList &lfl);
+
 /* Helper for pretty printing of default route. */
 static inline std::string
 node_id_pretty(const NodeId &node)
@@ -21,11 +21,14 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <algorithm>
 #include <climits>
 #include <cerrno>
 #include <sstream>
 #include <iostream>
 #include <functional>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include "uipcp-normal.hpp"
 #include "uipcp-normal-lfdb.hpp"
@@ -59,10 +62,10 @@ public:
     RoutingEngine(UipcpRib *rib, bool lfa_enabled)
         : LFDB(/*lfa_enabled=*/lfa_enabled,
                /*verbose=*/rl_verbosity >= RL_VERB_VERY),
-          rib(rib),
-          last_run(std::chrono::system_clock::now())
+          rib(rib)
     {
     }
+    ~RoutingEngine();
 
     /* Recompute routing and forwarding table and possibly
      * update kernel forwarding data structures. */
@@ -72,15 +75,34 @@ public:
 
     /* Used by the routing class to ask the RoutingEngine to actually recompute
      * the routing table. */
-    void schedule_recomputation() { recompute = true; }
+    void schedule_recomputation()
+    {
+        recompute = true;
+        changes_pending++;
+    }
+
+    /* Configure the throttling of the routing computations. */
+    void spf_throttle_set(Msecs initial_delay, Msecs hold, Msecs max_wait);
 
     /* Forwarding table computation and kernel update. */
     int compute_fwd_table();
 
+    void flow_changed(const gpb::LowerFlow &lf, bool removed) override;
+
+    /* Install the routing table computed by the SPF worker, if any, and
+     * update the forwarding table. */
+    void snapshot_install();
+
 private:
+    /* Start the SPF worker, returning -1 on failure. */
+    int spf_start();
+
+    /* Run the routing computation now. */
+    void spf_run(const NodeId &);
+
     /* The forwarding table computed by compute_fwd_table().
-     * It maps a NodeId --> (dst_addr, local_port). */
-    std::unordered_map<rlm_addr_t, std::pair<NodeId, rl_port_t>> next_ports;
+     * It maps a dst_addr --> (NodeId, local_ports). */
+    FwdTable next_ports;
 
     /* Set of ports that are currently down. */
     std::unordered_set<rl_port_t> ports_down;
@@ -92,20 +114,143 @@ private:
     /* Backpointer. */
     UipcpRib *rib;
 
-    /* Last time we ran the routing algorithm. */
-    std::chrono::system_clock::time_point last_run;
+    /* Last time we ran the routing algorithm, min() if never. */
+    std::chrono::steady_clock::time_point last_run =
+        std::chrono::steady_clock::time_point::min();
+
+    /* Throttling of the routing computations, as in OSPF. The first
+     * computation after a quiet period is delayed by 'spf_initial_delay',
+     * to coalesce the burst of updates caused by a single event. The
+     * following ones are spaced by the current hold time, which starts
+     * from 'spf_hold' and doubles each time it is applied, up to
+     * 'spf_max_wait'. The hold time is reset when no computation is
+     * needed for 'spf_max_wait'. */
+    Msecs spf_initial_delay = Msecs(0);
+    Msecs spf_hold          = Msecs(0);
+    Msecs spf_max_wait      = Msecs(0);
+    Msecs spf_hold_cur      = Msecs(0);
+    bool spf_held           = false;
+
+    /* Timer for a delayed computation, and time when it was started. */
+    std::unique_ptr<TimeoutEvent> spf_timer;
+    std::chrono::steady_clock::time_point spf_wait_start;
+
+    /* Number of changes since the last computation. */
+    uint64_t changes_pending = 0;
+
+    /* Thread computing the routing table out of the event loop, started
+     * on the first computation. It signals 'spf_efd' when a new routing
+     * table is ready to be installed. */
+    std::unique_ptr<SpfWorker> spf;
+    int spf_efd = -1;
+};
 
-    /* Minimum size of the LFDB after which we start to rate limit routing
-     * computations. */
-    size_t coalesce_size_threshold = 50;
+RoutingEngine::~RoutingEngine()
+{
+    /* Stop the worker before releasing the eventfd it signals. */
+    spf.reset();
+    if (spf_efd >= 0) {
+        uipcp_loop_fdh_del(rib->uipcp, spf_efd);
+        close(spf_efd);
+    }
+}
 
-    /* Minimum number of seconds that must elapse between two consecutive
-     * routing table computations, if rate limiting is active. */
-    Secs coalesce_period = Secs(5);
+static void
+spf_snapshot_ready(struct uipcp *uipcp, int fd, void *opaque)
+{
+    RoutingEngine *re = static_cast<RoutingEngine *>(opaque);
+    UipcpRib *rib     = UIPCP_RIB(uipcp);
 
-    /* Timer to provide an upper bound for the coalescing period. */
-    std::unique_ptr<TimeoutEvent> coalesce_timer;
-};
+    eventfd_drain(fd);
+    std::lock_guard<RibMutex> guard(rib->mutex);
+    re->snapshot_install();
+}
+
+int
+RoutingEngine::spf_start()
+{
+    spf_efd = eventfd(0, EFD_CLOEXEC);
+    if (spf_efd < 0) {
+        UPE(rib->uipcp, "eventfd() failed [%s]\n", strerror(errno));
+        return -1;
+    }
+
+    if (uipcp_loop_fdh_add(rib->uipcp, spf_efd, spf_snapshot_ready, this)) {
+        close(spf_efd);
+        spf_efd = -1;
+        return -1;
+    }
+
+    int efd = spf_efd;
+    spf     = utils::make_unique<SpfWorker>(
+        lfa_enabled, verbose, [efd]() { eventfd_signal(efd, 1); });
+
+    /* The worker starts with an empty database. */
+    for (const auto &kvi : db) {
+        for (const auto &kvj : kvi.second) {
+            spf->flow_changed(flow_get(kvi.first, kvj.first, kvj.second),
+                              /*removed=*/false);
+        }
+    }
+
+    /* The graph is now maintained by the worker only. */
+    graph_disable();
+
+    return 0;
+}
+
+void
+RoutingEngine::snapshot_install()
+{
+    std::unique_ptr<NextHopsSnapshot> snap;
+
+    if (!spf || !(snap = spf->snapshot_take())) {
+        return;
+    }
+
+    next_hops      = std::move(snap->next_hops);
+    next_hops_ecmp = std::move(snap->next_hops_ecmp);
+    last_times     = snap->times;
+    rib->stats.routing_table_compute++;
+    rib->stats.routing_graph_us += last_times.graph_us;
+    rib->stats.routing_spf_us += last_times.spf_us;
+    rib->stats.routing_lfa_spf_us += last_times.lfa_spf_us;
+    rib->stats.routing_merge_us += last_times.merge_us;
+
+    /* Using the new routing table, compute the forwarding table and
+     * update the kernel with the differences. */
+    compute_fwd_table();
+}
+
+/* Size of a lower flow within a serialized LowerFlowList. */
+static size_t
+flow_serlen(const gpb::LowerFlow &lf)
+{
+#ifdef HAVE_GPB_BYTE_SIZE_LONG
+    size_t len = lf.ByteSizeLong();
+#else
+    size_t len = lf.ByteSize();
+#endif
+    return len + 2; /* tag and length */
+}
+
+/* Mirror the LFDB into the RibSync engine and into the SPF worker. */
+void
+RoutingEngine::flow_changed(const gpb::LowerFlow &lf, bool removed)
+{
+    std::string key = flow_key(lf.local_node(), lf.remote_node());
+
+    if (spf) {
+        spf->flow_changed(lf, removed);
+    }
+
+    if (removed) {
+        rib->ribsync.entry_remove(Routing::TableName, key);
+    } else {
+        rib->ribsync.entry_update(Routing::TableName, key, flow_hash(lf),
+                                  flow_serlen(lf));
+    }
+}
 
 void
 RoutingEngine::flow_state_update(struct rl_kmsg_flow_state *upd)
@@ -127,20 +272,47 @@ RoutingEngine::flow_state_update(struct rl_kmsg_flow_state *upd)
 int
 RoutingEngine::compute_fwd_table()
 {
-    unordered_map<rlm_addr_t, pair<NodeId, rl_port_t>> next_ports_new_,
-        next_ports_new;
+    auto start = std::chrono::steady_clock::now();
+    FwdTable next_ports_new_, next_ports_new;
     struct uipcp *uipcp = rib->uipcp;
     unordered_map<rl_port_t, int> port_hits;
     rl_port_t dflt_port;
     int dflt_hits = 0;
 
     /* Compute the forwarding table by translating the next-hop address
-     * into a port-id towards the next-hop. */
+     * into a port-id towards the next-hop. With ECMP, the traffic towards
+     * a destination is spread over all the usable flows towards all the
+     * equal cost next hops. With LFA, the first usable flow towards the
+     * following next hops is installed as a backup, so that the kernel
+     * can reroute the traffic as soon as the flows in use go down. */
     for (const auto &kvr : next_hops) {
-        for (const NodeId &lfa : kvr.second) {
-            auto neigh = rib->neighbors.find(lfa);
-            rlm_addr_t dst_addr;
-            rl_port_t port_id;
+        auto ecmp          = next_hops_ecmp.find(kvr.first);
+        size_t ecmp_nhops  = ecmp == next_hops_ecmp.end() ? 1 : ecmp->second;
+        rl_port_t backup   = kPortIdNone;
+        vector<rl_port_t> ports;
+        NodeId nhop;
+        rlm_addr_t dst_addr;
+        size_t i;
+
+        /* Make sure we know the address for this destination. */
+        dst_addr = rib->lookup_node_address(kvr.first);
+        if (dst_addr == RL_ADDR_NULL) {
+            /* We still miss the address of this destination. */
+            UPV(uipcp, "Can't find address for destination %s\n",
+                kvr.first.c_str());
+            continue;
+        }
+
+        for (i = 0; i < kvr.second.size(); i++) {
+            const NodeId &lfa = kvr.second[i];
+            auto neigh        = rib->neighbors.find(lfa);
+            size_t num_ports  = ports.size();
+
+            if (!ports.empty() && i >= ecmp_nhops) {
+                /* We have found suitable ports for the destination, we
+                 * can stop searching. */
+                break;
+            }
 
             if (neigh == rib->neighbors.end()) {
                 UPE(uipcp, "Could not find neighbor with name %s\n",
@@ -157,32 +329,68 @@ RoutingEngine::compute_fwd_table()
                 continue;
             }
 
-            /* Take one of the kernel-bound flows towards the neighbor. */
-            port_id = neigh->second->flows.begin()->second->port_id;
-            if (ports_down.count(port_id)) {
-                UPD(uipcp, "Skipping port_id %u as it is down\n", port_id);
-                continue;
+            /* Take the kernel-bound flows towards the neighbor, all of
+             * them if ECMP is enabled. */
+            for (const auto &kvf : neigh->second->flows) {
+                rl_port_t port_id = kvf.second->port_id;
+
+                if (ports_down.count(port_id)) {
+                    UPD(uipcp, "Skipping port_id %u as it is down\n",
+                        port_id);
+                    continue;
+                }
+                ports.push_back(port_id);
+            }
+            std::sort(ports.begin() + num_ports, ports.end());
+            if (!ecmp_enabled && ports.size() > 1) {
+                ports.resize(1);
+            }
+            if (ports.size() > num_ports && nhop.empty()) {
+                nhop = lfa;
+            }
+            if (!ecmp_enabled && !ports.empty()) {
+                i++;
+                break;
             }
+        }
+
+        if (ports.empty()) {
+            continue;
+        }
+        if (ports.size() > RL_PDUFT_ECMP_MAX) {
+            ports.resize(RL_PDUFT_ECMP_MAX);
+        }
 
-            /* Also make sure we know the address for this destination. */
-            dst_addr = rib->lookup_node_address(kvr.first);
-            if (dst_addr == RL_ADDR_NULL) {
-                /* We still miss the address of this destination. */
-                UPV(uipcp, "Can't find address for destination %s\n",
-                    kvr.first.c_str());
+        for (; lfa_enabled && i < kvr.second.size() &&
+               backup == kPortIdNone;
+             i++) {
+            auto neigh = rib->neighbors.find(kvr.second[i]);
+
+            if (neigh == rib->neighbors.end()) {
                 continue;
             }
-
-            /* We have found a suitable port for the destination, we can
-             * stop searching. */
-            next_ports_new_[dst_addr] = make_pair(kvr.first, port_id);
-            if (++port_hits[port_id] > dflt_hits) {
-                dflt_hits = port_hits[port_id];
-                dflt_port = port_id;
-                dflt_nhop = lfa;
+            for (const auto &kvf : neigh->second->flows) {
+                rl_port_t port_id = kvf.second->port_id;
+
+                if (!ports_down.count(port_id) &&
+                    std::find(ports.begin(), ports.end(), port_id) ==
+                        ports.end() &&
+                    port_id < backup) {
+                    backup = port_id;
+                }
             }
-            break;
         }
+
+        /* Only the entries without a backup can be covered by the
+         * default entry. */
+        if (ports.size() == 1 && backup == kPortIdNone &&
+            ++port_hits[ports[0]] > dflt_hits) {
+            dflt_hits = port_hits[ports[0]];
+            dflt_port = ports[0];
+            dflt_nhop = nhop;
+        }
+        next_ports_new_[dst_addr] =
+            FwdEntry(kvr.first, std::move(ports), backup);
     }
 
 #if 1 /* Use default forwarding entry. */
@@ -192,88 +400,94 @@ RoutingEngine::compute_fwd_table()
         /* Prune out those entries corresponding to the default port, and
          * replace them with the default entry. */
         for (const auto &kve : next_ports_new_) {
-            if (kve.second.second != dflt_port) {
+            if (kve.second.ports.size() != 1 ||
+                kve.second.ports.front() != dflt_port ||
+                kve.second.backup != kPortIdNone) {
                 next_ports_new[kve.first] = kve.second;
             }
         }
-        next_ports_new[RL_ADDR_NULL] = make_pair(any, dflt_port);
-        next_hops[any]               = std::vector<NodeId>(1, dflt_nhop);
+        next_ports_new[RL_ADDR_NULL] =
+            FwdEntry(any, vector<rl_port_t>(1, dflt_port));
+        next_hops[any] = std::vector<NodeId>(1, dflt_nhop);
     }
 #else /* Avoid using the default forwarding entry. */
     next_ports_new = next_ports_new_;
 #endif
 
-    /* Remove old PDUFT entries first. */
-    for (const auto &kve : next_ports) {
-        struct rl_pci_match match = {};
-        rl_port_t port_id;
-        NodeId dst_node;
-        int ret;
-
-        auto nf = next_ports_new.find(kve.first);
-        if (nf != next_ports_new.end() &&
-            kve.second.second == nf->second.second) {
-            /* This old entry still exists, nothing to do. */
-            continue;
-        }
+    /* Push all the changes to the kernel with batched updates, so that
+     * the datapath never sees a partially updated table. */
+    vector<struct rl_pduft_op> ops;
+    FwdTable next_ports_old = std::move(next_ports);
 
-        /* Delete the old one. */
-        match.dst_addr = kve.first;
-        dst_node       = kve.second.first;
-        port_id        = kve.second.second;
-        ret            = uipcp_pduft_del(uipcp, port_id, &match);
-        if (ret) {
-            UPE(uipcp,
-                "Failed to delete PDUFT entry for %s(%lu) "
-                "(port_id=%u) [%s]\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                port_id, strerror(errno));
-        } else {
-            UPD(uipcp, "Delete PDUFT entry for %s(%lu) (port_id=%u)\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                port_id);
-        }
-    }
+    fwd_table_diff(next_ports_old, next_ports_new, ops);
+    next_ports = next_ports_new;
+
+    for (size_t ofs = 0, n; ofs < ops.size(); ofs += n) {
+        n = std::min(ops.size() - ofs, size_t(RL_PDUFT_BATCH_MAX));
 
-    /* Generate new PDUFT entries. */
-    for (auto &kve : next_ports_new) {
-        struct rl_pci_match match = {};
-        rl_port_t port_id;
-        NodeId dst_node;
-        int ret;
+        /* Don't split the operations of an entry across two batches. */
+        while (ofs + n < ops.size() && ops[ofs + n].op != RL_PDUFT_OP_SET &&
+               ops[ofs + n].op != RL_PDUFT_OP_DEL) {
+            n--;
+        }
 
-        auto of = next_ports.find(kve.first);
-        if (of != next_ports.end() && of->second.second == kve.second.second) {
-            /* This entry is already in place. */
+        if (uipcp_pduft_batch(uipcp, ops.data() + ofs, n) == 0) {
             continue;
         }
 
-        /* Add the new one. */
-        match.dst_addr = kve.first;
-        dst_node       = kve.second.first;
-        port_id        = kve.second.second;
-        ret            = uipcp_pduft_set(uipcp, port_id, &match);
-        if (ret) {
-            UPE(uipcp,
-                "Failed to insert %s(%lu) --> %s (port_id=%u) PDUFT "
-                "entry [%s]\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                next_hops[dst_node].front().c_str(), port_id, strerror(errno));
-            /* Trigger re insertion next time. */
-            kve.second = make_pair(NodeId(), 0);
-        } else {
-            UPD(uipcp, "Set PDUFT entry %s(%lu) --> %s (port_id=%u)\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)match.dst_addr,
-                next_hops[dst_node].front().c_str(), port_id);
+        UPE(uipcp, "Failed to apply %u PDUFT updates [%s]\n", unsigned(n),
+            strerror(errno));
+        /* None of these updates was applied. Trigger re insertion of
+         * new entries and re deletion of stale ones next time. */
+        for (size_t i = ofs; i < ofs + n; i++) {
+            rlm_addr_t dst_addr = ops[i].match.dst_addr;
+
+            if (ops[i].op == RL_PDUFT_OP_SET) {
+                next_ports[dst_addr] =
+                    FwdEntry(NodeId(), vector<rl_port_t>(1, 0));
+            } else if (ops[i].op == RL_PDUFT_OP_DEL) {
+                next_ports[dst_addr] = next_ports_old[dst_addr];
+            }
+        }
+    }
+
+    if (rl_verbosity >= RL_VERB_DBG) {
+        for (const auto &op : ops) {
+            const auto &kve = op.op != RL_PDUFT_OP_DEL
+                                  ? next_ports_new[op.match.dst_addr]
+                                  : next_ports_old[op.match.dst_addr];
+
+            UPD(uipcp, "%s PDUFT entry %s(%lu) (port_id=%u)\n",
+                op.op == RL_PDUFT_OP_SET
+                    ? "Set"
+                    : (op.op == RL_PDUFT_OP_ADD
+                           ? "Extend"
+                           : (op.op == RL_PDUFT_OP_BACKUP ? "Backup"
+                                                          : "Delete")),
+                node_id_pretty(kve.node).c_str(),
+                (long unsigned)op.match.dst_addr, op.local_port);
         }
     }
 
-    next_ports = next_ports_new;
     rib->stats.fwd_table_compute++;
+    rib->stats.fwd_table_us +=
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count();
 
     return 0;
 }
 
+void
+RoutingEngine::spf_throttle_set(Msecs initial_delay, Msecs hold,
+                                Msecs max_wait)
+{
+    spf_initial_delay = initial_delay;
+    spf_max_wait      = std::max(max_wait, initial_delay);
+    spf_hold          = std::min(hold, spf_max_wait);
+    spf_hold_cur      = spf_hold;
+}
+
 /* To be called under RIB lock. */
 void
 RoutingEngine::update_kernel_routing(const NodeId &addr)
@@ -284,37 +498,84 @@ RoutingEngine::update_kernel_routing(const NodeId &addr)
         return; /* Nothing to do. */
     }
 
-    auto now = std::chrono::system_clock::now();
-
-    if (db.size() > coalesce_size_threshold &&
-        (now - last_run) < coalesce_period) {
-        /* Postpone this computation, possibly starting the coalesce timer. */
-        if (!coalesce_timer) {
-            coalesce_timer = utils::make_unique<TimeoutEvent>(
-                coalesce_period, rib->uipcp, this,
-                [](struct uipcp *uipcp, void *arg) {
-                    RoutingEngine *re = (RoutingEngine *)arg;
-                    std::lock_guard<std::mutex> guard(re->rib->mutex);
-                    re->coalesce_timer->fired();
-                    re->update_kernel_routing(re->rib->myname);
-                });
-        }
+    if (spf_timer) {
+        return; /* A computation is already scheduled. */
+    }
+
+    auto now    = std::chrono::steady_clock::now();
+    Msecs delay = spf_initial_delay;
+
+    if (last_run != std::chrono::steady_clock::time_point::min() &&
+        now - last_run < spf_max_wait) {
+        /* Not a quiet period, wait for the hold time to expire. */
+        auto hold_left =
+            std::chrono::duration_cast<Msecs>(last_run + spf_hold_cur - now);
+        delay    = std::max(delay, hold_left);
+        spf_held = true;
+    } else {
+        spf_hold_cur = spf_hold;
+        spf_held     = false;
+    }
+
+    spf_wait_start = now;
+    if (delay <= Msecs::zero()) {
+        spf_run(addr);
         return;
     }
 
-    if (coalesce_timer) {
-        coalesce_timer->clear();
-        coalesce_timer = nullptr;
+    /* Postpone this computation. */
+    spf_timer = utils::make_unique<TimeoutEvent>(
+        delay, rib->uipcp, this, [](struct uipcp *uipcp, void *arg) {
+            RoutingEngine *re = (RoutingEngine *)arg;
+            std::lock_guard<RibMutex> guard(re->rib->mutex);
+            re->spf_timer->fired();
+            re->spf_run(re->rib->myname);
+        });
+}
+
+void
+RoutingEngine::spf_run(const NodeId &addr)
+{
+    auto now = std::chrono::steady_clock::now();
+
+    if (spf_timer) {
+        spf_timer->clear();
+        spf_timer = nullptr;
     }
     recompute = false;
     last_run  = now;
+    if (spf_held) {
+        /* The current hold time has been applied to this computation,
+         * the next one will wait twice as long. */
+        spf_hold_cur = std::min(spf_hold_cur * 2, spf_max_wait);
+        spf_held     = false;
+    }
+    rib->stats.routing_changes_queued += changes_pending;
+    rib->stats.routing_spf_wait_us +=
+        std::chrono::duration_cast<std::chrono::microseconds>(now -
+                                                              spf_wait_start)
+            .count();
+    rib->stats.routing_spf_hold_ms = spf_hold_cur.count();
+    changes_pending                = 0;
 
     UPD(rib->uipcp, "Recomputing routing and forwarding tables\n");
 
-    /* Step 1: Run a shortest path algorithm. This phase produces the
-     * 'next_hops' routing table. */
+    /* Hand over the computation to the SPF worker, so that the RIB lock
+     * is not held while running the shortest path algorithms. The
+     * forwarding table is updated by snapshot_install(). */
+    if (spf || spf_start() == 0) {
+        spf->compute(addr, ecmp_enabled);
+        return;
+    }
+
+    /* Fall back on the synchronous computation. Step 1: Run a shortest
+     * path algorithm. This phase produces the 'next_hops' routing table. */
     compute_next_hops(addr);
     rib->stats.routing_table_compute++;
+    rib->stats.routing_graph_us += last_times.graph_us;
+    rib->stats.routing_spf_us += last_times.spf_us;
+    rib->stats.routing_lfa_spf_us += last_times.lfa_spf_us;
+    rib->stats.routing_merge_us += last_times.merge_us;
 
     /* Step 2: Using the 'next_hops' routing table, compute forwarding table
      * (in userspace) and update the corresponding kernel data structure. */
@@ -329,14 +590,33 @@ class LinkStateRouting : public Routing {
     /* Timer ID for age increment of LFDB entries. */
     std::unique_ptr<TimeoutEvent> age_incr_timer;
 
+    /* Send the lower flows with the compact encoding. */
+    bool compact = false;
+
+    void encode(gpb::LowerFlowList &lfl) const
+    {
+        if (compact) {
+            lower_flows_compact(lfl);
+        }
+    }
+
 public:
     RL_NODEFAULT_NONCOPIABLE(LinkStateRouting);
     LinkStateRouting(UipcpRib *rib, bool lfa)
         : Routing(rib), re(rib, /*lfa_enabled=*/lfa)
     {
+        rib->ribsync.table_register(
+            TableName, this,
+            [this](const std::vector<std::string> &keys, SyncPeer &peer) {
+                return flows_push(keys, peer);
+            });
         age_incr_tmr_restart();
     }
-    ~LinkStateRouting() { age_incr_timer.reset(); }
+    ~LinkStateRouting()
+    {
+        age_incr_timer.reset();
+        rib->ribsync.table_unregister(TableName, this);
+    }
 
     void dump(std::stringstream &ss) const override { re.dump(ss); }
     void dump_routing(std::stringstream &ss) const override
@@ -352,19 +632,29 @@ public:
     void neigh_disconnected(const std::string &neigh_name) override;
 
     int rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src) override;
+    int reconfigure() override;
 
     int sync_neigh(const std::shared_ptr<NeighFlow> &nf,
-                   unsigned int limit) const override;
+                   size_t limit) const override;
     int neighs_refresh(size_t limit) override;
     void age_incr();
     void age_incr_tmr_restart();
 
+    int flows_push(const std::vector<std::string> &keys,
+                   SyncPeer &peer) const;
+
     /* Time interval (in seconds) between two consecutive increments
      * of the age of LFDB entries. */
     static constexpr int kAgeIncrIntvalSecs = 10;
 
     /* Max age (in seconds) for an LFDB entry not to be discarded. */
     static constexpr int kAgeMaxSecs = 900;
+
+    /* Default values for the throttling of the routing computations,
+     * in milliseconds. */
+    static constexpr int kSpfInitialDelayMsecs = 50;
+    static constexpr int kSpfHoldMsecs         = 200;
+    static constexpr int kSpfMaxWaitMsecs      = 5000;
 };
 
 /* The add method has overwrite semantic, and possibly resets the age.
@@ -372,13 +662,13 @@ public:
 bool
 LinkStateRouting::add(const gpb::LowerFlow &lf)
 {
-    auto it            = re.db.find(lf.local_node());
     string repr        = to_string(lf);
     gpb::LowerFlow lfz = lf;
+    gpb::LowerFlow cur;
 
     lfz.set_age(0);
 
-    if (it == re.db.end() || it->second.count(lf.remote_node()) == 0) {
+    if (!re.find(lf.local_node(), lf.remote_node(), &cur)) {
         /* Not there, we should add the entry. */
         if (lf.local_node() == rib->myname &&
             rib->get_neighbor(lf.remote_node(), /*create=*/false) == nullptr) {
@@ -388,7 +678,7 @@ LinkStateRouting::add(const gpb::LowerFlow &lf)
                 repr.c_str());
             return false;
         }
-        re.db[lf.local_node()][lf.remote_node()] = lfz;
+        re.add(lfz);
         re.schedule_recomputation();
         UPD(rib->uipcp, "Lower flow %s added\n", repr.c_str());
         return true;
@@ -398,10 +688,10 @@ LinkStateRouting::add(const gpb::LowerFlow &lf)
      * was obtained by means of a Karnaugh map on three variables:
      * local, newer, equal). */
     bool local_entry = (lfz.local_node() == rib->myname);
-    bool newer       = lfz.seqnum() > it->second[lfz.remote_node()].seqnum();
-    bool equal       = lfz == it->second[lfz.remote_node()];
+    bool newer       = lfz.seqnum() > cur.seqnum();
+    bool equal       = lfz == cur;
     if ((!local_entry && newer) || (local_entry && !equal)) {
-        it->second[lfz.remote_node()] = std::move(lfz); /* Update the entry */
+        re.add(lfz); /* Update the entry */
         if (equal) {
             /* The affected flow entry is just refreshed, but it did not
              * change. No recomputation is needed. */
@@ -422,22 +712,16 @@ LinkStateRouting::add(const gpb::LowerFlow &lf)
 bool
 LinkStateRouting::del(const NodeId &local_node, const NodeId &remote_node)
 {
-    auto it = re.db.find(local_node);
-    unordered_map<NodeId, gpb::LowerFlow>::iterator jt;
+    gpb::LowerFlow lf;
     string repr;
 
-    if (it == re.db.end()) {
-        return false;
-    }
-
-    jt = it->second.find(remote_node);
-
-    if (jt == it->second.end()) {
+    if (!re.find(local_node, remote_node, &lf)) {
         return false;
     }
-    repr = to_string(jt->second);
+    repr = to_string(lf);
 
-    it->second.erase(jt);
+    re.del(local_node, remote_node);
+    re.schedule_recomputation();
 
     UPD(rib->uipcp, "Lower flow %s removed\n", repr.c_str());
 
@@ -495,6 +779,10 @@ LinkStateRouting::rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src)
     gpb::LowerFlowList prop_lfl;
 
     lfl.ParseFromArray(objbuf, objlen);
+    if (lower_flows_expand(lfl)) {
+        UPE(rib->uipcp, "Malformed compact list of lower flows\n");
+        return 0;
+    }
 
     for (const gpb::LowerFlow &f : lfl.flows()) {
         if (add_f) {
@@ -511,6 +799,7 @@ LinkStateRouting::rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src)
 
     if (prop_lfl.flows_size() > 0) {
         /* Send the received lower flows to the other neighbors. */
+        encode(prop_lfl);
         rib->neighs_sync_obj_excluding(src.neigh, add_f, ObjClass, TableName,
                                        &prop_lfl);
 
@@ -521,6 +810,26 @@ LinkStateRouting::rib_handler(const CDAPMessage *rm, const MsgSrcInfo &src)
     return 0;
 }
 
+int
+LinkStateRouting::reconfigure()
+{
+    bool ecmp = rib->get_param_value<bool>(Routing::Prefix, "ecmp");
+
+    compact = rib->get_param_value<bool>(Routing::Prefix, "compact-encoding");
+
+    re.spf_throttle_set(
+        rib->get_param_value<Msecs>(Routing::Prefix, "spf-initial-delay"),
+        rib->get_param_value<Msecs>(Routing::Prefix, "spf-hold"),
+        rib->get_param_value<Msecs>(Routing::Prefix, "spf-max-wait"));
+
+    if (ecmp != re.ecmp_enabled) {
+        re.ecmp_enabled = ecmp;
+        update_kernel(/*force=*/true);
+    }
+
+    return 0;
+}
+
 void
 LinkStateRouting::update_kernel(bool force)
 {
@@ -542,29 +851,56 @@ LinkStateRouting::flow_state_update(struct rl_kmsg_flow_state *upd)
     return 0;
 }
 
+/* Only the enrollment initiator starts the comparison of the hash trees,
+ * and each side pushes the lower flows that the other one may miss. */
 int
 LinkStateRouting::sync_neigh(const std::shared_ptr<NeighFlow> &nf,
-                             unsigned int limit) const
+                             size_t limit) const
 {
+    return rib->ribsync_start(TableName, nf);
+}
+
+/* Push the lower flows with the given RibSync keys to a neighbor. */
+int
+LinkStateRouting::flows_push(const std::vector<std::string> &keys,
+                             SyncPeer &peer) const
+{
+    const size_t limit = peer.obj_size_max();
     gpb::LowerFlowList lfl;
-    auto func =
-        std::bind(&NeighFlow::sync_obj, nf, true, ObjClass, TableName, &lfl);
-    int ret = 0;
+    size_t bytes = 0;
+    int ret      = 0;
 
-    for (const auto &kvi : re.db) {
-        for (const auto &kvj : kvi.second) {
-            const gpb::LowerFlow &flow = kvj.second;
+    for (const std::string &key : keys) {
+        size_t sep = key.find('\0');
+        gpb::LowerFlow lf;
+        size_t len;
 
-            *lfl.add_flows() = flow;
-            if (lfl.flows_size() >= static_cast<int>(limit)) {
-                ret |= func();
-                lfl = gpb::LowerFlowList();
-            }
+        if (sep == std::string::npos ||
+            !re.find(key.substr(0, sep), key.substr(sep + 1), &lf)) {
+            continue;
         }
+
+        /* The compact encoding can only make the list smaller. */
+        len = gpb_embedded_size(lf);
+        if (lfl.flows_size() > 0 && bytes + len > limit) {
+            CDAPMessage m;
+
+            m.m_create(ObjClass, TableName);
+            encode(lfl);
+            ret |= peer.send(m, lfl);
+            lfl   = gpb::LowerFlowList();
+            bytes = 0;
+        }
+        *lfl.add_flows() = lf;
+        bytes += len;
     }
 
     if (lfl.flows_size() > 0) {
-        ret |= func();
+        CDAPMessage m;
+
+        m.m_create(ObjClass, TableName);
+        encode(lfl);
+        ret |= peer.send(m, lfl);
     }
 
     return ret;
@@ -573,41 +909,56 @@ LinkStateRouting::sync_neigh(const std::shared_ptr<NeighFlow> &nf,
 int
 LinkStateRouting::neighs_refresh(size_t limit)
 {
-    unordered_map<NodeId, gpb::LowerFlow>::iterator jt;
-    int ret = 0;
+    gpb::LowerFlowList lfl;
+    size_t bytes = 0;
+    int ret      = 0;
 
-    if (re.db.size() == 0) {
+    /* Fetch the map containing all the LFDB entries with the local
+     * address corresponding to me. */
+    auto it = re.db.find(re.nim.FindId(rib->myname));
+    if (it == re.db.end()) {
         /* Still not enrolled to anyone, nothing to do. */
         return 0;
     }
 
-    /* Fetch the map containing all the LFDB entries with the local
-     * address corresponding to me. */
-    auto it = re.db.find(rib->myname);
-    assert(it != re.db.end());
-
     auto age_thresh = rib->get_param_value<Msecs>(Routing::Prefix, "age-max");
     age_thresh      = age_thresh * 30 / 100;
 
-    for (auto jt = it->second.begin(); jt != it->second.end();) {
-        gpb::LowerFlowList lfl;
+    /* Only flood the entries that need to be renewed. The others are
+     * synchronized by the comparison of the hash trees. */
+    for (auto jt = it->second.begin(); jt != it->second.end(); jt++) {
+        auto age = Secs(jt->second.age);
 
-        while (lfl.flows_size() < static_cast<int>(limit) &&
-               jt != it->second.end()) {
-            auto age = Secs(jt->second.age());
+        /* Renew the entry by incrementing its sequence number if
+         * we reached ~1/3 of the maximum age. */
+        if (age < age_thresh) {
+            continue;
+        }
 
-            /* Renew the entry by incrementing its sequence number if
-             * we reached ~1/3 of the maximum age. */
-            if (age >= age_thresh) {
-                jt->second.set_seqnum(jt->second.seqnum() + 1);
-                jt->second.set_age(0);
-            }
-            *lfl.add_flows() = jt->second;
-            jt++;
+        gpb::LowerFlow lf = re.flow_get(it->first, jt->first, jt->second);
+        size_t len;
+
+        lf.set_seqnum(lf.seqnum() + 1);
+        lf.set_age(0);
+        re.add(lf);
+        len = gpb_embedded_size(lf);
+        if (lfl.flows_size() > 0 && bytes + len > limit) {
+            encode(lfl);
+            ret |= rib->neighs_sync_obj_all(true, ObjClass, TableName, &lfl);
+            lfl   = gpb::LowerFlowList();
+            bytes = 0;
         }
+        *lfl.add_flows() = lf;
+        bytes += len;
+    }
+    if (lfl.flows_size() > 0) {
+        encode(lfl);
         ret |= rib->neighs_sync_obj_all(true, ObjClass, TableName, &lfl);
     }
 
+    /* Let each neighbor check whether its LFDB is in sync with ours. */
+    ret |= rib->ribsync_neighs(TableName);
+
     return ret;
 }
 
@@ -618,7 +969,7 @@ LinkStateRouting::age_incr_tmr_restart()
         rib->get_param_value<Msecs>(Routing::Prefix, "age-incr-intval"),
         rib->uipcp, this, [](struct uipcp *uipcp, void *arg) {
             LinkStateRouting *r = (LinkStateRouting *)arg;
-            std::lock_guard<std::mutex> guard(r->rib->mutex);
+            std::lock_guard<RibMutex> guard(r->rib->mutex);
             r->age_incr_timer->fired();
             r->age_incr();
         });
@@ -631,18 +982,19 @@ LinkStateRouting::age_incr()
     auto age_inc_intval =
         rib->get_param_value<Msecs>(Routing::Prefix, "age-incr-intval");
     auto age_max = rib->get_param_value<Msecs>(Routing::Prefix, "age-max");
+    NodeIdx myid = re.nim.FindId(rib->myname);
     gpb::LowerFlowList prop_lfl;
 
     for (auto &kvi : re.db) {
-        list<unordered_map<NodeId, gpb::LowerFlow>::iterator> discard_list;
+        list<unordered_map<NodeIdx, LFDB::FlowEntry>::iterator> discard_list;
 
         for (auto jt = kvi.second.begin(); jt != kvi.second.end(); jt++) {
-            auto next_age = Secs(jt->second.age());
+            auto next_age = Secs(jt->second.age);
 
             next_age += std::chrono::duration_cast<Secs>(age_inc_intval);
-            jt->second.set_age(next_age.count());
+            jt->second.age = next_age.count();
 
-            if (kvi.first != rib->myname && next_age > age_max) {
+            if (kvi.first != myid && next_age > age_max) {
                 /* Insert this into the list of entries to be discarded. Don't
                  * discard local entries. */
                 discard_list.push_back(jt);
@@ -650,14 +1002,20 @@ LinkStateRouting::age_incr()
         }
 
         for (const auto &dit : discard_list) {
+            gpb::LowerFlow lf = re.flow_get(kvi.first, dit->first, dit->second);
+
             UPI(rib->uipcp, "Discarded lower-flow %s (age)\n",
-                to_string(dit->second).c_str());
-            *prop_lfl.add_flows() = dit->second;
-            kvi.second.erase(dit);
+                to_string(lf).c_str());
+            *prop_lfl.add_flows() = lf;
         }
     }
 
+    for (const gpb::LowerFlow &f : prop_lfl.flows()) {
+        re.del(f.local_node(), f.remote_node());
+    }
+
     if (prop_lfl.flows_size() > 0) {
+        encode(prop_lfl);
         rib->neighs_sync_obj_all(/*create=*/false, ObjClass, TableName,
                                  &prop_lfl);
         /* Update the routing table. */
@@ -671,28 +1029,37 @@ LinkStateRouting::age_incr()
 void
 LinkStateRouting::neigh_disconnected(const std::string &neigh_name)
 {
+    NodeIdx myid    = re.nim.FindId(rib->myname);
+    NodeIdx neighid = re.nim.FindId(neigh_name);
     gpb::LowerFlowList prop_lfl;
 
-    for (auto &kvi : re.db) {
-        list<unordered_map<NodeId, gpb::LowerFlow>::iterator> discard_list;
+    for (const auto &kvi : re.db) {
+        list<unordered_map<NodeIdx, LFDB::FlowEntry>::const_iterator>
+            discard_list;
 
         for (auto jt = kvi.second.begin(); jt != kvi.second.end(); jt++) {
-            if ((kvi.first == rib->myname && jt->first == neigh_name) ||
-                (kvi.first == neigh_name && jt->first == rib->myname)) {
+            if ((kvi.first == myid && jt->first == neighid) ||
+                (kvi.first == neighid && jt->first == myid)) {
                 /* Insert this into the list of entries to be discarded. */
                 discard_list.push_back(jt);
             }
         }
 
         for (const auto &dit : discard_list) {
+            gpb::LowerFlow lf = re.flow_get(kvi.first, dit->first, dit->second);
+
             UPI(rib->uipcp, "Discarded lower-flow %s (neighbor disconnected)\n",
-                to_string(dit->second).c_str());
-            *prop_lfl.add_flows() = dit->second;
-            kvi.second.erase(dit);
+                to_string(lf).c_str());
+            *prop_lfl.add_flows() = lf;
         }
     }
 
+    for (const gpb::LowerFlow &f : prop_lfl.flows()) {
+        re.del(f.local_node(), f.remote_node());
+    }
+
     if (prop_lfl.flows_size() > 0) {
+        encode(prop_lfl);
         rib->neighs_sync_obj_all(/*create=*/false, ObjClass, TableName,
                                  &prop_lfl);
         /* Update the routing table. */
@@ -765,7 +1132,14 @@ UipcpRib::routing_lib_init()
     std::vector<std::pair<std::string, PolicyParam>> link_state_params = {
         {"age-incr-intval",
          PolicyParam(Secs(int(LinkStateRouting::kAgeIncrIntvalSecs)))},
-        {"age-max", PolicyParam(Secs(int(LinkStateRouting::kAgeMaxSecs)))}};
+        {"age-max", PolicyParam(Secs(int(LinkStateRouting::kAgeMaxSecs)))},
+        {"ecmp", PolicyParam(false)},
+        {"compact-encoding", PolicyParam(false)},
+        {"spf-initial-delay",
+         PolicyParam(Msecs(int(LinkStateRouting::kSpfInitialDelayMsecs)))},
+        {"spf-hold", PolicyParam(Msecs(int(LinkStateRouting::kSpfHoldMsecs)))},
+        {"spf-max-wait",
+         PolicyParam(Msecs(int(LinkStateRouting::kSpfMaxWaitMsecs)))}};
 
     UipcpRib::policy_register(
         Routing::Prefix, "link-state",
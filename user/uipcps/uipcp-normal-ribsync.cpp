@@ -0,0 +1,354 @@
+/*
+ * Synchronization of fully replicated RIB tables with hash trees.
+ *
+ * Copyright (C) 2026 agent
+ * Author: agent <agent@local>
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "uipcp-normal-ribsync.hpp"
+
+namespace rlite {
+
+std::string RibSync::ObjClass = "rib_sync";
+std::string RibSync::ObjName  = "/mgmt/ribsync";
+
+/* Final mixing of a 64 bit hash (from MurmurHash3), as the hashes of the
+ * entries are combined with XOR. */
+static uint64_t
+hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+uint64_t
+RibSync::str_hash(const std::string &s)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    /* FNV-1a, which does not depend on the byte order. */
+    for (unsigned char c : s) {
+        h = (h ^ c) * 1099511628211ULL;
+    }
+
+    return hash_mix(h);
+}
+
+unsigned int
+RibSync::level_size(unsigned int level)
+{
+    return 1U << (kFanoutBits * level);
+}
+
+unsigned int
+RibSync::level_offset(unsigned int level)
+{
+    unsigned int offset = 0;
+
+    for (unsigned int l = 0; l < level; l++) {
+        offset += level_size(l);
+    }
+
+    return offset;
+}
+
+RibSync::Table::Table()
+{
+    size_t num_nodes = level_offset(kDepth + 1);
+
+    hashes.assign(num_nodes, 0);
+    counts.assign(num_nodes, 0);
+    bytes.assign(num_nodes, 0);
+}
+
+/* Add or remove the contribution of an entry to the nodes on the path
+ * from its leaf to the root. */
+void
+RibSync::Table::tree_update(const Entry &e, bool insert)
+{
+    for (unsigned int level = 0; level <= kDepth; level++) {
+        unsigned int i =
+            level_offset(level) + (e.leaf >> (kFanoutBits * (kDepth - level)));
+
+        hashes[i] ^= e.hash;
+        if (insert) {
+            counts[i]++;
+            bytes[i] += e.size;
+        } else {
+            counts[i]--;
+            bytes[i] -= e.size;
+        }
+    }
+}
+
+void
+RibSync::table_register(const std::string &table, const void *owner,
+                        PushFn push)
+{
+    Table &t = tables[table];
+
+    t       = Table();
+    t.owner = owner;
+    t.push  = std::move(push);
+}
+
+void
+RibSync::table_unregister(const std::string &table, const void *owner)
+{
+    auto tit = tables.find(table);
+
+    if (tit != tables.end() && tit->second.owner == owner) {
+        tables.erase(tit);
+    }
+}
+
+void
+RibSync::entry_update(const std::string &table, const std::string &key,
+                      uint64_t value_hash, size_t size)
+{
+    auto tit = tables.find(table);
+
+    if (tit == tables.end()) {
+        return;
+    }
+
+    Table &t       = tit->second;
+    uint64_t khash = str_hash(key);
+    Entry e;
+
+    /* The key selects the leaf, while the entry hash covers both the key
+     * and the value. */
+    e.hash = hash_mix(khash ^ hash_mix(value_hash + 0x9e3779b97f4a7c15ULL));
+    e.leaf = static_cast<uint32_t>(khash >> (64 - kFanoutBits * kDepth));
+    e.size = static_cast<uint32_t>(size);
+
+    auto eit = t.entries.find(key);
+
+    if (eit != t.entries.end()) {
+        if (eit->second.hash == e.hash && eit->second.size == e.size) {
+            return; /* Nothing changed. */
+        }
+        t.tree_update(eit->second, /*insert=*/false);
+        eit->second = e;
+    } else {
+        t.entries.insert(std::make_pair(key, e));
+    }
+    t.tree_update(e, /*insert=*/true);
+}
+
+void
+RibSync::entry_remove(const std::string &table, const std::string &key)
+{
+    auto tit = tables.find(table);
+
+    if (tit == tables.end()) {
+        return;
+    }
+
+    auto eit = tit->second.entries.find(key);
+
+    if (eit != tit->second.entries.end()) {
+        tit->second.tree_update(eit->second, /*insert=*/false);
+        tit->second.entries.erase(eit);
+    }
+}
+
+size_t
+RibSync::size(const std::string &table) const
+{
+    auto tit = tables.find(table);
+
+    return tit == tables.end() ? 0 : tit->second.entries.size();
+}
+
+uint64_t
+RibSync::root_hash(const std::string &table) const
+{
+    auto tit = tables.find(table);
+
+    return tit == tables.end() ? 0 : tit->second.hashes[0];
+}
+
+int
+RibSync::digest_send(const gpb::RibSyncDigest &d, SyncPeer &peer) const
+{
+    CDAPMessage m;
+
+    m.m_write(ObjClass, ObjName);
+
+    return peer.send(m, d);
+}
+
+int
+RibSync::sync_start(const std::string &table, SyncPeer &peer) const
+{
+    auto tit = tables.find(table);
+    gpb::RibSyncDigest d;
+
+    if (tit == tables.end()) {
+        return 0;
+    }
+
+    d.set_table(table);
+    d.set_level(0);
+    d.add_nodes(0);
+    d.add_hashes(tit->second.hashes[0]);
+    d.add_counts(tit->second.counts[0]);
+
+    return digest_send(d, peer);
+}
+
+/* Push all our entries below some nodes of the given level. */
+int
+RibSync::entries_push(const Table &t, unsigned int level,
+                      const std::vector<uint32_t> &nodes, SyncPeer &peer) const
+{
+    unsigned int shift = kFanoutBits * (kDepth - level);
+    std::vector<uint8_t> mark(level_size(level), 0);
+    std::vector<std::string> keys;
+
+    for (uint32_t idx : nodes) {
+        mark[idx] = 1;
+    }
+
+    for (const auto &kv : t.entries) {
+        if (mark[kv.second.leaf >> shift]) {
+            keys.push_back(kv.first);
+        }
+    }
+
+    if (keys.empty() || !t.push) {
+        return 0;
+    }
+
+    return t.push(keys, peer);
+}
+
+/* A neighbor sent us the hashes of some nodes of its tree, or asked us
+ * to push the entries below some nodes. For each node that differs from
+ * ours we either reply with the hashes of our children, so that the
+ * neighbor can go one level down, or, if we are at the leaves or one
+ * of the two subtrees is empty, we exchange the entries. */
+int
+RibSync::rib_handler(const CDAPMessage *rm, SyncPeer &peer)
+{
+    gpb::RibSyncDigest d;
+    const char *objbuf;
+    size_t objlen;
+
+    if (rm->op_code != gpb::M_WRITE) {
+        return -1;
+    }
+
+    rm->get_obj_value(objbuf, objlen);
+    if (!objbuf || !d.ParseFromArray(objbuf, objlen)) {
+        return -1;
+    }
+
+    auto tit = tables.find(d.table());
+
+    if (tit == tables.end()) {
+        /* The table is not in use here (e.g. a different policy). */
+        return 0;
+    }
+
+    const Table &t     = tit->second;
+    unsigned int level = d.level();
+
+    if (level > kDepth) {
+        return -1;
+    }
+    for (uint32_t idx : d.nodes()) {
+        if (idx >= level_size(level)) {
+            return -1;
+        }
+    }
+
+    if (d.pull()) {
+        return entries_push(
+            t, level, std::vector<uint32_t>(d.nodes().begin(), d.nodes().end()),
+            peer);
+    }
+
+    if (d.hashes_size() != d.nodes_size() ||
+        d.counts_size() != d.nodes_size()) {
+        return -1;
+    }
+
+    unsigned int offset = level_offset(level);
+    std::vector<uint32_t> push;
+    gpb::RibSyncDigest reply;
+    gpb::RibSyncDigest pull;
+    size_t bytes_saved = 0;
+    int ret            = 0;
+
+    reply.set_table(d.table());
+    reply.set_level(level + 1);
+    pull.set_table(d.table());
+    pull.set_level(level);
+    pull.set_pull(true);
+
+    for (int i = 0; i < d.nodes_size(); i++) {
+        uint32_t idx   = d.nodes(i);
+        unsigned int n = offset + idx;
+
+        if (t.hashes[n] == d.hashes(i) && t.counts[n] == d.counts(i)) {
+            /* The neighbor already has these entries. */
+            bytes_saved += t.bytes[n];
+        } else if (d.counts(i) == 0) {
+            push.push_back(idx);
+        } else if (t.counts[n] == 0) {
+            pull.add_nodes(idx);
+        } else if (level == kDepth) {
+            push.push_back(idx);
+            pull.add_nodes(idx);
+        } else {
+            unsigned int child_offset = level_offset(level + 1);
+
+            for (uint32_t c = idx << kFanoutBits;
+                 c < ((idx + 1) << kFanoutBits); c++) {
+                reply.add_nodes(c);
+                reply.add_hashes(t.hashes[child_offset + c]);
+                reply.add_counts(t.counts[child_offset + c]);
+            }
+        }
+    }
+
+    if (bytes_saved) {
+        peer.bytes_saved(bytes_saved);
+    }
+    if (reply.nodes_size() > 0) {
+        ret |= digest_send(reply, peer);
+    }
+    if (pull.nodes_size() > 0) {
+        ret |= digest_send(pull, peer);
+    }
+    if (!push.empty()) {
+        ret |= entries_push(t, level, push, peer);
+    }
+
+    return ret;
+}
+
+} // namespace rlite
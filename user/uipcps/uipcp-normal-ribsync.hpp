@@ -0,0 +1,156 @@
+/*
+ * Synchronization of fully replicated RIB tables with hash trees.
+ *
+ * Copyright (C) 2026 agent
+ * Author: agent <agent@local>
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __UIPCP_RIBSYNC_H__
+#define __UIPCP_RIBSYNC_H__
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+#include "rina/cdap.hpp"
+#include "BaseRIB.pb.h"
+
+namespace rlite {
+
+/* A neighbor taking part in the synchronization of the RIB tables. This
+ * decouples the RibSync engine from the management flows. */
+struct SyncPeer {
+    virtual ~SyncPeer() {}
+
+    /* Send a CDAP message carrying 'obj' to the neighbor. */
+    virtual int send(CDAPMessage &m,
+                     const ::google::protobuf::MessageLite &obj) = 0;
+
+    /* Account for the bytes that the synchronization did not need to
+     * send, because the neighbor already had the entries. */
+    virtual void bytes_saved(size_t bytes) {}
+
+    /* Maximum size of the object carried by a single message. */
+    virtual size_t obj_size_max() const { return SIZE_MAX; }
+};
+
+/* Anti-entropy engine for the RIB tables that are fully replicated on
+ * all the IPCPs of the DIF (e.g. the LFDB and the fully replicated DFT).
+ *
+ * Each table registers itself with a name, and then keeps the engine
+ * informed about the insertion, update and removal of its entries. An
+ * entry is identified by an opaque key, and summarized by a hash of its
+ * value (excluding the fields that are local to each node) and by its
+ * serialized size.
+ *
+ * The entries of each table are spread over the leaves of a hash tree
+ * with fixed shape, according to the hash of their key. The hash of a
+ * node of the tree is the XOR of the hashes of all the entries below,
+ * so that updates cost O(depth). Two neighbors compare the roots, and
+ * descend level by level only into the subtrees that differ. Each side
+ * then pushes to the other the entries of the differing leaves, using
+ * the regular M_CREATE messages of the table, so that the receiver
+ * merges them as any other update. A subtree that is empty on one side
+ * is transferred as a whole without descending further, which is the
+ * common case when a new IPCP enrolls. */
+class RibSync {
+public:
+    /* Callback used to push the entries with the given keys to a
+     * neighbor. */
+    using PushFn = std::function<int(const std::vector<std::string> &keys,
+                                     SyncPeer &peer)>;
+
+    /* Fanout (log2) and depth of the hash trees. With 16 children per
+     * node there are 4096 leaves, i.e. a few entries per leaf for tables
+     * with 10k entries. */
+    static constexpr unsigned int kFanoutBits = 4;
+    static constexpr unsigned int kDepth      = 3;
+
+    /* Register a table, dropping the entries of a previous registration
+     * with the same name, if any. The 'owner' is only used to match the
+     * unregistration, since a new component is built before the one it
+     * replaces is destroyed. */
+    void table_register(const std::string &table, const void *owner,
+                        PushFn push);
+    void table_unregister(const std::string &table, const void *owner);
+
+    /* Insert or update an entry of a table. Updates for tables that are
+     * not registered are ignored. */
+    void entry_update(const std::string &table, const std::string &key,
+                      uint64_t value_hash, size_t size);
+
+    /* Remove an entry of a table, if present. */
+    void entry_remove(const std::string &table, const std::string &key);
+
+    /* Start the synchronization of a table with a neighbor, by sending
+     * the root of the hash tree. */
+    int sync_start(const std::string &table, SyncPeer &peer) const;
+
+    /* Process a message of the synchronization protocol received from
+     * a neighbor. Returns -1 if the message is malformed. */
+    int rib_handler(const CDAPMessage *rm, SyncPeer &peer);
+
+    /* Number of entries and root hash of a table. */
+    size_t size(const std::string &table) const;
+    uint64_t root_hash(const std::string &table) const;
+
+    /* Hash of a string, with the same result on all the nodes. */
+    static uint64_t str_hash(const std::string &s);
+
+    static std::string ObjClass;
+    static std::string ObjName;
+
+private:
+    struct Entry {
+        uint64_t hash;
+        uint32_t leaf;
+        uint32_t size;
+    };
+
+    struct Table {
+        const void *owner = nullptr;
+        PushFn push;
+        std::unordered_map<std::string, Entry> entries;
+
+        /* The nodes of the tree, stored level by level starting from the
+         * root: hash, number of entries and serialized size of the
+         * entries below each node. */
+        std::vector<uint64_t> hashes;
+        std::vector<uint32_t> counts;
+        std::vector<uint64_t> bytes;
+
+        Table();
+        void tree_update(const Entry &e, bool insert);
+    };
+
+    std::unordered_map<std::string, Table> tables;
+
+    static unsigned int level_offset(unsigned int level);
+    static unsigned int level_size(unsigned int level);
+
+    int digest_send(const gpb::RibSyncDigest &d, SyncPeer &peer) const;
+    int entries_push(const Table &t, unsigned int level,
+                     const std::vector<uint32_t> &nodes, SyncPeer &peer) const;
+};
+
+} // namespace rlite
+
+#endif /* __UIPCP_RIBSYNC_H__ */
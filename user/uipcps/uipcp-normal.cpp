@@ -41,6 +41,7 @@
 #include <pthread.h>
 #include <poll.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 
 #include "rlite/conf.h"
 #include "uipcp-normal.hpp"
@@ -137,8 +138,8 @@ apname2string(const gpb::APName &gname)
         gname.ae_instance());
 }
 
-#define MGMTBUF_SIZE_MAX 8092
-
+/* The kernel checks that the SDU fits the N-1 flow, and fails the write()
+ * with EMSGSIZE otherwise. */
 int
 UipcpRib::mgmt_bound_flow_write(const struct rl_mgmt_hdr *mhdr, void *buf,
                                 size_t buflen)
@@ -147,11 +148,6 @@ UipcpRib::mgmt_bound_flow_write(const struct rl_mgmt_hdr *mhdr, void *buf,
     char *mgmtbuf;
     ssize_t n;
 
-    if (buflen > MGMTBUF_SIZE_MAX) {
-        errno = EFBIG;
-        return -1;
-    }
-
     mgmtbuf = static_cast<char *>(rl_alloc(sizeof(*mhdr) + buflen, RL_MT_MISC));
     if (mgmtbuf == nullptr) {
         errno = ENOMEM;
@@ -184,7 +180,8 @@ UipcpRib::mgmt_bound_flow_write(const struct rl_mgmt_hdr *mhdr, void *buf,
 }
 
 int
-UipcpRib::recv_msg(char *serbuf, int serlen, std::shared_ptr<NeighFlow> nf,
+UipcpRib::recv_msg(const char *serbuf, int serlen,
+                   std::shared_ptr<NeighFlow> nf,
                    std::shared_ptr<Neighbor> neigh, rl_port_t port_id)
 {
     std::unique_ptr<CDAPMessage> m;
@@ -213,7 +210,9 @@ UipcpRib::recv_msg(char *serbuf, int serlen, std::shared_ptr<NeighFlow> nf,
         bool is_connect_attempt;
         string src_appl;
 
-        m = msg_deser_stateless(serbuf, serlen);
+        /* The object value is not copied, as this message is only
+         * used within this function. */
+        m = msg_deser_stateless(serbuf, serlen, /*borrow=*/true);
         if (m == nullptr) {
             return -1;
         }
@@ -246,7 +245,8 @@ UipcpRib::recv_msg(char *serbuf, int serlen, std::shared_ptr<NeighFlow> nf,
 
             /* Get the encapsulated CDAP message and dispatch it. */
             auto cdap           = msg_deser_stateless(adata.cdap_msg().data(),
-                                            adata.cdap_msg().size());
+                                            adata.cdap_msg().size(),
+                                            /*borrow=*/true);
             rlm_addr_t src_addr = adata.src_addr();
             if (!cdap) {
                 UPE(uipcp, "Failed to deserialize encapsulated CDAP message\n");
@@ -277,7 +277,7 @@ UipcpRib::recv_msg(char *serbuf, int serlen, std::shared_ptr<NeighFlow> nf,
         }
 
         if (!nf->conn) {
-            nf->conn = utils::make_unique<CDAPConn>(nf->flow_fd);
+            nf->conn_create();
         }
 
         assert(neigh);
@@ -354,17 +354,26 @@ static void
 mgmt_bound_flow_ready(struct uipcp *uipcp, int fd, void *opaque)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    char mgmtbuf[MGMTBUF_SIZE_MAX];
     struct rl_mgmt_hdr *mhdr;
     std::shared_ptr<NeighFlow> nf;
     std::shared_ptr<Neighbor> neigh;
+    int avail = 0;
     ssize_t n;
 
     assert(fd == rib->mgmtfd);
 
+    /* Make room for the whole SDU. If the kernel cannot tell its length,
+     * assume the maximum SDU size supported by any IPCP. */
+    if (ioctl(fd, FIONREAD, &avail) || avail <= 0) {
+        avail = sizeof(*mhdr) + (1 << 16);
+    }
+    if (rib->mgmtbuf.size() < static_cast<size_t>(avail)) {
+        rib->mgmtbuf.resize(avail);
+    }
+
     /* Read a buffer that contains a management header followed by
      * a management SDU. */
-    n = read(fd, mgmtbuf, sizeof(mgmtbuf));
+    n = read(fd, rib->mgmtbuf.data(), rib->mgmtbuf.size());
     if (n < 0) {
         UPE(uipcp, "Error: read() failed [%zd]\n", n);
         return;
@@ -376,10 +385,10 @@ mgmt_bound_flow_ready(struct uipcp *uipcp, int fd, void *opaque)
     }
 
     /* Grab the management header. */
-    mhdr = (struct rl_mgmt_hdr *)mgmtbuf;
+    mhdr = (struct rl_mgmt_hdr *)rib->mgmtbuf.data();
     assert(mhdr->type == RLITE_MGMT_HDR_T_IN);
 
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
 
     /* Lookup neighbor by port id. If ADATA, the lookup fails with
      * (nf == nullptr && neigh == nullptr), but this is not an error. */
@@ -394,16 +403,7 @@ void
 normal_mgmt_only_flow_ready(struct uipcp *uipcp, int fd, void *opaque)
 {
     UipcpRib *rib = (UipcpRib *)opaque;
-    char mgmtbuf[MGMTBUF_SIZE_MAX];
-    int n;
-
-    n = read(fd, mgmtbuf, sizeof(mgmtbuf));
-    if (n < 0) {
-        UPE(rib->uipcp, "read(mgmt_flow_fd) failed [%s]\n", strerror(errno));
-        return;
-    }
-
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
     std::shared_ptr<Neighbor> neigh;
     std::shared_ptr<NeighFlow> nf;
 
@@ -412,7 +412,29 @@ normal_mgmt_only_flow_ready(struct uipcp *uipcp, int fd, void *opaque)
         return;
     }
 
-    rib->recv_msg(mgmtbuf, n, nf, neigh);
+    if (!nf->conn) {
+        nf->conn_create();
+    }
+
+    /* Read once, and then dispatch all the complete messages, since the
+     * event loop is not going to report the buffered ones. Stop if the
+     * dispatch replaced the CDAP connection of this flow. */
+    CDAPConn *conn = nf->conn.get();
+
+    do {
+        const char *serbuf;
+        ssize_t n = conn->msg_recv_raw(&serbuf, /*wait=*/false);
+
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                UPE(rib->uipcp, "msg_recv_raw(mgmt_flow_fd) failed [%s]\n",
+                    strerror(errno));
+            }
+            return;
+        }
+
+        rib->recv_msg(serbuf, n, nf, neigh);
+    } while (nf->conn.get() == conn && conn->msg_buffered());
 }
 
 static int
@@ -502,6 +524,7 @@ UipcpRib::UipcpRib(struct uipcp *_u)
         PolicyParam(false);
     params_map[UipcpRib::ResourceAllocPrefix]["broadcast-enroller"] =
         PolicyParam(true);
+    params_map[UipcpRib::ResourceAllocPrefix]["framing"] = PolicyParam(false);
     params_map[UipcpRib::RibDaemonPrefix]["refresh-intval"] =
         PolicyParam(Secs(int(kRIBRefreshIntvalSecs)));
 
@@ -530,6 +553,11 @@ UipcpRib::UipcpRib(struct uipcp *_u)
                              return status_handler(rm, src);
                          });
 
+    rib_handler_register(RibSync::ObjName,
+                         [this](const CDAPMessage *rm, const MsgSrcInfo &src) {
+                             return ribsync_handler(rm, src);
+                         });
+
     for (const auto &component :
          {DFT::Prefix, Routing::Prefix, AddrAllocator::Prefix}) {
         rib_handler_register(
@@ -768,7 +796,8 @@ UipcpRib::dump(std::stringstream &ss) const
                           .count()
                    << "s ago, " << (nf->stats.win[1].bytes_sent / 1000.0)
                    << "KB sent, " << (nf->stats.win[1].bytes_recvd / 1000.0)
-                   << "KB recvd in " << kNeighFlowStatsPeriod << "s]";
+                   << "KB recvd, " << (nf->stats.win[1].bytes_saved / 1000.0)
+                   << "KB saved in " << kNeighFlowStatsPeriod << "s]";
             } else {
                 ss << "[Enrollment ongoing <"
                    << Neighbor::enroll_state_repr(nf->enroll_state) << ">]";
@@ -819,6 +848,14 @@ UipcpRib::dump_stats(std::stringstream &ss) const
     const std::vector<std::pair<const char *, const uint64_t>> pairs = {
         {"routing_table_compute", stats.routing_table_compute},
         {"fwd_table_compute", stats.fwd_table_compute},
+        {"routing_graph_us", stats.routing_graph_us},
+        {"routing_spf_us", stats.routing_spf_us},
+        {"routing_lfa_spf_us", stats.routing_lfa_spf_us},
+        {"routing_merge_us", stats.routing_merge_us},
+        {"fwd_table_us", stats.fwd_table_us},
+        {"routing_changes_queued", stats.routing_changes_queued},
+        {"routing_spf_wait_us", stats.routing_spf_wait_us},
+        {"routing_spf_hold_ms", stats.routing_spf_hold_ms},
         {"fa_name_lookup_failed", stats.fa_name_lookup_failed},
         {"fa_request_issued", stats.fa_request_issued},
         {"fa_response_received", stats.fa_response_received},
@@ -830,8 +867,44 @@ UipcpRib::dump_stats(std::stringstream &ss) const
         ss << "    " << std::setw(25) << p.first;
         ss << ": " << p.second << std::endl;
     }
+
+    ss << "RIB lock hold times (max " << mutex.hold_max_us() << " us, total "
+       << mutex.hold_total_us() << " us):" << std::endl;
+    for (int i = 0; i < RibMutex::kHoldBuckets; i++) {
+        std::stringstream range;
+
+        if (mutex.hold_count(i) == 0) {
+            continue;
+        }
+        if (i == 0) {
+            range << "< 1 us";
+        } else if (i == RibMutex::kHoldBuckets - 1) {
+            range << ">= " << (1ULL << (i - 1)) << " us";
+        } else {
+            range << (1ULL << (i - 1)) << "-" << (1ULL << i) << " us";
+        }
+        ss << "    " << std::setw(25) << range.str();
+        ss << ": " << mutex.hold_count(i) << std::endl;
+    }
 };
 
+void
+RibMutex::hold_account(std::chrono::steady_clock::duration d)
+{
+    uint64_t us =
+        std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    int bucket = 0;
+
+    while (us >> bucket && bucket < kHoldBuckets - 1) {
+        bucket++;
+    }
+    hold_hist[bucket]++;
+    hold_total += us;
+    if (us > hold_max) {
+        hold_max = us;
+    }
+}
+
 void
 UipcpRib::update_address(rlm_addr_t new_addr)
 {
@@ -971,7 +1044,7 @@ UipcpRib::realize_registrations(bool reg)
     list<string> snapshot;
 
     {
-        std::lock_guard<std::mutex> guard(this->mutex);
+        std::lock_guard<RibMutex> guard(this->mutex);
         snapshot = lower_difs;
     }
 
@@ -1010,8 +1083,6 @@ UipcpRib::send_to_dst_addr(std::unique_ptr<CDAPMessage> m, rlm_addr_t dst_addr,
     struct rl_mgmt_hdr mhdr;
     gpb::AData adata;
     CDAPMessage am;
-    char *serbuf = nullptr;
-    size_t serlen;
     int ret;
 
     ret = obj_serialize(m.get(), obj);
@@ -1037,29 +1108,26 @@ UipcpRib::send_to_dst_addr(std::unique_ptr<CDAPMessage> m, rlm_addr_t dst_addr,
         return ret;
     }
 
+    /* The encapsulated message is encoded directly into the A-DATA
+     * object, which is serialized into a buffer borrowed by the A-DATA
+     * message. */
     adata.set_src_addr(myaddr);
     adata.set_dst_addr(dst_addr);
-    {
-        char *serbuf = nullptr;
-        size_t serlen;
-
-        ret = msg_ser_stateless(m.get(), &serbuf, &serlen);
-        if (ret) {
-            return ret;
-        }
-        adata.set_cdap_msg(serbuf, serlen);
-        delete[] serbuf;
-    }
-
     am.m_write(ADataObjClass, ADataObjName);
 
-    if (obj_serialize(&am, &adata)) {
-        UPE(uipcp, "serialization failed\n");
-        return -1;
-    }
-
     try {
-        ret = msg_ser_stateless(&am, &serbuf, &serlen);
+        std::string *cdap_msg = adata.mutable_cdap_msg();
+
+        cdap_msg->resize(m->wire_size());
+        m->wire_encode(&(*cdap_msg)[0]);
+#ifdef HAVE_GPB_BYTE_SIZE_LONG
+        adata_buf.resize(adata.ByteSizeLong());
+#else
+        adata_buf.resize(adata.ByteSize());
+#endif
+        adata.SerializeToArray(adata_buf.data(), adata_buf.size());
+        am.set_obj_value(adata_buf.data(), adata_buf.size());
+        ret = msg_ser_stateless(&am, &snd_buf);
     } catch (std::bad_alloc &e) {
         ret = -1;
     }
@@ -1067,9 +1135,6 @@ UipcpRib::send_to_dst_addr(std::unique_ptr<CDAPMessage> m, rlm_addr_t dst_addr,
     if (ret) {
         UPE(uipcp, "message serialization failed\n");
         invoke_id_mgr.put_invoke_id(m->invoke_id);
-        if (serbuf) {
-            delete[] serbuf;
-        }
         return -1;
     }
 
@@ -1077,13 +1142,11 @@ UipcpRib::send_to_dst_addr(std::unique_ptr<CDAPMessage> m, rlm_addr_t dst_addr,
     mhdr.type        = RLITE_MGMT_HDR_T_OUT_DST_ADDR;
     mhdr.remote_addr = dst_addr;
 
-    ret = mgmt_bound_flow_write(&mhdr, serbuf, serlen);
+    ret = mgmt_bound_flow_write(&mhdr, snd_buf.data(), snd_buf.size());
     if (ret < 0) {
         UPE(uipcp, "mgmt_write(): %s\n", strerror(errno));
     }
 
-    delete[] serbuf;
-
     return ret;
 }
 
@@ -1209,6 +1272,75 @@ UipcpRib::neighs_sync_obj_all(bool create, const string &obj_class,
     return neighs_sync_obj_excluding(nullptr, create, obj_class, obj_name, obj);
 }
 
+/* Start the synchronization of a fully replicated table with a neighbor.
+ * Only the enrollment initiator starts it, since the other side would
+ * otherwise pull what it is being pushed. */
+int
+UipcpRib::ribsync_start(const std::string &table,
+                        const std::shared_ptr<NeighFlow> &nf)
+{
+    NeighFlowSyncPeer peer(nf);
+
+    if (!nf->initiator) {
+        return 0;
+    }
+
+    return ribsync.sync_start(table, peer);
+}
+
+/* Let all the enrolled neighbors check whether their copy of a fully
+ * replicated table is in sync with ours. */
+int
+UipcpRib::ribsync_neighs(const std::string &table)
+{
+    int ret = 0;
+
+    for (const auto &kvn : neighbors) {
+        if (!kvn.second->has_flows() || kvn.second->mgmt_conn()->enroll_state !=
+                                            EnrollState::NEIGH_ENROLLED) {
+            continue;
+        }
+
+        NeighFlowSyncPeer peer(kvn.second->mgmt_conn());
+
+        ret |= ribsync.sync_start(table, peer);
+    }
+
+    return ret;
+}
+
+int
+UipcpRib::ribsync_handler(const CDAPMessage *rm, const MsgSrcInfo &src)
+{
+    if (!src.nf) {
+        UPE(uipcp, "RIB sync message not received from a neighbor\n");
+        return 0;
+    }
+
+    NeighFlowSyncPeer peer(src.nf);
+
+    if (ribsync.rib_handler(rm, peer) < 0) {
+        UPE(uipcp, "Invalid RIB sync message from neighbor %s\n",
+            src.nf->neigh_name.c_str());
+    }
+
+    return 0;
+}
+
+int
+NeighFlowSyncPeer::send(CDAPMessage &m,
+                        const ::google::protobuf::MessageLite &obj)
+{
+    int ret = nf->send_to_port_id(&m, 0, &obj);
+
+    if (ret) {
+        UPE(nf->rib->uipcp, "send_to_port_id() failed [%s]\n",
+            strerror(errno));
+    }
+
+    return ret;
+}
+
 void
 UipcpRib::neigh_flow_prune(const std::shared_ptr<NeighFlow> &nf)
 {
@@ -1505,7 +1637,7 @@ int
 UipcpRib::neigh_n_fa_req_arrived(const struct rl_kmsg_fa_req_arrived *req)
 {
     uint8_t response = RLITE_ERR;
-    std::lock_guard<std::mutex> guard(mutex);
+    std::lock_guard<RibMutex> guard(mutex);
     std::shared_ptr<Neighbor> neigh;
     std::shared_ptr<NeighFlow> nf;
     int mgmt_fd;
@@ -1562,6 +1694,7 @@ UipcpRib::neigh_n_fa_req_arrived(const struct rl_kmsg_fa_req_arrived *req)
                                      string(req->dif_name), req->port_id,
                                      mgmt_fd, RL_IPCP_ID_NONE);
     nf->reliable = true;
+    nf->framed   = is_framed_spec(&req->flowspec);
     neigh->n_flow_set(nf);
 
     return 0;
@@ -1592,7 +1725,7 @@ UipcpRib::neigh_fa_req_arrived(const struct rl_kmsg_fa_req_arrived *req)
         "port_id = %u]\n",
         req->remote_appl, supp_dif, neigh_port_id);
 
-    std::lock_guard<std::mutex> guard(mutex);
+    std::lock_guard<RibMutex> guard(mutex);
 
     /* First of all we update the neighbors in the RIB. This
      * must be done before invoking uipcp_fa_resp,
@@ -1609,6 +1742,7 @@ UipcpRib::neigh_fa_req_arrived(const struct rl_kmsg_fa_req_arrived *req)
                                      neigh_port_id, 0, lower_ipcp_id);
     nf->initiator = false;
     nf->reliable  = is_reliable_spec(&req->flowspec);
+    nf->framed    = is_framed_spec(&req->flowspec);
 
     /* If flow is reliable, we assume it is a management-only flow, and so
      * we don't bound the kernel datapath. If we bound it, EFCP would be
@@ -2202,7 +2336,7 @@ normal_appl_register(struct uipcp *uipcp, const struct rl_msg_base *msg)
 {
     struct rl_kmsg_appl_register *req = (struct rl_kmsg_appl_register *)msg;
     UipcpRib *rib                     = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
 
     rib->dft->appl_register(req);
 
@@ -2214,7 +2348,7 @@ normal_fa_req(struct uipcp *uipcp, const struct rl_msg_base *msg)
 {
     struct rl_kmsg_fa_req *req = (struct rl_kmsg_fa_req *)msg;
     UipcpRib *rib              = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(mutex);
+    std::lock_guard<RibMutex> guard(mutex);
 
     UPV(uipcp, "[uipcp %u] Got reflected message\n", uipcp->id);
 
@@ -2238,7 +2372,7 @@ normal_fa_resp(struct uipcp *uipcp, const struct rl_msg_base *msg)
 
     UPV(uipcp, "[uipcp %u] Got reflected message\n", uipcp->id);
 
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
 
     return rib->fa->fa_resp(resp);
 }
@@ -2249,7 +2383,7 @@ normal_flow_deallocated(struct uipcp *uipcp, const struct rl_msg_base *msg)
     struct rl_kmsg_flow_deallocated *req =
         (struct rl_kmsg_flow_deallocated *)msg;
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
 
     rib->fa->flow_deallocated(req);
 
@@ -2260,7 +2394,7 @@ static void
 normal_update_address(struct uipcp *uipcp, rlm_addr_t new_addr)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
 
     rib->update_address(new_addr);
 }
@@ -2270,7 +2404,7 @@ normal_flow_state_update(struct uipcp *uipcp, const struct rl_msg_base *msg)
 {
     UipcpRib *rib                  = UIPCP_RIB(uipcp);
     struct rl_kmsg_flow_state *upd = (struct rl_kmsg_flow_state *)msg;
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
 
     return rib->routing->flow_state_update(upd);
 }
@@ -2322,7 +2456,7 @@ static char *
 normal_ipcp_rib_show(struct uipcp *uipcp)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
     stringstream ss;
 
     rib->dump(ss);
@@ -2334,7 +2468,7 @@ static char *
 normal_ipcp_routing_show(struct uipcp *uipcp)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
     stringstream ss;
 
     rib->routing->dump_routing(ss);
@@ -2346,7 +2480,7 @@ static char *
 normal_ipcp_rib_paths_show(struct uipcp *uipcp)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
     stringstream ss;
 
     rib->dump_rib_paths(ss);
@@ -2359,7 +2493,7 @@ normal_policy_mod(struct uipcp *uipcp,
                   const struct rl_cmsg_ipcp_policy_mod *req)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
     const string comp_name   = req->comp_name;
     const string policy_name = req->policy_name;
 
@@ -2372,7 +2506,7 @@ normal_policy_list(struct uipcp *uipcp,
                    char **resp_msg)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
     stringstream msg;
     int ret = rib->policy_list(req, msg);
 
@@ -2390,7 +2524,7 @@ normal_policy_param_mod(struct uipcp *uipcp,
                         const struct rl_cmsg_ipcp_policy_param_mod *req)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
     const string comp_name   = req->comp_name;
     const string param_name  = req->param_name;
     const string param_value = req->param_value;
@@ -2404,7 +2538,7 @@ normal_policy_param_list(struct uipcp *uipcp,
                          char **resp_msg)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
     stringstream msg;
     int ret = rib->policy_param_list(req, msg);
 
@@ -2431,7 +2565,7 @@ normal_neigh_disconnect(struct uipcp *uipcp,
                         const struct rl_cmsg_ipcp_neigh_disconnect *req)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
 
     if (!req->neigh_name) {
         UPE(uipcp, "No neighbor name specified\n");
@@ -2445,7 +2579,7 @@ static int
 normal_lower_dif_detach(struct uipcp *uipcp, const char *lower_dif)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
 
     return rib->lower_dif_detach(string(lower_dif));
 }
@@ -2454,7 +2588,7 @@ static int
 normal_route_mod(struct uipcp *uipcp, const struct rl_cmsg_ipcp_route_mod *req)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
 
     return rib->routing->route_mod(req);
 }
@@ -2463,7 +2597,7 @@ static char *
 normal_stats_show(struct uipcp *uipcp)
 {
     UipcpRib *rib = UIPCP_RIB(uipcp);
-    std::lock_guard<std::mutex> guard(rib->mutex);
+    std::lock_guard<RibMutex> guard(rib->mutex);
     stringstream ss;
 
     rib->dump_stats(ss);
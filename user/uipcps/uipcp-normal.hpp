@@ -49,6 +49,7 @@
 
 #include "uipcp-container.h"
 #include "BaseRIB.pb.h"
+#include "uipcp-normal-ribsync.hpp"
 
 namespace rlite {
 
@@ -105,6 +106,51 @@ struct PolicyParam {
     Msecs get_duration_value() const;
 };
 
+/* A mutex that keeps a histogram of the time it is held, used for the
+ * RIB lock to spot the operations that stall the event loop. Bucket 0
+ * counts the holds shorter than 1 microsecond, and bucket i > 0 the
+ * holds in the range [2^(i-1), 2^i) microseconds. The last bucket also
+ * counts all the longer holds. The statistics are updated before the
+ * mutex is released, so they can be read while holding it. */
+class RibMutex {
+public:
+    static constexpr int kHoldBuckets = 24;
+
+    void lock()
+    {
+        m.lock();
+        acquired = std::chrono::steady_clock::now();
+    }
+
+    bool try_lock()
+    {
+        if (!m.try_lock()) {
+            return false;
+        }
+        acquired = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    void unlock()
+    {
+        hold_account(std::chrono::steady_clock::now() - acquired);
+        m.unlock();
+    }
+
+    uint64_t hold_count(int bucket) const { return hold_hist[bucket]; }
+    uint64_t hold_max_us() const { return hold_max; }
+    uint64_t hold_total_us() const { return hold_total; }
+
+private:
+    void hold_account(std::chrono::steady_clock::duration d);
+
+    std::mutex m;
+    std::chrono::steady_clock::time_point acquired;
+    uint64_t hold_hist[kHoldBuckets] = {};
+    uint64_t hold_max                = 0;
+    uint64_t hold_total              = 0;
+};
+
 struct Neighbor;
 struct NeighFlow;
 struct UipcpRib;
@@ -159,6 +205,11 @@ struct NeighFlow {
      * reliable. */
     bool reliable;
 
+    /* Does this flow carry framed CDAP messages? Only reliable flows
+     * allocated without message boundaries do, so that messages of any
+     * size can be sent. */
+    bool framed = false;
+
     /* CDAP connection associated to this flow, if any. */
     std::unique_ptr<CDAPConn> conn;
 
@@ -170,11 +221,14 @@ struct NeighFlow {
      * or were we the target? */
     bool initiator = false;
 
-    /* Statistics about management traffic. */
+    /* Statistics about management traffic. The bytes saved are the ones
+     * that RIB synchronization did not need to send, thanks to the
+     * comparison of the hash trees. */
     struct {
         struct {
             unsigned int bytes_sent;
             unsigned int bytes_recvd;
+            unsigned int bytes_saved;
         } win[2];
         std::chrono::system_clock::time_point t_last;
     } stats;
@@ -190,6 +244,14 @@ struct NeighFlow {
 
     void enroll_state_set(EnrollState st);
 
+    /* Create a new CDAP connection, with framing if the flow is
+     * framed. */
+    void conn_create();
+
+    /* Maximum size of the object carried by a message sent on this flow.
+     * Messages on unframed flows must fit in a single SDU. */
+    size_t obj_size_max() const;
+
     int send_to_port_id(CDAPMessage *m, int invoke_id = 0,
                         const ::google::protobuf::MessageLite *obj = nullptr);
     int sync_obj(bool create, const std::string &obj_class,
@@ -200,6 +262,20 @@ struct NeighFlow {
     static std::string KeepaliveObjClass;
 };
 
+/* Lets the RibSync engine exchange messages over a management flow. */
+struct NeighFlowSyncPeer : public SyncPeer {
+    std::shared_ptr<NeighFlow> nf;
+
+    NeighFlowSyncPeer(const std::shared_ptr<NeighFlow> &nf) : nf(nf) {}
+    int send(CDAPMessage &m,
+             const ::google::protobuf::MessageLite &obj) override;
+    void bytes_saved(size_t bytes) override
+    {
+        nf->stats.win[0].bytes_saved += bytes;
+    }
+    size_t obj_size_max() const override { return nf->obj_size_max(); }
+};
+
 /* Holds the information about a neighbor IPCP. */
 struct Neighbor {
     /* Backpointer to the RIB. */
@@ -301,9 +377,10 @@ struct Component {
     /* In case the component synchronizes RIB objects with its neighbors,
      * two methods can be implemented. The first one is used send the local
      * objects to a single neighbor, while the other is used to send the
-     * local objects to all the neighbors. */
+     * local objects to all the neighbors. The objects are split in many
+     * messages, each one carrying at most 'limit' bytes. */
     virtual int sync_neigh(const std::shared_ptr<NeighFlow> &nf,
-                           unsigned int limit) const
+                           size_t limit) const
     {
         return 0;
     }
@@ -463,16 +540,16 @@ struct EnrollmentResources {
     /* The thread used for enrollment and associated synchronization
      * variables. */
     std::thread th;
-    std::condition_variable msgs_avail;
-    std::condition_variable stopped;
+    std::condition_variable_any msgs_avail;
+    std::condition_variable_any stopped;
 
     void enroller_thread();
-    int enroller_default(std::unique_lock<std::mutex> &lk);
+    int enroller_default(std::unique_lock<RibMutex> &lk);
     void enrollee_thread();
-    int enrollee_default(std::unique_lock<std::mutex> &lk);
+    int enrollee_default(std::unique_lock<RibMutex> &lk);
 
     std::unique_ptr<const CDAPMessage> next_enroll_msg(
-        std::unique_lock<std::mutex> &lk);
+        std::unique_lock<RibMutex> &lk);
     void enrollment_commit();
     void enrollment_abort();
 
@@ -493,8 +570,11 @@ struct UipcpRib {
      * a kernel-bound flow. */
     int mgmtfd;
 
+    /* Reused to receive from mgmtfd. */
+    std::vector<char> mgmtbuf;
+
     /* RIB lock. */
-    std::mutex mutex;
+    RibMutex mutex;
 
     struct periodic_task *tasks = nullptr;
 
@@ -588,9 +668,16 @@ struct UipcpRib {
     /* Timer ID for LFDB synchronization with neighbors. */
     std::unique_ptr<TimeoutEvent> sync_timer;
 
+    /* Anti-entropy for the fully replicated tables (LFDB, DFT). */
+    RibSync ribsync;
+
     /* For A-DATA messages. */
     InvokeIdMgr invoke_id_mgr;
 
+    /* Reused to serialize A-DATA messages and their payload. */
+    std::vector<char> adata_buf;
+    std::vector<char> snd_buf;
+
     /* Auxiliary map containing raw pointers to the components above.
      * Useful to implement demultiplexing. */
     std::unordered_map<std::string, std::unique_ptr<Component>> components;
@@ -603,6 +690,20 @@ struct UipcpRib {
     struct {
         uint64_t routing_table_compute;
         uint64_t fwd_table_compute;
+        /* Cumulative time (in microseconds) spent in the phases of the
+         * routing and forwarding table computations. */
+        uint64_t routing_graph_us;
+        uint64_t routing_spf_us;
+        uint64_t routing_lfa_spf_us;
+        uint64_t routing_merge_us;
+        uint64_t fwd_table_us;
+        /* Number of lower flow changes coalesced into the routing
+         * computations, cumulative time (in microseconds) the changes
+         * waited because of the throttling, and current hold time (in
+         * milliseconds) between two computations. */
+        uint64_t routing_changes_queued;
+        uint64_t routing_spf_wait_us;
+        uint64_t routing_spf_hold_ms;
         uint64_t fa_name_lookup_failed;
         uint64_t fa_request_issued;
         uint64_t fa_response_received;
@@ -687,7 +788,7 @@ struct UipcpRib {
 
     int fa_req(struct rl_kmsg_fa_req *req);
 
-    int recv_msg(char *serbuf, int serlen, std::shared_ptr<NeighFlow> nf,
+    int recv_msg(const char *serbuf, int serlen, std::shared_ptr<NeighFlow> nf,
                  std::shared_ptr<Neighbor> neigh,
                  rl_port_t port_id = RL_PORT_ID_NONE);
     int mgmt_bound_flow_write(const struct rl_mgmt_hdr *mhdr, void *buf,
@@ -712,6 +813,9 @@ struct UipcpRib {
         bool create, const std::string &obj_class, const std::string &obj_name,
         const ::google::protobuf::MessageLite *obj = nullptr) const;
     int sync_rib(const std::shared_ptr<NeighFlow> &nf);
+    int ribsync_start(const std::string &table,
+                      const std::shared_ptr<NeighFlow> &nf);
+    int ribsync_neighs(const std::string &table);
 
     /* Receive info from neighbors. */
     int cdap_dispatch(const CDAPMessage *rm, const MsgSrcInfo &src);
@@ -722,6 +826,7 @@ struct UipcpRib {
     int neighbors_handler(const CDAPMessage *rm, const MsgSrcInfo &src);
     int keepalive_handler(const CDAPMessage *rm, const MsgSrcInfo &src);
     int status_handler(const CDAPMessage *rm, const MsgSrcInfo &src);
+    int ribsync_handler(const CDAPMessage *rm, const MsgSrcInfo &src);
 
     int lowerflow_handler(const CDAPMessage *rm, const MsgSrcInfo &src);
 
@@ -809,12 +914,15 @@ Msecs UipcpRib::get_param_value<Msecs>(const std::string &component,
 gpb::APName *apname2gpb(const std::string &name);
 std::string apname2string(const gpb::APName &gname);
 
+/* Flow spec of the reliable management flows, which do not preserve
+ * message boundaries if the CDAP messages are framed. */
 static inline void
-reliable_spec(struct rina_flow_spec *spec)
+reliable_spec(struct rina_flow_spec *spec, bool framed)
 {
     rl_flow_spec_default(spec);
     spec->max_sdu_gap       = 0;
     spec->in_order_delivery = 1;
+    spec->msg_boundaries    = !framed;
 }
 
 static inline bool
@@ -823,6 +931,24 @@ is_reliable_spec(const struct rina_flow_spec *spec)
     return spec->max_sdu_gap == 0 && spec->in_order_delivery == 1;
 }
 
+static inline bool
+is_framed_spec(const struct rina_flow_spec *spec)
+{
+    return is_reliable_spec(spec) && !spec->msg_boundaries;
+}
+
+/* Serialized size of a message embedded in another one, including the
+ * tag and the length (at most 6 bytes). */
+static inline size_t
+gpb_embedded_size(const ::google::protobuf::MessageLite &m)
+{
+#ifdef HAVE_GPB_BYTE_SIZE_LONG
+    return m.ByteSizeLong() + 6;
+#else
+    return m.ByteSize() + 6;
+#endif
+}
+
 int uipcp_do_register(struct uipcp *uipcp, const char *dif_name,
                       const char *local_name, int reg);
 